@@ -0,0 +1,399 @@
+/**
+ *  This class authenticates SNTP packets with symmetric keys (MD5, AES-CMAC), with the
+ *  MAC contexts prepared once per key (see NtpAuth.h).
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+/******************************************************************************
+* Project Headers
+*****************************************************************************/
+#include "NtpAuth.h"
+
+/******************************************************************************
+* System Headers
+*****************************************************************************/
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#if NTP_HAVE_OPENSSL
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#endif
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+#define NTP_AUTH_MAX_KEY_ID (65535)
+#define NTP_AUTH_MAX_MD5_KEY (20)       // longer keys are given in hex (ntpd)
+#define NTP_AUTH_CMAC_KEY (16)          // AES-128
+#define NTP_AUTH_CMAC_RB (0x87)         // the constant of the CMAC subkeys (RFC 4493)
+#define NTP_AUTH_MAX_LINE (512)
+
+// A key of the table, with its MAC context
+struct NtpAuth::Key
+{
+	Algorithm algorithm;
+	std::vector<unsigned char> secret;
+#if NTP_HAVE_OPENSSL
+	EVP_CIPHER_CTX* cipher;                 // AES-CMAC: AES-128 (ECB) with the key schedule done
+	unsigned char subkey[NTP_AUTH_MAC_SIZE]; // AES-CMAC: K1, for the last (complete) block
+
+	Key() : algorithm(MD5), cipher(nullptr) {}
+	~Key()
+	{
+		EVP_CIPHER_CTX_free(cipher);
+	}
+#endif
+};
+
+// The algorithms, fetched once, and the context of the digests
+struct NtpAuth::Contexts
+{
+#if NTP_HAVE_OPENSSL
+	EVP_MD* md5;
+	EVP_CIPHER* aes;
+	EVP_MD_CTX* digest;
+
+	Contexts()
+		: md5(EVP_MD_fetch(nullptr, "MD5", nullptr)),
+		  aes(EVP_CIPHER_fetch(nullptr, "AES-128-ECB", nullptr)),
+		  digest(EVP_MD_CTX_new())
+	{
+	}
+	~Contexts()
+	{
+		EVP_MD_CTX_free(digest);
+		EVP_CIPHER_free(aes);
+		EVP_MD_free(md5);
+	}
+#endif
+};
+
+/******************************************************************************
+* Static Function Definitions
+*****************************************************************************/
+
+// The bytes of a key given in hex, false if it is not hex
+static bool
+ParseHexKey(const char* text, std::vector<unsigned char>* out)
+{
+	size_t length = strlen(text);
+	if (length == 0 || (length % 2) != 0)
+		return false;
+
+	out->clear();
+	for (size_t ii = 0; ii < length; ii += 2)
+	{
+		if (!isxdigit((unsigned char)text[ii]) || !isxdigit((unsigned char)text[ii + 1]))
+			return false;
+		char digits[3] = { text[ii], text[ii + 1], 0 };
+		out->push_back((unsigned char)strtoul(digits, nullptr, 16));
+	}
+	return true;
+}
+
+// True if the names are the same, whatever the case
+static bool
+SameName(const char* a, const char* b)
+{
+	for (; *a != '\0' && *b != '\0'; a++, b++)
+	{
+		if (tolower((unsigned char)*a) != tolower((unsigned char)*b))
+			return false;
+	}
+	return (*a == *b);
+}
+
+/******************************************************************************
+* Class Member Function Definitions
+*****************************************************************************/
+
+NtpAuth::NtpAuth()
+	: m_contexts(new Contexts())
+{
+}
+
+NtpAuth::~NtpAuth()
+{
+}
+
+bool
+NtpAuth::AddKey(uint32_t keyId, Algorithm algorithm, const unsigned char* secret, int length)
+{
+	if (keyId == 0 || keyId > NTP_AUTH_MAX_KEY_ID || secret == nullptr || length <= 0)
+		return false;
+	if ((algorithm == MD5 && length > NTP_AUTH_MAX_MD5_KEY) || (algorithm == AesCmac && length != NTP_AUTH_CMAC_KEY))
+		return false;
+
+#if NTP_HAVE_OPENSSL
+	std::unique_ptr<Key> key(new Key());
+	key->algorithm = algorithm;
+	key->secret.assign(secret, secret + length);
+
+	// MD5(key || packet): the key is shorter than a block, so there is nothing to absorb
+	// ahead; the digest is fetched once (see Contexts)
+	if (algorithm == AesCmac)
+	{
+		// The AES key schedule is done here, once, and the CMAC subkey K1 derived from
+		// L = AES(key, 0) (RFC 4493, section 2.3)
+		unsigned char zero[NTP_AUTH_MAC_SIZE] = { 0 };
+		unsigned char L[NTP_AUTH_MAC_SIZE];
+		int outLength = 0;
+		key->cipher = EVP_CIPHER_CTX_new();
+		if (m_contexts->aes == nullptr || key->cipher == nullptr ||
+			EVP_EncryptInit_ex2(key->cipher, m_contexts->aes, secret, nullptr, nullptr) != 1 ||
+			EVP_CIPHER_CTX_set_padding(key->cipher, 0) != 1 ||
+			EVP_EncryptUpdate(key->cipher, L, &outLength, zero, sizeof(zero)) != 1)
+			return false;
+		for (int ii = 0; ii < NTP_AUTH_MAC_SIZE; ii++)
+			key->subkey[ii] = (unsigned char)((L[ii] << 1) | ((ii + 1 < NTP_AUTH_MAC_SIZE) ? (L[ii + 1] >> 7) : 0));
+		if (L[0] & 0x80)
+			key->subkey[NTP_AUTH_MAC_SIZE - 1] ^= NTP_AUTH_CMAC_RB;
+	}
+
+	m_keys[keyId] = std::move(key);
+	return true;
+#else
+	(void)algorithm;
+	return false;
+#endif
+}
+
+int
+NtpAuth::LoadKeys(const char* path)
+{
+	FILE* file = fopen(path, "r");
+	if (file == nullptr)
+	{
+		perror(path);
+		return -1;
+	}
+
+	int added = 0;
+	char line[NTP_AUTH_MAX_LINE];
+	for (int lineNumber = 1; fgets(line, sizeof(line), file) != nullptr; lineNumber++)
+	{
+		char* comment = strchr(line, '#');
+		if (comment != nullptr)
+			*comment = '\0';
+
+		unsigned long keyId;
+		char type[32];
+		char text[NTP_AUTH_MAX_LINE];
+		int fields = sscanf(line, "%lu %31s %511s", &keyId, type, text);
+		if (fields <= 0)
+			continue; // blank line
+
+		Algorithm algorithm;
+		if (fields == 3 && (SameName(type, "MD5") || SameName(type, "M")))
+			algorithm = MD5;
+		else if (fields == 3 && (SameName(type, "AES128CMAC") || SameName(type, "AES-128-CMAC")))
+			algorithm = AesCmac;
+		else
+		{
+			fprintf(stderr, "%s:%d: unsupported key\n", path, lineNumber);
+			continue;
+		}
+
+		// Up to 20 characters are the key itself (MD5), longer ones its bytes in hex
+		std::vector<unsigned char> secret;
+		size_t length = strlen(text);
+		if (length > NTP_AUTH_MAX_MD5_KEY && !ParseHexKey(text, &secret))
+		{
+			fprintf(stderr, "%s:%d: invalid hex key\n", path, lineNumber);
+			continue;
+		}
+		if (secret.empty())
+			secret.assign(text, text + length);
+
+		if (!AddKey((uint32_t)keyId, algorithm, &secret[0], (int)secret.size()))
+		{
+			fprintf(stderr, "%s:%d: invalid key %lu\n", path, lineNumber, keyId);
+			continue;
+		}
+		added++;
+	}
+	fclose(file);
+	return added;
+}
+
+void
+NtpAuth::RemoveKey(uint32_t keyId)
+{
+	m_keys.erase(keyId);
+}
+
+bool
+NtpAuth::HasKey(uint32_t keyId) const
+{
+	return (FindKey(keyId) != nullptr);
+}
+
+int
+NtpAuth::KeyCount(void) const
+{
+	return (int)m_keys.size();
+}
+
+bool
+NtpAuth::CopyKeys(const NtpAuth& other)
+{
+	bool _success = true;
+	for (std::unordered_map<uint32_t, std::unique_ptr<Key> >::const_iterator it = other.m_keys.begin(); it != other.m_keys.end(); ++it)
+	{
+		const Key& key = *it->second;
+		if (!AddKey(it->first, key.algorithm, &key.secret[0], (int)key.secret.size()))
+			_success = false;
+	}
+	return _success;
+}
+
+NtpAuth::Key*
+NtpAuth::FindKey(uint32_t keyId) const
+{
+	std::unordered_map<uint32_t, std::unique_ptr<Key> >::const_iterator it = m_keys.find(keyId);
+	return (it != m_keys.end()) ? it->second.get() : nullptr;
+}
+
+bool
+NtpAuth::ComputeMac(Key& key, const unsigned char* packet, unsigned char* mac)
+{
+#if NTP_HAVE_OPENSSL
+	if (key.algorithm == MD5)
+	{
+		unsigned int length = 0;
+		return EVP_DigestInit_ex2(m_contexts->digest, m_contexts->md5, nullptr) == 1 &&
+			EVP_DigestUpdate(m_contexts->digest, &key.secret[0], key.secret.size()) == 1 &&
+			EVP_DigestUpdate(m_contexts->digest, packet, NTP_MSG_SIZE) == 1 &&
+			EVP_DigestFinal_ex(m_contexts->digest, mac, &length) == 1 &&
+			length == NTP_AUTH_MAC_SIZE;
+	}
+
+	// CMAC: the CBC-MAC of the blocks with a zero IV, the last one (complete: the header is
+	// 3 blocks) XORed with K1. Chained here over the ECB context, so that nothing is reset
+	// per packet.
+	unsigned char block[NTP_AUTH_MAC_SIZE];
+	int outLength = 0;
+	memset(block, 0, sizeof(block));
+	for (int offset = 0; offset < NTP_MSG_SIZE; offset += NTP_AUTH_MAC_SIZE)
+	{
+		bool last = (offset + NTP_AUTH_MAC_SIZE == NTP_MSG_SIZE);
+		for (int ii = 0; ii < NTP_AUTH_MAC_SIZE; ii++)
+			block[ii] ^= packet[offset + ii] ^ (last ? key.subkey[ii] : 0);
+		if (EVP_EncryptUpdate(key.cipher, last ? mac : block, &outLength, block, NTP_AUTH_MAC_SIZE) != 1)
+			return false;
+	}
+	return true;
+#else
+	(void)key;
+	(void)packet;
+	(void)mac;
+	return false;
+#endif
+}
+
+int
+NtpAuth::Sign(unsigned char* packet, uint32_t keyId)
+{
+	Key* key = FindKey(keyId);
+	if (key == nullptr)
+		return -1;
+
+	packet[NTP_MSG_SIZE] = (unsigned char)(keyId >> 24);
+	packet[NTP_MSG_SIZE + 1] = (unsigned char)(keyId >> 16);
+	packet[NTP_MSG_SIZE + 2] = (unsigned char)(keyId >> 8);
+	packet[NTP_MSG_SIZE + 3] = (unsigned char)keyId;
+	if (!ComputeMac(*key, packet, packet + NTP_MSG_SIZE + NTP_AUTH_KEY_ID_SIZE))
+		return -1;
+	return NTP_AUTH_MSG_SIZE;
+}
+
+NtpAuth::Result
+NtpAuth::VerifyWithKey(Key* key, const unsigned char* packet, int length)
+{
+	if (length == NTP_MSG_SIZE)
+		return Unauthenticated;
+	if (length == NTP_AUTH_CRYPTO_NAK_SIZE && GetKeyId(packet, length) == 0)
+		return CryptoNak;
+	if (length != NTP_AUTH_MSG_SIZE)
+		return BadMac; // too short, or a MAC of another size (e.g. SHA-1)
+	if (key == nullptr)
+		return UnknownKey;
+
+	unsigned char mac[NTP_AUTH_MAC_SIZE];
+	if (!ComputeMac(*key, packet, mac))
+		return BadMac;
+#if NTP_HAVE_OPENSSL
+	// Constant time, not to leak how much of a forged MAC is right
+	if (CRYPTO_memcmp(mac, packet + NTP_MSG_SIZE + NTP_AUTH_KEY_ID_SIZE, NTP_AUTH_MAC_SIZE) != 0)
+		return BadMac;
+#endif
+	return Authentic;
+}
+
+NtpAuth::Result
+NtpAuth::Verify(const unsigned char* packet, int length)
+{
+	return VerifyWithKey(FindKey(GetKeyId(packet, length)), packet, length);
+}
+
+int
+NtpAuth::VerifyBatch(const unsigned char* const* packets, const int* lengths, int count, Result* results)
+{
+	// The key is looked up again only when the key id changes (the packets of a batch
+	// usually share one key)
+	int authentic = 0;
+	Key* key = nullptr;
+	uint32_t keyId = 0;
+	for (int ii = 0; ii < count; ii++)
+	{
+		uint32_t id = GetKeyId(packets[ii], lengths[ii]);
+		if (id != keyId)
+		{
+			keyId = id;
+			key = FindKey(id);
+		}
+		results[ii] = VerifyWithKey(key, packets[ii], lengths[ii]);
+		if (results[ii] == Authentic)
+			authentic++;
+	}
+	return authentic;
+}
+
+uint32_t
+NtpAuth::GetKeyId(const unsigned char* packet, int length)
+{
+	if (length < NTP_AUTH_CRYPTO_NAK_SIZE)
+		return 0;
+	return ((uint32_t)packet[NTP_MSG_SIZE] << 24) | ((uint32_t)packet[NTP_MSG_SIZE + 1] << 16) |
+		((uint32_t)packet[NTP_MSG_SIZE + 2] << 8) | (uint32_t)packet[NTP_MSG_SIZE + 3];
+}
+
+int
+NtpAuth::SetCryptoNak(unsigned char* packet)
+{
+	memset(packet + NTP_MSG_SIZE, 0, NTP_AUTH_KEY_ID_SIZE);
+	return NTP_AUTH_CRYPTO_NAK_SIZE;
+}
+
+const char*
+NtpAuth::GetResultString(Result result)
+{
+	switch (result)
+	{
+	case Authentic:
+		return "authentic";
+	case Unauthenticated:
+		return "unauthenticated";
+	case CryptoNak:
+		return "crypto-NAK";
+	case UnknownKey:
+		return "unknown key";
+	case BadMac:
+		return "bad MAC";
+	default:
+		return "unknown";
+	}
+}
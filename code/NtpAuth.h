@@ -0,0 +1,181 @@
+/**
+ *  This class authenticates SNTP packets with symmetric keys: the optional Key Identifier
+ *  and Message Digest fields of the header (see NtpClient.h), i.e. a 4-byte key id and a
+ *  16-byte MAC appended to the 48-byte header.
+ *  - MD5: the digest of the key followed by the packet (RFC 5905, section 7.3);
+ *  - AES-CMAC: the CMAC of the packet with a 128-bit AES key (RFC 8573), the one to use.
+ *
+ *  The keys are kept in a table by key id (see AddKey, or LoadKeys for an ntp.keys file).
+ *  The MAC contexts are prepared once: the algorithms are fetched when the table is
+ *  created, and each AES-CMAC key gets its AES key schedule and CMAC subkey when it is
+ *  added. The CMAC is then chained over the keyed AES context, so that signing or
+ *  verifying a packet costs no lookup of the algorithm, no key setup and no allocation.
+ *  VerifyBatch() checks the packets of one recvmmsg() in one pass, looking the key up once
+ *  per run of packets with the same key id (see NtpProber, NtpServer).
+ *
+ *  The contexts are reset per packet, so an NtpAuth is used by one thread at a time (as an
+ *  NtpClient); CopyKeys() gives another thread its own contexts for the same keys.
+ *
+ *  Building it requires OpenSSL 3 (libcrypto, NTP_HAVE_OPENSSL); without it no key can be
+ *  added, and only unauthenticated packets are accepted.
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#ifndef NTPAUTH_H
+#define NTPAUTH_H
+
+#ifndef NTP_HAVE_OPENSSL
+#if defined(__has_include)
+#if __has_include(<openssl/core_names.h>)
+#define NTP_HAVE_OPENSSL (1)
+#endif
+#endif
+#endif
+#ifndef NTP_HAVE_OPENSSL
+#define NTP_HAVE_OPENSSL (0)
+#endif
+
+#include "NtpClient.h"
+
+#include <stdint.h>
+#include <memory>
+#include <unordered_map>
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+#define NTP_AUTH_KEY_ID_SIZE (4)
+#define NTP_AUTH_MAC_SIZE (16)          // MD5 and AES-128-CMAC
+#define NTP_AUTH_MSG_SIZE (NTP_MSG_SIZE + NTP_AUTH_KEY_ID_SIZE + NTP_AUTH_MAC_SIZE)
+#define NTP_AUTH_CRYPTO_NAK_SIZE (NTP_MSG_SIZE + NTP_AUTH_KEY_ID_SIZE)
+
+class NtpAuth
+{
+public:
+	enum Algorithm
+	{
+		MD5,            // 0 - MD5(key || packet), RFC 5905
+		AesCmac         // 1 - AES-128-CMAC(key, packet), RFC 8573
+	};
+
+	enum Result
+	{
+		Authentic,          // 0 - The MAC matches the key
+		Unauthenticated,    // 1 - No MAC (the 48-byte header only)
+		CryptoNak,          // 2 - A crypto-NAK (key id 0, no MAC): the peer could not authenticate the request
+		UnknownKey,         // 3 - The key id is not in the table
+		BadMac              // 4 - The MAC does not match, or the packet is malformed
+	};
+
+	NtpAuth();
+	~NtpAuth();
+
+	/**
+	 * This function adds a key to the table (replacing the key with the same id) and
+	 * prepares its MAC context.
+	 *
+	 * \param keyId the key id (1 to 65535, as in ntpd)
+	 * \param algorithm the MAC algorithm
+	 * \param secret the key (1 to 20 bytes for MD5, 16 bytes for AES-CMAC)
+	 * \param length the size of the key
+	 *
+	 * Returns true upon success, false otherwise
+	 */
+	bool AddKey(uint32_t keyId, Algorithm algorithm, const unsigned char* secret, int length);
+	/**
+	 * This function adds the keys of a key file, in the ntpd format: one key per line,
+	 * "keyid type key", where type is MD5 or AES128CMAC and the key is either up to 20
+	 * printable characters or its bytes in hex (e.g. 32 digits for AES128CMAC); '#'
+	 * starts a comment.
+	 *
+	 * \param path the path of the file (e.g. /etc/ntp.keys)
+	 *
+	 * Returns the number of keys added, or -1 if the file cannot be read
+	 */
+	int LoadKeys(const char* path);
+	/**
+	 * This function removes a key from the table.
+	 */
+	void RemoveKey(uint32_t keyId);
+	/**
+	 * This function returns true if the key is in the table.
+	 */
+	bool HasKey(uint32_t keyId) const;
+	/**
+	 * This function returns the number of keys in the table.
+	 */
+	int KeyCount(void) const;
+	/**
+	 * This function adds the keys of another table, with contexts of its own (e.g. for
+	 * another thread).
+	 *
+	 * Returns true upon success
+	 */
+	bool CopyKeys(const NtpAuth& other);
+
+	/**
+	 * This function appends the key id and the MAC of the 48-byte header to the packet.
+	 *
+	 * \param packet the packet (room for NTP_AUTH_MSG_SIZE bytes)
+	 * \param keyId the key to sign with
+	 *
+	 * Returns the size of the signed packet (NTP_AUTH_MSG_SIZE), or -1 if the key is not in the table
+	 */
+	int Sign(unsigned char* packet, uint32_t keyId);
+	/**
+	 * This function checks the MAC of a packet.
+	 *
+	 * \param packet the packet, as received
+	 * \param length the size of the packet
+	 *
+	 * Returns the result of the check (see Result)
+	 */
+	Result Verify(const unsigned char* packet, int length);
+	/**
+	 * This function checks the MACs of a batch of packets (e.g. one recvmmsg()).
+	 *
+	 * \param packets the packets
+	 * \param lengths the size of each packet
+	 * \param count the number of packets
+	 * \param results where the result of each packet is stored
+	 *
+	 * Returns the number of authentic packets
+	 */
+	int VerifyBatch(const unsigned char* const* packets, const int* lengths, int count, Result* results);
+
+	/**
+	 * This function returns the key id of a packet (0 if it has none).
+	 */
+	static uint32_t GetKeyId(const unsigned char* packet, int length);
+	/**
+	 * This function appends a crypto-NAK (key id 0, no MAC) to the packet, e.g. to answer a
+	 * request that could not be authenticated.
+	 *
+	 * Returns the size of the packet (NTP_AUTH_CRYPTO_NAK_SIZE)
+	 */
+	static int SetCryptoNak(unsigned char* packet);
+	/**
+	 * Returns the string format of a Result
+	 */
+	static const char* GetResultString(Result result);
+
+private:
+	NtpAuth(const NtpAuth&);
+	NtpAuth& operator=(const NtpAuth&);
+
+	struct Key;
+	struct Contexts;
+
+	// The key of an id (nullptr if not in the table)
+	Key* FindKey(uint32_t keyId) const;
+	// Computes the MAC of the 48-byte header with the key into mac (NTP_AUTH_MAC_SIZE bytes)
+	bool ComputeMac(Key& key, const unsigned char* packet, unsigned char* mac);
+	// The result of a packet, with the key already looked up (nullptr if not in the table)
+	Result VerifyWithKey(Key* key, const unsigned char* packet, int length);
+
+	std::unordered_map<uint32_t, std::unique_ptr<Key> > m_keys;
+	std::unique_ptr<Contexts> m_contexts;   // the scratch contexts the keyed ones are copied to
+};
+
+#endif  /* NTPAUTH_H */
@@ -0,0 +1,466 @@
+/**
+ *  This class sends a batch of SNTP requests with sendmmsg() and collects the
+ *  responses with recvmmsg().
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#ifndef _WIN32
+
+/******************************************************************************
+* Project Headers
+*****************************************************************************/
+#include "NtpBatch.h"
+#include "NtpTimestamping.h"
+
+/******************************************************************************
+* System Headers
+*****************************************************************************/
+#include <sys/uio.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+#define NTP_BATCH_SEND_CHUNK (64)                    // requests per sendmmsg(), the socket drained in between
+#define NTP_BATCH_BUFFER_PER_REQUEST (2048)          // a response, and its transmit timestamp on the error queue
+#define NTP_BATCH_MIN_SOCKET_BUFFER (256 * 1024)
+#define NTP_BATCH_MAX_SOCKET_BUFFER (4 * 1024 * 1024)
+
+/******************************************************************************
+* Static Function Definitions
+*****************************************************************************/
+
+static bool
+SameAddress(const struct sockaddr_storage& a, const struct sockaddr_storage& b)
+{
+	if (a.ss_family != b.ss_family)
+		return false;
+
+	if (a.ss_family == AF_INET)
+	{
+		const struct sockaddr_in* a4 = (const struct sockaddr_in*)&a;
+		const struct sockaddr_in* b4 = (const struct sockaddr_in*)&b;
+		return (a4->sin_port == b4->sin_port && a4->sin_addr.s_addr == b4->sin_addr.s_addr);
+	}
+	const struct sockaddr_in6* a6 = (const struct sockaddr_in6*)&a;
+	const struct sockaddr_in6* b6 = (const struct sockaddr_in6*)&b;
+	return (a6->sin6_port == b6->sin6_port && memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr)) == 0);
+}
+
+/******************************************************************************
+* Class Member Function Definitions
+*****************************************************************************/
+
+NtpBatch::NtpBatch(int capacity)
+	: m_capacity(capacity > 0 ? capacity : 1),
+	  m_count(0),
+	  m_fd4(-1),
+	  m_fd6(-1),
+	  m_txKey4(0),
+	  m_txKey6(0),
+	  m_kernelTimestamps(true),
+	  m_cookies(m_capacity)
+{
+	m_slots.resize(m_capacity);
+	m_sendHdrs.resize(m_capacity);
+	m_sendIovs.resize(m_capacity);
+	m_sendSlots.resize(m_capacity);
+	m_recvHdrs.resize(m_capacity);
+	m_recvIovs.resize(m_capacity);
+	m_recvAddrs.resize(m_capacity);
+	m_recvBuffers.resize((size_t)m_capacity * MaxMessageSize);
+	m_recvControl.resize((size_t)m_capacity * NTP_TIMESTAMP_CONTROL_SIZE);
+
+	// The receive side never changes, so its headers are set up once
+	for (int ii = 0; ii < m_capacity; ii++)
+	{
+		m_recvIovs[ii].iov_base = &m_recvBuffers[(size_t)ii * MaxMessageSize];
+		m_recvIovs[ii].iov_len = MaxMessageSize;
+		memset(&m_recvHdrs[ii], 0, sizeof(m_recvHdrs[ii]));
+		m_recvHdrs[ii].msg_hdr.msg_iov = &m_recvIovs[ii];
+		m_recvHdrs[ii].msg_hdr.msg_iovlen = 1;
+	}
+}
+
+NtpBatch::~NtpBatch()
+{
+	if (m_fd4 >= 0)
+		close(m_fd4);
+	if (m_fd6 >= 0)
+		close(m_fd6);
+}
+
+void
+NtpBatch::ReadTransmitTimestamps(int fd)
+{
+	int family = (fd == m_fd6) ? AF_INET6 : AF_INET;
+	struct timespec ts;
+	uint32_t id;
+	int ret;
+	while ((ret = NtpReadTxTimestamp(fd, &ts, &id)) >= 0)
+	{
+		if (ret == 0)
+			continue;
+
+		for (int ii = 0; ii < m_count; ii++)
+		{
+			Slot& slot = m_slots[ii];
+			if (slot.addr.ss_family == family && slot.sent && slot.txKey == id)
+			{
+				slot.transmitTime = ts;
+				slot.kernelTransmitTimestamp = true;
+				break;
+			}
+		}
+	}
+}
+
+void
+NtpBatch::Clear(void)
+{
+	m_count = 0;
+	m_cookies.Clear();
+}
+
+int
+NtpBatch::Add(const struct sockaddr* addr, socklen_t addrLen, const char* request, int length, int stampOffset)
+{
+	if (m_count >= m_capacity || length <= 0 || length > MaxMessageSize || stampOffset + 8 > length ||
+		addrLen > sizeof(struct sockaddr_storage))
+		return -1;
+
+	Slot& slot = m_slots[m_count];
+	memcpy(&slot.addr, addr, addrLen);
+	slot.addrLen = addrLen;
+	slot.length = length;
+	slot.stampOffset = stampOffset;
+	slot.replyLength = 0;
+	slot.sent = false;
+	memcpy(slot.request, request, length);
+
+	// A transmit timestamp written by the caller (not at send time) is the cookie of the request
+	slot.cookie = 0;
+	if (length >= NtpConstPacketView::Size && stampOffset != NtpConstPacketView::OffsetTransmitTimestamp)
+		slot.cookie = NtpConstPacketView((const unsigned char*)request).TransmitTimestamp();
+	if (slot.cookie != 0)
+		m_cookies.Insert(slot.cookie, (uint32_t)m_count);
+	return m_count++;
+}
+
+int
+NtpBatch::Count(void) const
+{
+	return m_count;
+}
+
+const char*
+NtpBatch::Reply(int index) const
+{
+	if (index < 0 || index >= m_count || m_slots[index].replyLength == 0)
+		return nullptr;
+	return m_slots[index].reply;
+}
+
+int
+NtpBatch::ReplyLength(int index) const
+{
+	if (index < 0 || index >= m_count)
+		return 0;
+	return m_slots[index].replyLength;
+}
+
+struct timespec
+NtpBatch::ReceiveTime(int index) const
+{
+	struct timespec ts = { 0, 0 };
+	if (index >= 0 && index < m_count)
+		ts = m_slots[index].receiveTime;
+	return ts;
+}
+
+struct timespec
+NtpBatch::TransmitTime(int index) const
+{
+	struct timespec ts = { 0, 0 };
+	if (index >= 0 && index < m_count)
+		ts = m_slots[index].transmitTime;
+	return ts;
+}
+
+bool
+NtpBatch::KernelTransmitTimestamp(int index) const
+{
+	if (index < 0 || index >= m_count)
+		return false;
+	return m_slots[index].kernelTransmitTimestamp;
+}
+
+bool
+NtpBatch::KernelTimestamp(int index) const
+{
+	if (index < 0 || index >= m_count)
+		return false;
+	return m_slots[index].kernelTimestamp;
+}
+
+void
+NtpBatch::SetKernelTimestamps(bool enable)
+{
+	m_kernelTimestamps = enable;
+}
+
+int
+NtpBatch::GetSocket(int family)
+{
+	int& fd = (family == AF_INET6) ? m_fd6 : m_fd4;
+	if (fd < 0)
+	{
+		fd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+		if (fd < 0)
+			return fd;
+
+		// Room for the responses of a full batch; the transmit timestamps on the error queue
+		// count against the same buffer
+		int size = m_capacity * NTP_BATCH_BUFFER_PER_REQUEST;
+		if (size < NTP_BATCH_MIN_SOCKET_BUFFER)
+			size = NTP_BATCH_MIN_SOCKET_BUFFER;
+		if (size > NTP_BATCH_MAX_SOCKET_BUFFER)
+			size = NTP_BATCH_MAX_SOCKET_BUFFER;
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+		if (m_kernelTimestamps)
+		{
+			NtpEnableRxTimestamps(fd);
+			NtpEnableTxTimestamps(fd);
+		}
+	}
+	return fd;
+}
+
+int
+NtpBatch::SendFamily(int family, int* answered, int* failed)
+{
+	int n = 0;
+	for (int ii = 0; ii < m_count; ii++)
+	{
+		Slot& slot = m_slots[ii];
+		if (slot.addr.ss_family != family)
+			continue;
+
+		m_sendIovs[n].iov_base = slot.request;
+		m_sendIovs[n].iov_len = slot.length;
+		memset(&m_sendHdrs[n], 0, sizeof(m_sendHdrs[n]));
+		m_sendHdrs[n].msg_hdr.msg_name = &slot.addr;
+		m_sendHdrs[n].msg_hdr.msg_namelen = slot.addrLen;
+		m_sendHdrs[n].msg_hdr.msg_iov = &m_sendIovs[n];
+		m_sendHdrs[n].msg_hdr.msg_iovlen = 1;
+		m_sendSlots[n] = ii;
+		n++;
+	}
+	if (n == 0)
+		return 0;
+
+	int fd = GetSocket(family);
+	if (fd < 0)
+		return errno;
+
+	// The requests leave in chunks, and the responses that are already in are read between
+	// two chunks, so a large batch does not overflow the receive buffer before the first wait
+	// The kernel only numbers the datagrams that went out: the requests after a refused one
+	// take its place
+	uint32_t& txKey = (family == AF_INET6) ? m_txKey6 : m_txKey4;
+	int sent = 0;
+	int skipped = 0;
+	while (sent < n)
+	{
+		int chunk = n - sent;
+		if (chunk > NTP_BATCH_SEND_CHUNK)
+			chunk = NTP_BATCH_SEND_CHUNK;
+
+		// The requests of one system call share the user-space T1
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		for (int ii = sent; ii < sent + chunk; ii++)
+		{
+			Slot& slot = m_slots[m_sendSlots[ii]];
+			if (slot.stampOffset >= 0)
+				NtpStampMessage(slot.request, slot.stampOffset, &slot.transmitTime);
+			else
+				slot.transmitTime = now;
+			slot.kernelTransmitTimestamp = false;
+			slot.sent = true;
+			slot.txKey = txKey + (uint32_t)(ii - skipped);
+		}
+
+		// sendmmsg() may stop early (e.g. full socket buffer), so resume until all are sent
+		int ret = sendmmsg(fd, &m_sendHdrs[sent], chunk, 0);
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				struct pollfd pfd = { fd, POLLOUT, 0 };
+				poll(&pfd, 1, 10);
+				continue;
+			}
+
+			// The first request of the chunk is refused (e.g. EACCES for a broadcast address):
+			// it is left unanswered, and the rest goes on
+			m_slots[m_sendSlots[sent]].sent = false;
+			sent++;
+			skipped++;
+			(*failed)++;
+			continue;
+		}
+		sent += ret;
+
+		if (m_kernelTimestamps)
+			ReadTransmitTimestamps(fd);
+		*answered += ReceiveFamily(fd);
+	}
+	txKey += (uint32_t)(n - skipped);
+	return 0;
+}
+
+int
+NtpBatch::ReceiveFamily(int fd)
+{
+	int answered = 0;
+	for (;;)
+	{
+		for (int ii = 0; ii < m_capacity; ii++)
+		{
+			m_recvHdrs[ii].msg_hdr.msg_name = &m_recvAddrs[ii];
+			m_recvHdrs[ii].msg_hdr.msg_namelen = sizeof(m_recvAddrs[ii]);
+			m_recvHdrs[ii].msg_hdr.msg_control = &m_recvControl[(size_t)ii * NTP_TIMESTAMP_CONTROL_SIZE];
+			m_recvHdrs[ii].msg_hdr.msg_controllen = NTP_TIMESTAMP_CONTROL_SIZE;
+		}
+
+		int n = recvmmsg(fd, &m_recvHdrs[0], m_capacity, MSG_DONTWAIT, nullptr);
+		if (n <= 0)
+			break;
+
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+
+		for (int ii = 0; ii < n; ii++)
+		{
+			const struct sockaddr_storage& from = m_recvAddrs[ii];
+			const unsigned char* reply = (const unsigned char*)m_recvIovs[ii].iov_base;
+
+			// The request whose cookie the response echoes (a constant time lookup), if any;
+			// otherwise the first unanswered request without cookie sent to the source address
+			int index = -1;
+			uint32_t found;
+			if (m_recvHdrs[ii].msg_len >= (unsigned int)NtpConstPacketView::Size &&
+				m_cookies.Find(NtpConstPacketView(reply).OriginateTimestamp(), &found))
+			{
+				if (m_slots[found].replyLength == 0 && SameAddress(m_slots[found].addr, from))
+					index = (int)found;
+			}
+			else
+			{
+				for (int jj = 0; jj < m_count; jj++)
+				{
+					if (m_slots[jj].cookie == 0 && m_slots[jj].replyLength == 0 && SameAddress(m_slots[jj].addr, from))
+					{
+						index = jj;
+						break;
+					}
+				}
+			}
+			if (index < 0)
+				continue; // late, duplicated or spoofed
+
+			Slot& slot = m_slots[index];
+			slot.replyLength = (int)m_recvHdrs[ii].msg_len;
+			slot.kernelTimestamp = NtpReadRxTimestamp(&m_recvHdrs[ii].msg_hdr, &slot.receiveTime);
+			if (!slot.kernelTimestamp)
+				slot.receiveTime = now;
+			memcpy(slot.reply, reply, slot.replyLength);
+			answered++;
+		}
+
+		if (n < m_capacity)
+			break;
+	}
+	return answered;
+}
+
+int
+NtpBatch::Exchange(int timeoutMs)
+{
+	for (int ii = 0; ii < m_count; ii++)
+		m_slots[ii].replyLength = 0;
+	if (m_count == 0)
+		return 0;
+
+	int answered = 0;
+	int failed = 0;
+	int _error = SendFamily(AF_INET, &answered, &failed);
+	if (_error == 0)
+		_error = SendFamily(AF_INET6, &answered, &failed);
+	if (_error != 0)
+	{
+		errno = _error;
+		return -1;
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	int64_t deadline = ((int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000) + timeoutMs;
+
+	while (answered < m_count - failed)
+	{
+		struct pollfd pfds[2];
+		int nfds = 0;
+		if (m_fd4 >= 0)
+		{
+			pfds[nfds].fd = m_fd4;
+			pfds[nfds].events = POLLIN;
+			pfds[nfds].revents = 0;
+			nfds++;
+		}
+		if (m_fd6 >= 0)
+		{
+			pfds[nfds].fd = m_fd6;
+			pfds[nfds].events = POLLIN;
+			pfds[nfds].revents = 0;
+			nfds++;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		int64_t remaining = deadline - (((int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000));
+		if (remaining <= 0)
+			break;
+
+		int ret = poll(pfds, nfds, (int)remaining);
+		if (ret < 0 && errno != EINTR)
+			return -1;
+
+		for (int ii = 0; ii < nfds && ret > 0; ii++)
+		{
+			if ((pfds[ii].revents & POLLERR) && m_kernelTimestamps)
+				ReadTransmitTimestamps(pfds[ii].fd);
+			if (pfds[ii].revents & POLLIN)
+				answered += ReceiveFamily(pfds[ii].fd);
+		}
+	}
+
+	// Pick up the transmit timestamps not read while waiting for the responses
+	if (m_kernelTimestamps)
+	{
+		if (m_fd4 >= 0)
+			ReadTransmitTimestamps(m_fd4);
+		if (m_fd6 >= 0)
+			ReadTransmitTimestamps(m_fd6);
+	}
+	return answered;
+}
+
+#endif  /* _WIN32 */
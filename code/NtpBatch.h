@@ -0,0 +1,168 @@
+/**
+ *  This class sends a batch of SNTP requests to several servers with one sendmmsg()
+ *  call and collects the responses with recvmmsg() into a preallocated array of
+ *  buffers, so that the per-packet system call cost is paid once per batch.
+ *  The message headers, I/O vectors and buffers are allocated once (for the given
+ *  capacity) and the sockets are kept open, so the object should be reused across polls.
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#ifndef NTPBATCH_H
+#define NTPBATCH_H
+
+#ifndef _WIN32
+
+#include "NtpRequestTable.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+
+class NtpBatch
+{
+public:
+	/**
+	 * \param capacity the maximum number of requests in one batch
+	 */
+	explicit NtpBatch(int capacity);
+	~NtpBatch();
+
+	/**
+	 * This function removes all the requests (the buffers are kept for reuse).
+	 */
+	void Clear(void);
+	/**
+	 * This function adds a request to the batch.
+	 *
+	 * \param addr the address of the server
+	 * \param addrLen the size of addr
+	 * \param request the message to be sent
+	 * \param length the size of the message to be sent
+	 * \param stampOffset the offset of the timestamp to be written right before sendmmsg() (-1 for none)
+	 *
+	 * Returns the index of the request in the batch, or -1 if the batch is full
+	 */
+	int Add(const struct sockaddr* addr, socklen_t addrLen, const char* request, int length, int stampOffset = -1);
+	/**
+	 * This function sends all the requests and waits up to timeoutMs for the responses.
+	 * A request that carries a cookie (a non-zero transmit timestamp, see NtpRequestTable)
+	 * gets the response that echoes it as the originate timestamp, from its server; the other
+	 * requests get the first response from their server that matches no cookie.
+	 * A request that cannot be sent (e.g. to a broadcast address) is left without a response,
+	 * and the others are still sent.
+	 *
+	 * \param timeoutMs the time (in ms) to wait for the responses
+	 *
+	 * Returns the number of responses received, or -1 on error
+	 */
+	int Exchange(int timeoutMs);
+	/**
+	 * This function returns the number of requests in the batch.
+	 */
+	int Count(void) const;
+	/**
+	 * This function returns the response to the request at index (nullptr if none was received).
+	 */
+	const char* Reply(int index) const;
+	/**
+	 * This function returns the size of the response to the request at index (0 if none was received).
+	 */
+	int ReplyLength(int index) const;
+	/**
+	 * This function returns the (CLOCK_REALTIME) time at which the response to the request
+	 * at index was received: the kernel receive timestamp if available (see KernelTimestamp),
+	 * or the time recvmmsg() returned it otherwise.
+	 */
+	struct timespec ReceiveTime(int index) const;
+	/**
+	 * This function returns true if ReceiveTime(index) was taken by the kernel.
+	 */
+	bool KernelTimestamp(int index) const;
+	/**
+	 * This function returns the (CLOCK_REALTIME) time at which the request at index was sent:
+	 * the kernel transmit timestamp if available (see KernelTransmitTimestamp), or the time
+	 * read right before sendmmsg() otherwise.
+	 */
+	struct timespec TransmitTime(int index) const;
+	/**
+	 * This function returns true if TransmitTime(index) was taken by the kernel.
+	 */
+	bool KernelTransmitTimestamp(int index) const;
+	/**
+	 * This function enables (default) or disables the kernel receive and transmit timestamps.
+	 * It must be called before the first Exchange().
+	 *
+	 * \param enable true to request kernel timestamps
+	 */
+	void SetKernelTimestamps(bool enable);
+
+private:
+	NtpBatch(const NtpBatch&);
+	NtpBatch& operator=(const NtpBatch&);
+
+	enum { MaxMessageSize = 68 }; // 48-byte header + optional key id (4) and digest (16)
+
+	struct Slot
+	{
+		struct sockaddr_storage addr;
+		socklen_t addrLen;
+		int length;
+		int stampOffset;
+		int replyLength;
+		bool sent;                       // false if sendmmsg() refused the request
+		uint32_t txKey;                  // number of the datagram on its socket (for the transmit timestamp)
+		uint64_t cookie;                 // transmit timestamp of the request (0 if none)
+		struct timespec transmitTime;
+		bool kernelTransmitTimestamp;
+		struct timespec receiveTime;
+		bool kernelTimestamp;
+		char request[MaxMessageSize];
+		char reply[MaxMessageSize];
+	};
+
+	/**
+	 * This function returns the socket for the address family (created on first use).
+	 */
+	int GetSocket(int family);
+	/**
+	 * This function sends the requests of the given family with sendmmsg(), in chunks, and
+	 * reads the responses that arrive in between (added to answered). A request refused by
+	 * sendmmsg() is skipped (added to failed).
+	 * Returns 0 upon success, or the errno value if the socket could not be created.
+	 */
+	int SendFamily(int family, int* answered, int* failed);
+	/**
+	 * This function drains the socket with recvmmsg() and matches the responses to the slots.
+	 * Returns the number of newly answered slots.
+	 */
+	int ReceiveFamily(int fd);
+	/**
+	 * This function drains the error queue of the socket and matches the transmit timestamps to the slots.
+	 */
+	void ReadTransmitTimestamps(int fd);
+
+	int m_capacity;
+	int m_count;
+	int m_fd4;
+	int m_fd6;
+	uint32_t m_txKey4;                   // datagrams sent on m_fd4 since the transmit timestamps were enabled
+	uint32_t m_txKey6;
+	bool m_kernelTimestamps;
+	std::vector<Slot> m_slots;
+	NtpRequestTable m_cookies;           // cookie -> slot
+	std::vector<struct mmsghdr> m_sendHdrs;
+	std::vector<struct iovec> m_sendIovs;
+	std::vector<int> m_sendSlots;        // the slot of each send header
+	std::vector<struct mmsghdr> m_recvHdrs;
+	std::vector<struct iovec> m_recvIovs;
+	std::vector<struct sockaddr_storage> m_recvAddrs;
+	std::vector<char> m_recvBuffers;
+	std::vector<char> m_recvControl;
+};
+
+#endif  /* _WIN32 */
+
+#endif  /* NTPBATCH_H */
@@ -0,0 +1,37 @@
+/**
+ *  This class is the interface of a blocking request-response transport for the SNTP
+ *  client (see NtpClient::Connect(NtpChannel&, ...)): the request is sent to the server
+ *  and the call returns with its response, or upon timeout. It lets something else than
+ *  the sockets carry the exchanges, e.g. the discrete-event network simulator
+ *  (NtpSimulator), where the call advances the simulated time instead of waiting.
+ *
+ *  The client stamps T1 and T4 with its time source (see NtpClient::SetTimeSource)
+ *  right before and after Exchange().
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#ifndef NTPCHANNEL_H
+#define NTPCHANNEL_H
+
+class NtpChannel
+{
+public:
+	virtual ~NtpChannel() {}
+
+	/**
+	 * This function sends a request to a server and waits for its response.
+	 *
+	 * \param host the hostname or IP address of the NTP server
+	 * \param request the request
+	 * \param length the size of the request (NTP_MSG_SIZE, or NTP_AUTH_MSG_SIZE if signed)
+	 * \param response where the response is stored (up to NTP_AUTH_MSG_SIZE bytes)
+	 * \param timeoutMs the time (in ms) to wait for the response
+	 *
+	 * Returns the size of the response, 0 if none came before the timeout, or -1 if the
+	 * request could not be sent (errno is set)
+	 */
+	virtual int Exchange(const char* host, const char* request, int length, char* response, int timeoutMs) = 0;
+};
+
+#endif  /* NTPCHANNEL_H */
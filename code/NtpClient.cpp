@@ -1,4 +1,6 @@
+#ifdef _MSC_VER
 #pragma warning(disable:4996)
+#endif
 /**
  *  This class is developed to get the local time or UTC time with precision.
  *  In particular, the offset is returned based on the Network Time Protocol (NTP),
@@ -8,6 +10,7 @@
  *  Ioannis Selinis 2019 (5GIC, University of Surrey)
  */
 
+#ifdef _WIN32
 #ifndef UNICODE
 #define UNICODE
 #endif
@@ -17,32 +20,59 @@
 #define WIN32_LEAN_AND_MEAN
 
 #include <Ws2tcpip.h>
+#endif
 #include <stdio.h>
 
+#ifdef _WIN32
  // Link with ws2_32.lib
 #pragma comment(lib, "Ws2_32.lib")
+#endif
 
  /******************************************************************************
   * Project Headers
   *****************************************************************************/
 #include "NtpClient.h"
+#include "NtpSession.h"
+#include "NtpPacket.h"
+#include "NtpClock.h"
+#include "NtpRequestTable.h"
+#include "NtpResolver.h"
+#include "NtpMetrics.h"
+#include "NtpChannel.h"
+#include "NtpAuth.h"
+#ifndef _WIN32
+#include "NtpTransport.h"
+#include "NtpBatch.h"
+#include "NtpTimestamping.h"
+#endif
 #include <iostream>    // Needed to perform IO operations
 
   /******************************************************************************
   * System Headers
   *****************************************************************************/
+#ifdef _WIN32
 #include <winsock2.h>
 #include <winsock.h>
 #include <ws2tcpip.h>
 #include <wchar.h>
+#include <Windows.h>
+#include <timeapi.h>
+#else
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <cstring>
+#endif
 #include <sstream>
 #include <ctime>
-#include <Windows.h>
+#include <cmath>
+#include <cerrno>
+#include <vector>
+#include <memory>
 
   ////
 #include <filesystem>
 #include <string>       // std::string
-#include <timeapi.h>
 #include <bitset>
 #include <iomanip>
 ////
@@ -52,17 +82,13 @@ using namespace std;
 /******************************************************************************
 * Preprocessor Directives and Macros
 *****************************************************************************/
-#define NTP_PORT (123)
-#define SERVICE_NAME ("npt")
 #define NTP_SERVER ("pool.ntp.org") //pool.ntp.org time-a-g.nist.gov time.google.com
-#define NTP_MSG_SIZE (48) // in bytes
-#define NTP_MSG_OFFSET_ROOT_DELAY (4)
-#define NTP_MSG_OFFSET_ROOT_DISPERSION (8)
-#define NTP_MSG_OFFSET_REFERENCE_IDENTIFIER (12)
-#define NTP_MSG_OFFSET_REFERENCE_TIMESTAMP (16)
-#define NTP_MSG_OFFSET_ORIGINATE_TIMESTAMP (24)
-#define NTP_MSG_OFFSET_RECEIVE_TIMESTAMP (32)
-#define NTP_MSG_OFFSET_TRANSMIT_TIMESTAMP (40)
+#define NTP_RACE_DELAY_MS (250) // head start of the preferred address family (as in RFC 8305)
+
+static_assert(NtpConstPacketView::Size == NTP_MSG_SIZE &&
+	NtpConstPacketView::OffsetReferenceIdentifier == NTP_MSG_OFFSET_REFERENCE_IDENTIFIER &&
+	NtpConstPacketView::OffsetOriginateTimestamp == NTP_MSG_OFFSET_ORIGINATE_TIMESTAMP &&
+	NtpConstPacketView::OffsetTransmitTimestamp == NTP_MSG_OFFSET_TRANSMIT_TIMESTAMP, "NtpPacket.h and NtpClient.h disagree on the layout");
 
 constexpr auto SECONDS_SINCE_FIRST_EPOCH = (2208988800UL); // Seconds from 1/1/1900 00.00 to 1/1/1970 00.00;
 //constexpr auto NTP_SCALE_FRAC = (4294967296UL);
@@ -73,311 +99,771 @@ constexpr auto SECONDS_SINCE_FIRST_EPOCH = (2208988800UL); // Seconds from 1/1/1
 
 NtpClient::NtpClient()
 	: m_clockOffset(0),
-	  m_originateTimestamp(0)
+	  m_clockOffsetNs(0),
+	  m_clockState(&NtpClockState::Global()),
+	  m_kernelTimestamps(true),
+	  m_originateTimestamp(0),
+	  m_originateTimestampSource(UserSpaceTimestamp),
+	  m_transmitCookie(0),
+	  m_instrumentation(&NtpMetrics::Global()),
+	  m_timeSource(&NtpTimeSource::System()),
+	  m_auth(nullptr),
+	  m_keyId(0)
 {
+	memset(&m_lastSample, 0, sizeof(m_lastSample));
+	memset(&m_serverAddress, 0, sizeof(m_serverAddress));
+	m_serverAddress.ss_family = AF_UNSPEC;
+	BuildRequestTemplate();
 }
 
 NtpClient::~NtpClient()
 {
 }
 
+bool
+NtpClient::dns_lookup(const char* host, struct sockaddr_storage* out, socklen_t* outLen, int family)
+{
+	NtpResolver& resolver = NtpResolver::Global();
+	if (family == AF_UNSPEC)
+		family = resolver.GetPreferredFamily(host);
+	return resolver.Resolve(host, family, out, outLen);
+}
+
 void
-NtpClient::dns_lookup(const char* host, sockaddr_in* out)
+NtpClient::SetClockOffset(int clockOffset)
 {
-	struct addrinfo* result;
-	int ret = getaddrinfo(host, SERVICE_NAME, NULL, &result);
-	for (struct addrinfo* p = result; p; p = p->ai_next)
-	{
-		if (p->ai_family != AF_INET)
-			continue;
+	m_clockOffset.store(clockOffset, std::memory_order_relaxed);
+}
 
-		memcpy(out, p->ai_addr, sizeof(*out));
-	}
+void
+NtpClient::SetClockState(NtpClockState* state)
+{
+	m_clockState = state;
 }
 
 void
-NtpClient::SetClockOffset(int clockOffset)
+NtpClient::SetInstrumentation(NtpInstrumentation* instrumentation)
+{
+	m_instrumentation = instrumentation;
+}
+
+void
+NtpClient::SetTimeSource(NtpTimeSource* source)
 {
-	m_clockOffset = clockOffset;
+	m_timeSource = (source != nullptr) ? source : &NtpTimeSource::System();
+}
+
+void
+NtpClient::SetAuthentication(NtpAuth* auth, uint32_t keyId)
+{
+	m_auth = auth;
+	m_keyId = keyId;
 }
 
 int
 NtpClient::GetClockOffset(void)
 {
-	return m_clockOffset;
+	return m_clockOffset.load(std::memory_order_relaxed);
 }
 
-void 
-NtpClient::gettimeofday(struct timeval* tp)
+int64_t
+NtpClient::GetClockOffsetNs(void)
 {
-	// Note: some broken versions only have 8 trailing zero's, the correct epoch has 9 trailing zero's
-	// This magic number is the number of 100 nanosecond intervals since January 1, 1601 (UTC)
-	// until 00:00:00 January 1, 1970 
-	static const uint64_t EPOCH = ((uint64_t)116444736000000000ULL);
+	return m_clockOffsetNs.load(std::memory_order_relaxed);
+}
 
-	SYSTEMTIME  system_time;
-	FILETIME    file_time;
-	uint64_t    time;
+NtpClient::Sample
+NtpClient::GetLastSample(void)
+{
+	return m_lastSample;
+}
 
-	GetSystemTime(&system_time);
-	SystemTimeToFileTime(&system_time, &file_time);
-	time = ((uint64_t)file_time.dwLowDateTime);
-	time += ((uint64_t)file_time.dwHighDateTime) << 32;
+NtpFilter::Result
+NtpClient::GetFilterResult(void)
+{
+	return m_filter.GetResult();
+}
 
-	tp->tv_sec = (long)((time - EPOCH) / 10000000L);
-	tp->tv_usec = (long)(system_time.wMilliseconds * 1000);
+const NtpFilter&
+NtpClient::GetFilter(void) const
+{
+	return m_filter;
+}
+
+double
+NtpClient::GetFrequency(void) const
+{
+	return m_discipline.GetState().frequency;
+}
+
+void
+NtpClient::SetKernelTimestamps(bool enable)
+{
+	m_kernelTimestamps = enable;
+}
+
+void
+NtpClient::SetPollInterval(signed char pollExponent)
+{
+	NtpPacketView(m_requestTemplate).SetPollInterval((unsigned char)pollExponent);
+}
+
+bool
+NtpClient::ReplayExchange(const char* server, const unsigned char* response, uint64_t originateTimestamp, TimestampSource transmitSource,
+	uint64_t destinationTimestamp, TimestampSource receiveSource, Sample* sample)
+{
+	char buffer[NTP_MSG_SIZE];
+	memcpy(buffer, response, NTP_MSG_SIZE);
+
+	// The recorded response echoes the cookie of its request
+	m_transmitCookie = NtpConstPacketView(response).OriginateTimestamp();
+	m_originateTimestamp = originateTimestamp;
+	m_originateTimestampSource = transmitSource;
+	m_server = server;
+	m_serverAddress.ss_family = AF_UNSPEC;
+	return ReceivedMessage(buffer, sample, destinationTimestamp, receiveSource);
+}
+
+void 
+NtpClient::gettimeofday(struct timeval* tp)
+{
+	// The system clock unless another time source was set (e.g. a simulated clock)
+	int64_t _nowNs = m_timeSource->Now();
+	tp->tv_sec = (long)(_nowNs / 1000000000LL);
+	tp->tv_usec = (long)((_nowNs % 1000000000LL) / 1000);
 }
 
 void 
 NtpClient::convert_unix_to_ntp(struct ntp_timestamp *ntpTs, struct timeval *unixTs)
 {
-	ntpTs->second = unixTs->tv_sec + SECONDS_SINCE_FIRST_EPOCH;//0x83AA7E80;
-	ntpTs->fraction = (uint32_t)((double)(unixTs->tv_usec + 1) * (double)(1LL << 32) * 1.0e-6);
+	ntpTs->second = (uint32_t)(unixTs->tv_sec + SECONDS_SINCE_FIRST_EPOCH);//0x83AA7E80;
+	ntpTs->fraction = (uint32_t)(((uint64_t)unixTs->tv_usec << 32) / 1000000);
 }
 void 
 NtpClient::convert_ntp_to_unix(struct ntp_timestamp *ntpTs, struct timeval *unixTs)
 {
 	unixTs->tv_sec = ntpTs->second - SECONDS_SINCE_FIRST_EPOCH;// 0x83AA7E80; // the seconds from Jan 1, 1900 to Jan 1, 1970
-	unixTs->tv_usec = (uint32_t)((double)ntpTs->fraction * 1.0e6 / (double)(1LL << 32));
+	unixTs->tv_usec = (long)(((uint64_t)ntpTs->fraction * 1000000) >> 32);
 }
 
-uint64_t
+int64_t
+NtpClient::convert_ntp_diff_to_ns(int64_t _ntpDiff)
+{
+	// Split the signed 32.32 value, so that the scaling by 1e9 cannot overflow
+	int64_t seconds = _ntpDiff >> 32; // arithmetic shift (floor), the fraction below is then always positive
+	uint64_t fraction = (uint64_t)_ntpDiff & 0xFFFFFFFF;
+	return (seconds * 1000000000LL) + (int64_t)((fraction * 1000000000ULL) >> 32);
+}
+
+int64_t
+NtpClient::convert_ntp_to_unix_ns(uint64_t _ntpTs)
+{
+	int64_t seconds = (int64_t)(_ntpTs >> 32);
+	if (seconds < (int64_t)SECONDS_SINCE_FIRST_EPOCH)
+		seconds += (1LL << 32); // NTP era 1 (from 7/2/2036)
+	uint64_t fraction = _ntpTs & 0xFFFFFFFF;
+	return ((seconds - (int64_t)SECONDS_SINCE_FIRST_EPOCH) * 1000000000LL) + (int64_t)((fraction * 1000000000ULL) >> 32);
+}
+
+void
 NtpClient::convert_ntp_to_date(uint64_t _ntpTs, struct date_structure *_outDataTs)
 {
 	uint32_t second = (uint32_t)((_ntpTs >> 32) & 0xFFFFFFFF);
 	uint32_t fraction = (uint32_t)(_ntpTs & 0xFFFFFFFF);
 
-	struct timeval unix;
+	struct timeval unixTime;
 	struct ntp_timestamp ntpTs;
 	ntpTs.second = second;
 	ntpTs.fraction = fraction;
 
-	convert_ntp_to_unix(&ntpTs, &unix);
-	_outDataTs->hour = (unix.tv_sec % 86400L) / 3600;
-	_outDataTs->minute = (unix.tv_sec % 3600) / 60;
-	_outDataTs->second = (unix.tv_sec % 60);
-	_outDataTs->millisecond = unix.tv_usec;
+	convert_ntp_to_unix(&ntpTs, &unixTime);
+	_outDataTs->hour = (unixTime.tv_sec % 86400L) / 3600;
+	_outDataTs->minute = (unixTime.tv_sec % 3600) / 60;
+	_outDataTs->second = (unixTime.tv_sec % 60);
+	_outDataTs->millisecond = unixTime.tv_usec;
+}
 
-	ostringstream _ss;
-	_ss << std::internal << std::setfill('0') << std::setw(2) << _outDataTs->hour << std::internal << std::setfill('0') << std::setw(2) << _outDataTs->minute
-		<< std::internal << std::setfill('0') << std::setw(2) << _outDataTs->second << std::internal << std::setfill('0') << std::setw(6) << _outDataTs->millisecond;
+void
+NtpClient::BuildRequestTemplate(void)
+{
+	SNTPMessage _sntpMsg;
+	_sntpMsg.clear();  // Important, if you don't set the version/mode, the server will ignore you. 
+	_sntpMsg._leapIndicator = 0;
+	_sntpMsg._versionNumber = 3;
+	_sntpMsg._mode = 3;
 
-	std::string _s = _ss.str();
-	return (stoull(_s));
+	memset(m_requestTemplate, 0, sizeof(m_requestTemplate));
+	NtpPacketView(m_requestTemplate).SetHeader(_sntpMsg._leapIndicator, _sntpMsg._versionNumber, _sntpMsg._mode); // create the 1-byte info in one go... the result should be 27 :)
 }
 
 void
-NtpClient::CreateMessage(char* buffer)
+NtpClient::StampMessage(char* buffer)
 {
 	struct ntp_timestamp ntp;
-	struct timeval unix;
+	struct timeval unixTime;
 
-	gettimeofday(&unix); //get time
-	convert_unix_to_ntp(&ntp, &unix); // convert unix time to ntp time
-	convert_ntp_to_unix(&ntp, &unix);
+	gettimeofday(&unixTime); //get time
+	convert_unix_to_ntp(&ntp, &unixTime); // convert unix time to ntp time
 	uint64_t _ntpTs = ntp.second;
 	_ntpTs = (_ntpTs << 32) | ntp.fraction;
 	m_originateTimestamp = _ntpTs;
+	m_originateTimestampSource = UserSpaceTimestamp;
 
-	SNTPMessage _sntpMsg;
-	_sntpMsg.clear();  // Important, if you don't set the version/mode, the server will ignore you. 
-	_sntpMsg._leapIndicator = 0;
-	_sntpMsg._versionNumber = 3;
-	_sntpMsg._mode = 3;
-	_sntpMsg._originateTimestamp = _ntpTs; //optional (?)
+	NtpPacketView(buffer).SetOriginateTimestamp(_ntpTs);
+}
 
-	char value[sizeof(uint64_t)];
-	memcpy(value, &_sntpMsg._originateTimestamp, sizeof(uint64_t));
-	int jj = sizeof(uint64_t) - 1;
-	int ofssetEnd = NTP_MSG_OFFSET_ORIGINATE_TIMESTAMP + sizeof(uint64_t);
-	for (int ii = NTP_MSG_OFFSET_ORIGINATE_TIMESTAMP; ii < ofssetEnd; ii++)
-	{
-		buffer[ii] = value[jj];
-		jj--;
-	}
+void
+NtpClient::SetCookie(char* buffer)
+{
+	m_transmitCookie = NtpRequestTable::NewCookie();
+	NtpPacketView((unsigned char*)buffer).SetTransmitTimestamp(m_transmitCookie);
+}
 
-	buffer[0] = (_sntpMsg._leapIndicator << 6) | (_sntpMsg._versionNumber << 3) | _sntpMsg._mode; // create the 1-byte info in one go... the result should be 27 :)
+int
+NtpClient::SignMessage(char* buffer)
+{
+	if (m_auth == nullptr)
+		return NTP_MSG_SIZE;
+	return m_auth->Sign((unsigned char*)buffer, m_keyId);
+}
+
+bool
+NtpClient::AuthenticReply(const char* buffer, int length)
+{
+	if (m_auth == nullptr)
+		return true;
+
+	const unsigned char* reply = (const unsigned char*)buffer;
+	if (m_auth->Verify(reply, length) == NtpAuth::Authentic && NtpAuth::GetKeyId(reply, length) == m_keyId)
+		return true;
+
+	// Not from a server that holds the key (no MAC, a bad one, or a crypto-NAK)
+	if (m_instrumentation != nullptr)
+		m_instrumentation->RequestFailed(m_server.c_str(), EACCES);
+	return false;
 }
 
 void
-NtpClient::ReceivedMessage(char* buffer)
+NtpClient::CreateMessage(char* buffer)
 {
-	struct ntp_timestamp ntp;
-	struct timeval unix;
+	memcpy(buffer, m_requestTemplate, NTP_MSG_SIZE);
+	SetCookie(buffer);
+	StampMessage(buffer);
+}
 
-	gettimeofday(&unix);
-	convert_unix_to_ntp(&ntp, &unix); // convert unix time to ntp time
+bool
+NtpClient::ReceivedMessage(char* buffer, Sample* sample, uint64_t receiveTimestamp, TimestampSource source)
+{
+	// The server echoes the transmit timestamp of the request (the cookie) as the originate timestamp
+	uint64_t _cookie = NtpConstPacketView((const unsigned char*)buffer).OriginateTimestamp();
+	if (m_transmitCookie == 0 || _cookie != m_transmitCookie)
+	{
+		// The response does not match the request (late, duplicated or spoofed)
+		if (m_instrumentation != nullptr)
+			m_instrumentation->ResponseUnmatched(m_server.c_str());
+		return false;
+	}
+	m_transmitCookie = 0;
 
-	uint64_t _ntpTs = ntp.second;
-	_ntpTs = (_ntpTs << 32) | ntp.fraction;
+	uint64_t _ntpTs = receiveTimestamp;
+	if (_ntpTs == 0)
+	{
+		struct ntp_timestamp ntp;
+		struct timeval unixTime;
+
+		gettimeofday(&unixTime);
+		convert_unix_to_ntp(&ntp, &unixTime); // convert unix time to ntp time
+		_ntpTs = ntp.second;
+		_ntpTs = (_ntpTs << 32) | ntp.fraction;
+		source = UserSpaceTimestamp;
+	}
 
 	SNTPMessage _sntpMsg;
 	_sntpMsg.clear();  
-	_sntpMsg._leapIndicator = buffer[0] >> 6;
-	_sntpMsg._versionNumber = (buffer[0] & 0x38) >> 3;
-	_sntpMsg._mode = (buffer[0] & 0x7);
-	_sntpMsg._stratum = buffer[1];
-	_sntpMsg._pollInterval = buffer[2];
-	_sntpMsg._precision = buffer[3];
-	_sntpMsg._rootDelay = GetNtpField32(NTP_MSG_OFFSET_ROOT_DELAY, buffer);
-	_sntpMsg._rootDispersion = GetNtpField32(NTP_MSG_OFFSET_ROOT_DISPERSION, buffer);
+	// Decode the fields in place (no copies of the received buffer)
+	NtpConstPacketView _view(buffer);
+	_sntpMsg._leapIndicator = _view.LeapIndicator();
+	_sntpMsg._versionNumber = _view.VersionNumber();
+	_sntpMsg._mode = _view.Mode();
+	_sntpMsg._stratum = _view.Stratum();
+	_sntpMsg._pollInterval = _view.PollInterval();
+	_sntpMsg._precision = _view.Precision();
+	_sntpMsg._rootDelay = _view.RootDelay();
+	_sntpMsg._rootDispersion = _view.RootDispersion();
 	int _refId[4];
 	GetReferenceId(NTP_MSG_OFFSET_REFERENCE_IDENTIFIER, buffer, _refId);
 	_sntpMsg._referenceIdentifier[0] = _refId[0];
 	_sntpMsg._referenceIdentifier[1] = _refId[1];
 	_sntpMsg._referenceIdentifier[2] = _refId[2];
 	_sntpMsg._referenceIdentifier[3] = _refId[3];
-	_sntpMsg._referenceTimestamp = GetNtpTimestamp64(NTP_MSG_OFFSET_REFERENCE_TIMESTAMP, buffer);
-	_sntpMsg._originateTimestamp = GetNtpTimestamp64(NTP_MSG_OFFSET_ORIGINATE_TIMESTAMP, buffer);
-	_sntpMsg._receiveTimestamp = GetNtpTimestamp64(NTP_MSG_OFFSET_RECEIVE_TIMESTAMP, buffer);
-	_sntpMsg._transmitTimestamp = GetNtpTimestamp64(NTP_MSG_OFFSET_TRANSMIT_TIMESTAMP, buffer);
+	_sntpMsg._referenceTimestamp = _view.ReferenceTimestamp();
+	_sntpMsg._originateTimestamp = _view.OriginateTimestamp();
+	_sntpMsg._receiveTimestamp = _view.ReceiveTimestamp();
+	_sntpMsg._transmitTimestamp = _view.TransmitTimestamp();
 
-	uint64_t _tempOriginate = m_originateTimestamp;
-	if (_sntpMsg._originateTimestamp > 0)
-		_tempOriginate = _sntpMsg._originateTimestamp;
+	// A Kiss-o'-Death (stratum 0) carries no time: its code is in the reference identifier
+	if (_sntpMsg._stratum == 0)
+	{
+		char _code[5];
+		for (int ii = 0; ii < 4; ii++)
+			_code[ii] = (_refId[ii] >= 0x20 && _refId[ii] < 0x7F) ? (char)_refId[ii] : '?';
+		_code[4] = '\0';
+		if (m_instrumentation != nullptr)
+			m_instrumentation->KissOfDeath(m_server.c_str(), _code);
+		return false;
+	}
+
+	// RFC 5905 (section 8): a reply that is not from a synchronised server in server mode, or
+	// that lacks its receive or transmit timestamp, carries no usable time
+	if (_sntpMsg._stratum >= 16 || _sntpMsg._leapIndicator == 3 || _sntpMsg._mode != 4 ||
+		_sntpMsg._receiveTimestamp == 0 || _sntpMsg._transmitTimestamp == 0)
+	{
+		if (m_instrumentation != nullptr)
+			m_instrumentation->RequestFailed(m_server.c_str(), 0);
+		return false;
+	}
 
-	struct date_structure dataTs;
-	uint64_t _originClient = convert_ntp_to_date(_tempOriginate, &dataTs);
-	std::cout << "Originate Client: " <<dataTs.hour << ":" << dataTs.minute << ":" << dataTs.second << "." << dataTs.millisecond << std::endl;
-	uint64_t _receiveServer = convert_ntp_to_date(_sntpMsg._receiveTimestamp, &dataTs);
-	std::cout << "Receive Server: " << dataTs.hour << ":" << dataTs.minute << ":" << dataTs.second << "." << dataTs.millisecond << std::endl;
-	uint64_t _transmitServer = convert_ntp_to_date(_sntpMsg._transmitTimestamp, &dataTs);
-	std::cout << "Transmit Server: " << dataTs.hour << ":" << dataTs.minute << ":" << dataTs.second << "." << dataTs.millisecond << std::endl;
-	uint64_t _receiveClient = convert_ntp_to_date(_ntpTs, &dataTs);
-	std::cout << "Receive Client: " << dataTs.hour << ":" << dataTs.minute << ":" << dataTs.second << "." << dataTs.millisecond << std::endl;
+	// T1 is the time recorded when the request was sent (the field echoed by the server is the cookie)
+	uint64_t _tempOriginate = m_originateTimestamp;
 
-	int _clockOffset = (((_receiveServer - _originClient) + (_transmitServer - _receiveClient)) / 2); 
-	_clockOffset = _clockOffset / 1000; // divided by 1e3 to only keep three decimals (negative means local clock is ahead, positive means local clock is behind)
+	// RFC 5905 (section 8): the differences of two timestamps are taken modulo 2^64 and read as signed
+	// 32.32 fixed point, which is correct across midnight and era boundaries (as long as the clocks are
+	// within 68 years of each other). Each difference is halved before the sum, so it cannot overflow.
+	int64_t _forward = (int64_t)(_sntpMsg._receiveTimestamp - _tempOriginate);   // T2 - T1
+	int64_t _backward = (int64_t)(_sntpMsg._transmitTimestamp - _ntpTs);         // T3 - T4
+	int64_t _clockOffsetNs = convert_ntp_diff_to_ns((_forward >> 1) + (_backward >> 1)); // negative means local clock is ahead, positive means local clock is behind
+
+	int64_t _elapsed = (int64_t)(_ntpTs - _tempOriginate);                                    // T4 - T1
+	int64_t _serverTime = (int64_t)(_sntpMsg._transmitTimestamp - _sntpMsg._receiveTimestamp); // T3 - T2
+	int64_t _roundTripDelayNs = convert_ntp_diff_to_ns(_elapsed - _serverTime);
+
+	int _clockOffset = (int)(_clockOffsetNs / 1000000);  // in ms
+	int _roundTripDelay = (int)(_roundTripDelayNs / 1000000);
+
+	// Sample dispersion: the precision of the server plus the drift over the round trip (RFC 5905, PHI)
+	int64_t _precisionNs = (int64_t)std::ldexp(1000000000.0, (signed char)_sntpMsg._precision);
+	int64_t _dispersionNs = _precisionNs + ((_roundTripDelayNs > 0 ? _roundTripDelayNs : 0) / 1000000) * NTP_FILTER_PHI_PPM;
+	// Root delay/dispersion are in NTP short format (16.16)
+	int64_t _rootDelayNs = (int64_t)(((uint64_t)_sntpMsg._rootDelay * 1000000000ULL) >> 16);
+	int64_t _rootDispersionNs = (int64_t)(((uint64_t)_sntpMsg._rootDispersion * 1000000000ULL) >> 16);
+
+	m_lastSample.valid = true;
+	m_lastSample.clockOffset = _clockOffset;
+	m_lastSample.roundTripDelay = _roundTripDelay;
+	m_lastSample.clockOffsetNs = _clockOffsetNs;
+	m_lastSample.roundTripDelayNs = _roundTripDelayNs;
+	m_lastSample.leapIndicator = _sntpMsg._leapIndicator;
+	m_lastSample.stratum = _sntpMsg._stratum;
+	m_lastSample.transmitTimestampSource = m_originateTimestampSource;
+	m_lastSample.receiveTimestampSource = source;
+	m_lastSample.dispersionNs = _dispersionNs;
+	m_lastSample.rootDelayNs = _rootDelayNs;
+	m_lastSample.rootDispersionNs = _rootDispersionNs;
+	m_lastSample.receiveTimeNs = convert_ntp_to_unix_ns(_ntpTs);
+	m_lastSample.pollInterval = (signed char)_sntpMsg._pollInterval;
+	m_lastSample.precision = (signed char)_sntpMsg._precision;
+	if (sample != nullptr)
+		*sample = m_lastSample;
+
+	if (m_instrumentation != nullptr)
+	{
+		NtpInstrumentation::Exchange _exchange;
+		_exchange.server = m_server.c_str();
+		_exchange.address = &m_serverAddress;
+		_exchange.response = (const unsigned char*)buffer;
+		_exchange.originateTimestamp = _tempOriginate;
+		_exchange.receiveTimestamp = _sntpMsg._receiveTimestamp;
+		_exchange.transmitTimestamp = _sntpMsg._transmitTimestamp;
+		_exchange.destinationTimestamp = _ntpTs;
+		_exchange.sample = &m_lastSample;
+		m_instrumentation->ResponseReceived(_exchange);
+	}
 
-	int _roundTripDelay = (_receiveClient - _originClient) - (_receiveServer - _transmitServer);
-	_roundTripDelay = _roundTripDelay / 1000;
+	// The offset of the client is the one of the minimum delay sample in the filter
+	NtpFilter::Entry _entry;
+	_entry.offsetNs = _clockOffsetNs;
+	_entry.delayNs = _roundTripDelayNs;
+	_entry.dispersionNs = _dispersionNs;
+	_entry.timeNs = m_lastSample.receiveTimeNs;
+	NtpFilter::Result _filtered = m_filter.Add(_entry);
 
-	std::cout << "Leap Second: " << (uint32_t) _sntpMsg._leapIndicator << " " << GetLeapString(_sntpMsg._leapIndicator) << "\n"
-			  << "Version Number: " << (uint32_t)_sntpMsg._versionNumber << "\n"
-		      << "Mode: " << (uint32_t) _sntpMsg._mode << " " << GetModeString(_sntpMsg._mode) << "\n"
-		      << "Stratum: " << (uint32_t) _sntpMsg._stratum << " " << GetStratumString(_sntpMsg._stratum) << "\n"
-		      << "Offset [ms]: " << _clockOffset << "\n"
-		      << "RountTrip Delay [ms]: " << _roundTripDelay << std::endl;
+	m_clockOffsetNs.store(_filtered.offsetNs, std::memory_order_relaxed);
+	SetClockOffset((int)(_filtered.offsetNs / 1000000));
 
-	SetClockOffset(_clockOffset);
+	if (m_clockState != nullptr && _filtered.fresh)
+	{
+		// The corrected time follows the estimated drift until the next update
+		const NtpDiscipline::State& _discipline = m_discipline.Update(_filtered.offsetNs, _filtered.timeNs);
+
+		NtpClockState::Snapshot _snapshot;
+		_snapshot.offsetNs = _filtered.offsetNs;
+		_snapshot.frequency = _discipline.frequency;
+		_snapshot.updateTimeNs = _filtered.timeNs;
+		// Root distance: half the round trip to the server and to its reference, plus the server dispersion and the jitter
+		_snapshot.errorBoundNs = (_filtered.delayNs / 2) + (_rootDelayNs / 2) + _rootDispersionNs + _filtered.jitterNs;
+		_snapshot.updates = 0;
+		m_clockState->Publish(_snapshot);
+	}
+	return true;
 }
 
 bool
 NtpClient::Connect()
 {
-	int iResult;
-	WSADATA wsaData;
-
-	SOCKET SendSocket = INVALID_SOCKET;
-	sockaddr_in RecvAddr;
-	unsigned short Port = NTP_PORT;
-	int BufLen = NTP_MSG_SIZE;
+#ifdef _WIN32
+	// A one-off session: the socket is closed and Winsock released when it goes out of scope
+	NtpSession session(*this);
+	if (!session.Open(NTP_SERVER, NTP_TIMEOUT_MS))
+		return false;
 
-	//---------------------------------------------------------------------
-	// Create the NTP tx timestamp and fill the fields in the msg to be tx
-	char SendBuf[NTP_MSG_SIZE] = {0};
-	CreateMessage(SendBuf);
+	return session.Query();
+#else
+	NtpTransport transport;
+	if (!transport.Open())
+	{
+		perror("epoll_create1");
+		return false;
+	}
+	transport.SetKernelTimestamps(m_kernelTimestamps);
 
-	//----------------------
-	//----------------------
-	// Initialize Winsock
-	iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
-	if (iResult != NO_ERROR) {
-		wprintf(L"WSAStartup failed with error: %d\n", iResult);
+	// ConnectAsync() does not wait for the DNS, so the name is resolved here (this call blocks anyway)
+	struct sockaddr_storage RecvAddr;
+	socklen_t RecvAddrLen;
+	if (!dns_lookup(NTP_SERVER, &RecvAddr, &RecvAddrLen))
+	{
+		fprintf(stderr, "%s: host name lookup failure\n", NTP_SERVER);
 		return false;
 	}
 
-	//---------------------------------------------
-	// Create a socket for sending data
-	SendSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-	if (SendSocket == INVALID_SOCKET) {
-		wprintf(L"socket failed with error: %ld\n", WSAGetLastError());
-		WSACleanup();
+	bool _success = false;
+	if (!ConnectAsync(transport, NTP_SERVER, [&_success](bool success) { _success = success; }))
 		return false;
+
+	while (transport.Outstanding() > 0)
+	{
+		if (transport.Poll(-1) < 0)
+			return false;
 	}
-	const char* host = NTP_SERVER;
+	return _success;
+#endif
+}
 
-	//---------------------------------------------
-	struct hostent* hostV;
-	if ((hostV = gethostbyname(host)) == nullptr)
+bool
+NtpClient::Connect(NtpChannel& channel, const char* host, Sample* sample, int timeoutMs)
+{
+	if (sample != nullptr)
+		memset(sample, 0, sizeof(*sample));
+
+	// T1 is taken right before the exchange, T4 right after it (ReceivedMessage)
+	char SendBuf[NTP_AUTH_MSG_SIZE];
+	char RecvBuf[NTP_AUTH_MSG_SIZE];
+	CreateMessage(SendBuf);
+	int length = SignMessage(SendBuf);
+	if (length < 0)
+		errno = EINVAL;
+	int received = (length < 0) ? -1 : channel.Exchange(host, SendBuf, length, RecvBuf, timeoutMs);
+	if (received < 0)
+	{
+		if (m_instrumentation != nullptr)
+			m_instrumentation->RequestFailed(host, errno);
+		return false;
+	}
+	if (m_instrumentation != nullptr)
 	{
-		//More descriptive error message?
-		perror(host);
-		exit(EXIT_FAILURE);
+		m_instrumentation->RequestSent(host);
+		if (received == 0)
+			m_instrumentation->RequestTimedOut(host);
+		else if (received < NTP_MSG_SIZE)
+			m_instrumentation->RequestFailed(host, 0);
 	}
+	if (received < NTP_MSG_SIZE)
+		return false;
+
+	m_server = host;
+	m_serverAddress.ss_family = AF_UNSPEC;
+	return AuthenticReply(RecvBuf, received) && ReceivedMessage(RecvBuf, sample);
+}
+
+#ifndef _WIN32
+bool
+NtpClient::ConnectAsync(NtpTransport& transport, const char* host, std::function<void(bool)> onComplete)
+{
+	return SubmitExchange(transport, host, NTP_TIMEOUT_MS, [onComplete](const Sample& sample)
+		{
+			if (onComplete)
+				onComplete(sample.valid);
+		});
+}
 
-	printf("Hostname: %s\n", hostV->h_name);
-	printf("IP Address: %s\n", inet_ntoa(*((struct in_addr*)hostV->h_addr)));
+#if NTP_HAVE_COROUTINES
+NtpClient::QueryAwaitable::QueryAwaitable(NtpClient& client, NtpTransport& transport, const char* host, int timeoutMs)
+	: m_client(client),
+	  m_transport(transport),
+	  m_host(host),
+	  m_timeoutMs(timeoutMs)
+{
+	memset(&m_sample, 0, sizeof(m_sample));
+}
 
-	memset((char*)& RecvAddr, 0, sizeof(RecvAddr));
-	RecvAddr.sin_family = AF_INET;
+bool
+NtpClient::QueryAwaitable::await_suspend(std::coroutine_handle<> handle)
+{
+	// Not suspended (resumed at once, with an invalid sample) if the request could not be sent;
+	// a name not resolved yet suspends until it is, and the request is sent from Poll()
+	return m_client.SubmitExchange(m_transport, m_host.c_str(), m_timeoutMs, [this, handle](const Sample& sample)
+		{
+			m_sample = sample;
+			handle.resume();
+		});
+}
 
-	std::memcpy((char*)& RecvAddr.sin_addr.s_addr, (char*)hostV->h_addr, hostV->h_length);
-	RecvAddr.sin_port = htons(Port);
-	if (connect(SendSocket, (struct sockaddr*) & RecvAddr, sizeof(RecvAddr)) < 0)
+NtpClient::QueryAwaitable
+NtpClient::Query(NtpTransport& transport, const char* host, int timeoutMs)
+{
+	return QueryAwaitable(*this, transport, host, timeoutMs);
+}
+#endif
+
+bool
+NtpClient::SubmitExchange(NtpTransport& transport, const char* host, int timeoutMs, std::function<void(const Sample&)> onSample, bool resolved)
+{
+	//---------------------------------------------
+	// An address of each family, the one that answered first last time (or IPv6, as in RFC 8305) first.
+	// Only the cache is looked up: this runs on the thread of the event loop, which must not wait
+	// for the DNS (a name not resolved yet is submitted again from Poll() once it is)
+	NtpResolver& resolver = NtpResolver::Global();
+	int preferred = resolver.GetPreferredFamily(host);
+	int families[2];
+	families[0] = (preferred != AF_UNSPEC) ? preferred : AF_INET6;
+	families[1] = (families[0] == AF_INET6) ? AF_INET : AF_INET6;
+
+	struct sockaddr_storage RecvAddr[2];
+	socklen_t RecvAddrLen[2];
+	int count = 0;
+	if (resolver.Lookup(host, families[0], &RecvAddr[count], &RecvAddrLen[count]))
+		count++;
+	else
+		families[0] = families[1];
+	if (resolver.Lookup(host, families[1], &RecvAddr[count], &RecvAddrLen[count]))
+		count++;
+	if (count == 0 && !resolved)
 	{
-		perror(host);
-		exit(EXIT_FAILURE);
+		std::string name(host);
+		std::function<void()> release = transport.Defer([this, &transport, name, timeoutMs, onSample]()
+			{
+				if (!SubmitExchange(transport, name.c_str(), timeoutMs, onSample, true))
+				{
+					Sample sample;
+					memset(&sample, 0, sizeof(sample));
+					onSample(sample);
+				}
+			});
+		resolver.ResolveAsync(host, [release](bool) { release(); });
+		return true;
 	}
-	iResult = sendto(SendSocket, SendBuf, BufLen, 0, (SOCKADDR*)& RecvAddr, sizeof(RecvAddr));
-	if (iResult == SOCKET_ERROR) {
-		wprintf(L"sendto failed with error: %d\n", WSAGetLastError());
-		closesocket(SendSocket);
-		WSACleanup();
+	if (count == 0)
+	{
+		fprintf(stderr, "%s: host name lookup failure\n", host);
 		return false;
 	}
 
-	char bufferRx[NTP_MSG_SIZE] = { 0 };
-	// Receive until the peer closes the connection
-	iResult = recv(SendSocket, bufferRx, NTP_MSG_SIZE, 0);
-	if (iResult == SOCKET_ERROR) {
-		wprintf(L"sendto failed with error: %d\n", WSAGetLastError());
-		closesocket(SendSocket);
-		WSACleanup();
-		return false;
+	// Both families are sent at once when the faster one is not known, otherwise the
+	// other one only goes if the preferred one did not answer within the race delay
+	struct Race
+	{
+		int ids[2];
+		int outstanding;
+	};
+	std::shared_ptr<Race> race = std::make_shared<Race>();
+	race->ids[0] = race->ids[1] = -1;
+	race->outstanding = 0;
+
+	for (int ii = 0; ii < count; ii++)
+	{
+		//---------------------------------------------------------------------
+		// The NTP tx timestamp is written by the transport right before the transmission
+		// (but in a signed request, whose MAC covers the header: T1 is only kept)
+		char SendBuf[NTP_AUTH_MSG_SIZE];
+		memcpy(SendBuf, m_requestTemplate, NTP_MSG_SIZE);
+		SetCookie(SendBuf);
+		uint64_t cookie = m_transmitCookie;
+		int length = SignMessage(SendBuf);
+		int stampOffset = (m_auth == nullptr) ? NTP_MSG_OFFSET_ORIGINATE_TIMESTAMP : -1;
+		int family = RecvAddr[ii].ss_family;
+		bool remember = (count == 2) && (preferred == AF_UNSPEC || ii == 1);
+		int delayMs = (ii == 1 && preferred != AF_UNSPEC && race->outstanding > 0) ? NTP_RACE_DELAY_MS : 0;
+
+		// The completion runs from Poll(), after the caller's host string may be gone: it keeps a copy
+		struct sockaddr_storage address = RecvAddr[ii];
+		std::string name(host);
+		int id = (length < 0) ? -1 : transport.Submit((struct sockaddr*)& RecvAddr[ii], RecvAddrLen[ii], SendBuf, length, timeoutMs,
+			[this, &transport, name, onSample, cookie, race, ii, family, remember, delayMs, address](const NtpTransport::Completion& completion)
+			{
+				race->ids[ii] = -1;
+				race->outstanding--;
+
+				// A delayed request only counts once it went out (it is dropped if cancelled before)
+				if (delayMs > 0 && m_instrumentation != nullptr)
+					m_instrumentation->RequestSent(name.c_str());
+
+				bool _success = false;
+				Sample sample;
+				memset(&sample, 0, sizeof(sample));
+				if (completion.status == NtpTransport::Completed && completion.length >= NTP_MSG_SIZE)
+				{
+					m_originateTimestamp = NtpTimestampFromTimespec(&completion.transmitTime);
+					m_originateTimestampSource = completion.kernelTransmitTimestamp ? KernelTimestamp : UserSpaceTimestamp;
+					m_transmitCookie = cookie;
+					m_server = name;
+					m_serverAddress = address;
+
+					_success = AuthenticReply((const char*)completion.buffer, completion.length) &&
+						ReceivedMessage((char*)completion.buffer, &sample, NtpTimestampFromTimespec(&completion.receiveTime),
+						completion.kernelTimestamp ? KernelTimestamp : UserSpaceTimestamp);
+				}
+				else if (m_instrumentation != nullptr)
+				{
+					if (completion.status == NtpTransport::TimedOut)
+						m_instrumentation->RequestTimedOut(name.c_str());
+					else
+						m_instrumentation->RequestFailed(name.c_str(), completion.status == NtpTransport::Failed ? completion.error : 0);
+				}
+
+				if (_success)
+				{
+					// The other family lost the race (or is not needed anymore)
+					if (race->ids[1 - ii] >= 0 && transport.Cancel(race->ids[1 - ii]))
+						race->outstanding--;
+					if (remember)
+						NtpResolver::Global().SetPreferredFamily(name.c_str(), family);
+				}
+				else if (race->outstanding > 0)
+					return; // the other family may still answer
+
+				onSample(sample);
+			}, stampOffset, delayMs);
+		if (id < 0)
+		{
+			if (m_instrumentation != nullptr)
+				m_instrumentation->RequestFailed(host, (length < 0) ? EINVAL : errno);
+			continue;
+		}
+		if (delayMs == 0 && m_instrumentation != nullptr)
+			m_instrumentation->RequestSent(host);
+		race->ids[ii] = id;
+		race->outstanding++;
 	}
-
-	ReceivedMessage(bufferRx);
-	WSACleanup();
-	return true;
+	return (race->outstanding > 0);
 }
 
-uint64_t
-NtpClient::GetNtpTimestamp64(int offset, char* buffer)
+template <typename Batch>
+int
+NtpClient::ExchangeBatch(Batch& batch, const char* const* hosts, int count, Sample* samples)
 {
-	const int _len = sizeof(uint64_t);
-	char valueRx[_len];
-	memset(valueRx, 0, _len);
-	int jj = sizeof(uint64_t) - 1;
-	for (int ii = offset; ii < offset + _len; ii++)
+	batch.Clear();
+
+	// Index of the batch slot per host (-1 if the host could not be resolved), and the cookie of its request
+	std::vector<int> slots(count, -1);
+	std::vector<uint64_t> cookies(count, 0);
+	std::vector<struct sockaddr_storage> addresses(count);
+	char SendBuf[NTP_AUTH_MSG_SIZE];
+	int stampOffset = (m_auth == nullptr) ? NTP_MSG_OFFSET_ORIGINATE_TIMESTAMP : -1;
+	for (int ii = 0; ii < count; ii++)
+	{
+		memset(&samples[ii], 0, sizeof(samples[ii]));
+
+		struct sockaddr_storage& RecvAddr = addresses[ii];
+		socklen_t RecvAddrLen;
+		if (!dns_lookup(hosts[ii], &RecvAddr, &RecvAddrLen))
+		{
+			fprintf(stderr, "%s: host name lookup failure\n", hosts[ii]);
+			continue;
+		}
+
+		// The NTP tx timestamp is written by the batch right before the transmission (but
+		// in a signed request)
+		memcpy(SendBuf, m_requestTemplate, NTP_MSG_SIZE);
+		SetCookie(SendBuf);
+		cookies[ii] = m_transmitCookie;
+		int length = SignMessage(SendBuf);
+		if (length < 0)
+		{
+			if (m_instrumentation != nullptr)
+				m_instrumentation->RequestFailed(hosts[ii], EINVAL);
+			continue;
+		}
+		slots[ii] = batch.Add((struct sockaddr*)& RecvAddr, RecvAddrLen, SendBuf, length, stampOffset);
+	}
+
+	if (batch.Exchange(NTP_TIMEOUT_MS) < 0)
 	{
-		valueRx[jj] = buffer[ii];
-		jj--;
+		int error = errno;
+		for (int ii = 0; ii < count; ii++)
+		{
+			if (slots[ii] >= 0 && m_instrumentation != nullptr)
+				m_instrumentation->RequestFailed(hosts[ii], error);
+		}
+		errno = error;
+		perror("batch exchange");
+		return -1;
 	}
 
-	uint64_t milliseconds;
-	memcpy(&milliseconds, valueRx, sizeof(uint64_t));
+	int received = 0;
+	for (int ii = 0; ii < count; ii++)
+	{
+		if (slots[ii] < 0)
+			continue;
+		if (m_instrumentation != nullptr)
+		{
+			m_instrumentation->RequestSent(hosts[ii]);
+			if (batch.ReplyLength(slots[ii]) == 0)
+				m_instrumentation->RequestTimedOut(hosts[ii]);
+			else if (batch.ReplyLength(slots[ii]) < NTP_MSG_SIZE)
+				m_instrumentation->RequestFailed(hosts[ii], 0);
+		}
+		if (batch.ReplyLength(slots[ii]) < NTP_MSG_SIZE)
+			continue;
 
-	return milliseconds;
+		struct timespec ts = batch.TransmitTime(slots[ii]);
+		m_originateTimestamp = NtpTimestampFromTimespec(&ts);
+		m_originateTimestampSource = batch.KernelTransmitTimestamp(slots[ii]) ? KernelTimestamp : UserSpaceTimestamp;
+		m_transmitCookie = cookies[ii];
+		m_server = hosts[ii];
+		m_serverAddress = addresses[ii];
+		ts = batch.ReceiveTime(slots[ii]);
+		if (AuthenticReply((const char*)batch.Reply(slots[ii]), batch.ReplyLength(slots[ii])) &&
+			ReceivedMessage((char*)batch.Reply(slots[ii]), &samples[ii], NtpTimestampFromTimespec(&ts),
+			batch.KernelTimestamp(slots[ii]) ? KernelTimestamp : UserSpaceTimestamp))
+			received++;
+	}
+	return received;
 }
 
-unsigned int
-NtpClient::GetNtpField32(int offset, char* buffer)
+int
+NtpClient::ConnectBatch(NtpBatch& batch, const char* const* hosts, int count, Sample* samples)
 {
-	const int _len = sizeof(int);
-	char valueRx[_len];
-	memset(valueRx, 0, _len);
-	int jj = sizeof(int) - 1;
-	for (int ii = offset; ii < offset + _len; ii++)
-	{
-		valueRx[jj] = buffer[ii];
-		jj--;
-	}
+	return ExchangeBatch(batch, hosts, count, samples);
+}
 
-	unsigned int milliseconds;
-	memcpy(&milliseconds, valueRx, sizeof(int));
+#if NTP_HAVE_IO_URING
+int
+NtpClient::ConnectBatch(NtpUringBatch& batch, const char* const* hosts, int count, Sample* samples)
+{
+	return ExchangeBatch(batch, hosts, count, samples);
+}
+#endif
+#endif
+
+uint64_t
+NtpClient::GetNtpTimestamp64(int offset, char* buffer)
+{
+	return NtpWire::Load64((const unsigned char*)buffer + offset);
+}
 
-	return milliseconds;
+unsigned int
+NtpClient::GetNtpField32(int offset, char* buffer)
+{
+	return NtpWire::Load32((const unsigned char*)buffer + offset);
 }
 
 void 
@@ -58,29 +58,319 @@
 #ifndef NTPCLIENT_H
 #define NTPCLIENT_H
 
+#ifdef _WIN32
 #include <winsock2.h>
-#include <ctime>
 #include <ws2def.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <functional>
+#endif
+#include <ctime>
+#include <stdint.h>
 #include <string>
 #include <stdlib.h>
+#include <atomic>
+#include "NtpFilter.h"
+#include "NtpDiscipline.h"
+#ifndef _WIN32
+#include "NtpUringBatch.h"
+#endif
+
+// The coroutine API (Query()) needs C++20 (and the non-blocking transport, i.e. not Windows)
+#ifndef NTP_HAVE_COROUTINES
+#if !defined(_WIN32) && defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define NTP_HAVE_COROUTINES (1)
+#endif
+#endif
+#endif
+#ifndef NTP_HAVE_COROUTINES
+#define NTP_HAVE_COROUTINES (0)
+#endif
+#if NTP_HAVE_COROUTINES
+#include <coroutine>
+#endif
+
+class NtpClockState;
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+#define NTP_PORT (123)
+#define NTP_MSG_SIZE (48) // in bytes
+#define NTP_MSG_OFFSET_ROOT_DELAY (4)
+#define NTP_MSG_OFFSET_ROOT_DISPERSION (8)
+#define NTP_MSG_OFFSET_REFERENCE_IDENTIFIER (12)
+#define NTP_MSG_OFFSET_REFERENCE_TIMESTAMP (16)
+#define NTP_MSG_OFFSET_ORIGINATE_TIMESTAMP (24)
+#define NTP_MSG_OFFSET_RECEIVE_TIMESTAMP (32)
+#define NTP_MSG_OFFSET_TRANSMIT_TIMESTAMP (40)
+#define NTP_TIMEOUT_MS (2000) // time to wait for the SNTP response
+
+#ifndef _WIN32
+class NtpTransport;
+class NtpBatch;
+#endif
+class NtpInstrumentation;
+class NtpTimeSource;
+class NtpChannel;
+class NtpAuth;
 
 class NtpClient
 {
+	friend class NtpSession;
+	friend class NtpBenchmark;     // times the message codec (benchmark/NtpBenchmark.cpp)
+	friend class NtpProber;        // uses the timestamp conversions
+	friend class NtpDebugSink;     // prints the exchanges with the string helpers
+
 public:
+	/**
+	 * Where the transmit (T1) and receive (T4) timestamps of a sample were taken.
+	 */
+	enum TimestampSource
+	{
+		UserSpaceTimestamp,     // 0 - Read from the system clock by the client before sending/after receiving
+		KernelTimestamp         // 1 - Taken by the kernel when the datagram was sent/received (SO_TIMESTAMPING/SO_TIMESTAMPNS)
+	};
+
+	/**
+	 * The result of one request-response exchange with an NTP server.
+	 */
+	struct Sample
+	{
+		bool valid;                    /**< True if a response was received and processed. */
+		int clockOffset;               /**< Clock offset in ms (see GetClockOffset). */
+		int roundTripDelay;            /**< Round-trip delay in ms. */
+		int64_t clockOffsetNs;         /**< Clock offset in ns. */
+		int64_t roundTripDelayNs;      /**< Round-trip delay in ns. */
+		unsigned char leapIndicator;   /**< Leap indicator of the response (see _LeapIndicatorValues). */
+		unsigned char stratum;         /**< Stratum of the server (see _StratumValues). */
+		TimestampSource transmitTimestampSource; /**< Source of the transmit timestamp (T1). */
+		TimestampSource receiveTimestampSource;  /**< Source of the receive timestamp (T4). */
+		int64_t dispersionNs;          /**< Dispersion of the sample (server precision + PHI * delay), in ns. */
+		int64_t rootDelayNs;           /**< Root delay of the server, in ns. */
+		int64_t rootDispersionNs;      /**< Root dispersion of the server, in ns. */
+		int64_t receiveTimeNs;         /**< Local time the response was received (T4, ns since the UNIX epoch). */
+		signed char pollInterval;      /**< Poll exponent of the response (log2 s). */
+		signed char precision;         /**< Precision of the server clock (log2 s). */
+	};
+
 	NtpClient();
 	~NtpClient();
 
-	void dns_lookup(const char* host, sockaddr_in* out);
+	/**
+	 * This function resolves the address of a server, with the NTP port, through the
+	 * caching resolver (the next address of the name each time, for a pool).
+	 *
+	 * \param host the hostname or IP address
+	 * \param out where the address (IPv4 or IPv6) is stored
+	 * \param outLen where the size of the address is stored
+	 * \param family AF_INET or AF_INET6 for that family only; AF_UNSPEC for the family that
+	 * answered first the last time the server was raced, or any family if it is not known
+	 *
+	 * Returns true upon success, false if the name could not be resolved.
+	 */
+	bool dns_lookup(const char* host, struct sockaddr_storage* out, socklen_t* outLen, int family = AF_UNSPEC);
 	/**
 	 * This function should be called to create a socket/connect/receive NTP message.
+	 * For periodic queries, use an NtpSession instead (the socket is set up only once).
 	 * Returns true upon success, false otherwise.
 	 */
 	bool Connect();
+	/**
+	 * This function exchanges an SNTP request with a server over the given channel (blocking),
+	 * e.g. a simulated network (see NtpSimulator). T1 and T4 are taken from the time source
+	 * of the client (see SetTimeSource).
+	 *
+	 * \param channel the channel that carries the exchange
+	 * \param host the hostname or IP address of the NTP server
+	 * \param sample the structure where the results are stored (optional)
+	 * \param timeoutMs the time (in ms) to wait for the response
+	 *
+	 * Returns true upon success, false otherwise
+	 */
+	bool Connect(NtpChannel& channel, const char* host, Sample* sample = nullptr, int timeoutMs = NTP_TIMEOUT_MS);
+#ifndef _WIN32
+	/**
+	 * This function submits an SNTP request to the transport and returns without blocking.
+	 * The reply is processed (see ReceivedMessage) when the transport delivers it, i.e. from
+	 * NtpTransport::Poll(), and onComplete is then invoked with true upon success, or false
+	 * upon timeout or error. Use one NtpClient per server when several exchanges are in flight.
+	 * If the server has both IPv4 and IPv6 addresses, the request races over both families:
+	 * the first valid reply wins (the other exchange is cancelled) and its family is remembered,
+	 * so the following requests go over that family only, the other one being tried if no reply
+	 * came within 250 ms. The families are raced again every 10 min.
+	 * The DNS is never waited for: a name that is not in the cache of NtpResolver is resolved
+	 * in the background (see NtpResolver::ResolveAsync()), and the request is submitted from
+	 * Poll() once it is (the exchange counts in NtpTransport::Outstanding() meanwhile); if the
+	 * name cannot be resolved, onComplete is invoked with false.
+	 *
+	 * \param transport the (already opened) transport that carries the exchange
+	 * \param host the hostname or IP address of the NTP server (copied, it may be freed on return)
+	 * \param onComplete the function to be invoked upon completion (may be empty)
+	 *
+	 * Returns true if the request was submitted, false otherwise
+	 */
+	bool ConnectAsync(NtpTransport& transport, const char* host, std::function<void(bool)> onComplete);
+	/**
+	 * This function queries several NTP servers at once: the requests are sent with one
+	 * sendmmsg() and the responses are collected with recvmmsg() (see NtpBatch).
+	 * The responses go through the clock filter of this client, as if they came from one server
+	 * (use one NtpClient per server to keep a filter per server).
+	 *
+	 * \param batch the batch object (reused across calls, with capacity >= count)
+	 * \param hosts the hostnames or IP addresses of the NTP servers
+	 * \param count the number of hosts
+	 * \param samples the array (of count elements) where the result per host is stored
+	 *
+	 * Returns the number of hosts that responded, or -1 on error
+	 */
+	int ConnectBatch(NtpBatch& batch, const char* const* hosts, int count, Sample* samples);
+#if NTP_HAVE_IO_URING
+	/**
+	 * This function is ConnectBatch() over io_uring (see NtpUringBatch): the requests are sent
+	 * and the responses collected with about one system call per batch.
+	 * Check batch.IsOpen() first, and fall back on the NtpBatch overload otherwise.
+	 */
+	int ConnectBatch(NtpUringBatch& batch, const char* const* hosts, int count, Sample* samples);
+#endif
+#if NTP_HAVE_COROUTINES
+	/**
+	 * The awaitable returned by Query(): the coroutine is suspended while the request is in
+	 * flight, and resumed (from NtpTransport::Poll()) with the sample of the exchange.
+	 */
+	class QueryAwaitable
+	{
+	public:
+		QueryAwaitable(NtpClient& client, NtpTransport& transport, const char* host, int timeoutMs);
+
+		bool await_ready(void) const noexcept { return false; }
+		bool await_suspend(std::coroutine_handle<> handle);
+		Sample await_resume(void) const noexcept { return m_sample; }
+
+	private:
+		NtpClient& m_client;
+		NtpTransport& m_transport;
+		std::string m_host;
+		int m_timeoutMs;
+		Sample m_sample;
+	};
+
+	/**
+	 * This function is ConnectAsync() for coroutines (C++20):
+	 *     NtpClient::Sample sample = co_await client.Query(transport, "pool.ntp.org");
+	 * No thread waits for the response: the coroutine is resumed from NtpTransport::Poll(),
+	 * i.e. on the thread that drives the transport, with the sample of the exchange (valid is
+	 * false upon timeout, error or if the name cannot be resolved; it is resumed at once, without
+	 * suspending, only if the request could not be sent). A name that is not resolved yet is
+	 * resolved in the background first, as in ConnectAsync().
+	 * NtpClient.cpp must be built with C++20 as well.
+	 *
+	 * \param transport the (already opened) transport that carries the exchange
+	 * \param host the hostname or IP address of the NTP server
+	 * \param timeoutMs the time (in ms) to wait for the response
+	 */
+	QueryAwaitable Query(NtpTransport& transport, const char* host, int timeoutMs = NTP_TIMEOUT_MS);
+#endif
+#endif
 	/**
 	 * This function returns the clock offset in ms. 
 	 * Negative value means the local clock is ahead, positive means the local clock is behind (relative to the NTP server)
+	 * This is the offset of the sample with the minimum delay among the last 8 (see NtpFilter).
+	 * It may be called from any thread.
 	 */
 	int GetClockOffset(void);
+	/**
+	 * This function returns the clock offset in ns (same sign convention as GetClockOffset).
+	 */
+	int64_t GetClockOffsetNs(void);
+	/**
+	 * This function sets where the clock state (offset, error bound, time of the update) is
+	 * published after each exchange, for ntp_clock and other readers (see NtpClock.h).
+	 * By default the client publishes to NtpClockState::Global(); nullptr disables it.
+	 *
+	 * \param state the state to publish to
+	 */
+	void SetClockState(NtpClockState* state);
+	/**
+	 * This function sets where the exchanges are reported (requests sent, responses, timeouts,
+	 * errors, Kiss-o'-Death; see NtpInstrumentation), NtpMetrics::Global() by default.
+	 * Nothing is printed, unless an NtpDebugSink is set.
+	 *
+	 * \param instrumentation the instrumentation (nullptr for none); it must outlive the client
+	 */
+	void SetInstrumentation(NtpInstrumentation* instrumentation);
+	/**
+	 * This function sets the clock T1 and T4 are read from when they are not taken by the
+	 * kernel, e.g. a simulated clock (see NtpSimulator). NtpTimeSource::System() by default.
+	 *
+	 * \param source the time source (nullptr for the system clock); it must outlive the client
+	 */
+	void SetTimeSource(NtpTimeSource* source);
+	/**
+	 * This function sets the symmetric key the requests are signed with (see NtpAuth): the
+	 * replies are then only used if they are authenticated with the same key (a reply
+	 * without MAC, with a bad one or a crypto-NAK is reported as failed, EACCES).
+	 * A signed request carries no T1 (it is kept locally), so that the MAC is computed
+	 * before the send.
+	 *
+	 * \param auth the key table (nullptr for unauthenticated requests, the default); it is
+	 * used from the thread that processes the replies, and must outlive the client
+	 * \param keyId the id of the key, in the table
+	 */
+	void SetAuthentication(NtpAuth* auth, uint32_t keyId);
+	/**
+	 * This function returns the result of the last exchange processed.
+	 */
+	Sample GetLastSample(void);
+	/**
+	 * This function returns the state of the clock filter (selected offset, delay, dispersion, jitter).
+	 */
+	NtpFilter::Result GetFilterResult(void);
+	/**
+	 * This function returns the clock filter, i.e. the history of the last 8 samples.
+	 */
+	const NtpFilter& GetFilter(void) const;
+	/**
+	 * This function returns the frequency error of the local clock estimated from the
+	 * offsets published so far (s/s, positive means it runs slow; see NtpDiscipline).
+	 */
+	double GetFrequency(void) const;
+	/**
+	 * This function enables (default) or disables the kernel transmit and receive timestamps used by Connect().
+	 * If the kernel does not provide them, the client falls back to the system clock.
+	 * The exchanges submitted with ConnectAsync()/ConnectBatch() follow the option of the transport/batch.
+	 *
+	 * \param enable true to take T1/T4 from the kernel timestamps
+	 */
+	void SetKernelTimestamps(bool enable);
+	/**
+	 * This function sets the poll exponent sent in the requests (log2 s, i.e. the interval
+	 * at which the client queries the server).
+	 *
+	 * \param pollExponent the poll exponent
+	 */
+	void SetPollInterval(signed char pollExponent);
+	/**
+	 * This function processes a response recorded earlier (see NtpJournal) as if it had just
+	 * been received: it goes through the decoder, the clock filter and the discipline, and is
+	 * reported to the instrumentation. Nothing is sent.
+	 *
+	 * \param server the name of the server (as reported to the instrumentation)
+	 * \param response the response (NTP_MSG_SIZE bytes)
+	 * \param originateTimestamp T1, when the request was sent (NTP format)
+	 * \param transmitSource where T1 was taken
+	 * \param destinationTimestamp T4, when the response was received (NTP format)
+	 * \param receiveSource where T4 was taken
+	 * \param sample the structure where the results are stored (optional)
+	 *
+	 * Returns true if the response was valid, false otherwise (e.g. Kiss-o'-Death)
+	 */
+	bool ReplayExchange(const char* server, const unsigned char* response, uint64_t originateTimestamp, TimestampSource transmitSource,
+		uint64_t destinationTimestamp, TimestampSource receiveSource, Sample* sample = nullptr);
 
 private:
 
@@ -150,7 +440,7 @@ private:
 
 	/**
 	 * This function returns the timestamp (64-bit) from the received
-	 * buffer, given the offset provided.
+	 * buffer, given the offset provided (in place, see NtpWire).
 	 * 
 	 * \param offset the offset of the timestamp in the NTP message
 	 * \param buffer the received message
@@ -160,7 +450,7 @@ private:
 	uint64_t GetNtpTimestamp64(int offset, char* buffer);
 	/**
 	 * This function returns the 32-bit value from the received
-	 * buffer, given the offset provided.
+	 * buffer, given the offset provided (in place, see NtpWire).
 	 *
 	 * \param offset the offset of the field in the NTP message
 	 * \param buffer the received message
@@ -188,18 +478,77 @@ private:
 	void SetClockOffset(int clockOffset);
 	/**
 	 * This function creates the SNTP message ready for transmission (SNTP Req)
-	 * and returns it back.
+	 * and returns it back. It should be called right before the transmission,
+	 * as it takes the transmit timestamp (T1).
 	 *
 	 * \param buffer the message to be sent
 	 */
 	void CreateMessage(char* buffer);
 	/**
-	 * This function gets the information received from the SNTP response
-	 * and prints the results (e.g. offset, round trip delay etc.)
+	 * This function prepares the fields of the SNTP request that do not change
+	 * between requests (i.e. all but the originate timestamp).
+	 */
+	void BuildRequestTemplate(void);
+	/**
+	 * This function writes the current time in the originate timestamp field of
+	 * the request and keeps it as T1 (m_originateTimestamp).
+	 *
+	 * \param buffer the message to be sent
+	 */
+	void StampMessage(char* buffer);
+	/**
+	 * This function writes a new random cookie in the transmit timestamp field of the
+	 * request and keeps it (m_transmitCookie). The server echoes it as the originate
+	 * timestamp, which is how the response is matched to the request.
+	 *
+	 * \param buffer the message to be sent
+	 */
+	void SetCookie(char* buffer);
+	/**
+	 * This function appends the key id and the MAC to the request if authentication is set
+	 * (see SetAuthentication); buffer has room for NTP_AUTH_MSG_SIZE bytes.
+	 *
+	 * \param buffer the message to be sent, once complete
+	 *
+	 * Returns the size of the request, or -1 if the key is not in the table
+	 */
+	int SignMessage(char* buffer);
+	/**
+	 * This function returns true if authentication is not set, or if the reply is
+	 * authenticated with the key of the requests; otherwise the failure is reported (EACCES).
 	 *
 	 * \param buffer the message received
+	 * \param length its size
+	 */
+	bool AuthenticReply(const char* buffer, int length);
+	/**
+	 * This function gets the information received from the SNTP response (e.g. offset, round
+	 * trip delay etc.) and reports it to the instrumentation (see SetInstrumentation).
+	 *
+	 * \param buffer the message received
+	 * \param sample the structure where the results are stored (optional)
+	 * \param receiveTimestamp the NTP time the message was received (optional, the current time is used if 0)
+	 * \param source where receiveTimestamp was taken (recorded in the sample)
+	 *
+	 * Returns false if the response does not echo the cookie of the request (late, duplicated or spoofed),
+	 * or if it carries no usable time (Kiss-o'-Death, unsynchronised server, not in server mode, or
+	 * missing timestamps): the filter and the clock state are then left as they are
 	 */
-	void ReceivedMessage(char* buffer);
+	bool ReceivedMessage(char* buffer, Sample* sample = nullptr, uint64_t receiveTimestamp = 0, TimestampSource source = UserSpaceTimestamp);
+#ifndef _WIN32
+	/**
+	 * This function does the work of ConnectBatch() for either batch backend (same interface).
+	 */
+	template <typename Batch>
+	int ExchangeBatch(Batch& batch, const char* const* hosts, int count, Sample* samples);
+	/**
+	 * This function does the work of ConnectAsync(): onSample is invoked with the sample of
+	 * the exchange (valid is false upon timeout or error) unless false is returned.
+	 * If the name is not in the cache, the submission is deferred until it is resolved, unless
+	 * resolved is true (the name was resolved already, or could not be).
+	 */
+	bool SubmitExchange(NtpTransport& transport, const char* host, int timeoutMs, std::function<void(const Sample&)> onSample, bool resolved = false);
+#endif
 	/**
 	 * This function gets the UNIX time
 	 *
@@ -219,14 +568,31 @@ private:
 	 * \param ntpTs the structure NTP where the NTP values are already set
 	 * \param unixTs the structure UNIX where the UNIX values are stored
 	 */
-	void convert_ntp_to_unix(struct ntp_timestamp* ntpTs, struct timeval* unixTs);
+	static void convert_ntp_to_unix(struct ntp_timestamp* ntpTs, struct timeval* unixTs);
 	/**
-	 * This function converts the NTP time to local time
+	 * This function converts the NTP time to local time (for printing only)
 	 *
 	 * \param _ntpTs the NTP timestamp to be converted
 	 * \param _outDataTs the structure Date where the [HH, MM, SS, MMMMMM] are stored
 	 */
-	uint64_t convert_ntp_to_date(uint64_t _ntpTs, struct date_structure* _outDataTs);
+	static void convert_ntp_to_date(uint64_t _ntpTs, struct date_structure* _outDataTs);
+	/**
+	 * This function converts the difference of two NTP timestamps (signed 32.32 fixed point) to ns
+	 *
+	 * \param _ntpDiff the difference, taken modulo 2^64 and read as signed
+	 *
+	 * Returns the difference in ns
+	 */
+	static int64_t convert_ntp_diff_to_ns(int64_t _ntpDiff);
+	/**
+	 * This function converts the NTP time to UNIX time in ns (era aware: times before
+	 * 1970 are read as the next NTP era, i.e. after 2036)
+	 *
+	 * \param _ntpTs the NTP timestamp to be converted
+	 *
+	 * Returns the ns since 1/1/1970 00.00
+	 */
+	static int64_t convert_ntp_to_unix_ns(uint64_t _ntpTs);
 	/**
 	 * This function returns the LeapIndicator field in a string format (see _LeapIndicatorValues).
 	 *     
@@ -234,7 +600,7 @@ private:
 	 *
 	 * Returns the string format of LeapIndicator
 	 */
-	std::string GetLeapString(unsigned char _leapIndicator);
+	static std::string GetLeapString(unsigned char _leapIndicator);
 	/**
 	 * This function returns the Mode field in a string format (see _ModeValues).
 	 *
@@ -242,7 +608,7 @@ private:
 	 *
 	 * Returns the string format of Mode
 	 */
-	std::string GetModeString(unsigned char _mode);
+	static std::string GetModeString(unsigned char _mode);
 	/**
 	 * This function returns the Stratum field in a string format (see _StratumValues).
 	 *
@@ -250,11 +616,26 @@ private:
 	 *
 	 * Returns the string format of Stratum
 	 */
-	std::string GetStratumString(unsigned char _stratum);
+	static std::string GetStratumString(unsigned char _stratum);
 
 
-	int m_clockOffset;			   // offset of the local clock	
-	uint64_t m_originateTimestamp; // the time that the req is transmitted (in case that the NTP server does not copy this field from the req to the response)
+	std::atomic<int> m_clockOffset;			   // offset of the local clock	
+	std::atomic<int64_t> m_clockOffsetNs;	   // offset of the local clock, in ns
+	NtpClockState* m_clockState;   // where the clock state is published (may be nullptr)
+	Sample m_lastSample;		   // result of the last exchange processed
+	NtpFilter m_filter;			   // the last 8 samples, the offset is taken from the minimum delay one
+	NtpDiscipline m_discipline;	   // frequency error, from the offsets published
+	bool m_kernelTimestamps;	   // take T4 from the kernel receive timestamps (if available)
+	uint64_t m_originateTimestamp; // the time that the req is transmitted (T1)
+	TimestampSource m_originateTimestampSource; // where m_originateTimestamp was taken
+	uint64_t m_transmitCookie;     // the cookie of the req in flight (0 once its response is processed)
+	std::string m_server;          // the server of the req in flight (as reported to the instrumentation)
+	struct sockaddr_storage m_serverAddress; // its address (AF_UNSPEC if not known)
+	NtpInstrumentation* m_instrumentation; // where the exchanges are reported (may be nullptr)
+	NtpTimeSource* m_timeSource;   // the clock of the user-space timestamps
+	NtpAuth* m_auth;               // the keys the requests are signed with (nullptr if not authenticated)
+	uint32_t m_keyId;              // the key of the requests, in m_auth
+	char m_requestTemplate[NTP_MSG_SIZE];	   // the SNTP request, but the originate timestamp
 };
 
 #endif  /* NTPCLIENT_H */
\ No newline at end of file
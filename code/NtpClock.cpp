@@ -0,0 +1,135 @@
+/**
+ *  This file provides the clock state published by the SNTP client (seqlock) and
+ *  the NTP-corrected std::chrono clock.
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+/******************************************************************************
+* Project Headers
+*****************************************************************************/
+#include "NtpClock.h"
+#include "NtpTscClock.h"
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+#define NTP_CLOCK_MAX_DRIFT_PPM (15) // tolerance of the local clock frequency (RFC 5905, PHI)
+
+// The time source of the clients, unless one is injected
+class NtpSystemTimeSource : public NtpTimeSource
+{
+public:
+	int64_t Now(void) override
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+};
+
+/******************************************************************************
+* Class Member Function Definitions
+*****************************************************************************/
+
+NtpTimeSource&
+NtpTimeSource::System(void)
+{
+	static NtpSystemTimeSource source;
+	return source;
+}
+
+NtpClockState::NtpClockState()
+	: m_sequence(0),
+	  m_offsetNs(0),
+	  m_frequency(0.0),
+	  m_updateTimeNs(0),
+	  m_errorBoundNs(0),
+	  m_updates(0),
+	  m_tsc(nullptr)
+{
+}
+
+NtpClockState&
+NtpClockState::Global(void)
+{
+	static NtpClockState state;
+	return state;
+}
+
+void
+NtpClockState::Publish(const Snapshot& snapshot)
+{
+	uint64_t sequence = m_sequence.load(std::memory_order_relaxed);
+	m_sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	m_offsetNs.store(snapshot.offsetNs, std::memory_order_relaxed);
+	m_frequency.store(snapshot.frequency, std::memory_order_relaxed);
+	m_updateTimeNs.store(snapshot.updateTimeNs, std::memory_order_relaxed);
+	m_errorBoundNs.store(snapshot.errorBoundNs, std::memory_order_relaxed);
+	m_updates.store(m_updates.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+	m_sequence.store(sequence + 2, std::memory_order_release);
+
+	if (m_tsc != nullptr)
+		m_tsc->Recalibrate(snapshot);
+}
+
+void
+NtpClockState::SetTscClock(NtpTscClock* tsc)
+{
+	m_tsc = tsc;
+}
+
+NtpClockState::Snapshot
+NtpClockState::Read(void) const
+{
+	Snapshot snapshot;
+	for (;;)
+	{
+		uint64_t before = m_sequence.load(std::memory_order_acquire);
+		snapshot.offsetNs = m_offsetNs.load(std::memory_order_relaxed);
+		snapshot.frequency = m_frequency.load(std::memory_order_relaxed);
+		snapshot.updateTimeNs = m_updateTimeNs.load(std::memory_order_relaxed);
+		snapshot.errorBoundNs = m_errorBoundNs.load(std::memory_order_relaxed);
+		snapshot.updates = m_updates.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+
+		// Retry if a publication started before or during the reads
+		if ((before & 1) == 0 && m_sequence.load(std::memory_order_relaxed) == before)
+			return snapshot;
+	}
+}
+
+int64_t
+NtpClockState::Correct(const Snapshot& snapshot, int64_t systemTimeNs)
+{
+	int64_t elapsed = systemTimeNs - snapshot.updateTimeNs;
+	return systemTimeNs + snapshot.offsetNs + (int64_t)(snapshot.frequency * (double)elapsed);
+}
+
+ntp_clock::time_point
+ntp_clock::now(const NtpClockState& state) noexcept
+{
+	int64_t systemTimeNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+	return time_point(duration(NtpClockState::Correct(state.Read(), systemTimeNs)));
+}
+
+ntp_clock::time_point
+ntp_clock::now() noexcept
+{
+	return now(NtpClockState::Global());
+}
+
+ntp_clock::duration
+ntp_clock::error_bound() noexcept
+{
+	NtpClockState::Snapshot snapshot = NtpClockState::Global().Read();
+	int64_t systemTimeNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+	int64_t elapsed = systemTimeNs - snapshot.updateTimeNs;
+	if (elapsed < 0)
+		elapsed = -elapsed;
+	return duration(snapshot.errorBoundNs + (elapsed / 1000000) * NTP_CLOCK_MAX_DRIFT_PPM); // 1 ms at 1 ppm is 1 ns
+}
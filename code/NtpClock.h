@@ -0,0 +1,137 @@
+/**
+ *  This file provides the clock state published by the SNTP client and a std::chrono
+ *  clock that returns the NTP-corrected time.
+ *
+ *  NtpTimeSource is the clock the client reads its timestamps from, the system clock by
+ *  default; it is an interface so that the time can be simulated (see NtpSimulator.h).
+ *
+ *  NtpClockState is a seqlock: the (single) sync thread publishes a new snapshot after
+ *  each exchange, while any number of threads read it without taking a lock and without
+ *  writing to shared memory, so reads scale across cores. A reader only retries if it
+ *  overlaps with a publication, which happens once per poll.
+ *
+ *  ntp_clock meets the TrivialClock requirements; ntp_clock::now() is the system clock
+ *  corrected by the published offset (and frequency error, extrapolated since the update).
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#ifndef NTPCLOCK_H
+#define NTPCLOCK_H
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+
+class NtpTscClock;
+
+class NtpTimeSource
+{
+public:
+	virtual ~NtpTimeSource() {}
+
+	/**
+	 * This function returns the time of the clock (ns since the UNIX epoch).
+	 */
+	virtual int64_t Now(void) = 0;
+	/**
+	 * This function returns the system clock (std::chrono::system_clock).
+	 */
+	static NtpTimeSource& System(void);
+};
+
+class NtpClockState
+{
+public:
+	struct Snapshot
+	{
+		int64_t offsetNs;        /**< Offset to add to the system clock, in ns (positive means the local clock is behind). */
+		double frequency;        /**< Frequency error of the system clock (s/s, positive means it runs slow). */
+		int64_t updateTimeNs;    /**< System clock time (ns since the UNIX epoch) at which offsetNs was measured. */
+		int64_t errorBoundNs;    /**< Maximum error of the corrected time at updateTimeNs, in ns. */
+		uint64_t updates;        /**< Number of snapshots published so far (0 means not synchronised yet). */
+	};
+
+	NtpClockState();
+
+	/**
+	 * This function publishes a new snapshot. Only one thread may publish at a time.
+	 *
+	 * \param snapshot the new state (the updates field is ignored)
+	 */
+	void Publish(const Snapshot& snapshot);
+	/**
+	 * This function returns a consistent copy of the last snapshot published (lock-free).
+	 */
+	Snapshot Read(void) const;
+	/**
+	 * This function returns the corrected time for the given system clock time,
+	 * using the snapshot provided.
+	 *
+	 * \param snapshot the clock state
+	 * \param systemTimeNs the system clock time (ns since the UNIX epoch)
+	 */
+	static int64_t Correct(const Snapshot& snapshot, int64_t systemTimeNs);
+	/**
+	 * This function returns the state read by ntp_clock (and published by NtpClient by default).
+	 */
+	static NtpClockState& Global(void);
+	/**
+	 * This function attaches a TSC clock, recalibrated on each Publish() (see NtpTscClock.h).
+	 * Called by NtpTscClock::Enable().
+	 */
+	void SetTscClock(NtpTscClock* tsc);
+
+private:
+	NtpClockState(const NtpClockState&);
+	NtpClockState& operator=(const NtpClockState&);
+
+	// Readers only touch this cache line; odd sequence numbers mean a publication is in progress
+	alignas(64) std::atomic<uint64_t> m_sequence;
+	std::atomic<int64_t> m_offsetNs;
+	std::atomic<double> m_frequency;
+	std::atomic<int64_t> m_updateTimeNs;
+	std::atomic<int64_t> m_errorBoundNs;
+	std::atomic<uint64_t> m_updates;
+	char m_padding[64 - 6 * 8];
+
+	NtpTscClock* m_tsc;			   // only used by the publishing thread
+};
+
+/**
+ * std::chrono clock that returns the NTP-corrected UTC time (same epoch as std::chrono::system_clock).
+ */
+struct ntp_clock
+{
+	typedef std::chrono::nanoseconds duration;
+	typedef duration::rep rep;
+	typedef duration::period period;
+	typedef std::chrono::time_point<ntp_clock> time_point;
+	static constexpr bool is_steady = false;
+
+	/**
+	 * This function returns the corrected time, using NtpClockState::Global().
+	 */
+	static time_point now() noexcept;
+	/**
+	 * This function returns the corrected time, using the given state.
+	 */
+	static time_point now(const NtpClockState& state) noexcept;
+	/**
+	 * This function returns the upper bound of the error of now() (in ns), i.e. the error bound
+	 * published with the last update plus the drift since then (15 ppm, as in RFC 5905).
+	 */
+	static duration error_bound() noexcept;
+
+	static std::chrono::system_clock::time_point to_sys(const time_point& tp) noexcept
+	{
+		return std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(tp.time_since_epoch()));
+	}
+
+	static time_point from_sys(const std::chrono::system_clock::time_point& tp) noexcept
+	{
+		return time_point(std::chrono::duration_cast<duration>(tp.time_since_epoch()));
+	}
+};
+
+#endif  /* NTPCLOCK_H */
@@ -0,0 +1,140 @@
+/**
+ *  This class estimates the frequency error of the local clock (RFC 5905, section 11.3).
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+/******************************************************************************
+* Project Headers
+*****************************************************************************/
+#include "NtpDiscipline.h"
+
+/******************************************************************************
+* System Headers
+*****************************************************************************/
+#include <cstring>
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+#define NTP_DISCIPLINE_MIN_SPAN_NS (64000000000LL) // the FLL needs offsets over at least 64 s
+#define NTP_DISCIPLINE_AVG (4)                     // averaging of the FLL (AVG)
+#define NTP_DISCIPLINE_PLL (16)                    // gain of the PLL (PLL)
+#define NTP_DISCIPLINE_MIN_INTERVAL_S (16.0)       // shortest interval used in the PLL gain, 16 s (MINPOLL)
+
+/******************************************************************************
+* Class Member Function Definitions
+*****************************************************************************/
+
+NtpDiscipline::NtpDiscipline()
+{
+	memset(&m_state, 0, sizeof(m_state));
+	Reset();
+}
+
+void
+NtpDiscipline::Reset(void)
+{
+	memset(m_history, 0, sizeof(m_history));
+	m_next = 0;
+	m_count = 0;
+	m_state.updates = 0;
+	m_state.stepped = false;
+	m_state.residualNs = 0;
+}
+
+const NtpDiscipline::State&
+NtpDiscipline::GetState(void) const
+{
+	return m_state;
+}
+
+int64_t
+NtpDiscipline::Predict(int64_t timeNs) const
+{
+	return m_state.offsetNs + (int64_t)(m_state.frequency * (double)(timeNs - m_state.timeNs));
+}
+
+bool
+NtpDiscipline::Slope(double* slope) const
+{
+	if (m_count < 3)
+		return false;
+
+	// Relative to the newest point, so that the sums keep their precision
+	const Point& newest = m_history[(m_next - 1 + NTP_DISCIPLINE_HISTORY) % NTP_DISCIPLINE_HISTORY];
+	double sumT = 0.0, sumO = 0.0, sumTT = 0.0, sumTO = 0.0;
+	int64_t span = 0;
+	for (int i = 0; i < m_count; i++)
+	{
+		const Point& point = m_history[i];
+		double t = (double)(point.timeNs - newest.timeNs) * 1e-9;
+		double o = (double)(point.offsetNs - newest.offsetNs) * 1e-9;
+		sumT += t;
+		sumO += o;
+		sumTT += t * t;
+		sumTO += t * o;
+		if (newest.timeNs - point.timeNs > span)
+			span = newest.timeNs - point.timeNs;
+	}
+	if (span < NTP_DISCIPLINE_MIN_SPAN_NS)
+		return false;
+
+	double n = (double)m_count;
+	double denominator = (n * sumTT) - (sumT * sumT);
+	if (denominator <= 0.0)
+		return false;
+	*slope = ((n * sumTO) - (sumT * sumO)) / denominator;
+	return true;
+}
+
+const NtpDiscipline::State&
+NtpDiscipline::Update(int64_t offsetNs, int64_t timeNs)
+{
+	if (m_state.updates > 0 && timeNs <= m_state.timeNs)
+		return m_state; // not newer than the last update (e.g. the same sample selected again)
+
+	m_state.stepped = false;
+	m_state.residualNs = 0;
+	if (m_state.updates > 0)
+	{
+		double interval = (double)(timeNs - m_state.timeNs) * 1e-9;
+		int64_t residual = offsetNs - Predict(timeNs);
+		m_state.residualNs = residual;
+
+		if (residual > NTP_DISCIPLINE_STEP_NS || residual < -NTP_DISCIPLINE_STEP_NS)
+		{
+			// The clock (or the server) was stepped: the old offsets say nothing about the frequency
+			Reset();
+			m_state.stepped = true;
+		}
+		else
+		{
+			// PLL: the gain falls with the square of the interval (loop time constant)
+			double tau = (interval > NTP_DISCIPLINE_MIN_INTERVAL_S) ? interval : NTP_DISCIPLINE_MIN_INTERVAL_S;
+			double pll = 4.0 * NTP_DISCIPLINE_PLL * tau;
+			m_state.frequency += ((double)residual * 1e-9) * interval / (pll * pll);
+		}
+	}
+
+	m_history[m_next].timeNs = timeNs;
+	m_history[m_next].offsetNs = offsetNs;
+	m_next = (m_next + 1) % NTP_DISCIPLINE_HISTORY;
+	if (m_count < NTP_DISCIPLINE_HISTORY)
+		m_count++;
+
+	// FLL: move the frequency towards the slope of the offsets
+	double slope;
+	if (Slope(&slope))
+		m_state.frequency += (slope - m_state.frequency) / NTP_DISCIPLINE_AVG;
+
+	if (m_state.frequency > NTP_DISCIPLINE_MAX_FREQUENCY)
+		m_state.frequency = NTP_DISCIPLINE_MAX_FREQUENCY;
+	else if (m_state.frequency < -NTP_DISCIPLINE_MAX_FREQUENCY)
+		m_state.frequency = -NTP_DISCIPLINE_MAX_FREQUENCY;
+
+	m_state.offsetNs = offsetNs;
+	m_state.timeNs = timeNs;
+	m_state.updates++;
+	return m_state;
+}
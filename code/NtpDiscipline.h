@@ -0,0 +1,85 @@
+/**
+ *  This class estimates the frequency error of the local clock from the offsets measured
+ *  over time, so that the corrected time can follow the drift between two polls
+ *  (RFC 5905, section 11.3, adapted: the system clock is not adjusted, the offset and
+ *  frequency are published instead, see NtpClockState).
+ *
+ *  Each update compares the measured offset to the one predicted by the last offset and
+ *  frequency. The frequency is then corrected by:
+ *  - a frequency-lock loop (FLL): the least-squares slope of the last 8 offsets over time,
+ *    averaged in with a weight of 1/4 once the history spans at least 64 s;
+ *  - a phase-lock loop (PLL): the residual of the prediction, integrated over the time
+ *    since the last update, with a gain that decreases with the square of the interval.
+ *  A residual larger than 128 ms means the clock was stepped: the history is restarted.
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#ifndef NTPDISCIPLINE_H
+#define NTPDISCIPLINE_H
+
+#include <stdint.h>
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+#define NTP_DISCIPLINE_HISTORY (8)               // offsets used by the FLL
+#define NTP_DISCIPLINE_MAX_FREQUENCY (500e-6)    // frequency tolerance, 500 ppm (MAXFREQ)
+#define NTP_DISCIPLINE_STEP_NS (128000000LL)     // larger residuals are steps, 128 ms (STEPT)
+
+class NtpDiscipline
+{
+public:
+	struct State
+	{
+		int updates;            /**< Number of updates since the last reset. */
+		bool stepped;           /**< True if the last update was a step (the history was restarted). */
+		int64_t offsetNs;       /**< Offset measured at the last update, in ns. */
+		int64_t timeNs;         /**< Time of the last update (ns since the UNIX epoch). */
+		int64_t residualNs;     /**< Measured minus predicted offset at the last update, in ns. */
+		double frequency;       /**< Frequency error of the local clock (s/s, positive means it runs slow). */
+	};
+
+	NtpDiscipline();
+
+	/**
+	 * This function adds a measured offset and updates the frequency.
+	 *
+	 * \param offsetNs the offset measured, in ns
+	 * \param timeNs the time the offset was measured (ns since the UNIX epoch)
+	 *
+	 * Returns the new state
+	 */
+	const State& Update(int64_t offsetNs, int64_t timeNs);
+	/**
+	 * This function returns the offset predicted at the given time.
+	 *
+	 * \param timeNs the time (ns since the UNIX epoch)
+	 */
+	int64_t Predict(int64_t timeNs) const;
+	/**
+	 * This function returns the current state.
+	 */
+	const State& GetState(void) const;
+	/**
+	 * This function restarts the estimation (the frequency is kept).
+	 */
+	void Reset(void);
+
+private:
+	struct Point
+	{
+		int64_t timeNs;
+		int64_t offsetNs;
+	};
+
+	// Least-squares slope of the offsets in the history; false if it spans too short a time
+	bool Slope(double* slope) const;
+
+	Point m_history[NTP_DISCIPLINE_HISTORY];   // ring of the last offsets
+	int m_next;
+	int m_count;
+	State m_state;
+};
+
+#endif  /* NTPDISCIPLINE_H */
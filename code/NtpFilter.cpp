@@ -0,0 +1,119 @@
+/**
+ *  This class is the clock filter of one server (RFC 5905, section 10).
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+/******************************************************************************
+* Project Headers
+*****************************************************************************/
+#include "NtpFilter.h"
+
+/******************************************************************************
+* System Headers
+*****************************************************************************/
+#include <cmath>
+#include <cstring>
+
+/******************************************************************************
+* Class Member Function Definitions
+*****************************************************************************/
+
+NtpFilter::NtpFilter()
+{
+	Clear();
+}
+
+void
+NtpFilter::Clear(void)
+{
+	memset(m_entries, 0, sizeof(m_entries));
+	m_next = 0;
+	m_count = 0;
+	m_lastSelectedTimeNs = 0;
+	memset(&m_result, 0, sizeof(m_result));
+}
+
+int
+NtpFilter::Count(void) const
+{
+	return m_count;
+}
+
+const NtpFilter::Entry&
+NtpFilter::GetEntry(int age) const
+{
+	return m_entries[(m_next - 1 - age + (2 * NTP_FILTER_STAGES)) % NTP_FILTER_STAGES];
+}
+
+const NtpFilter::Result&
+NtpFilter::GetResult(void) const
+{
+	return m_result;
+}
+
+NtpFilter::Result
+NtpFilter::Add(const Entry& entry)
+{
+	m_entries[m_next] = entry;
+	m_next = (m_next + 1) % NTP_FILTER_STAGES;
+	if (m_count < NTP_FILTER_STAGES)
+		m_count++;
+
+	// The dispersion of each sample grows with its age (the local clock may drift by PHI)
+	int64_t aged[NTP_FILTER_STAGES];
+	int order[NTP_FILTER_STAGES];
+	for (int i = 0; i < m_count; i++)
+	{
+		const Entry& e = GetEntry(i);
+		int64_t age = entry.timeNs - e.timeNs;
+		if (age < 0)
+			age = 0;
+		aged[i] = e.dispersionNs + (age / 1000000) * NTP_FILTER_PHI_PPM; // 1 ms at 1 ppm is 1 ns
+		order[i] = i;
+	}
+
+	// Sort by delay (insertion sort, at most 8 entries); the newest wins a tie
+	for (int i = 1; i < m_count; i++)
+	{
+		int current = order[i];
+		int j = i - 1;
+		while (j >= 0 && GetEntry(order[j]).delayNs > GetEntry(current).delayNs)
+		{
+			order[j + 1] = order[j];
+			j--;
+		}
+		order[j + 1] = current;
+	}
+
+	const Entry& best = GetEntry(order[0]);
+
+	// Dispersion: the aged dispersions weighted by 1/2, 1/4, ... in the order of the delay (empty stages count as MAXDISP)
+	double dispersion = 0.0;
+	double weight = 0.5;
+	for (int i = 0; i < NTP_FILTER_STAGES; i++, weight /= 2)
+		dispersion += weight * (double)(i < m_count ? aged[order[i]] : NTP_FILTER_MAX_DISPERSION_NS);
+
+	// Jitter: RMS of the offset differences to the selected sample
+	double jitter = 0.0;
+	for (int i = 1; i < m_count; i++)
+	{
+		double diff = (double)(GetEntry(order[i]).offsetNs - best.offsetNs);
+		jitter += diff * diff;
+	}
+	if (m_count > 1)
+		jitter = std::sqrt(jitter / (double)(m_count - 1));
+
+	m_result.valid = true;
+	m_result.fresh = (best.timeNs > m_lastSelectedTimeNs);
+	m_result.count = m_count;
+	m_result.offsetNs = best.offsetNs;
+	m_result.delayNs = best.delayNs;
+	m_result.dispersionNs = (int64_t)dispersion;
+	m_result.sampleDispersionNs = aged[order[0]];
+	m_result.jitterNs = (int64_t)jitter;
+	m_result.timeNs = best.timeNs;
+	if (m_result.fresh)
+		m_lastSelectedTimeNs = best.timeNs;
+	return m_result;
+}
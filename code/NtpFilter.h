@@ -0,0 +1,92 @@
+/**
+ *  This class is the clock filter of one server (RFC 5905, section 10): it keeps the last
+ *  8 samples (offset, delay, dispersion, time) in a shift register and selects the sample
+ *  with the minimum delay, since the offset of an exchange delayed by queueing in one
+ *  direction is off by up to half the extra delay. It also estimates the jitter (RMS of
+ *  the offset differences) and the dispersion of the server.
+ *
+ *  The register is a fixed-size ring (8 x 32 bytes), so adding a sample does not allocate
+ *  and the selection only sorts 8 indices.
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#ifndef NTPFILTER_H
+#define NTPFILTER_H
+
+#include <stdint.h>
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+// May be overridden at build time, e.g. to tune the filter against a journal (tools/NtpReplay.cpp)
+#ifndef NTP_FILTER_STAGES
+#define NTP_FILTER_STAGES (8)                      // size of the shift register (NSTAGE)
+#endif
+#define NTP_FILTER_MAX_DISPERSION_NS (16000000000LL) // dispersion of an empty stage, 16 s (MAXDISP)
+#ifndef NTP_FILTER_PHI_PPM
+#define NTP_FILTER_PHI_PPM (15)                    // frequency tolerance, the dispersion grows by 15 us/s (PHI)
+#endif
+
+class NtpFilter
+{
+public:
+	struct Entry
+	{
+		int64_t offsetNs;       /**< Clock offset of the sample, in ns. */
+		int64_t delayNs;        /**< Round-trip delay of the sample, in ns. */
+		int64_t dispersionNs;   /**< Dispersion of the sample when taken (precision + PHI * delay), in ns. */
+		int64_t timeNs;         /**< Local time the sample was taken (T4, ns since the UNIX epoch). */
+	};
+
+	struct Result
+	{
+		bool valid;             /**< True if at least one sample was added. */
+		bool fresh;             /**< True if the selected sample had not been selected before. */
+		int count;              /**< Number of samples in the register. */
+		int64_t offsetNs;       /**< Offset of the selected (minimum delay) sample, in ns. */
+		int64_t delayNs;        /**< Delay of the selected sample, in ns. */
+		int64_t dispersionNs;   /**< Dispersion of the server (weighted over the register), in ns. */
+		int64_t sampleDispersionNs; /**< Dispersion of the selected sample, aged to the newest sample, in ns. */
+		int64_t jitterNs;       /**< RMS of the offsets relative to the selected one, in ns. */
+		int64_t timeNs;         /**< Time the selected sample was taken (ns since the UNIX epoch). */
+	};
+
+	NtpFilter();
+
+	/**
+	 * This function shifts a new sample in (the oldest one is dropped) and selects again.
+	 *
+	 * \param entry the new sample
+	 *
+	 * Returns the result of the selection
+	 */
+	Result Add(const Entry& entry);
+	/**
+	 * This function returns the result of the last selection.
+	 */
+	const Result& GetResult(void) const;
+	/**
+	 * This function returns the number of samples in the register.
+	 */
+	int Count(void) const;
+	/**
+	 * This function returns a sample in the register (0 is the newest).
+	 *
+	 * \param age the index of the sample, from 0 to Count() - 1
+	 */
+	const Entry& GetEntry(int age) const;
+	/**
+	 * This function empties the register (e.g. after the clock was stepped).
+	 */
+	void Clear(void);
+
+private:
+	Entry m_entries[NTP_FILTER_STAGES];   // ring, m_next is the slot of the next sample
+	int m_next;
+	int m_count;
+	int64_t m_lastSelectedTimeNs;         // time of the last sample selected
+	Result m_result;
+};
+
+#endif  /* NTPFILTER_H */
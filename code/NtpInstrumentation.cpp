@@ -0,0 +1,110 @@
+/**
+ *  This class is the interface through which the SNTP client reports its exchanges
+ *  (see NtpInstrumentation.h); NtpDebugSink prints them.
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+/******************************************************************************
+* Project Headers
+*****************************************************************************/
+#include "NtpInstrumentation.h"
+#include "NtpPacket.h"
+
+/******************************************************************************
+* System Headers
+*****************************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+#include <mutex>
+
+/******************************************************************************
+* Static Function Definitions
+*****************************************************************************/
+
+// The lines of the exchanges printed by several threads are not interleaved
+static std::mutex&
+PrintMutex(void)
+{
+	static std::mutex mutex;
+	return mutex;
+}
+
+/******************************************************************************
+* Class Member Function Definitions
+*****************************************************************************/
+
+NtpDebugSink::NtpDebugSink(NtpInstrumentation* next)
+	: m_next(next)
+{
+}
+
+void
+NtpDebugSink::RequestSent(const char* server)
+{
+	if (m_next != nullptr)
+		m_next->RequestSent(server);
+}
+
+void
+NtpDebugSink::ResponseReceived(const Exchange& exchange)
+{
+	{
+		std::lock_guard<std::mutex> lock(PrintMutex());
+		NtpConstPacketView _view(exchange.response);
+		NtpClient::date_structure dataTs;
+
+		std::cout << "Hostname: " << exchange.server << std::endl;
+		NtpClient::convert_ntp_to_date(exchange.originateTimestamp, &dataTs);
+		std::cout << "Originate Client: " << dataTs.hour << ":" << dataTs.minute << ":" << dataTs.second << "." << dataTs.millisecond << std::endl;
+		NtpClient::convert_ntp_to_date(exchange.receiveTimestamp, &dataTs);
+		std::cout << "Receive Server: " << dataTs.hour << ":" << dataTs.minute << ":" << dataTs.second << "." << dataTs.millisecond << std::endl;
+		NtpClient::convert_ntp_to_date(exchange.transmitTimestamp, &dataTs);
+		std::cout << "Transmit Server: " << dataTs.hour << ":" << dataTs.minute << ":" << dataTs.second << "." << dataTs.millisecond << std::endl;
+		NtpClient::convert_ntp_to_date(exchange.destinationTimestamp, &dataTs);
+		std::cout << "Receive Client: " << dataTs.hour << ":" << dataTs.minute << ":" << dataTs.second << "." << dataTs.millisecond << std::endl;
+
+		std::cout << "Leap Second: " << (uint32_t)_view.LeapIndicator() << " " << NtpClient::GetLeapString(_view.LeapIndicator()) << "\n"
+				  << "Version Number: " << (uint32_t)_view.VersionNumber() << "\n"
+				  << "Mode: " << (uint32_t)_view.Mode() << " " << NtpClient::GetModeString(_view.Mode()) << "\n"
+				  << "Stratum: " << (uint32_t)_view.Stratum() << " " << NtpClient::GetStratumString(_view.Stratum()) << "\n"
+				  << "Offset [ms]: " << exchange.sample->clockOffset << "\n"
+				  << "RountTrip Delay [ms]: " << exchange.sample->roundTripDelay << std::endl;
+	}
+
+	if (m_next != nullptr)
+		m_next->ResponseReceived(exchange);
+}
+
+void
+NtpDebugSink::RequestTimedOut(const char* server)
+{
+	fprintf(stderr, "%s: no response\n", server);
+	if (m_next != nullptr)
+		m_next->RequestTimedOut(server);
+}
+
+void
+NtpDebugSink::RequestFailed(const char* server, int error)
+{
+	fprintf(stderr, "%s: %s\n", server, (error != 0) ? strerror(error) : "invalid response");
+	if (m_next != nullptr)
+		m_next->RequestFailed(server, error);
+}
+
+void
+NtpDebugSink::ResponseUnmatched(const char* server)
+{
+	fprintf(stderr, "%s: unmatched response dropped\n", server);
+	if (m_next != nullptr)
+		m_next->ResponseUnmatched(server);
+}
+
+void
+NtpDebugSink::KissOfDeath(const char* server, const char* code)
+{
+	fprintf(stderr, "%s: kiss-o'-death %s\n", server, code);
+	if (m_next != nullptr)
+		m_next->KissOfDeath(server, code);
+}
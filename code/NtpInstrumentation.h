@@ -0,0 +1,90 @@
+/**
+ *  This class is the interface through which the SNTP client reports its exchanges
+ *  (instead of printing them): the requests sent, the responses processed, the timeouts,
+ *  the errors and the Kiss-o'-Death responses, per server. NtpMetrics keeps counters,
+ *  histograms and gauges from them; NtpDebugSink prints them (for debugging only), and
+ *  passes them on to another instrumentation.
+ *
+ *  The functions are called on the thread that processes the exchange, so an
+ *  implementation shared by several clients must be thread-safe.
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#ifndef NTPINSTRUMENTATION_H
+#define NTPINSTRUMENTATION_H
+
+#include "NtpClient.h"
+
+#include <stdint.h>
+
+class NtpInstrumentation
+{
+public:
+	// A response that was processed
+	struct Exchange
+	{
+		const char* server;              /**< The name (or address) of the server queried. */
+		const struct sockaddr_storage* address; /**< The address of the server (ss_family is AF_UNSPEC if not known). */
+		const unsigned char* response;   /**< The response (NTP_MSG_SIZE bytes). */
+		uint64_t originateTimestamp;     /**< T1, when the request was sent (NTP format). */
+		uint64_t receiveTimestamp;       /**< T2, when the server received the request. */
+		uint64_t transmitTimestamp;      /**< T3, when the server sent the response. */
+		uint64_t destinationTimestamp;   /**< T4, when the response was received. */
+		const NtpClient::Sample* sample; /**< The result of the exchange. */
+	};
+
+	virtual ~NtpInstrumentation() {}
+
+	/**
+	 * This function is called when a request is sent to the server.
+	 */
+	virtual void RequestSent(const char* server) = 0;
+	/**
+	 * This function is called when a response of the server was processed.
+	 */
+	virtual void ResponseReceived(const Exchange& exchange) = 0;
+	/**
+	 * This function is called when no response came before the timeout.
+	 */
+	virtual void RequestTimedOut(const char* server) = 0;
+	/**
+	 * This function is called when the request could not be sent or the response could not
+	 * be received (error is the errno value, or 0 e.g. for a short or unusable response).
+	 */
+	virtual void RequestFailed(const char* server, int error) = 0;
+	/**
+	 * This function is called when a response does not match the request in flight (late,
+	 * duplicated or spoofed); the response is dropped (it is not an error of the server).
+	 */
+	virtual void ResponseUnmatched(const char* server) = 0;
+	/**
+	 * This function is called when the server answered with a Kiss-o'-Death (stratum 0), e.g.
+	 * "RATE" to slow down or "DENY" to stop; the response is not used.
+	 *
+	 * \param server the name of the server
+	 * \param code the kiss code (4 ASCII characters, null-terminated)
+	 */
+	virtual void KissOfDeath(const char* server, const char* code) = 0;
+};
+
+class NtpDebugSink : public NtpInstrumentation
+{
+public:
+	/**
+	 * \param next the instrumentation the events are passed on to (optional)
+	 */
+	explicit NtpDebugSink(NtpInstrumentation* next = nullptr);
+
+	void RequestSent(const char* server) override;
+	void ResponseReceived(const Exchange& exchange) override;
+	void RequestTimedOut(const char* server) override;
+	void RequestFailed(const char* server, int error) override;
+	void ResponseUnmatched(const char* server) override;
+	void KissOfDeath(const char* server, const char* code) override;
+
+private:
+	NtpInstrumentation* m_next;
+};
+
+#endif  /* NTPINSTRUMENTATION_H */
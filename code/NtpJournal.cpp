@@ -0,0 +1,337 @@
+/**
+ *  This class records every SNTP exchange in a memory-mapped ring file (see NtpJournal.h).
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#ifndef _WIN32
+
+/******************************************************************************
+* Project Headers
+*****************************************************************************/
+#include "NtpJournal.h"
+
+/******************************************************************************
+* System Headers
+*****************************************************************************/
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+#define NTP_JOURNAL_MAGIC "NTPJRNL"    // 8 bytes, with the terminating null
+#define NTP_JOURNAL_VERSION (1)
+
+// The header of the file (one cache line)
+struct NtpJournal::Header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t recordSize;
+	uint64_t capacity;
+	std::atomic<uint64_t> next;        // sequence number of the next record
+	char padding[32];
+};
+
+// A record in the file: the sequence is the seqlock of the slot
+struct NtpJournal::Slot
+{
+	std::atomic<uint64_t> sequence;
+	unsigned char data[sizeof(NtpJournal::Record) - sizeof(uint64_t)];
+};
+
+// The writers of other processes share the counters through the mapping
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the journal needs lock-free 64-bit atomics");
+static_assert(sizeof(NtpJournal::Record) == 128, "the records are 128 bytes");
+
+/******************************************************************************
+* Class Member Function Definitions
+*****************************************************************************/
+
+NtpJournal::NtpJournal(NtpInstrumentation* next)
+	: m_next(next),
+	  m_header(nullptr),
+	  m_slots(nullptr),
+	  m_capacity(0),
+	  m_size(0)
+{
+	static_assert(sizeof(Header) == 64, "the header is one cache line");
+	static_assert(sizeof(Slot) == sizeof(Record), "a slot holds a record");
+}
+
+NtpJournal::~NtpJournal()
+{
+	Close();
+}
+
+bool
+NtpJournal::Open(const char* path, uint64_t capacity)
+{
+	Close();
+	if (capacity == 0)
+		return false;
+
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		perror(path);
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+	{
+		perror(path);
+		close(fd);
+		return false;
+	}
+
+	// A new journal: the records are zero (empty) until written
+	bool created = (st.st_size == 0);
+	size_t size = created ? sizeof(Header) + (size_t)capacity * sizeof(Record) : (size_t)st.st_size;
+	if (created && ftruncate(fd, (off_t)size) < 0)
+	{
+		perror(path);
+		close(fd);
+		return false;
+	}
+
+	if (!Map(fd, size, true))
+	{
+		fprintf(stderr, "%s: not a journal\n", path);
+		return false;
+	}
+
+	if (created)
+	{
+		m_header->version = NTP_JOURNAL_VERSION;
+		m_header->recordSize = sizeof(Record);
+		m_header->capacity = capacity;
+		m_header->next.store(0, std::memory_order_relaxed);
+		memcpy(m_header->magic, NTP_JOURNAL_MAGIC, sizeof(m_header->magic));
+		m_capacity = capacity;
+	}
+	else if (m_capacity == 0)
+	{
+		fprintf(stderr, "%s: not a journal\n", path);
+		Close();
+		return false;
+	}
+	return true;
+}
+
+bool
+NtpJournal::OpenReadOnly(const char* path)
+{
+	Close();
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		perror(path);
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(Header) || !Map(fd, (size_t)st.st_size, false) || m_capacity == 0)
+	{
+		fprintf(stderr, "%s: not a journal\n", path);
+		Close();
+		return false;
+	}
+	return true;
+}
+
+bool
+NtpJournal::Map(int fd, size_t size, bool writable)
+{
+	void* mapping = mmap(nullptr, size, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+		return false;
+
+	m_header = (Header*)mapping;
+	m_slots = (Slot*)((char*)mapping + sizeof(Header));
+	m_size = size;
+
+	// A new journal is initialised by Open()
+	if (writable && m_header->magic[0] == '\0' && m_header->capacity == 0)
+		return true;
+
+	if (memcmp(m_header->magic, NTP_JOURNAL_MAGIC, sizeof(m_header->magic)) != 0 || m_header->version != NTP_JOURNAL_VERSION ||
+		m_header->recordSize != sizeof(Record) || size < sizeof(Header) + m_header->capacity * sizeof(Record))
+	{
+		Close();
+		return false;
+	}
+	m_capacity = m_header->capacity;
+	return true;
+}
+
+void
+NtpJournal::Close(void)
+{
+	if (m_header != nullptr)
+		munmap(m_header, m_size);
+	m_header = nullptr;
+	m_slots = nullptr;
+	m_capacity = 0;
+	m_size = 0;
+}
+
+bool
+NtpJournal::IsOpen(void) const
+{
+	return (m_header != nullptr);
+}
+
+void
+NtpJournal::Sync(void)
+{
+	if (m_header != nullptr)
+		msync(m_header, m_size, MS_SYNC);
+}
+
+void
+NtpJournal::ResponseReceived(const Exchange& exchange)
+{
+	if (m_next != nullptr)
+		m_next->ResponseReceived(exchange);
+	if (m_header == nullptr || m_capacity == 0)
+		return;
+
+	Record record;
+	memset(&record, 0, sizeof(record));
+	record.originateTimestamp = exchange.originateTimestamp;
+	record.receiveTimestamp = exchange.receiveTimestamp;
+	record.transmitTimestamp = exchange.transmitTimestamp;
+	record.destinationTimestamp = exchange.destinationTimestamp;
+	memcpy(record.response, exchange.response, NTP_MSG_SIZE);
+	record.transmitTimestampSource = (uint8_t)exchange.sample->transmitTimestampSource;
+	record.receiveTimestampSource = (uint8_t)exchange.sample->receiveTimestampSource;
+	record.family = AF_UNSPEC;
+	if (exchange.address != nullptr && exchange.address->ss_family == AF_INET)
+	{
+		const struct sockaddr_in* address = (const struct sockaddr_in*)exchange.address;
+		record.family = AF_INET;
+		record.port = address->sin_port;
+		memcpy(record.address, &address->sin_addr, sizeof(address->sin_addr));
+	}
+	else if (exchange.address != nullptr && exchange.address->ss_family == AF_INET6)
+	{
+		const struct sockaddr_in6* address = (const struct sockaddr_in6*)exchange.address;
+		record.family = AF_INET6;
+		record.port = address->sin6_port;
+		memcpy(record.address, &address->sin6_addr, sizeof(address->sin6_addr));
+	}
+	strncpy(record.server, exchange.server, sizeof(record.server) - 1);
+
+	// Claim the slot, then clear its sequence while it is written (readers skip it)
+	uint64_t sequence = m_header->next.fetch_add(1, std::memory_order_relaxed);
+	Slot& slot = m_slots[sequence % m_capacity];
+	slot.sequence.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(slot.data, (const char*)&record + sizeof(uint64_t), sizeof(slot.data));
+	slot.sequence.store(sequence + 1, std::memory_order_release);
+}
+
+// Only the responses are recorded
+void
+NtpJournal::RequestSent(const char* server)
+{
+	if (m_next != nullptr)
+		m_next->RequestSent(server);
+}
+
+void
+NtpJournal::RequestTimedOut(const char* server)
+{
+	if (m_next != nullptr)
+		m_next->RequestTimedOut(server);
+}
+
+void
+NtpJournal::RequestFailed(const char* server, int error)
+{
+	if (m_next != nullptr)
+		m_next->RequestFailed(server, error);
+}
+
+void
+NtpJournal::ResponseUnmatched(const char* server)
+{
+	if (m_next != nullptr)
+		m_next->ResponseUnmatched(server);
+}
+
+void
+NtpJournal::KissOfDeath(const char* server, const char* code)
+{
+	if (m_next != nullptr)
+		m_next->KissOfDeath(server, code);
+}
+
+uint64_t
+NtpJournal::GetCapacity(void) const
+{
+	return m_capacity;
+}
+
+uint64_t
+NtpJournal::GetFirst(void) const
+{
+	uint64_t next = GetNext();
+	return (next > m_capacity) ? next - m_capacity : 0;
+}
+
+uint64_t
+NtpJournal::GetNext(void) const
+{
+	return (m_header != nullptr) ? m_header->next.load(std::memory_order_acquire) : 0;
+}
+
+bool
+NtpJournal::Read(uint64_t sequence, Record* record) const
+{
+	if (m_header == nullptr || m_capacity == 0)
+		return false;
+
+	const Slot& slot = m_slots[sequence % m_capacity];
+	if (slot.sequence.load(std::memory_order_acquire) != sequence + 1)
+		return false;
+	memcpy((char*)record + sizeof(uint64_t), slot.data, sizeof(slot.data));
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (slot.sequence.load(std::memory_order_relaxed) != sequence + 1)
+		return false;
+	record->sequence = sequence + 1;
+	return true;
+}
+
+void
+NtpJournal::GetAddress(const Record& record, struct sockaddr_storage* out)
+{
+	memset(out, 0, sizeof(*out));
+	out->ss_family = AF_UNSPEC;
+	if (record.family == AF_INET)
+	{
+		struct sockaddr_in* address = (struct sockaddr_in*)out;
+		address->sin_family = AF_INET;
+		address->sin_port = record.port;
+		memcpy(&address->sin_addr, record.address, sizeof(address->sin_addr));
+	}
+	else if (record.family == AF_INET6)
+	{
+		struct sockaddr_in6* address = (struct sockaddr_in6*)out;
+		address->sin6_family = AF_INET6;
+		address->sin6_port = record.port;
+		memcpy(&address->sin6_addr, record.address, sizeof(address->sin6_addr));
+	}
+}
+
+#endif
@@ -0,0 +1,146 @@
+/**
+ *  This class records every SNTP exchange in a journal file, for post-mortems on clock
+ *  incidents and to tune the filter and the selection offline (see tools/NtpReplay.cpp):
+ *  the raw response, T1 to T4, where T1/T4 were taken and the address of the server.
+ *
+ *  The file is a ring of fixed-size records (128 bytes) mapped in memory, after a header
+ *  of one cache line. A record is written by claiming the next sequence number (one atomic
+ *  add) and copying the exchange into its slot: no lock, no allocation, no system call, so
+ *  several clients (and threads) may share a journal. Each slot is a seqlock: its sequence
+ *  is cleared while the record is written and set once it is complete, so a reader (even
+ *  another process, while the journal is written) skips the slots being overwritten.
+ *  Once the ring is full the oldest records are overwritten; the data reaches the disk when
+ *  the kernel writes the pages back (Sync() forces it).
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#ifndef NTPJOURNAL_H
+#define NTPJOURNAL_H
+
+#ifndef _WIN32
+
+#include "NtpInstrumentation.h"
+
+#include <stdint.h>
+#include <atomic>
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+#define NTP_JOURNAL_CAPACITY (65536)   // records in a new journal (8 MB)
+
+class NtpJournal : public NtpInstrumentation
+{
+public:
+	// A record, as stored in the file (native byte order, but the response)
+	struct Record
+	{
+		uint64_t sequence;                /**< Sequence number of the record + 1 (0 while it is written). */
+		uint64_t originateTimestamp;      /**< T1, when the request was sent (NTP format). */
+		uint64_t receiveTimestamp;        /**< T2, when the server received the request. */
+		uint64_t transmitTimestamp;       /**< T3, when the server sent the response. */
+		uint64_t destinationTimestamp;    /**< T4, when the response was received. */
+		unsigned char response[NTP_MSG_SIZE]; /**< The response, as received. */
+		uint8_t transmitTimestampSource;  /**< Where T1 was taken (NtpClient::TimestampSource). */
+		uint8_t receiveTimestampSource;   /**< Where T4 was taken (NtpClient::TimestampSource). */
+		uint8_t family;                   /**< AF_INET, AF_INET6 or AF_UNSPEC if the address is not known. */
+		uint8_t reserved;
+		uint16_t port;                    /**< Port of the server (network byte order). */
+		uint16_t reserved2;
+		unsigned char address[16];        /**< Address of the server (4 bytes for IPv4). */
+		char server[16];                  /**< Name of the server (truncated, for display only). */
+	};
+
+	/**
+	 * \param next the instrumentation the events are passed on to (optional), e.g. NtpMetrics::Global()
+	 */
+	explicit NtpJournal(NtpInstrumentation* next = nullptr);
+	~NtpJournal();
+
+	/**
+	 * This function opens the journal for writing: an existing journal is appended to
+	 * (with its own capacity), otherwise a new one is created.
+	 *
+	 * \param path the path of the file
+	 * \param capacity the number of records of a new journal
+	 *
+	 * Returns true upon success, false otherwise
+	 */
+	bool Open(const char* path, uint64_t capacity = NTP_JOURNAL_CAPACITY);
+	/**
+	 * This function opens an existing journal for reading only.
+	 *
+	 * \param path the path of the file
+	 *
+	 * Returns true upon success, false otherwise
+	 */
+	bool OpenReadOnly(const char* path);
+	/**
+	 * This function unmaps the journal (the records stay in the file).
+	 */
+	void Close(void);
+	/**
+	 * This function returns true if the journal is open.
+	 */
+	bool IsOpen(void) const;
+	/**
+	 * This function writes the mapped records back to the file (blocking).
+	 */
+	void Sync(void);
+
+	/**
+	 * This function records an exchange (lock-free and allocation-free).
+	 */
+	void ResponseReceived(const Exchange& exchange) override;
+	void RequestSent(const char* server) override;
+	void RequestTimedOut(const char* server) override;
+	void RequestFailed(const char* server, int error) override;
+	void ResponseUnmatched(const char* server) override;
+	void KissOfDeath(const char* server, const char* code) override;
+
+	/**
+	 * This function returns the number of records in the ring.
+	 */
+	uint64_t GetCapacity(void) const;
+	/**
+	 * This function returns the sequence number of the oldest record still in the ring.
+	 */
+	uint64_t GetFirst(void) const;
+	/**
+	 * This function returns the sequence number of the next record to be written.
+	 */
+	uint64_t GetNext(void) const;
+	/**
+	 * This function reads a record (lock-free).
+	 *
+	 * \param sequence the sequence number of the record, from GetFirst() to GetNext() - 1
+	 * \param record where the record is copied
+	 *
+	 * Returns true upon success, false if the record was overwritten or is being written
+	 */
+	bool Read(uint64_t sequence, Record* record) const;
+	/**
+	 * This function stores the address of a record in out (AF_UNSPEC if not known).
+	 */
+	static void GetAddress(const Record& record, struct sockaddr_storage* out);
+
+private:
+	NtpJournal(const NtpJournal&);
+	NtpJournal& operator=(const NtpJournal&);
+
+	struct Header;
+	struct Slot;
+
+	bool Map(int fd, size_t size, bool writable);
+
+	NtpInstrumentation* m_next;
+	Header* m_header;
+	Slot* m_slots;
+	uint64_t m_capacity;
+	size_t m_size;                 // of the mapping
+};
+
+#endif
+
+#endif  /* NTPJOURNAL_H */
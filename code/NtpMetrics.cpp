@@ -0,0 +1,543 @@
+/**
+ *  This class keeps the metrics of the SNTP exchanges, per server, and exports them in
+ *  the OpenMetrics text format (see NtpMetrics.h).
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+/******************************************************************************
+* Project Headers
+*****************************************************************************/
+#include "NtpMetrics.h"
+
+/******************************************************************************
+* System Headers
+*****************************************************************************/
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+#define NTP_METRICS_POLL_MS (200)            // how often the endpoint checks for Stop()
+#define NTP_METRICS_REQUEST_TIMEOUT_S (1)    // longest wait for the request of a scraper
+#define NTP_METRICS_REQUEST_SIZE (4096)
+
+/******************************************************************************
+* Static Function Definitions
+*****************************************************************************/
+
+// Index of the highest bit set (value > 0)
+static int
+HighestBit(uint64_t value)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanReverse64(&index, value);
+	return (int)index;
+#else
+	return 63 - __builtin_clzll(value);
+#endif
+}
+
+static void
+AppendEscaped(std::string* out, const std::string& value)
+{
+	for (size_t ii = 0; ii < value.size(); ii++)
+	{
+		char c = value[ii];
+		if (c == '\\' || c == '"')
+		{
+			out->push_back('\\');
+			out->push_back(c);
+		}
+		else if (c == '\n')
+			out->append("\\n");
+		else
+			out->push_back(c);
+	}
+}
+
+static void
+AppendSample(std::string* out, const char* name, const std::string& server, const char* le, double value)
+{
+	char number[32];
+	out->append(name);
+	out->append("{server=\"");
+	AppendEscaped(out, server);
+	out->push_back('"');
+	if (le != nullptr)
+	{
+		out->append(",le=\"");
+		out->append(le);
+		out->push_back('"');
+	}
+	snprintf(number, sizeof(number), "} %.17g\n", value);
+	out->append(number);
+}
+
+static void
+AppendFamily(std::string* out, const char* name, const char* type, const char* unit, const char* help)
+{
+	out->append("# TYPE ").append(name).append(" ").append(type).append("\n");
+	if (unit != nullptr)
+		out->append("# UNIT ").append(name).append(" ").append(unit).append("\n");
+	out->append("# HELP ").append(name).append(" ").append(help).append("\n");
+}
+
+static void
+AppendHistogram(std::string* out, const char* name, const std::string& server, const NtpHistogram& histogram)
+{
+	std::string bucket = std::string(name) + "_bucket";
+	char le[32];
+	uint64_t cumulative = 0;
+	for (int bb = 0; bb < NtpHistogram::BucketCount; bb++)
+	{
+		cumulative += histogram.BucketValues(bb);
+		// Exported at the powers of two only (the last sub-bucket of each)
+		if (bb == NtpHistogram::BucketCount - 1)
+			AppendSample(out, bucket.c_str(), server, "+Inf", (double)cumulative);
+		else if (bb == 0 || ((bb - 1) & ((1 << NtpHistogram::SubBucketBits) - 1)) == (1 << NtpHistogram::SubBucketBits) - 1)
+		{
+			snprintf(le, sizeof(le), "%.9g", (double)NtpHistogram::BucketUpperBound(bb) / 1e9);
+			AppendSample(out, bucket.c_str(), server, le, (double)cumulative);
+		}
+	}
+	// The count of the buckets read, so that it matches the +Inf bucket
+	AppendSample(out, (std::string(name) + "_count").c_str(), server, nullptr, (double)cumulative);
+	AppendSample(out, (std::string(name) + "_sum").c_str(), server, nullptr, (double)histogram.Sum() / 1e9);
+}
+
+/******************************************************************************
+* Class Member Function Definitions
+*****************************************************************************/
+
+NtpHistogram::NtpHistogram()
+	: m_count(0),
+	  m_sum(0)
+{
+	for (int bb = 0; bb < BucketCount; bb++)
+		m_buckets[bb].store(0, std::memory_order_relaxed);
+}
+
+int
+NtpHistogram::BucketOf(int64_t valueNs)
+{
+	if (valueNs < ((int64_t)1 << MinExponent))
+		return 0;
+	int exponent = HighestBit((uint64_t)valueNs);
+	if (exponent >= MaxExponent)
+		return BucketCount - 1;
+	int sub = (int)(((uint64_t)valueNs >> (exponent - SubBucketBits)) & ((1 << SubBucketBits) - 1));
+	return 1 + ((exponent - MinExponent) << SubBucketBits) + sub;
+}
+
+int64_t
+NtpHistogram::BucketUpperBound(int bucket)
+{
+	if (bucket <= 0)
+		return (int64_t)1 << MinExponent;
+	if (bucket >= BucketCount - 1)
+		return INT64_MAX;
+	int exponent = MinExponent + ((bucket - 1) >> SubBucketBits);
+	int sub = (bucket - 1) & ((1 << SubBucketBits) - 1);
+	return (int64_t)((1 << SubBucketBits) + sub + 1) << (exponent - SubBucketBits);
+}
+
+void
+NtpHistogram::Record(int64_t valueNs)
+{
+	if (valueNs < 0)
+		valueNs = 0;
+	m_buckets[BucketOf(valueNs)].fetch_add(1, std::memory_order_relaxed);
+	m_count.fetch_add(1, std::memory_order_relaxed);
+	m_sum.fetch_add(valueNs, std::memory_order_relaxed);
+}
+
+uint64_t
+NtpHistogram::Count(void) const
+{
+	return m_count.load(std::memory_order_relaxed);
+}
+
+int64_t
+NtpHistogram::Sum(void) const
+{
+	return m_sum.load(std::memory_order_relaxed);
+}
+
+uint64_t
+NtpHistogram::BucketValues(int bucket) const
+{
+	if (bucket < 0 || bucket >= BucketCount)
+		return 0;
+	return m_buckets[bucket].load(std::memory_order_relaxed);
+}
+
+void
+NtpHistogram::Reset(void)
+{
+	for (int bb = 0; bb < BucketCount; bb++)
+		m_buckets[bb].store(0, std::memory_order_relaxed);
+	m_count.store(0, std::memory_order_relaxed);
+	m_sum.store(0, std::memory_order_relaxed);
+}
+
+int64_t
+NtpHistogram::ValueAtQuantile(double quantile) const
+{
+	uint64_t total = 0;
+	for (int bb = 0; bb < BucketCount; bb++)
+		total += BucketValues(bb);
+	if (total == 0)
+		return 0;
+
+	uint64_t rank = (uint64_t)(quantile * (double)total + 0.5);
+	if (rank < 1)
+		rank = 1;
+	uint64_t cumulative = 0;
+	for (int bb = 0; bb < BucketCount; bb++)
+	{
+		cumulative += BucketValues(bb);
+		if (cumulative >= rank)
+			return BucketUpperBound(bb);
+	}
+	return INT64_MAX;
+}
+
+NtpMetrics::Server::Server()
+	: sent(0),
+	  received(0),
+	  timeouts(0),
+	  errors(0),
+	  kissOfDeath(0),
+	  unmatched(0),
+	  lastOffsetNs(0),
+	  lastRoundTripDelayNs(0),
+	  lastStratum(0),
+	  lastReceiveTimeNs(0)
+{
+}
+
+void
+NtpMetrics::Server::Reset(void)
+{
+	sent.store(0, std::memory_order_relaxed);
+	received.store(0, std::memory_order_relaxed);
+	timeouts.store(0, std::memory_order_relaxed);
+	errors.store(0, std::memory_order_relaxed);
+	kissOfDeath.store(0, std::memory_order_relaxed);
+	unmatched.store(0, std::memory_order_relaxed);
+	roundTripDelay.Reset();
+	offset.Reset();
+	lastOffsetNs.store(0, std::memory_order_relaxed);
+	lastRoundTripDelayNs.store(0, std::memory_order_relaxed);
+	lastStratum.store(0, std::memory_order_relaxed);
+	lastReceiveTimeNs.store(0, std::memory_order_relaxed);
+}
+
+NtpMetrics::NtpMetrics()
+{
+}
+
+NtpMetrics&
+NtpMetrics::Global(void)
+{
+	static NtpMetrics metrics;
+	return metrics;
+}
+
+NtpMetrics::Server&
+NtpMetrics::GetServer(const char* server)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::unique_ptr<Server>& entry = m_servers[server];
+	if (!entry)
+	{
+		entry.reset(new Server());
+		m_order.push_back(server);
+	}
+	return *entry;
+}
+
+void
+NtpMetrics::RequestSent(const char* server)
+{
+	GetServer(server).sent.fetch_add(1, std::memory_order_relaxed);
+}
+
+void
+NtpMetrics::ResponseReceived(const Exchange& exchange)
+{
+	Server& server = GetServer(exchange.server);
+	const NtpClient::Sample& sample = *exchange.sample;
+	server.received.fetch_add(1, std::memory_order_relaxed);
+	server.roundTripDelay.Record(sample.roundTripDelayNs);
+	server.offset.Record(sample.clockOffsetNs < 0 ? -sample.clockOffsetNs : sample.clockOffsetNs);
+	server.lastOffsetNs.store(sample.clockOffsetNs, std::memory_order_relaxed);
+	server.lastRoundTripDelayNs.store(sample.roundTripDelayNs, std::memory_order_relaxed);
+	server.lastStratum.store(sample.stratum, std::memory_order_relaxed);
+	server.lastReceiveTimeNs.store(sample.receiveTimeNs, std::memory_order_relaxed);
+}
+
+void
+NtpMetrics::RequestTimedOut(const char* server)
+{
+	GetServer(server).timeouts.fetch_add(1, std::memory_order_relaxed);
+}
+
+void
+NtpMetrics::RequestFailed(const char* server, int)
+{
+	GetServer(server).errors.fetch_add(1, std::memory_order_relaxed);
+}
+
+void
+NtpMetrics::ResponseUnmatched(const char* server)
+{
+	GetServer(server).unmatched.fetch_add(1, std::memory_order_relaxed);
+}
+
+void
+NtpMetrics::KissOfDeath(const char* server, const char*)
+{
+	GetServer(server).kissOfDeath.fetch_add(1, std::memory_order_relaxed);
+}
+
+std::vector<std::pair<std::string, NtpMetrics::Server*>>
+NtpMetrics::Servers(void)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::vector<std::pair<std::string, Server*>> servers;
+	for (size_t ii = 0; ii < m_order.size(); ii++)
+		servers.push_back(std::make_pair(m_order[ii], m_servers[m_order[ii]].get()));
+	return servers;
+}
+
+void
+NtpMetrics::WriteOpenMetrics(std::string* out)
+{
+	std::vector<std::pair<std::string, Server*>> servers = Servers();
+
+	struct Counter
+	{
+		const char* name;
+		const char* help;
+		std::atomic<uint64_t> Server::* value;
+	};
+	static const Counter counters[] =
+	{
+		{ "ntp_requests_sent", "Requests sent to the server.", &Server::sent },
+		{ "ntp_responses_received", "Responses of the server processed.", &Server::received },
+		{ "ntp_timeouts", "Requests without response before the timeout.", &Server::timeouts },
+		{ "ntp_errors", "Requests that could not be sent, or whose response could not be received.", &Server::errors },
+		{ "ntp_kiss_of_death", "Kiss-o'-Death responses of the server.", &Server::kissOfDeath },
+		{ "ntp_unmatched_responses", "Responses that matched no request in flight (late, duplicated or spoofed), dropped.", &Server::unmatched }
+	};
+	for (size_t cc = 0; cc < sizeof(counters) / sizeof(counters[0]); cc++)
+	{
+		AppendFamily(out, counters[cc].name, "counter", nullptr, counters[cc].help);
+		std::string total = std::string(counters[cc].name) + "_total";
+		for (size_t ii = 0; ii < servers.size(); ii++)
+			AppendSample(out, total.c_str(), servers[ii].first, nullptr,
+				(double)(servers[ii].second->*counters[cc].value).load(std::memory_order_relaxed));
+	}
+
+	AppendFamily(out, "ntp_round_trip_delay_seconds", "histogram", "seconds", "Round-trip delay of the exchanges.");
+	for (size_t ii = 0; ii < servers.size(); ii++)
+		AppendHistogram(out, "ntp_round_trip_delay_seconds", servers[ii].first, servers[ii].second->roundTripDelay);
+	AppendFamily(out, "ntp_offset_abs_seconds", "histogram", "seconds", "Absolute clock offset of the exchanges.");
+	for (size_t ii = 0; ii < servers.size(); ii++)
+		AppendHistogram(out, "ntp_offset_abs_seconds", servers[ii].first, servers[ii].second->offset);
+
+	// The gauges of the servers that answered at least once
+	AppendFamily(out, "ntp_last_offset_seconds", "gauge", "seconds", "Clock offset of the last response (positive if the local clock is behind).");
+	for (size_t ii = 0; ii < servers.size(); ii++)
+	{
+		if (servers[ii].second->lastReceiveTimeNs.load(std::memory_order_relaxed) != 0)
+			AppendSample(out, "ntp_last_offset_seconds", servers[ii].first, nullptr,
+				(double)servers[ii].second->lastOffsetNs.load(std::memory_order_relaxed) / 1e9);
+	}
+	AppendFamily(out, "ntp_last_round_trip_delay_seconds", "gauge", "seconds", "Round-trip delay of the last response.");
+	for (size_t ii = 0; ii < servers.size(); ii++)
+	{
+		if (servers[ii].second->lastReceiveTimeNs.load(std::memory_order_relaxed) != 0)
+			AppendSample(out, "ntp_last_round_trip_delay_seconds", servers[ii].first, nullptr,
+				(double)servers[ii].second->lastRoundTripDelayNs.load(std::memory_order_relaxed) / 1e9);
+	}
+	AppendFamily(out, "ntp_last_stratum", "gauge", nullptr, "Stratum of the server in the last response.");
+	for (size_t ii = 0; ii < servers.size(); ii++)
+	{
+		if (servers[ii].second->lastReceiveTimeNs.load(std::memory_order_relaxed) != 0)
+			AppendSample(out, "ntp_last_stratum", servers[ii].first, nullptr,
+				(double)servers[ii].second->lastStratum.load(std::memory_order_relaxed));
+	}
+	AppendFamily(out, "ntp_last_response_timestamp_seconds", "gauge", "seconds", "Time the last response was received (UNIX).");
+	for (size_t ii = 0; ii < servers.size(); ii++)
+	{
+		int64_t receiveTimeNs = servers[ii].second->lastReceiveTimeNs.load(std::memory_order_relaxed);
+		if (receiveTimeNs != 0)
+			AppendSample(out, "ntp_last_response_timestamp_seconds", servers[ii].first, nullptr, (double)receiveTimeNs / 1e9);
+	}
+	out->append("# EOF\n");
+}
+
+std::string
+NtpMetrics::Snapshot(void)
+{
+	std::string out;
+	WriteOpenMetrics(&out);
+	return out;
+}
+
+void
+NtpMetrics::Clear(void)
+{
+	// The servers are zeroed in place, never freed: the recorders and WriteOpenMetrics() use
+	// them after the lock is released
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (std::unordered_map<std::string, std::unique_ptr<Server>>::iterator it = m_servers.begin(); it != m_servers.end(); ++it)
+		it->second->Reset();
+}
+
+#ifndef _WIN32
+NtpMetricsEndpoint::NtpMetricsEndpoint(NtpMetrics& metrics)
+	: m_metrics(metrics),
+	  m_socket(-1),
+	  m_port(0),
+	  m_stop(false)
+{
+}
+
+NtpMetricsEndpoint::~NtpMetricsEndpoint()
+{
+	Stop();
+}
+
+bool
+NtpMetricsEndpoint::Start(uint16_t port, const char* address)
+{
+	if (m_socket >= 0)
+		return false;
+
+	struct sockaddr_in local;
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_port = htons(port);
+	if (inet_pton(AF_INET, address, &local.sin_addr) != 1)
+	{
+		fprintf(stderr, "%s: not an IPv4 address\n", address);
+		return false;
+	}
+
+	m_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (m_socket < 0)
+		return false;
+	int enable = 1;
+	setsockopt(m_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+	socklen_t localLen = sizeof(local);
+	if (bind(m_socket, (struct sockaddr*)&local, sizeof(local)) < 0 || listen(m_socket, 16) < 0 ||
+		getsockname(m_socket, (struct sockaddr*)&local, &localLen) < 0)
+	{
+		perror("metrics endpoint");
+		close(m_socket);
+		m_socket = -1;
+		return false;
+	}
+	m_port = ntohs(local.sin_port);
+
+	m_stop = false;
+	m_thread = std::thread(&NtpMetricsEndpoint::Run, this);
+	return true;
+}
+
+void
+NtpMetricsEndpoint::Stop(void)
+{
+	m_stop = true;
+	if (m_thread.joinable())
+		m_thread.join();
+	if (m_socket >= 0)
+	{
+		close(m_socket);
+		m_socket = -1;
+	}
+}
+
+uint16_t
+NtpMetricsEndpoint::GetPort(void) const
+{
+	return m_port;
+}
+
+void
+NtpMetricsEndpoint::Run(void)
+{
+	while (!m_stop.load())
+	{
+		struct pollfd pfd = { m_socket, POLLIN, 0 };
+		if (poll(&pfd, 1, NTP_METRICS_POLL_MS) <= 0)
+			continue;
+
+		int fd = accept4(m_socket, nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd < 0)
+			continue;
+		Serve(fd);
+		close(fd);
+	}
+}
+
+void
+NtpMetricsEndpoint::Serve(int fd)
+{
+	// Only the request line matters (the scrapers send a short GET)
+	struct timeval timeout = { NTP_METRICS_REQUEST_TIMEOUT_S, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	char request[NTP_METRICS_REQUEST_SIZE];
+	size_t length = 0;
+	while (length < sizeof(request) - 1 && memchr(request, '\n', length) == nullptr)
+	{
+		ssize_t received = recv(fd, request + length, sizeof(request) - 1 - length, 0);
+		if (received <= 0)
+			return;
+		length += (size_t)received;
+	}
+	request[length] = '\0';
+
+	std::string response;
+	if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0)
+	{
+		std::string body;
+		m_metrics.WriteOpenMetrics(&body);
+		char header[160];
+		snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+			"Content-Length: %zu\r\n\r\n", body.size());
+		response = header + body;
+	}
+	else
+		response = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+
+	size_t sent = 0;
+	while (sent < response.size())
+	{
+		ssize_t ret = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return;
+		sent += (size_t)ret;
+	}
+}
+#endif
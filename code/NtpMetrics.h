@@ -0,0 +1,197 @@
+/**
+ *  This class keeps the metrics of the SNTP exchanges, per server (see NtpInstrumentation):
+ *  - counters of the requests sent, responses received, timeouts, errors, Kiss-o'-Death and
+ *    unmatched (late, duplicated or spoofed) responses;
+ *  - histograms of the round-trip delay and of the (absolute) clock offset;
+ *  - gauges of the last sample (offset, delay, stratum, time).
+ *  They are updated with atomics only (the server is looked up under a lock), and exported
+ *  in the OpenMetrics text format, by snapshot (WriteOpenMetrics()) or over HTTP
+ *  (NtpMetricsEndpoint, e.g. scraped by Prometheus).
+ *
+ *  The histograms are log-linear, as HDR histograms: 8 buckets per power of two from 1 us
+ *  (so the value of a bucket is within 12.5%) up to 68 s. They are exported with one bucket
+ *  per power of two.
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#ifndef NTPMETRICS_H
+#define NTPMETRICS_H
+
+#include "NtpInstrumentation.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+class NtpHistogram
+{
+public:
+	enum
+	{
+		SubBucketBits = 3,                            // 8 buckets per power of two
+		MinExponent = 10,                             // 2^10 ns (1 us): the first bucket is [0, 1 us)
+		MaxExponent = 36,                             // 2^36 ns (68 s): the last bucket is [68 s, +Inf)
+		BucketCount = 2 + ((MaxExponent - MinExponent) << SubBucketBits)
+	};
+
+	NtpHistogram();
+
+	/**
+	 * This function adds a value (ns, negative values are counted as 0).
+	 */
+	void Record(int64_t valueNs);
+	/**
+	 * This function returns the number of values recorded.
+	 */
+	uint64_t Count(void) const;
+	/**
+	 * This function returns the sum of the values recorded (ns).
+	 */
+	int64_t Sum(void) const;
+	/**
+	 * This function returns the number of values in a bucket.
+	 */
+	uint64_t BucketValues(int bucket) const;
+	/**
+	 * This function returns the upper bound (exclusive, ns) of a bucket (INT64_MAX for the last one).
+	 */
+	static int64_t BucketUpperBound(int bucket);
+	/**
+	 * This function returns the value (upper bound of its bucket) below which the given
+	 * share of the values is, e.g. 0.99 for the 99th percentile (0 if empty).
+	 */
+	int64_t ValueAtQuantile(double quantile) const;
+	/**
+	 * This function sets all the buckets back to 0.
+	 */
+	void Reset(void);
+
+private:
+	static int BucketOf(int64_t valueNs);
+
+	std::atomic<uint64_t> m_buckets[BucketCount];
+	std::atomic<uint64_t> m_count;
+	std::atomic<int64_t> m_sum;
+};
+
+class NtpMetrics : public NtpInstrumentation
+{
+public:
+	// The metrics of a server
+	struct Server
+	{
+		Server();
+		// Sets all the metrics back to 0
+		void Reset(void);
+
+		std::atomic<uint64_t> sent;
+		std::atomic<uint64_t> received;
+		std::atomic<uint64_t> timeouts;
+		std::atomic<uint64_t> errors;
+		std::atomic<uint64_t> kissOfDeath;
+		std::atomic<uint64_t> unmatched;      // late, duplicated or spoofed responses
+		NtpHistogram roundTripDelay;
+		NtpHistogram offset;                  // absolute value
+		std::atomic<int64_t> lastOffsetNs;
+		std::atomic<int64_t> lastRoundTripDelayNs;
+		std::atomic<int> lastStratum;
+		std::atomic<int64_t> lastReceiveTimeNs;   // 0 before the first response
+	};
+
+	NtpMetrics();
+
+	/**
+	 * This function returns the metrics shared by the clients (the default instrumentation
+	 * of NtpClient).
+	 */
+	static NtpMetrics& Global(void);
+
+	void RequestSent(const char* server) override;
+	void ResponseReceived(const Exchange& exchange) override;
+	void RequestTimedOut(const char* server) override;
+	void RequestFailed(const char* server, int error) override;
+	void ResponseUnmatched(const char* server) override;
+	void KissOfDeath(const char* server, const char* code) override;
+
+	/**
+	 * This function returns the metrics of a server (created on first use), e.g. to read
+	 * them without going through the text format.
+	 */
+	Server& GetServer(const char* server);
+	/**
+	 * This function appends all the metrics to out, in the OpenMetrics text format
+	 * (terminated by "# EOF").
+	 */
+	void WriteOpenMetrics(std::string* out);
+	/**
+	 * This function returns WriteOpenMetrics() as a string.
+	 */
+	std::string Snapshot(void);
+	/**
+	 * This function sets the metrics of all the servers back to 0. The servers are kept (and
+	 * still exported), so the references returned by GetServer() remain valid.
+	 */
+	void Clear(void);
+
+private:
+	NtpMetrics(const NtpMetrics&);
+	NtpMetrics& operator=(const NtpMetrics&);
+
+	// The servers in the order they were added (stable addresses)
+	std::vector<std::pair<std::string, Server*>> Servers(void);
+
+	std::mutex m_mutex;
+	std::unordered_map<std::string, std::unique_ptr<Server>> m_servers;
+	std::vector<std::string> m_order;    // the servers are never removed (see Clear())
+};
+
+#ifndef _WIN32
+class NtpMetricsEndpoint
+{
+public:
+	/**
+	 * \param metrics the metrics served
+	 */
+	explicit NtpMetricsEndpoint(NtpMetrics& metrics);
+	~NtpMetricsEndpoint();
+
+	/**
+	 * This function starts serving the metrics over HTTP (GET /metrics), from a background thread.
+	 *
+	 * \param port the TCP port (0 for any, see GetPort())
+	 * \param address the local IPv4 address to listen on
+	 *
+	 * Returns true upon success, false otherwise
+	 */
+	bool Start(uint16_t port, const char* address = "127.0.0.1");
+	/**
+	 * This function stops serving the metrics.
+	 */
+	void Stop(void);
+	/**
+	 * This function returns the port the metrics are served on.
+	 */
+	uint16_t GetPort(void) const;
+
+private:
+	NtpMetricsEndpoint(const NtpMetricsEndpoint&);
+	NtpMetricsEndpoint& operator=(const NtpMetricsEndpoint&);
+
+	void Run(void);
+	void Serve(int fd);
+
+	NtpMetrics& m_metrics;
+	int m_socket;
+	uint16_t m_port;
+	std::atomic<bool> m_stop;
+	std::thread m_thread;
+};
+#endif
+
+#endif  /* NTPMETRICS_H */
@@ -0,0 +1,237 @@
+/**
+ *  Zero-copy codec for the 48-byte NTP header (see the layout in NtpClient.h).
+ *  NtpConstPacketView/NtpPacketView read and write the fields in place, over the
+ *  receive/transmit buffer, in network byte order. At run time the 32/64-bit fields
+ *  are loaded with a single (unaligned) load and a bswap; in constant expressions the
+ *  same functions fall back to shifts, so that the codec can be checked at compile time
+ *  (see the static_asserts at the end of this file).
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#ifndef NTPPACKET_H
+#define NTPPACKET_H
+
+#include <stdint.h>
+#include <string.h>
+#ifdef _MSC_VER
+#include <stdlib.h>    // _byteswap_ulong, _byteswap_uint64
+#endif
+#if __cplusplus >= 202002L || (defined(_MSVC_LANG) && _MSVC_LANG >= 202002L)
+#include <type_traits> // std::is_constant_evaluated
+#endif
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+#if defined(__cpp_lib_is_constant_evaluated)
+#define NTP_CONSTANT_EVALUATED() (std::is_constant_evaluated())
+#elif (defined(__GNUC__) && __GNUC__ >= 9) || defined(__clang__) || (defined(_MSC_VER) && _MSC_VER >= 1925)
+#define NTP_CONSTANT_EVALUATED() (__builtin_is_constant_evaluated())
+#else
+#define NTP_CONSTANT_EVALUATED() (true) // always use the shifts (still compiled to a bswap by most compilers)
+#endif
+
+#if defined(_WIN32) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define NTP_LITTLE_ENDIAN (1)
+#else
+#define NTP_LITTLE_ENDIAN (0)
+#endif
+
+/**
+ * Big-endian (network byte order) loads and stores.
+ */
+struct NtpWire
+{
+	static inline uint32_t ByteSwap32(uint32_t value)
+	{
+#if defined(_MSC_VER)
+		return _byteswap_ulong(value);
+#else
+		return __builtin_bswap32(value);
+#endif
+	}
+
+	static inline uint64_t ByteSwap64(uint64_t value)
+	{
+#if defined(_MSC_VER)
+		return _byteswap_uint64(value);
+#else
+		return __builtin_bswap64(value);
+#endif
+	}
+
+	static constexpr uint32_t Load32(const unsigned char* p)
+	{
+		if (!NTP_CONSTANT_EVALUATED())
+		{
+			uint32_t value = 0;
+			memcpy(&value, p, sizeof(value));
+			return NTP_LITTLE_ENDIAN ? ByteSwap32(value) : value;
+		}
+		return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+	}
+
+	static constexpr uint64_t Load64(const unsigned char* p)
+	{
+		if (!NTP_CONSTANT_EVALUATED())
+		{
+			uint64_t value = 0;
+			memcpy(&value, p, sizeof(value));
+			return NTP_LITTLE_ENDIAN ? ByteSwap64(value) : value;
+		}
+		return ((uint64_t)Load32(p) << 32) | Load32(p + 4);
+	}
+
+	static constexpr void Store32(unsigned char* p, uint32_t value)
+	{
+		if (!NTP_CONSTANT_EVALUATED())
+		{
+			value = NTP_LITTLE_ENDIAN ? ByteSwap32(value) : value;
+			memcpy(p, &value, sizeof(value));
+			return;
+		}
+		p[0] = (unsigned char)(value >> 24);
+		p[1] = (unsigned char)(value >> 16);
+		p[2] = (unsigned char)(value >> 8);
+		p[3] = (unsigned char)value;
+	}
+
+	static constexpr void Store64(unsigned char* p, uint64_t value)
+	{
+		if (!NTP_CONSTANT_EVALUATED())
+		{
+			value = NTP_LITTLE_ENDIAN ? ByteSwap64(value) : value;
+			memcpy(p, &value, sizeof(value));
+			return;
+		}
+		Store32(p, (uint32_t)(value >> 32));
+		Store32(p + 4, (uint32_t)value);
+	}
+};
+
+/**
+ * Read-only view of an NTP header. The buffer must hold at least Size bytes.
+ */
+class NtpConstPacketView
+{
+public:
+	enum
+	{
+		Size = 48,
+		OffsetRootDelay = 4,
+		OffsetRootDispersion = 8,
+		OffsetReferenceIdentifier = 12,
+		OffsetReferenceTimestamp = 16,
+		OffsetOriginateTimestamp = 24,
+		OffsetReceiveTimestamp = 32,
+		OffsetTransmitTimestamp = 40
+	};
+
+	constexpr explicit NtpConstPacketView(const unsigned char* data) : m_data(data) {}
+	explicit NtpConstPacketView(const char* data) : m_data(reinterpret_cast<const unsigned char*>(data)) {}
+
+	constexpr const unsigned char* Data(void) const { return m_data; }
+
+	constexpr unsigned char LeapIndicator(void) const { return m_data[0] >> 6; }
+	constexpr unsigned char VersionNumber(void) const { return (m_data[0] >> 3) & 0x7; }
+	constexpr unsigned char Mode(void) const { return m_data[0] & 0x7; }
+	constexpr unsigned char Stratum(void) const { return m_data[1]; }
+	constexpr unsigned char PollInterval(void) const { return m_data[2]; }
+	constexpr unsigned char Precision(void) const { return m_data[3]; }
+	constexpr uint32_t RootDelay(void) const { return NtpWire::Load32(m_data + OffsetRootDelay); }
+	constexpr uint32_t RootDispersion(void) const { return NtpWire::Load32(m_data + OffsetRootDispersion); }
+	constexpr uint32_t ReferenceIdentifier(void) const { return NtpWire::Load32(m_data + OffsetReferenceIdentifier); }
+	constexpr uint64_t ReferenceTimestamp(void) const { return NtpWire::Load64(m_data + OffsetReferenceTimestamp); }
+	constexpr uint64_t OriginateTimestamp(void) const { return NtpWire::Load64(m_data + OffsetOriginateTimestamp); }
+	constexpr uint64_t ReceiveTimestamp(void) const { return NtpWire::Load64(m_data + OffsetReceiveTimestamp); }
+	constexpr uint64_t TransmitTimestamp(void) const { return NtpWire::Load64(m_data + OffsetTransmitTimestamp); }
+
+protected:
+	const unsigned char* m_data;
+};
+
+/**
+ * Read-write view of an NTP header. The buffer must hold at least Size bytes.
+ */
+class NtpPacketView : public NtpConstPacketView
+{
+public:
+	constexpr explicit NtpPacketView(unsigned char* data) : NtpConstPacketView(data), m_mutable(data) {}
+	explicit NtpPacketView(char* data) : NtpConstPacketView(data), m_mutable(reinterpret_cast<unsigned char*>(data)) {}
+
+	constexpr unsigned char* MutableData(void) const { return m_mutable; }
+
+	/**
+	 * Sets the first byte (LI, VN, Mode) in one go.
+	 */
+	constexpr void SetHeader(unsigned char leapIndicator, unsigned char versionNumber, unsigned char mode) const
+	{
+		m_mutable[0] = (unsigned char)(((leapIndicator & 0x3) << 6) | ((versionNumber & 0x7) << 3) | (mode & 0x7));
+	}
+	constexpr void SetStratum(unsigned char value) const { m_mutable[1] = value; }
+	constexpr void SetPollInterval(unsigned char value) const { m_mutable[2] = value; }
+	constexpr void SetPrecision(unsigned char value) const { m_mutable[3] = value; }
+	constexpr void SetRootDelay(uint32_t value) const { NtpWire::Store32(m_mutable + OffsetRootDelay, value); }
+	constexpr void SetRootDispersion(uint32_t value) const { NtpWire::Store32(m_mutable + OffsetRootDispersion, value); }
+	constexpr void SetReferenceIdentifier(uint32_t value) const { NtpWire::Store32(m_mutable + OffsetReferenceIdentifier, value); }
+	constexpr void SetReferenceTimestamp(uint64_t value) const { NtpWire::Store64(m_mutable + OffsetReferenceTimestamp, value); }
+	constexpr void SetOriginateTimestamp(uint64_t value) const { NtpWire::Store64(m_mutable + OffsetOriginateTimestamp, value); }
+	constexpr void SetReceiveTimestamp(uint64_t value) const { NtpWire::Store64(m_mutable + OffsetReceiveTimestamp, value); }
+	constexpr void SetTransmitTimestamp(uint64_t value) const { NtpWire::Store64(m_mutable + OffsetTransmitTimestamp, value); }
+
+private:
+	unsigned char* m_mutable;
+};
+
+/******************************************************************************
+* Compile-time checks of the codec
+*****************************************************************************/
+namespace NtpPacketSelfTest
+{
+	// A server response: LI 0, VN 4, Mode 4, stratum 2, poll 6, precision -20
+	constexpr unsigned char kResponse[NtpConstPacketView::Size] = {
+		0x24, 0x02, 0x06, 0xEC,
+		0x00, 0x00, 0x01, 0x02,                          // root delay
+		0x00, 0x00, 0x03, 0x04,                          // root dispersion
+		'G', 'P', 'S', 0x00,                             // reference id
+		0xE0, 0x00, 0x00, 0x01, 0x80, 0x00, 0x00, 0x00,  // reference timestamp
+		0xE0, 0x00, 0x00, 0x02, 0x40, 0x00, 0x00, 0x00,  // originate timestamp
+		0xE0, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00, 0x01,  // receive timestamp
+		0xE0, 0x00, 0x00, 0x04, 0xFF, 0xFF, 0xFF, 0xFF   // transmit timestamp
+	};
+
+	constexpr NtpConstPacketView kView(kResponse);
+	static_assert(kView.LeapIndicator() == 0 && kView.VersionNumber() == 4 && kView.Mode() == 4, "first byte");
+	static_assert(kView.Stratum() == 2 && kView.PollInterval() == 6 && kView.Precision() == 0xEC, "stratum/poll/precision");
+	static_assert(kView.RootDelay() == 0x0102 && kView.RootDispersion() == 0x0304, "32-bit fields");
+	static_assert(kView.ReferenceIdentifier() == 0x47505300, "reference id");
+	static_assert(kView.ReferenceTimestamp() == 0xE000000180000000ULL, "reference timestamp");
+	static_assert(kView.OriginateTimestamp() == 0xE000000240000000ULL, "originate timestamp");
+	static_assert(kView.ReceiveTimestamp() == 0xE000000300000001ULL, "receive timestamp");
+	static_assert(kView.TransmitTimestamp() == 0xE0000004FFFFFFFFULL, "transmit timestamp");
+
+	// Encoding a request and decoding it back gives the same fields
+	struct Request
+	{
+		unsigned char data[NtpConstPacketView::Size];
+	};
+
+	constexpr Request Encode(uint64_t transmit)
+	{
+		Request request = {};
+		NtpPacketView view(request.data);
+		view.SetHeader(0, 3, 3);
+		view.SetRootDispersion(0x00010000);
+		view.SetTransmitTimestamp(transmit);
+		return request;
+	}
+
+	constexpr Request kRequest = Encode(0x0123456789ABCDEFULL);
+	static_assert(kRequest.data[0] == 27, "LI 0, VN 3, Mode 3");
+	static_assert(kRequest.data[40] == 0x01 && kRequest.data[47] == 0xEF, "big-endian store");
+	static_assert(NtpConstPacketView(kRequest.data).TransmitTimestamp() == 0x0123456789ABCDEFULL, "round trip");
+	static_assert(NtpConstPacketView(kRequest.data).RootDispersion() == 0x00010000, "round trip");
+}
+
+#endif  /* NTPPACKET_H */
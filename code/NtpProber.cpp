@@ -0,0 +1,525 @@
+/**
+ *  This class probes a large fleet of NTP servers, with the timeouts in a timer wheel.
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#ifndef _WIN32
+
+/******************************************************************************
+* Project Headers
+*****************************************************************************/
+#include "NtpProber.h"
+#include "NtpPacket.h"
+#include "NtpTimestamping.h"
+
+/******************************************************************************
+* System Headers
+*****************************************************************************/
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+#define NTP_PROBER_TIMEOUT_MS (2000)         // default deadline of a request
+#define NTP_PROBER_WAIT_SLICE_MS (10)        // longest wait while requests are in flight (timeout resolution)
+#define NTP_PROBER_SOCKET_BUFFER (4 * 1024 * 1024)
+
+/******************************************************************************
+* Class Member Function Definitions
+*****************************************************************************/
+
+NtpProber::NtpProber()
+	: m_queueHead(0),
+	  m_wheel(NowMs()),
+	  m_auth(nullptr),
+	  m_timeoutMs(NTP_PROBER_TIMEOUT_MS),
+	  m_fd4(-1),
+	  m_fd6(-1),
+	  m_inFlight(0),
+	  m_delivered(0)
+{
+	memset(&m_statistics, 0, sizeof(m_statistics));
+
+	m_recvHdrs.resize(BatchSize);
+	m_recvIovs.resize(BatchSize);
+	m_recvAddrs.resize(BatchSize);
+	m_recvBuffers.resize((size_t)BatchSize * MaxMessageSize);
+	m_recvControl.resize((size_t)BatchSize * NTP_TIMESTAMP_CONTROL_SIZE);
+	m_recvPackets.resize(BatchSize);
+	m_recvLengths.resize(BatchSize);
+	m_recvResults.resize(BatchSize);
+	for (int ii = 0; ii < BatchSize; ii++)
+	{
+		m_recvIovs[ii].iov_base = &m_recvBuffers[(size_t)ii * MaxMessageSize];
+		m_recvIovs[ii].iov_len = MaxMessageSize;
+		memset(&m_recvHdrs[ii], 0, sizeof(m_recvHdrs[ii]));
+		m_recvHdrs[ii].msg_hdr.msg_iov = &m_recvIovs[ii];
+		m_recvHdrs[ii].msg_hdr.msg_iovlen = 1;
+	}
+}
+
+NtpProber::~NtpProber()
+{
+	if (m_fd4 >= 0)
+		close(m_fd4);
+	if (m_fd6 >= 0)
+		close(m_fd6);
+}
+
+uint64_t
+NtpProber::NowMs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000ULL) + ((uint64_t)ts.tv_nsec / 1000000ULL);
+}
+
+int
+NtpProber::AddServer(const char* host, uint32_t keyId)
+{
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+
+	struct addrinfo* result = nullptr;
+	int _error = getaddrinfo(host, "123", &hints, &result);
+	if (_error != 0 || result == nullptr)
+	{
+		fprintf(stderr, "%s: %s\n", host, gai_strerror(_error));
+		return -1;
+	}
+
+	Server server;
+	server.host = host;
+	memset(&server.addr, 0, sizeof(server.addr));
+	memcpy(&server.addr, result->ai_addr, result->ai_addrlen);
+	server.addrLen = result->ai_addrlen;
+	server.keyId = keyId;
+	freeaddrinfo(result);
+
+	m_servers.push_back(server);
+	return (int)m_servers.size() - 1;
+}
+
+int
+NtpProber::ServerCount(void) const
+{
+	return (int)m_servers.size();
+}
+
+const std::string&
+NtpProber::GetHost(int index) const
+{
+	return m_servers[index].host;
+}
+
+void
+NtpProber::SetTimeout(int timeoutMs)
+{
+	m_timeoutMs = timeoutMs;
+}
+
+void
+NtpProber::SetCallback(Callback callback)
+{
+	m_callback = callback;
+}
+
+void
+NtpProber::SetAuthentication(NtpAuth* auth)
+{
+	m_auth = auth;
+}
+
+bool
+NtpProber::Probe(int index)
+{
+	if (index < 0 || index >= (int)m_servers.size())
+		return false;
+
+	m_queue.push_back(index);
+	return true;
+}
+
+void
+NtpProber::ProbeAll(void)
+{
+	for (int ii = 0; ii < (int)m_servers.size(); ii++)
+		m_queue.push_back(ii);
+}
+
+int
+NtpProber::Pending(void) const
+{
+	return (int)(m_queue.size() - m_queueHead) + m_inFlight;
+}
+
+NtpProber::Statistics
+NtpProber::GetStatistics(void) const
+{
+	return m_statistics;
+}
+
+int
+NtpProber::GetSocket(int family)
+{
+	int& fd = (family == AF_INET6) ? m_fd6 : m_fd4;
+	if (fd >= 0)
+		return fd;
+
+	fd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+	if (fd < 0)
+		return -1;
+
+	// Thousands of responses may arrive together
+	int size = NTP_PROBER_SOCKET_BUFFER;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	NtpEnableRxTimestamps(fd);
+	return fd;
+}
+
+void
+NtpProber::Complete(int request, const Record& record)
+{
+	Request& slot = m_requests[request];
+	m_wheel.Cancel(&slot.timer);
+	m_outstanding.Erase(slot.cookie);
+	m_freeRequests.push_back(request);
+	m_inFlight--;
+
+	m_delivered++;
+	if (m_callback)
+		m_callback(record);
+}
+
+void
+NtpProber::SendQueued(void)
+{
+	char request[NTP_AUTH_MSG_SIZE];
+	memset(request, 0, sizeof(request));
+	NtpPacketView((unsigned char*)request).SetHeader(0, 4, 3);
+
+	while (m_queueHead < m_queue.size())
+	{
+		int serverIndex = m_queue[m_queueHead];
+		const Server& server = m_servers[serverIndex];
+
+		Record record;
+		memset(&record, 0, sizeof(record));
+		record.server = serverIndex;
+
+		// The cookie the response is matched with (and the MAC over it); T1 is only kept here
+		uint64_t cookie = NtpRequestTable::NewCookie();
+		NtpPacketView((unsigned char*)request).SetTransmitTimestamp(cookie);
+		int length = NTP_MSG_SIZE;
+		if (server.keyId != 0)
+			length = (m_auth != nullptr) ? m_auth->Sign((unsigned char*)request, server.keyId) : -1;
+
+		int fd = (length < 0) ? -1 : GetSocket(server.addr.ss_family);
+		if (fd < 0)
+		{
+			record.status = Failed;
+			record.error = (length < 0) ? EINVAL : errno; // EINVAL: the key is not in the table
+			m_queueHead++;
+			m_statistics.failures++;
+			m_delivered++;
+			if (m_callback)
+				m_callback(record);
+			continue;
+		}
+
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+
+		if (sendto(fd, request, length, 0, (const struct sockaddr*)&server.addr, server.addrLen) < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+				break; // the socket is full: the rest is sent when it drains
+
+			record.status = Failed;
+			record.error = errno;
+			m_queueHead++;
+			m_statistics.failures++;
+			m_delivered++;
+			if (m_callback)
+				m_callback(record);
+			continue;
+		}
+		m_queueHead++;
+		m_statistics.sent++;
+
+		int index;
+		if (!m_freeRequests.empty())
+		{
+			index = m_freeRequests.back();
+			m_freeRequests.pop_back();
+		}
+		else
+		{
+			index = (int)m_requests.size();
+			m_requests.push_back(Request());
+		}
+		Request& slot = m_requests[index];
+		slot.timer.id = index;
+		slot.server = serverIndex;
+		slot.cookie = cookie;
+		slot.transmitTimestamp = NtpTimestampFromTimespec(&ts);
+		m_outstanding.Insert(cookie, (uint32_t)index);
+		m_wheel.Schedule(&slot.timer, NowMs() + (uint64_t)m_timeoutMs);
+		m_inFlight++;
+	}
+
+	if (m_queueHead == m_queue.size())
+	{
+		m_queue.clear();
+		m_queueHead = 0;
+	}
+}
+
+void
+NtpProber::Receive(int fd)
+{
+	for (;;)
+	{
+		for (int ii = 0; ii < BatchSize; ii++)
+		{
+			m_recvHdrs[ii].msg_hdr.msg_name = &m_recvAddrs[ii];
+			m_recvHdrs[ii].msg_hdr.msg_namelen = sizeof(m_recvAddrs[ii]);
+			m_recvHdrs[ii].msg_hdr.msg_control = &m_recvControl[(size_t)ii * NTP_TIMESTAMP_CONTROL_SIZE];
+			m_recvHdrs[ii].msg_hdr.msg_controllen = NTP_TIMESTAMP_CONTROL_SIZE;
+		}
+
+		int n = recvmmsg(fd, &m_recvHdrs[0], BatchSize, MSG_DONTWAIT, nullptr);
+		if (n <= 0)
+			break;
+
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+
+		// The MACs of the batch are checked in one pass
+		if (m_auth != nullptr)
+		{
+			for (int ii = 0; ii < n; ii++)
+			{
+				m_recvPackets[ii] = (const unsigned char*)m_recvIovs[ii].iov_base;
+				m_recvLengths[ii] = (int)m_recvHdrs[ii].msg_len;
+			}
+			m_auth->VerifyBatch(&m_recvPackets[0], &m_recvLengths[0], n, &m_recvResults[0]);
+		}
+
+		for (int ii = 0; ii < n; ii++)
+		{
+			const unsigned char* reply = (const unsigned char*)m_recvIovs[ii].iov_base;
+			NtpConstPacketView view(reply);
+			if (m_recvHdrs[ii].msg_len < NTP_MSG_SIZE || (view.Mode() != 4 && view.Mode() != 5))
+			{
+				m_statistics.unmatched++;
+				continue;
+			}
+
+			// The server echoes the cookie as the originate timestamp; the source must be the server it was sent to
+			uint32_t index;
+			if (!m_outstanding.Find(view.OriginateTimestamp(), &index))
+			{
+				m_statistics.unmatched++;
+				continue;
+			}
+			const Request& request = m_requests[index];
+			const Server& server = m_servers[request.server];
+			const struct sockaddr_storage& from = m_recvAddrs[ii];
+			bool match = (from.ss_family == server.addr.ss_family);
+			if (match && from.ss_family == AF_INET)
+			{
+				const struct sockaddr_in* a = (const struct sockaddr_in*)&server.addr;
+				const struct sockaddr_in* b = (const struct sockaddr_in*)&from;
+				match = (a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr);
+			}
+			else if (match)
+			{
+				const struct sockaddr_in6* a = (const struct sockaddr_in6*)&server.addr;
+				const struct sockaddr_in6* b = (const struct sockaddr_in6*)&from;
+				match = (a->sin6_port == b->sin6_port && memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)) == 0);
+			}
+			if (!match)
+			{
+				m_statistics.unmatched++;
+				continue;
+			}
+			// A signed request only takes a response with a valid MAC of its key (the probe
+			// is left to expire otherwise)
+			if (server.keyId != 0 && (m_auth == nullptr || m_recvResults[ii] != NtpAuth::Authentic ||
+				NtpAuth::GetKeyId(reply, (int)m_recvHdrs[ii].msg_len) != server.keyId))
+			{
+				m_statistics.unauthenticated++;
+				continue;
+			}
+
+			struct timespec receiveTime;
+			if (!NtpReadRxTimestamp(&m_recvHdrs[ii].msg_hdr, &receiveTime))
+				receiveTime = now;
+			uint64_t t1 = request.transmitTimestamp;
+			uint64_t t2 = view.ReceiveTimestamp();
+			uint64_t t3 = view.TransmitTimestamp();
+			uint64_t t4 = NtpTimestampFromTimespec(&receiveTime);
+
+			// Same arithmetic as NtpClient::ReceivedMessage (RFC 5905, section 8)
+			Record record;
+			record.server = request.server;
+			record.status = Ok;
+			record.error = 0;
+			record.offsetNs = NtpClient::convert_ntp_diff_to_ns(((int64_t)(t2 - t1) >> 1) + ((int64_t)(t3 - t4) >> 1));
+			record.delayNs = NtpClient::convert_ntp_diff_to_ns((int64_t)(t4 - t1) - (int64_t)(t3 - t2));
+			record.leapIndicator = view.LeapIndicator();
+			record.versionNumber = view.VersionNumber();
+			record.stratum = view.Stratum();
+			record.pollInterval = (signed char)view.PollInterval();
+			record.precision = (signed char)view.Precision();
+			record.referenceId = view.ReferenceIdentifier();
+			record.rootDelayNs = (int64_t)(((uint64_t)view.RootDelay() * 1000000000ULL) >> 16);
+			record.rootDispersionNs = (int64_t)(((uint64_t)view.RootDispersion() * 1000000000ULL) >> 16);
+			record.timeNs = ((int64_t)receiveTime.tv_sec * 1000000000LL) + receiveTime.tv_nsec;
+
+			m_statistics.responses++;
+			Complete((int)index, record);
+		}
+
+		if (n < BatchSize)
+			break;
+	}
+}
+
+void
+NtpProber::Expire(void)
+{
+	NtpTimerWheel::Timer* timer = m_wheel.Advance(NowMs());
+	if (timer == nullptr)
+		return;
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	while (timer != nullptr)
+	{
+		NtpTimerWheel::Timer* next = timer->next;
+
+		Record record;
+		memset(&record, 0, sizeof(record));
+		record.server = m_requests[timer->id].server;
+		record.status = Timeout;
+		record.timeNs = ((int64_t)now.tv_sec * 1000000000LL) + now.tv_nsec;
+		m_statistics.timeouts++;
+		Complete(timer->id, record);
+
+		timer = next;
+	}
+}
+
+int
+NtpProber::Poll(int timeoutMs)
+{
+	m_delivered = 0;
+	SendQueued();
+	Expire();
+
+	struct pollfd pfds[2];
+	int nfds = 0;
+	bool blocked = (m_queueHead < m_queue.size());
+	if (m_fd4 >= 0)
+	{
+		pfds[nfds].fd = m_fd4;
+		pfds[nfds].events = POLLIN | (blocked ? POLLOUT : 0);
+		nfds++;
+	}
+	if (m_fd6 >= 0)
+	{
+		pfds[nfds].fd = m_fd6;
+		pfds[nfds].events = POLLIN | (blocked ? POLLOUT : 0);
+		nfds++;
+	}
+
+	// Wake up regularly while requests are in flight, to expire them on time
+	int waitMs = timeoutMs;
+	if (m_inFlight > 0 && (waitMs < 0 || waitMs > NTP_PROBER_WAIT_SLICE_MS))
+		waitMs = NTP_PROBER_WAIT_SLICE_MS;
+	if (m_delivered > 0 || nfds == 0)
+		waitMs = 0;
+
+	int ready = poll(pfds, nfds, waitMs);
+	if (ready < 0)
+	{
+		if (errno == EINTR)
+			return m_delivered;
+		return -1;
+	}
+
+	for (int ii = 0; ii < nfds && ready > 0; ii++)
+	{
+		if (pfds[ii].revents & POLLIN)
+			Receive(pfds[ii].fd);
+	}
+	if (blocked)
+		SendQueued();
+	Expire();
+	return m_delivered;
+}
+
+std::string
+NtpProber::FormatRecord(const Record& record, const std::string& host)
+{
+	static const char* statusNames[] = { "ok", "timeout", "failed" };
+
+	std::string escapedHost;
+	for (size_t ii = 0; ii < host.size(); ii++)
+	{
+		if (host[ii] == '"' || host[ii] == '\\')
+			escapedHost += '\\';
+		escapedHost += host[ii];
+	}
+
+	char line[512];
+	if (record.status != Ok)
+	{
+		snprintf(line, sizeof(line), "{\"host\":\"%s\",\"status\":\"%s\",\"error\":%d,\"time_ns\":%lld}",
+			escapedHost.c_str(), statusNames[record.status], record.error, (long long)record.timeNs);
+		return line;
+	}
+
+	// Stratum 0 (kiss code) and 1 (reference clock) carry ASCII, the others the address of the upstream server
+	char refid[16];
+	uint32_t id = record.referenceId;
+	if (record.stratum <= 1)
+	{
+		int length = 0;
+		for (int shift = 24; shift >= 0; shift -= 8)
+		{
+			char c = (char)((id >> shift) & 0xFF);
+			if (c == 0)
+				break;
+			refid[length++] = (c >= 0x20 && c < 0x7F && c != '"' && c != '\\') ? c : '?';
+		}
+		refid[length] = 0;
+	}
+	else
+	{
+		snprintf(refid, sizeof(refid), "%u.%u.%u.%u", (id >> 24) & 0xFF, (id >> 16) & 0xFF, (id >> 8) & 0xFF, id & 0xFF);
+	}
+
+	snprintf(line, sizeof(line),
+		"{\"host\":\"%s\",\"status\":\"ok\",\"offset_ns\":%lld,\"delay_ns\":%lld,\"stratum\":%u,\"leap\":%u,"
+		"\"version\":%u,\"poll\":%d,\"precision\":%d,\"refid\":\"%s\",\"root_delay_ns\":%lld,\"root_dispersion_ns\":%lld,\"time_ns\":%lld}",
+		escapedHost.c_str(), (long long)record.offsetNs, (long long)record.delayNs, (unsigned)record.stratum,
+		(unsigned)record.leapIndicator, (unsigned)record.versionNumber, (int)record.pollInterval, (int)record.precision,
+		refid, (long long)record.rootDelayNs, (long long)record.rootDispersionNs, (long long)record.timeNs);
+	return line;
+}
+
+#endif  /* _WIN32 */
@@ -0,0 +1,220 @@
+/**
+ *  This class probes a large fleet of NTP servers (thousands) for monitoring: one request
+ *  per probe, all in flight at once on one socket per address family, with a deadline per
+ *  request kept in an NtpTimerWheel (1 ms ticks), so arming and expiring a timeout is O(1)
+ *  whatever the number of outstanding requests.
+ *
+ *  Each probe ends with one structured record (offset, delay, stratum, leap, refid, ...),
+ *  handed to the callback as soon as the response arrives or the deadline passes; the owner
+ *  drives the event loop by calling Poll(). The receive timestamps are taken by the kernel
+ *  (SO_TIMESTAMPNS) when available.
+ *
+ *  Each request carries a random cookie in its transmit timestamp field (T1 is kept locally);
+ *  the response is matched by the cookie echoed in its originate timestamp field, through an
+ *  NtpRequestTable, and must come from the address the request was sent to.
+ *
+ *  A server may be probed with a symmetric key (see SetAuthentication, AddServer): the
+ *  request is signed, and the response only completes the probe if it is authenticated
+ *  with the same key. The MACs of each recvmmsg() batch are checked in one pass
+ *  (NtpAuth::VerifyBatch).
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#ifndef NTPPROBER_H
+#define NTPPROBER_H
+
+#ifndef _WIN32
+
+#include "NtpClient.h"
+#include "NtpAuth.h"
+#include "NtpRequestTable.h"
+#include "NtpTimerWheel.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+
+class NtpProber
+{
+public:
+	enum Status
+	{
+		Ok,         // 0 - A response was received
+		Timeout,    // 1 - No response before the deadline
+		Failed      // 2 - The request could not be sent (see error)
+	};
+
+	/**
+	 * The result of one probe.
+	 */
+	struct Record
+	{
+		int server;                    /**< Index of the server (see AddServer). */
+		Status status;
+		int error;                     /**< errno value when status is Failed, 0 otherwise. */
+		int64_t offsetNs;              /**< Clock offset in ns (positive means the local clock is behind). */
+		int64_t delayNs;               /**< Round-trip delay in ns. */
+		unsigned char leapIndicator;   /**< Leap indicator of the response. */
+		unsigned char versionNumber;   /**< Version of the response. */
+		unsigned char stratum;         /**< Stratum of the server (0 is a kiss-o'-death, see referenceId). */
+		signed char pollInterval;      /**< Poll exponent of the response (log2 s). */
+		signed char precision;         /**< Precision of the server clock (log2 s). */
+		uint32_t referenceId;          /**< Reference identifier (e.g. "GPS", or the address of the upstream server). */
+		int64_t rootDelayNs;           /**< Root delay of the server, in ns. */
+		int64_t rootDispersionNs;      /**< Root dispersion of the server, in ns. */
+		int64_t timeNs;                /**< Local time the record was completed (ns since the UNIX epoch). */
+	};
+
+	typedef std::function<void(const Record& record)> Callback;
+
+	struct Statistics
+	{
+		uint64_t sent;                 /**< Requests sent. */
+		uint64_t responses;            /**< Responses matched to a request. */
+		uint64_t timeouts;             /**< Requests that expired. */
+		uint64_t failures;             /**< Requests that could not be sent. */
+		uint64_t unmatched;            /**< Datagrams that matched no outstanding request (late, duplicated or spoofed). */
+		uint64_t unauthenticated;      /**< Responses to signed requests without a valid MAC of the key (ignored). */
+	};
+
+	NtpProber();
+	~NtpProber();
+
+	/**
+	 * This function adds a server to the fleet. Hostnames are resolved once, here
+	 * (the first address returned is used).
+	 *
+	 * \param host the IPv4/IPv6 address or hostname of the server
+	 * \param keyId the key the requests are signed with (see SetAuthentication), 0 for none
+	 *
+	 * Returns the index of the server, or -1 if it could not be resolved
+	 */
+	int AddServer(const char* host, uint32_t keyId = 0);
+	/**
+	 * This function returns the number of servers in the fleet.
+	 */
+	int ServerCount(void) const;
+	/**
+	 * This function returns the host a server was added with.
+	 */
+	const std::string& GetHost(int index) const;
+	/**
+	 * This function sets the deadline of each request (default 2000 ms).
+	 */
+	void SetTimeout(int timeoutMs);
+	/**
+	 * This function sets the callback that receives the records (called from Poll()).
+	 */
+	void SetCallback(Callback callback);
+	/**
+	 * This function sets the key table of the servers added with a key id.
+	 *
+	 * \param auth the keys (used from Poll()); it must outlive the prober
+	 */
+	void SetAuthentication(NtpAuth* auth);
+	/**
+	 * This function queues a probe of a server; it is sent by the next Poll().
+	 *
+	 * \param index the index of the server
+	 *
+	 * Returns false if the index is not valid
+	 */
+	bool Probe(int index);
+	/**
+	 * This function queues a probe of every server of the fleet.
+	 */
+	void ProbeAll(void);
+	/**
+	 * This function returns the number of probes queued or in flight.
+	 */
+	int Pending(void) const;
+	/**
+	 * This function sends the queued probes, waits up to timeoutMs for responses and
+	 * completes the probes that are answered or have expired.
+	 *
+	 * \param timeoutMs the longest time to wait (0 to only handle what is ready)
+	 *
+	 * Returns the number of records delivered, or -1 on error
+	 */
+	int Poll(int timeoutMs);
+	/**
+	 * This function returns the counters since the prober was created.
+	 */
+	Statistics GetStatistics(void) const;
+	/**
+	 * This function formats a record as one line of JSON (without the newline), e.g. for a log.
+	 *
+	 * \param record the record
+	 * \param host the host of the server
+	 */
+	static std::string FormatRecord(const Record& record, const std::string& host);
+
+private:
+	NtpProber(const NtpProber&);
+	NtpProber& operator=(const NtpProber&);
+
+	enum { BatchSize = 64, MaxMessageSize = NTP_AUTH_MSG_SIZE };
+
+	struct Server
+	{
+		std::string host;
+		struct sockaddr_storage addr;
+		socklen_t addrLen;
+		uint32_t keyId;                // 0 if the requests are not signed
+	};
+
+	struct Request
+	{
+		NtpTimerWheel::Timer timer;    // the deadline (timer.id is the index of the request)
+		int server;
+		uint64_t cookie;               // sent as the transmit timestamp (the key of m_outstanding)
+		uint64_t transmitTimestamp;    // T1
+	};
+
+	// Returns the socket of the address family (created on first use), -1 on error
+	int GetSocket(int family);
+	// Sends the queued probes while the sockets accept them
+	void SendQueued(void);
+	// Drains the socket and completes the requests answered
+	void Receive(int fd);
+	// Completes the requests whose deadline has passed
+	void Expire(void);
+	// Releases the request and hands the record to the callback
+	void Complete(int request, const Record& record);
+
+	static uint64_t NowMs(void);
+
+	std::vector<Server> m_servers;
+	std::vector<int> m_queue;                          // servers to probe, in order
+	size_t m_queueHead;
+	std::deque<Request> m_requests;                    // grows to the largest number in flight (never moves: the wheel links the timers)
+	std::vector<int> m_freeRequests;
+	NtpRequestTable m_outstanding;                     // cookie -> request
+	NtpTimerWheel m_wheel;
+	Callback m_callback;
+	NtpAuth* m_auth;
+	Statistics m_statistics;
+	int m_timeoutMs;
+	int m_fd4;
+	int m_fd6;
+	int m_inFlight;
+	int m_delivered;                                   // records handed to the callback
+
+	// Receive buffers, for recvmmsg()
+	std::vector<struct mmsghdr> m_recvHdrs;
+	std::vector<struct iovec> m_recvIovs;
+	std::vector<struct sockaddr_storage> m_recvAddrs;
+	std::vector<char> m_recvBuffers;
+	std::vector<char> m_recvControl;
+	std::vector<const unsigned char*> m_recvPackets;   // the batch, for NtpAuth::VerifyBatch()
+	std::vector<int> m_recvLengths;
+	std::vector<NtpAuth::Result> m_recvResults;
+};
+
+#endif  /* _WIN32 */
+
+#endif  /* NTPPROBER_H */
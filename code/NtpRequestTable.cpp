@@ -0,0 +1,186 @@
+/**
+ *  This class indexes the requests in flight by their random cookie (open addressing).
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+/******************************************************************************
+* Project Headers
+*****************************************************************************/
+#include "NtpRequestTable.h"
+
+/******************************************************************************
+* System Headers
+*****************************************************************************/
+#include <errno.h>
+#include <random>
+#ifndef _WIN32
+#include <sys/random.h>
+#endif
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+#define NTP_COOKIE_POOL (64)        // cookies drawn from the system per refill (512 bytes)
+
+/******************************************************************************
+* Class Member Function Definitions
+*****************************************************************************/
+
+NtpRequestTable::NtpRequestTable(int capacity)
+	: m_count(0)
+{
+	size_t size = 16;
+	while (size < (size_t)(capacity > 0 ? capacity : 1) * 2)
+		size <<= 1;
+
+	Entry empty = { 0, 0 };
+	m_entries.assign(size, empty);
+	m_mask = size - 1;
+	m_limit = (int)(size / 2);
+}
+
+size_t
+NtpRequestTable::Home(uint64_t key) const
+{
+	// The cookies are random, but spoofed ones may not be: mix the bits anyway (Fibonacci hashing)
+	return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & m_mask;
+}
+
+void
+NtpRequestTable::Grow(void)
+{
+	std::vector<Entry> old;
+	old.swap(m_entries);
+
+	Entry empty = { 0, 0 };
+	m_entries.assign(old.size() * 2, empty);
+	m_mask = m_entries.size() - 1;
+	m_limit = (int)(m_entries.size() / 2);
+	m_count = 0;
+	for (size_t ii = 0; ii < old.size(); ii++)
+	{
+		if (old[ii].key != 0)
+			Insert(old[ii].key, old[ii].value);
+	}
+}
+
+void
+NtpRequestTable::Insert(uint64_t key, uint32_t value)
+{
+	if (m_count >= m_limit)
+		Grow();
+
+	size_t ii = Home(key);
+	while (m_entries[ii].key != 0 && m_entries[ii].key != key)
+		ii = (ii + 1) & m_mask;
+
+	if (m_entries[ii].key == 0)
+		m_count++;
+	m_entries[ii].key = key;
+	m_entries[ii].value = value;
+}
+
+bool
+NtpRequestTable::Find(uint64_t key, uint32_t* value) const
+{
+	if (key == 0)
+		return false;
+
+	size_t ii = Home(key);
+	while (m_entries[ii].key != 0)
+	{
+		if (m_entries[ii].key == key)
+		{
+			*value = m_entries[ii].value;
+			return true;
+		}
+		ii = (ii + 1) & m_mask;
+	}
+	return false;
+}
+
+bool
+NtpRequestTable::Erase(uint64_t key)
+{
+	if (key == 0)
+		return false;
+
+	size_t ii = Home(key);
+	while (m_entries[ii].key != key)
+	{
+		if (m_entries[ii].key == 0)
+			return false;
+		ii = (ii + 1) & m_mask;
+	}
+
+	// Backward shift: move up the entries of the run that would no longer be reachable
+	size_t hole = ii;
+	for (size_t jj = (ii + 1) & m_mask; m_entries[jj].key != 0; jj = (jj + 1) & m_mask)
+	{
+		size_t home = Home(m_entries[jj].key);
+		// The entry stays if its home lies cyclically in (hole, jj]
+		bool stays = (hole <= jj) ? (hole < home && home <= jj) : (hole < home || home <= jj);
+		if (!stays)
+		{
+			m_entries[hole] = m_entries[jj];
+			hole = jj;
+		}
+	}
+	m_entries[hole].key = 0;
+	m_entries[hole].value = 0;
+	m_count--;
+	return true;
+}
+
+void
+NtpRequestTable::Clear(void)
+{
+	Entry empty = { 0, 0 };
+	m_entries.assign(m_entries.size(), empty);
+	m_count = 0;
+}
+
+int
+NtpRequestTable::Count(void) const
+{
+	return m_count;
+}
+
+uint64_t
+NtpRequestTable::NewCookie(void)
+{
+	// The cookies must not be predictable from the ones seen on the wire, so they come from
+	// the system CSPRNG, drawn in blocks into a per-thread pool (one getrandom() per 64)
+	thread_local uint64_t pool[NTP_COOKIE_POOL];
+	thread_local int next = NTP_COOKIE_POOL;
+
+	uint64_t cookie;
+	do
+	{
+		if (next == NTP_COOKIE_POOL)
+		{
+#ifndef _WIN32
+			size_t filled = 0;
+			while (filled < sizeof(pool))
+			{
+				ssize_t got = getrandom((char*)pool + filled, sizeof(pool) - filled, 0);
+				if (got < 0 && errno != EINTR)
+					break;
+				if (got > 0)
+					filled += (size_t)got;
+			}
+			if (filled < sizeof(pool))
+#endif
+			{
+				std::random_device device;
+				for (int ii = 0; ii < NTP_COOKIE_POOL; ii++)
+					pool[ii] = ((uint64_t)device() << 32) ^ device();
+			}
+			next = 0;
+		}
+		cookie = pool[next];
+		pool[next++] = 0;
+	} while (cookie == 0);
+	return cookie;
+}
@@ -0,0 +1,90 @@
+/**
+ *  This class indexes the requests in flight by the cookie they carry: a random 64-bit value
+ *  sent in the transmit timestamp field of the request, which the server echoes in the
+ *  originate timestamp field of the response (RFC 5905, section 8). A response whose
+ *  originate timestamp is not in the table is late, duplicated or spoofed.
+ *
+ *  The table uses open addressing with linear probing over one flat array of 16-byte
+ *  entries (key, value), kept at most half full, so a lookup is a couple of cache lines
+ *  whatever the number of entries; removals shift the following entries back (no
+ *  tombstones). The default capacity holds 100k requests in flight without growing.
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#ifndef NTPREQUESTTABLE_H
+#define NTPREQUESTTABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+#define NTP_REQUEST_TABLE_CAPACITY (100000)   // entries held without growing
+
+class NtpRequestTable
+{
+public:
+	/**
+	 * \param capacity the number of entries the table holds before it grows
+	 */
+	explicit NtpRequestTable(int capacity = NTP_REQUEST_TABLE_CAPACITY);
+
+	/**
+	 * This function adds an entry (or replaces the value of the key).
+	 *
+	 * \param key the cookie (not 0)
+	 * \param value the value (e.g. the index of the request)
+	 */
+	void Insert(uint64_t key, uint32_t value);
+	/**
+	 * This function looks up a key.
+	 *
+	 * \param key the cookie
+	 * \param value where the value is stored, if the key is found
+	 *
+	 * Returns true if the key is found
+	 */
+	bool Find(uint64_t key, uint32_t* value) const;
+	/**
+	 * This function removes an entry.
+	 *
+	 * Returns true if the key was found
+	 */
+	bool Erase(uint64_t key);
+	/**
+	 * This function removes all the entries.
+	 */
+	void Clear(void);
+	/**
+	 * This function returns the number of entries.
+	 */
+	int Count(void) const;
+
+	/**
+	 * This function returns a new random cookie (never 0), from the system CSPRNG (getrandom(),
+	 * std::random_device on Windows), so a cookie seen on the wire does not reveal the next ones.
+	 */
+	static uint64_t NewCookie(void);
+
+private:
+	struct Entry
+	{
+		uint64_t key;        // 0 when the entry is free
+		uint32_t value;
+	};
+
+	// The first entry to probe for the key
+	size_t Home(uint64_t key) const;
+	// Doubles the number of entries
+	void Grow(void);
+
+	std::vector<Entry> m_entries;   // a power of two
+	size_t m_mask;
+	int m_count;
+	int m_limit;                    // the table grows beyond this count (half the entries)
+};
+
+#endif  /* NTPREQUESTTABLE_H */
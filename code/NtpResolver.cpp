@@ -0,0 +1,418 @@
+/**
+ *  This class resolves the NTP server names in the background and caches the results.
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+/******************************************************************************
+* Project Headers
+*****************************************************************************/
+#include "NtpResolver.h"
+#include "NtpClient.h"
+
+/******************************************************************************
+* System Headers
+*****************************************************************************/
+#ifndef _WIN32
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+#endif
+#include <string.h>
+#include <chrono>
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+#define NTP_RESOLVER_ANSWER_SIZE (8192)
+
+/******************************************************************************
+* Static Function Definitions
+*****************************************************************************/
+
+static void
+AddAddress(std::vector<struct sockaddr_storage>* addresses, int family, const void* address)
+{
+	struct sockaddr_storage addr;
+	memset(&addr, 0, sizeof(addr));
+	if (family == AF_INET)
+	{
+		struct sockaddr_in* addr4 = (struct sockaddr_in*)&addr;
+		addr4->sin_family = AF_INET;
+		addr4->sin_port = htons(NTP_PORT);
+		memcpy(&addr4->sin_addr, address, sizeof(addr4->sin_addr));
+	}
+	else
+	{
+		struct sockaddr_in6* addr6 = (struct sockaddr_in6*)&addr;
+		addr6->sin6_family = AF_INET6;
+		addr6->sin6_port = htons(NTP_PORT);
+		memcpy(&addr6->sin6_addr, address, sizeof(addr6->sin6_addr));
+	}
+	addresses->push_back(addr);
+}
+
+#ifndef _WIN32
+// Skips a (possibly compressed) name of a DNS message; returns nullptr if it is malformed
+static const unsigned char*
+SkipName(const unsigned char* p, const unsigned char* end)
+{
+	while (p < end)
+	{
+		if (*p == 0)
+			return p + 1;
+		if ((*p & 0xC0) == 0xC0)
+			return (p + 2 <= end) ? p + 2 : nullptr;
+		p += 1 + *p;
+	}
+	return nullptr;
+}
+
+// Queries the records of one type; returns the smallest TTL of the answers, or -1
+static int
+QueryRecords(const char* host, int type, std::vector<struct sockaddr_storage>* addresses)
+{
+	thread_local struct __res_state state;
+	thread_local bool initialised = false;
+	if (!initialised)
+	{
+		if (res_ninit(&state) != 0)
+			return -1;
+		initialised = true;
+	}
+
+	unsigned char answer[NTP_RESOLVER_ANSWER_SIZE];
+	int length = res_nquery(&state, host, C_IN, type, answer, sizeof(answer));
+	if (length < NS_HFIXEDSZ)
+		return -1;
+	if (length > (int)sizeof(answer))
+		length = sizeof(answer); // truncated
+
+	const unsigned char* end = answer + length;
+	int questions = (answer[4] << 8) | answer[5];
+	int answers = (answer[6] << 8) | answer[7];
+	const unsigned char* p = answer + NS_HFIXEDSZ;
+	for (int ii = 0; ii < questions && p != nullptr; ii++)
+	{
+		p = SkipName(p, end);
+		if (p != nullptr)
+			p += NS_QFIXEDSZ;
+	}
+
+	int ttl = -1;
+	size_t found = addresses->size();
+	for (int ii = 0; ii < answers && p != nullptr; ii++)
+	{
+		p = SkipName(p, end);
+		if (p == nullptr || p + NS_RRFIXEDSZ > end)
+			break;
+
+		int rrType = (p[0] << 8) | p[1];
+		int rrClass = (p[2] << 8) | p[3];
+		int rrTtl = (int)(((uint32_t)p[4] << 24) | ((uint32_t)p[5] << 16) | ((uint32_t)p[6] << 8) | p[7]);
+		int rdLength = (p[8] << 8) | p[9];
+		p += NS_RRFIXEDSZ;
+		if (p + rdLength > end)
+			break;
+
+		// The TTL of the name is the smallest of the chain (e.g. CNAME then A)
+		if (rrClass == C_IN && (ttl < 0 || rrTtl < ttl))
+			ttl = rrTtl;
+		if (rrClass == C_IN && rrType == T_A && rdLength == 4)
+			AddAddress(addresses, AF_INET, p);
+		else if (rrClass == C_IN && rrType == T_AAAA && rdLength == 16)
+			AddAddress(addresses, AF_INET6, p);
+		p += rdLength;
+	}
+	return (addresses->size() > found) ? ttl : -1;
+}
+#endif
+
+/******************************************************************************
+* Class Member Function Definitions
+*****************************************************************************/
+
+NtpResolver::NtpResolver()
+	: m_stop(false)
+{
+}
+
+NtpResolver::~NtpResolver()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_work.notify_all();
+	if (m_thread.joinable())
+		m_thread.join();
+}
+
+NtpResolver&
+NtpResolver::Global(void)
+{
+	static NtpResolver resolver;
+	return resolver;
+}
+
+int64_t
+NtpResolver::NowMs(void)
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool
+NtpResolver::ParseAddress(const std::string& host, std::vector<struct sockaddr_storage>* addresses)
+{
+	unsigned char literal[16];
+	if (inet_pton(AF_INET, host.c_str(), literal) == 1)
+	{
+		AddAddress(addresses, AF_INET, literal);
+		return true;
+	}
+	if (inet_pton(AF_INET6, host.c_str(), literal) == 1)
+	{
+		AddAddress(addresses, AF_INET6, literal);
+		return true;
+	}
+	return false;
+}
+
+int
+NtpResolver::Query(const std::string& host, std::vector<struct sockaddr_storage>* addresses)
+{
+	// An address needs no lookup, and never expires
+	if (ParseAddress(host, addresses))
+		return NTP_RESOLVER_MAX_TTL_S;
+
+#ifndef _WIN32
+	int ttl4 = QueryRecords(host.c_str(), T_A, addresses);
+	int ttl6 = QueryRecords(host.c_str(), T_AAAA, addresses);
+	if (ttl4 >= 0 || ttl6 >= 0)
+		return (ttl4 >= 0 && (ttl6 < 0 || ttl4 < ttl6)) ? ttl4 : ttl6;
+#endif
+
+	// Not in the DNS (e.g. /etc/hosts), or no resolver library: no TTL
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	struct addrinfo* result = nullptr;
+	if (getaddrinfo(host.c_str(), nullptr, &hints, &result) != 0)
+		return -1;
+
+	for (struct addrinfo* p = result; p != nullptr; p = p->ai_next)
+	{
+		if (p->ai_family == AF_INET)
+			AddAddress(addresses, AF_INET, &((struct sockaddr_in*)p->ai_addr)->sin_addr);
+		else if (p->ai_family == AF_INET6)
+			AddAddress(addresses, AF_INET6, &((struct sockaddr_in6*)p->ai_addr)->sin6_addr);
+	}
+	freeaddrinfo(result);
+	return addresses->empty() ? -1 : NTP_RESOLVER_DEFAULT_TTL_S;
+}
+
+void
+NtpResolver::Queue(const std::string& host, Entry& entry)
+{
+	if (entry.pending)
+		return;
+
+	entry.pending = true;
+	m_queue.push_back(host);
+	if (!m_thread.joinable())
+		m_thread = std::thread(&NtpResolver::Run, this);
+	m_work.notify_one();
+}
+
+bool
+NtpResolver::Pick(Entry& entry, int family, struct sockaddr_storage* out, socklen_t* outLen)
+{
+	size_t count = entry.addresses.size();
+	for (size_t ii = 0; ii < count; ii++)
+	{
+		const struct sockaddr_storage& addr = entry.addresses[(entry.next + ii) % count];
+		if (family != AF_UNSPEC && addr.ss_family != family)
+			continue;
+
+		entry.next = (unsigned int)((entry.next + ii + 1) % count);
+		*out = addr;
+		*outLen = (addr.ss_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+		return true;
+	}
+	return false;
+}
+
+void
+NtpResolver::Run(void)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	for (;;)
+	{
+		m_work.wait(lock, [this] { return m_stop || !m_queue.empty(); });
+		if (m_stop)
+			return;
+
+		std::string host = m_queue.front();
+		m_queue.pop_front();
+
+		lock.unlock();
+		std::vector<struct sockaddr_storage> addresses;
+		int ttl = Query(host, &addresses);
+		lock.lock();
+
+		Entry& entry = m_cache[host];
+		int64_t now = NowMs();
+		if (ttl >= 0)
+		{
+			if (ttl < NTP_RESOLVER_MIN_TTL_S)
+				ttl = NTP_RESOLVER_MIN_TTL_S;
+			else if (ttl > NTP_RESOLVER_MAX_TTL_S)
+				ttl = NTP_RESOLVER_MAX_TTL_S;
+			entry.addresses.swap(addresses);
+			entry.resolved = true;
+			entry.expiryMs = now + ((int64_t)ttl * 1000);
+			entry.refreshMs = now + ((int64_t)ttl * 900);
+		}
+		else
+		{
+			// Keep serving the old records (if any), and try again later
+			entry.expiryMs = now + (NTP_RESOLVER_NEGATIVE_TTL_S * 1000);
+			entry.refreshMs = entry.expiryMs;
+		}
+		entry.pending = false;
+
+		std::vector<Callback> callbacks;
+		callbacks.swap(entry.callbacks);
+		bool success = entry.resolved;
+		m_done.notify_all();
+
+		lock.unlock();
+		for (size_t ii = 0; ii < callbacks.size(); ii++)
+			callbacks[ii](success);
+		lock.lock();
+	}
+}
+
+bool
+NtpResolver::Lookup(const char* host, int family, struct sockaddr_storage* out, socklen_t* outLen)
+{
+	return Resolve(host, family, out, outLen, 0);
+}
+
+bool
+NtpResolver::Resolve(const char* host, int family, struct sockaddr_storage* out, socklen_t* outLen, int timeoutMs)
+{
+	std::string name(host);
+	std::unique_lock<std::mutex> lock(m_mutex);
+	Entry& entry = m_cache[name];
+	int64_t now = NowMs();
+	if (!entry.resolved && ParseAddress(name, &entry.addresses))
+	{
+		// An address is cached at once, so even Lookup() never misses it
+		entry.resolved = true;
+		entry.expiryMs = now + ((int64_t)NTP_RESOLVER_MAX_TTL_S * 1000);
+		entry.refreshMs = now + ((int64_t)NTP_RESOLVER_MAX_TTL_S * 900);
+	}
+	else if (now >= entry.refreshMs)
+		Queue(name, entry); // first use, expiring records, or a failure to retry
+
+	if (entry.resolved)
+		return Pick(entry, family, out, outLen);
+	if (timeoutMs <= 0)
+		return false;
+
+	// The entry is looked up again on each wake up, as Clear() may have removed it meanwhile
+	Entry* done = nullptr;
+	m_done.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this, &name, &done] {
+		std::unordered_map<std::string, Entry>::iterator it = m_cache.find(name);
+		done = (it != m_cache.end() && (it->second.resolved || !it->second.pending)) ? &it->second : nullptr;
+		return done != nullptr || it == m_cache.end();
+	});
+	return done != nullptr && done->resolved && Pick(*done, family, out, outLen);
+}
+
+void
+NtpResolver::ResolveAsync(const char* host, Callback callback)
+{
+	std::string name(host);
+	std::unique_lock<std::mutex> lock(m_mutex);
+	Entry& entry = m_cache[name];
+	if (entry.resolved && NowMs() < entry.refreshMs)
+	{
+		lock.unlock();
+		if (callback)
+			callback(true);
+		return;
+	}
+
+	if (callback)
+		entry.callbacks.push_back(callback);
+	Queue(name, entry);
+}
+
+int
+NtpResolver::GetAddresses(const char* host, std::vector<struct sockaddr_storage>* out)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::unordered_map<std::string, Entry>::iterator it = m_cache.find(host);
+	if (it == m_cache.end() || !it->second.resolved)
+	{
+		out->clear();
+		return 0;
+	}
+	*out = it->second.addresses;
+	return (int)out->size();
+}
+
+int
+NtpResolver::GetPreferredFamily(const char* host)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::unordered_map<std::string, Entry>::iterator it = m_cache.find(host);
+	if (it == m_cache.end() || it->second.preferredFamily == AF_UNSPEC || NowMs() >= it->second.preferredUntilMs)
+		return AF_UNSPEC;
+
+	const std::vector<struct sockaddr_storage>& addresses = it->second.addresses;
+	for (size_t ii = 0; ii < addresses.size(); ii++)
+	{
+		if (addresses[ii].ss_family == it->second.preferredFamily)
+			return it->second.preferredFamily;
+	}
+	return AF_UNSPEC;
+}
+
+void
+NtpResolver::SetPreferredFamily(const char* host, int family)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	Entry& entry = m_cache[host];
+	entry.preferredFamily = family;
+	entry.preferredUntilMs = NowMs() + (NTP_RESOLVER_PREFERENCE_S * 1000);
+}
+
+std::string
+NtpResolver::ToString(const struct sockaddr_storage& addr)
+{
+	char text[INET6_ADDRSTRLEN] = { 0 };
+	if (addr.ss_family == AF_INET6)
+		inet_ntop(AF_INET6, (void*)&((const struct sockaddr_in6*)&addr)->sin6_addr, text, sizeof(text));
+	else if (addr.ss_family == AF_INET)
+		inet_ntop(AF_INET, (void*)&((const struct sockaddr_in*)&addr)->sin_addr, text, sizeof(text));
+	return text;
+}
+
+void
+NtpResolver::Clear(void)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (std::unordered_map<std::string, Entry>::iterator it = m_cache.begin(); it != m_cache.end();)
+	{
+		// The names being resolved stay, so that their waiters get the result
+		if (it->second.pending)
+			++it;
+		else
+			it = m_cache.erase(it);
+	}
+}
@@ -0,0 +1,161 @@
+/**
+ *  This class resolves the NTP server names in the background and caches the results.
+ *
+ *  Every A and AAAA record of a name is kept (a pool name such as pool.ntp.org returns
+ *  several servers), and each lookup returns the next one in turn, so that the queries are
+ *  spread over the servers of the pool. The records are kept for their TTL (on Linux they
+ *  are queried with res_nquery(); elsewhere, or when the DNS does not know the name, e.g.
+ *  one from /etc/hosts, getaddrinfo() is used with a default TTL). A name is resolved again
+ *  in the background when 90% of its TTL has passed, while the old records are still
+ *  served, so only the very first lookup of a name waits for the DNS. A name that cannot be
+ *  resolved is not tried again for 30 s.
+ *
+ *  The resolver also remembers, per name, the address family that answered first when the
+ *  client raced a request over IPv4 and IPv6 (see NtpClient::ConnectAsync()), for 10 min.
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#ifndef NTPRESOLVER_H
+#define NTPRESOLVER_H
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+#define NTP_RESOLVER_TIMEOUT_MS (5000)        // longest wait for a name that was never resolved
+#define NTP_RESOLVER_DEFAULT_TTL_S (300)      // TTL of the records when it is not known (getaddrinfo)
+#define NTP_RESOLVER_MIN_TTL_S (10)
+#define NTP_RESOLVER_MAX_TTL_S (86400)
+#define NTP_RESOLVER_NEGATIVE_TTL_S (30)      // a name that cannot be resolved is not tried again before
+#define NTP_RESOLVER_PREFERENCE_S (600)       // the faster family of a name is raced again after
+
+class NtpResolver
+{
+public:
+	typedef std::function<void(bool success)> Callback;
+
+	NtpResolver();
+	~NtpResolver();
+
+	/**
+	 * This function returns the resolver shared by the clients.
+	 */
+	static NtpResolver& Global(void);
+
+	/**
+	 * This function returns the next address of the name (in turn over its records), with the
+	 * NTP port. It only waits if the name was never resolved; expired records are still
+	 * returned while they are resolved again in the background.
+	 *
+	 * \param host the hostname or IP address
+	 * \param family AF_INET or AF_INET6 for an address of that family only, AF_UNSPEC for any
+	 * \param out where the address is stored
+	 * \param outLen where the size of the address is stored
+	 * \param timeoutMs the longest wait for the first resolution of the name
+	 *
+	 * Returns true upon success, false if the name could not be resolved (in time)
+	 */
+	bool Resolve(const char* host, int family, struct sockaddr_storage* out, socklen_t* outLen, int timeoutMs = NTP_RESOLVER_TIMEOUT_MS);
+	/**
+	 * This function is Resolve() without waiting: if the name is not in the cache, its
+	 * resolution is started in the background and false is returned (an IP address is
+	 * always found).
+	 */
+	bool Lookup(const char* host, int family, struct sockaddr_storage* out, socklen_t* outLen);
+	/**
+	 * This function resolves the name in the background (e.g. ahead of its first use).
+	 *
+	 * \param host the hostname or IP address
+	 * \param callback called (from the resolver thread, or at once if the name is cached) with the result (optional)
+	 */
+	void ResolveAsync(const char* host, Callback callback = nullptr);
+	/**
+	 * This function returns all the cached addresses of the name.
+	 *
+	 * Returns the number of addresses
+	 */
+	int GetAddresses(const char* host, std::vector<struct sockaddr_storage>* out);
+	/**
+	 * This function returns the address family that answered first the last time the name
+	 * was raced over IPv4 and IPv6.
+	 *
+	 * Returns AF_INET or AF_INET6, or AF_UNSPEC if it is not known (or no longer), or if the
+	 * name has no address of that family anymore
+	 */
+	int GetPreferredFamily(const char* host);
+	/**
+	 * This function remembers the address family that answered first for the name.
+	 *
+	 * \param host the hostname
+	 * \param family AF_INET or AF_INET6
+	 */
+	void SetPreferredFamily(const char* host, int family);
+	/**
+	 * This function returns the IP address of addr as a string, e.g. for the logs.
+	 */
+	static std::string ToString(const struct sockaddr_storage& addr);
+	/**
+	 * This function empties the cache.
+	 */
+	void Clear(void);
+
+private:
+	NtpResolver(const NtpResolver&);
+	NtpResolver& operator=(const NtpResolver&);
+
+	struct Entry
+	{
+		Entry() : expiryMs(0), refreshMs(0), resolved(false), pending(false), next(0), preferredFamily(AF_UNSPEC), preferredUntilMs(0) {}
+
+		std::vector<struct sockaddr_storage> addresses;   // A and AAAA records, with the NTP port
+		int64_t expiryMs;          // records (or the failure) valid until (steady clock, ms)
+		int64_t refreshMs;         // resolved again in the background from then on
+		bool resolved;             // the records are valid
+		bool pending;              // a resolution is queued or running
+		unsigned int next;         // round robin over the addresses
+		int preferredFamily;       // the family that answered first (AF_UNSPEC if not known)
+		int64_t preferredUntilMs;  // raced again from then on
+		std::vector<Callback> callbacks;
+	};
+
+	// The loop of the background thread
+	void Run(void);
+	// Queues the resolution of the entry (the lock must be held)
+	void Queue(const std::string& host, Entry& entry);
+	// Picks the next address of the family (the lock must be held)
+	static bool Pick(Entry& entry, int family, struct sockaddr_storage* out, socklen_t* outLen);
+	// Adds the address if the name is an IPv4/IPv6 address; returns false otherwise
+	static bool ParseAddress(const std::string& host, std::vector<struct sockaddr_storage>* addresses);
+	// Resolves a name (blocking); returns the TTL in s, or -1 if it cannot be resolved
+	static int Query(const std::string& host, std::vector<struct sockaddr_storage>* addresses);
+
+	static int64_t NowMs(void);
+
+	std::unordered_map<std::string, Entry> m_cache;
+	std::deque<std::string> m_queue;
+	std::mutex m_mutex;
+	std::condition_variable m_work;          // the queue is not empty (or stop)
+	std::condition_variable m_done;          // a resolution has completed
+	std::thread m_thread;                    // started on the first resolution
+	bool m_stop;
+};
+
+#endif  /* NTPRESOLVER_H */
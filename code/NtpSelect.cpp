@@ -0,0 +1,478 @@
+/**
+ *  This class queries a set of NTP servers in parallel and combines their offsets
+ *  (RFC 5905, section 11.2).
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+/******************************************************************************
+* Project Headers
+*****************************************************************************/
+#include "NtpSelect.h"
+#include "NtpSession.h"
+#include "NtpClock.h"
+#include "NtpResolver.h"
+#include "NtpChannel.h"
+#ifndef _WIN32
+#include "NtpTransport.h"
+#endif
+
+/******************************************************************************
+* System Headers
+*****************************************************************************/
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <stdio.h>
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+#define NTP_SELECT_MIN_DELAY_NS (10000000LL) // floor of the delay in the root distance, 10 ms (MINDISP)
+#define NTP_SELECT_TIMEOUT_MS (2000)         // time to wait for the responses in Round() (Windows, or over a channel)
+
+/******************************************************************************
+* Class Member Function Definitions
+*****************************************************************************/
+
+NtpSelect::NtpSelect()
+	: m_clockState(&NtpClockState::Global()),
+	  m_channel(nullptr),
+	  m_timeSource(&NtpTimeSource::System())
+{
+	memset(&m_result, 0, sizeof(m_result));
+	m_result.systemPeer = -1;
+}
+
+NtpSelect::~NtpSelect()
+{
+}
+
+void
+NtpSelect::AddServer(const char* host)
+{
+	Peer peer;
+	peer.host = host;
+	peer.client.reset(new NtpClient());
+	peer.client->SetClockState(nullptr); // only the combined offset is published
+	peer.client->SetTimeSource(m_timeSource);
+	peer.responded = false;
+	peer.selectable = false;
+	peer.truechimer = false;
+	peer.survivor = false;
+	peer.rootDistanceNs = 0;
+	m_peers.push_back(std::move(peer));
+
+	// Resolved ahead of the first poll, which then does not wait for the DNS
+	if (m_channel == nullptr)
+		NtpResolver::Global().ResolveAsync(host);
+}
+
+void
+NtpSelect::ClearServers(void)
+{
+	m_peers.clear();
+	memset(&m_result, 0, sizeof(m_result));
+	m_result.systemPeer = -1;
+}
+
+int
+NtpSelect::ServerCount(void) const
+{
+	return (int)m_peers.size();
+}
+
+const NtpSelect::Peer&
+NtpSelect::GetPeer(int index) const
+{
+	return m_peers[index];
+}
+
+void
+NtpSelect::SetClockState(NtpClockState* state)
+{
+	m_clockState = state;
+}
+
+void
+NtpSelect::SetChannel(NtpChannel* channel)
+{
+	m_channel = channel;
+}
+
+void
+NtpSelect::SetTimeSource(NtpTimeSource* source)
+{
+	m_timeSource = (source != nullptr) ? source : &NtpTimeSource::System();
+	for (size_t ii = 0; ii < m_peers.size(); ii++)
+		m_peers[ii].client->SetTimeSource(m_timeSource);
+}
+
+const NtpSelect::Result&
+NtpSelect::GetResult(void) const
+{
+	return m_result;
+}
+
+int64_t
+NtpSelect::GetClockOffsetNs(void) const
+{
+	return m_result.offsetNs;
+}
+
+double
+NtpSelect::GetFrequency(void) const
+{
+	return m_discipline.GetState().frequency;
+}
+
+int64_t
+NtpSelect::RootDistance(const Peer& peer, int64_t nowNs)
+{
+	NtpFilter::Result filtered = peer.client->GetFilterResult();
+	NtpClient::Sample last = peer.client->GetLastSample();
+
+	int64_t age = nowNs - filtered.timeNs;
+	if (age < 0)
+		age = 0;
+	int64_t delay = std::max((int64_t)NTP_SELECT_MIN_DELAY_NS, last.rootDelayNs + filtered.delayNs);
+	return (delay / 2) + last.rootDispersionNs + filtered.sampleDispersionNs + ((age / 1000000) * NTP_FILTER_PHI_PPM) + filtered.jitterNs;
+}
+
+bool
+NtpSelect::Round(void)
+{
+	for (size_t ii = 0; ii < m_peers.size(); ii++)
+		m_peers[ii].responded = false;
+
+	if (m_channel != nullptr)
+	{
+		for (size_t ii = 0; ii < m_peers.size(); ii++)
+			m_peers[ii].responded = m_peers[ii].client->Connect(*m_channel, m_peers[ii].host.c_str(), nullptr, NTP_SELECT_TIMEOUT_MS);
+		return Select().valid;
+	}
+
+#ifdef _WIN32
+	for (size_t ii = 0; ii < m_peers.size(); ii++)
+	{
+		NtpSession session(*m_peers[ii].client);
+		m_peers[ii].responded = session.Open(m_peers[ii].host.c_str(), NTP_SELECT_TIMEOUT_MS) && session.Query();
+	}
+	return Select().valid;
+#else
+	NtpTransport transport;
+	if (!transport.Open())
+	{
+		perror("epoll_create1");
+		return false;
+	}
+
+	// This call blocks anyway: the names not resolved yet are waited for here, as
+	// RoundAsync() does not wait for the DNS
+	for (size_t ii = 0; ii < m_peers.size(); ii++)
+		WaitResolved((int)ii);
+
+	bool _valid = false;
+	RoundAsync(transport, [&_valid](bool valid) { _valid = valid; });
+	while (transport.Outstanding() > 0)
+	{
+		if (transport.Poll(-1) < 0)
+			return false;
+	}
+	return _valid;
+#endif
+}
+
+bool
+NtpSelect::Query(int index)
+{
+	Peer& peer = m_peers[index];
+	if (m_channel != nullptr)
+	{
+		peer.responded = peer.client->Connect(*m_channel, peer.host.c_str(), nullptr, NTP_SELECT_TIMEOUT_MS);
+		Select();
+		return peer.responded;
+	}
+#ifdef _WIN32
+	NtpSession session(*peer.client);
+	peer.responded = session.Open(peer.host.c_str(), NTP_SELECT_TIMEOUT_MS) && session.Query();
+#else
+	NtpTransport transport;
+	if (!transport.Open())
+	{
+		perror("epoll_create1");
+		return false;
+	}
+	peer.responded = false;
+	WaitResolved(index);
+	if (!QueryAsync(transport, index, nullptr))
+		return false;
+	while (transport.Outstanding() > 0)
+	{
+		if (transport.Poll(-1) < 0)
+			return false;
+	}
+#endif
+	Select();
+	return peer.responded;
+}
+
+#ifndef _WIN32
+void
+NtpSelect::WaitResolved(int index)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrLen;
+	NtpResolver::Global().Resolve(m_peers[index].host.c_str(), AF_UNSPEC, &addr, &addrLen);
+}
+
+bool
+NtpSelect::QueryAsync(NtpTransport& transport, int index, std::function<void(bool)> onComplete)
+{
+	return m_peers[index].client->ConnectAsync(transport, m_peers[index].host.c_str(),
+		[this, index, onComplete](bool success)
+		{
+			m_peers[index].responded = success;
+			if (onComplete)
+				onComplete(success);
+		});
+}
+
+int
+NtpSelect::RoundAsync(NtpTransport& transport, std::function<void(bool)> onComplete)
+{
+	// Each round counts its own requests, so a round abandoned with its transport (whose
+	// callbacks are dropped) or overlapped by the next one does not hold the following ones.
+	// The count starts at 1 while the requests are submitted, so the round completes once,
+	// even if nothing could be submitted
+	std::shared_ptr<int> pending = std::make_shared<int>(1);
+	std::function<void()> done = [this, pending, onComplete]()
+		{
+			if (--*pending == 0)
+			{
+				bool _valid = Select().valid;
+				if (onComplete)
+					onComplete(_valid);
+			}
+		};
+
+	int submitted = 0;
+	for (size_t ii = 0; ii < m_peers.size(); ii++)
+	{
+		m_peers[ii].responded = false;
+		(*pending)++;
+		if (QueryAsync(transport, (int)ii, [done](bool) { done(); }))
+			submitted++;
+		else
+			(*pending)--;
+	}
+	done();
+	return submitted;
+}
+#endif
+
+NtpSelect::Result
+NtpSelect::Select(void)
+{
+	return Select(m_timeSource->Now());
+}
+
+NtpSelect::Result
+NtpSelect::Select(int64_t nowNs)
+{
+
+	struct Candidate
+	{
+		int peer;
+		int64_t offsetNs;
+		int64_t distanceNs;
+		int64_t jitterNs;
+	};
+
+	Result result;
+	memset(&result, 0, sizeof(result));
+	result.systemPeer = -1;
+	result.frequency = m_discipline.GetState().frequency;
+
+	//---------------------------------------------------------------------
+	// Candidates: servers with samples, synchronised, and not too far from their reference
+	std::vector<Candidate> candidates;
+	for (size_t ii = 0; ii < m_peers.size(); ii++)
+	{
+		Peer& peer = m_peers[ii];
+		peer.selectable = peer.truechimer = peer.survivor = false;
+
+		NtpFilter::Result filtered = peer.client->GetFilterResult();
+		NtpClient::Sample last = peer.client->GetLastSample();
+		if (!filtered.valid || last.stratum == 0 || last.stratum >= 16 || last.leapIndicator == 3)
+			continue;
+
+		peer.rootDistanceNs = RootDistance(peer, nowNs);
+		if (peer.rootDistanceNs > NTP_SELECT_MAX_DISTANCE_NS)
+			continue;
+
+		peer.selectable = true;
+		Candidate candidate = { (int)ii, filtered.offsetNs, std::max(peer.rootDistanceNs, (int64_t)1), filtered.jitterNs };
+		candidates.push_back(candidate);
+	}
+
+	int n = (int)candidates.size();
+	result.candidates = n;
+	if (n == 0)
+	{
+		m_result = result;
+		return result;
+	}
+
+	//---------------------------------------------------------------------
+	// Intersection: the smallest interval that contains the midpoints of n - allow servers,
+	// for the fewest falsetickers (allow) possible
+	struct Edge
+	{
+		int64_t value;
+		int type;   // -1 lower endpoint, 0 midpoint, +1 upper endpoint
+	};
+	std::vector<Edge> edges;
+	edges.reserve(3 * n);
+	for (int ii = 0; ii < n; ii++)
+	{
+		Edge lower = { candidates[ii].offsetNs - candidates[ii].distanceNs, -1 };
+		Edge middle = { candidates[ii].offsetNs, 0 };
+		Edge upper = { candidates[ii].offsetNs + candidates[ii].distanceNs, +1 };
+		edges.push_back(lower);
+		edges.push_back(middle);
+		edges.push_back(upper);
+	}
+	std::sort(edges.begin(), edges.end(), [](const Edge& a, const Edge& b)
+		{
+			return (a.value < b.value) || (a.value == b.value && a.type < b.type);
+		});
+
+	int64_t low = 0, high = 0;
+	bool intersected = false;
+	for (int allow = 0; 2 * allow < n; allow++)
+	{
+		int found = 0;
+		int chime = 0;
+		low = INT64_MAX;
+		high = INT64_MIN;
+		for (int ii = 0; ii < 3 * n; ii++)
+		{
+			chime -= edges[ii].type;
+			if (chime >= n - allow)
+			{
+				low = edges[ii].value;
+				break;
+			}
+			if (edges[ii].type == 0)
+				found++;
+		}
+		chime = 0;
+		for (int ii = (3 * n) - 1; ii >= 0; ii--)
+		{
+			chime += edges[ii].type;
+			if (chime >= n - allow)
+			{
+				high = edges[ii].value;
+				break;
+			}
+			if (edges[ii].type == 0)
+				found++;
+		}
+		if (found > allow)
+			continue;
+		if (high >= low)
+		{
+			intersected = true;
+			break;
+		}
+	}
+	if (!intersected)
+	{
+		// No majority agrees
+		m_result = result;
+		return result;
+	}
+
+	std::vector<Candidate> survivors;
+	for (int ii = 0; ii < n; ii++)
+	{
+		if (candidates[ii].offsetNs - candidates[ii].distanceNs > high || candidates[ii].offsetNs + candidates[ii].distanceNs < low)
+			continue; // falseticker
+		m_peers[candidates[ii].peer].truechimer = true;
+		survivors.push_back(candidates[ii]);
+	}
+	result.truechimers = (int)survivors.size();
+
+	//---------------------------------------------------------------------
+	// Clustering: drop the survivor whose offset adds the most jitter, as long as that
+	// jitter exceeds the jitter of the best server (i.e. removing it helps)
+	std::sort(survivors.begin(), survivors.end(), [](const Candidate& a, const Candidate& b)
+		{
+			return a.distanceNs < b.distanceNs;
+		});
+	while ((int)survivors.size() > NTP_SELECT_MIN_SURVIVORS)
+	{
+		double maxSelectionJitter = -1.0;
+		int worst = -1;
+		int64_t minPeerJitter = INT64_MAX;
+		for (size_t ii = 0; ii < survivors.size(); ii++)
+		{
+			double sum = 0.0;
+			for (size_t jj = 0; jj < survivors.size(); jj++)
+			{
+				double diff = (double)(survivors[jj].offsetNs - survivors[ii].offsetNs);
+				sum += diff * diff;
+			}
+			double selectionJitter = std::sqrt(sum / (double)(survivors.size() - 1));
+			if (selectionJitter > maxSelectionJitter)
+			{
+				maxSelectionJitter = selectionJitter;
+				worst = (int)ii;
+			}
+			minPeerJitter = std::min(minPeerJitter, survivors[ii].jitterNs);
+		}
+		if (maxSelectionJitter <= (double)minPeerJitter)
+			break;
+		survivors.erase(survivors.begin() + worst);
+	}
+
+	//---------------------------------------------------------------------
+	// Combine: average weighted by 1/root distance; the system peer is the closest survivor
+	const Candidate& systemPeer = survivors[0];
+	double x = 0.0, y = 0.0, z = 0.0;
+	for (size_t ii = 0; ii < survivors.size(); ii++)
+	{
+		m_peers[survivors[ii].peer].survivor = true;
+		double weight = 1.0 / (double)survivors[ii].distanceNs;
+		double diff = (double)(survivors[ii].offsetNs - systemPeer.offsetNs);
+		x += weight;
+		y += weight * (double)survivors[ii].offsetNs;
+		z += weight * diff * diff;
+	}
+	double selectionJitter = std::sqrt(z / x);
+	double peerJitter = (double)systemPeer.jitterNs;
+
+	result.valid = true;
+	result.survivors = (int)survivors.size();
+	result.systemPeer = systemPeer.peer;
+	result.offsetNs = (int64_t)(y / x);
+	result.jitterNs = (int64_t)std::sqrt((selectionJitter * selectionJitter) + (peerJitter * peerJitter));
+	result.rootDistanceNs = systemPeer.distanceNs;
+	result.timeNs = m_peers[systemPeer.peer].client->GetFilterResult().timeNs;
+	result.frequency = m_discipline.Update(result.offsetNs, result.timeNs).frequency;
+	m_result = result;
+
+	if (m_clockState != nullptr)
+	{
+		NtpClockState::Snapshot snapshot;
+		snapshot.offsetNs = result.offsetNs;
+		snapshot.frequency = result.frequency;
+		snapshot.updateTimeNs = result.timeNs;
+		snapshot.errorBoundNs = result.rootDistanceNs + result.jitterNs;
+		snapshot.updates = 0;
+		m_clockState->Publish(snapshot);
+	}
+	return result;
+}
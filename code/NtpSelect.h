@@ -0,0 +1,211 @@
+/**
+ *  This class queries a set of NTP servers in parallel and combines their offsets
+ *  (RFC 5905, section 11.2):
+ *  - each server has its own NtpClient, hence its own clock filter;
+ *  - the root distance of a server (half the round trip to its reference, plus the root
+ *    dispersion, the dispersion and the jitter of its samples) bounds its error, so its
+ *    offset +/- root distance is an interval that must contain the true offset;
+ *  - the intersection (Marzullo) keeps the largest group of servers whose intervals agree,
+ *    the others are falsetickers;
+ *  - the clustering drops the outliers (the survivor that adds the most jitter) while
+ *    that reduces the jitter;
+ *  - the combined offset is the average of the survivors, weighted by 1/root distance.
+ *
+ *  A bad server is then outvoted within one round, instead of being trusted (or retried).
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#ifndef NTPSELECT_H
+#define NTPSELECT_H
+
+#include "NtpClient.h"
+#include "NtpDiscipline.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+// May be overridden at build time, e.g. to tune the selection against a journal (tools/NtpReplay.cpp)
+#ifndef NTP_SELECT_MIN_SURVIVORS
+#define NTP_SELECT_MIN_SURVIVORS (3)              // the clustering stops at this number of survivors (NMIN)
+#endif
+#ifndef NTP_SELECT_MAX_DISTANCE_NS
+#define NTP_SELECT_MAX_DISTANCE_NS (1500000000LL) // servers further than this are not selectable (MAXDIST)
+#endif
+#ifndef _WIN32
+class NtpTransport;
+#endif
+class NtpChannel;
+class NtpTimeSource;
+
+class NtpSelect
+{
+public:
+	/**
+	 * The state of one server after the last selection.
+	 */
+	struct Peer
+	{
+		std::string host;                 /**< Hostname or IP address of the server. */
+		std::unique_ptr<NtpClient> client; /**< The client (and clock filter) of the server. */
+		bool responded;                   /**< True if the server responded in the last round. */
+		bool selectable;                  /**< True if the server is synchronised and close enough. */
+		bool truechimer;                  /**< True if the interval of the server intersects the others. */
+		bool survivor;                    /**< True if the offset of the server is in the combined offset. */
+		int64_t rootDistanceNs;           /**< Root distance of the server, in ns. */
+	};
+
+	struct Result
+	{
+		bool valid;                       /**< True if at least one server survived. */
+		int candidates;                   /**< Number of selectable servers. */
+		int truechimers;                  /**< Number of servers in the intersection. */
+		int survivors;                    /**< Number of servers combined. */
+		int systemPeer;                   /**< Index of the server with the smallest root distance among the survivors. */
+		int64_t offsetNs;                 /**< Combined offset, in ns (same sign convention as NtpClient). */
+		int64_t jitterNs;                 /**< Combined jitter (selection and system peer jitter), in ns. */
+		int64_t rootDistanceNs;           /**< Root distance of the system peer, in ns. */
+		int64_t timeNs;                   /**< Time of the sample of the system peer (ns since the UNIX epoch). */
+		double frequency;                 /**< Frequency error of the local clock (see NtpDiscipline). */
+	};
+
+	NtpSelect();
+	~NtpSelect();
+
+	/**
+	 * This function adds a server to the set.
+	 *
+	 * \param host the hostname or IP address of the NTP server
+	 */
+	void AddServer(const char* host);
+	/**
+	 * This function removes all the servers (and their sample history).
+	 */
+	void ClearServers(void);
+	/**
+	 * This function returns the number of servers.
+	 */
+	int ServerCount(void) const;
+	/**
+	 * This function returns the state of a server.
+	 *
+	 * \param index the index of the server, in the order they were added
+	 */
+	const Peer& GetPeer(int index) const;
+	/**
+	 * This function sets where the combined offset is published after each selection
+	 * (NtpClockState::Global() by default, nullptr disables it; see NtpClock.h).
+	 *
+	 * \param state the state to publish to
+	 */
+	void SetClockState(NtpClockState* state);
+	/**
+	 * This function makes Round() and Query() exchange over the given channel, one server
+	 * after the other, instead of the sockets (e.g. a simulated network, see NtpSimulator).
+	 *
+	 * The names of the servers added afterwards are not resolved.
+	 *
+	 * \param channel the channel (nullptr for the sockets); it must outlive the selection
+	 */
+	void SetChannel(NtpChannel* channel);
+	/**
+	 * This function sets the clock of the clients and of Select() (see NtpClient::SetTimeSource).
+	 *
+	 * \param source the time source (nullptr for the system clock)
+	 */
+	void SetTimeSource(NtpTimeSource* source);
+	/**
+	 * This function queries all the servers in parallel (on Windows, one after the other),
+	 * waits for the responses (or the timeouts) and then runs Select().
+	 *
+	 * Returns true if the selection produced an offset
+	 */
+	bool Round(void);
+#ifndef _WIN32
+	/**
+	 * This function submits one request per server to the transport and returns without
+	 * blocking; onComplete is invoked (from NtpTransport::Poll()) once all the servers
+	 * responded or timed out, after Select() ran; if no request could be submitted, at once.
+	 * A round whose transport is closed before it completes is abandoned (onComplete is not
+	 * invoked), without affecting the next rounds.
+	 *
+	 * \param transport the (already opened) transport that carries the exchanges
+	 * \param onComplete the function to be invoked upon completion (may be empty)
+	 *
+	 * Returns the number of requests submitted
+	 */
+	int RoundAsync(NtpTransport& transport, std::function<void(bool)> onComplete);
+#endif
+	/**
+	 * This function queries one server (blocking) and then runs Select().
+	 *
+	 * \param index the index of the server
+	 *
+	 * Returns true if the server responded
+	 */
+	bool Query(int index);
+#ifndef _WIN32
+	/**
+	 * This function submits a request to one server and returns without blocking; the
+	 * response is added to the clock filter of the server, but Select() is not run.
+	 *
+	 * \param transport the (already opened) transport that carries the exchange
+	 * \param index the index of the server
+	 * \param onComplete the function to be invoked upon completion (may be empty)
+	 *
+	 * Returns true if the request was submitted
+	 */
+	bool QueryAsync(NtpTransport& transport, int index, std::function<void(bool)> onComplete);
+#endif
+	/**
+	 * This function runs the intersection and the clustering over the clock filters of
+	 * the servers, computes the combined offset and publishes it.
+	 *
+	 * Returns the result of the selection
+	 */
+	Result Select(void);
+	/**
+	 * This function is Select() at the given time, e.g. the time of the last sample when the
+	 * samples are replayed (see NtpJournal): the root distances are aged up to nowNs.
+	 *
+	 * \param nowNs the current time (ns since the UNIX epoch)
+	 */
+	Result Select(int64_t nowNs);
+	/**
+	 * This function returns the result of the last selection.
+	 */
+	const Result& GetResult(void) const;
+	/**
+	 * This function returns the combined offset in ns (0 until a selection succeeded).
+	 */
+	int64_t GetClockOffsetNs(void) const;
+	/**
+	 * This function returns the frequency error of the local clock estimated from the
+	 * combined offsets (s/s, positive means it runs slow; see NtpDiscipline).
+	 */
+	double GetFrequency(void) const;
+
+private:
+	NtpSelect(const NtpSelect&);
+	NtpSelect& operator=(const NtpSelect&);
+
+	// Root distance of a server at the given time (RFC 5905, root_dist())
+	static int64_t RootDistance(const Peer& peer, int64_t nowNs);
+#ifndef _WIN32
+	// Waits (up to the resolver timeout) for the name of a server to be in the resolver cache
+	void WaitResolved(int index);
+#endif
+
+	std::vector<Peer> m_peers;
+	NtpClockState* m_clockState;
+	NtpChannel* m_channel;                // the exchanges go over the sockets if nullptr
+	NtpTimeSource* m_timeSource;
+	Result m_result;
+	NtpDiscipline m_discipline;           // frequency error, from the combined offsets
+};
+
+#endif  /* NTPSELECT_H */
@@ -0,0 +1,380 @@
+/**
+ *  This class answers SNTP requests (mode 3) with server responses (mode 4).
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#ifndef _WIN32
+
+/******************************************************************************
+* Project Headers
+*****************************************************************************/
+#include "NtpServer.h"
+#include "NtpPacket.h"
+#include "NtpTimestamping.h"
+
+/******************************************************************************
+* System Headers
+*****************************************************************************/
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+#define NTP_SERVER_MAX_MESSAGE_SIZE (NTP_AUTH_MSG_SIZE) // 48-byte header + optional key id (4) and digest (16)
+#define NTP_SERVER_RECEIVE_TIMEOUT_MS (100)      // how often a worker checks whether it should stop
+#define NTP_SERVER_SOCKET_BUFFER (4 * 1024 * 1024)
+
+/******************************************************************************
+* Class Member Function Definitions
+*****************************************************************************/
+
+NtpServer::NtpServer()
+	: m_clockState(nullptr),
+	  m_auth(nullptr),
+	  m_stop(false),
+	  m_port(0),
+	  m_stratum(1),
+	  m_referenceId(0x4C4F434C), // "LOCL"
+	  m_precision(-20)
+{
+}
+
+NtpServer::~NtpServer()
+{
+	Stop();
+}
+
+void
+NtpServer::SetReference(unsigned char stratum, uint32_t referenceId, signed char precision)
+{
+	m_stratum = stratum;
+	m_referenceId = referenceId;
+	m_precision = precision;
+}
+
+void
+NtpServer::SetClockState(const NtpClockState* state)
+{
+	m_clockState = state;
+}
+
+void
+NtpServer::SetAuthentication(const NtpAuth* auth)
+{
+	m_auth = auth;
+}
+
+uint16_t
+NtpServer::GetPort(void) const
+{
+	return m_port;
+}
+
+NtpServer::Statistics
+NtpServer::GetStatistics(void) const
+{
+	Statistics statistics = { 0, 0, 0, 0 };
+	for (size_t ii = 0; ii < m_workers.size(); ii++)
+	{
+		statistics.requests += m_workers[ii]->requests.load(std::memory_order_relaxed);
+		statistics.responses += m_workers[ii]->responses.load(std::memory_order_relaxed);
+		statistics.dropped += m_workers[ii]->dropped.load(std::memory_order_relaxed);
+		statistics.cryptoNaks += m_workers[ii]->cryptoNaks.load(std::memory_order_relaxed);
+	}
+	return statistics;
+}
+
+bool
+NtpServer::Open(uint16_t port, int workers, const char* address)
+{
+	Stop();
+
+	int cores = (int)std::thread::hardware_concurrency();
+	if (cores <= 0)
+		cores = 1;
+	if (workers <= 0)
+		workers = cores;
+
+	struct sockaddr_storage local;
+	socklen_t localLen;
+	memset(&local, 0, sizeof(local));
+	struct sockaddr_in* local4 = (struct sockaddr_in*)&local;
+	struct sockaddr_in6* local6 = (struct sockaddr_in6*)&local;
+	if (address != nullptr && inet_pton(AF_INET6, address, &local6->sin6_addr) == 1)
+	{
+		local6->sin6_family = AF_INET6;
+		local6->sin6_port = htons(port);
+		localLen = sizeof(*local6);
+	}
+	else
+	{
+		local4->sin_family = AF_INET;
+		local4->sin_port = htons(port);
+		local4->sin_addr.s_addr = htonl(INADDR_ANY);
+		if (address != nullptr && inet_pton(AF_INET, address, &local4->sin_addr) != 1)
+		{
+			fprintf(stderr, "%s: not an IPv4/IPv6 address\n", address);
+			return false;
+		}
+		localLen = sizeof(*local4);
+	}
+
+	for (int ii = 0; ii < workers; ii++)
+	{
+		int fd = socket(local.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+		if (fd < 0)
+		{
+			perror("socket");
+			Stop();
+			return false;
+		}
+
+		// All the workers share the port, the kernel spreads the clients (by address hash)
+		int enable = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+		int size = NTP_SERVER_SOCKET_BUFFER;
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+		struct timeval timeout = { 0, NTP_SERVER_RECEIVE_TIMEOUT_MS * 1000 };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		NtpEnableRxTimestamps(fd);
+
+		std::unique_ptr<Worker> worker(new Worker());
+		worker->fd = fd;
+		worker->core = ii % cores;
+		worker->requests = 0;
+		worker->responses = 0;
+		worker->dropped = 0;
+		worker->cryptoNaks = 0;
+		m_workers.push_back(std::move(worker));
+
+		if (bind(fd, (struct sockaddr*)&local, localLen) < 0)
+		{
+			perror("bind");
+			Stop();
+			return false;
+		}
+
+		// With port 0, the other workers bind to the port the first one got
+		if (ii == 0)
+		{
+			getsockname(fd, (struct sockaddr*)&local, &localLen);
+			m_port = ntohs(local.ss_family == AF_INET6 ? local6->sin6_port : local4->sin_port);
+		}
+	}
+	return true;
+}
+
+bool
+NtpServer::Start(void)
+{
+	if (m_workers.empty())
+		return false;
+
+	m_stop = false;
+	for (size_t ii = 0; ii < m_workers.size(); ii++)
+	{
+		Worker* worker = m_workers[ii].get();
+		worker->auth.reset();
+		if (m_auth != nullptr)
+		{
+			// The MAC contexts are reset per packet: one copy of the keys per worker
+			worker->auth.reset(new NtpAuth());
+			worker->auth->CopyKeys(*m_auth);
+		}
+		worker->thread = std::thread([this, worker] { Run(*worker); });
+
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(worker->core, &cpus);
+		pthread_setaffinity_np(worker->thread.native_handle(), sizeof(cpus), &cpus);
+	}
+	return true;
+}
+
+void
+NtpServer::Stop(void)
+{
+	m_stop = true;
+	for (size_t ii = 0; ii < m_workers.size(); ii++)
+	{
+		if (m_workers[ii]->thread.joinable())
+			m_workers[ii]->thread.join();
+		close(m_workers[ii]->fd);
+	}
+	m_workers.clear();
+}
+
+bool
+NtpServer::Respond(char* buffer, int length, int64_t receiveTimeNs, const NtpClockState::Snapshot& snapshot) const
+{
+	if (length < NTP_MSG_SIZE)
+		return false;
+
+	NtpPacketView packet((unsigned char*)buffer);
+	unsigned char version = packet.VersionNumber();
+	if (packet.Mode() != 3 || version < 1 || version > 4)
+		return false;
+
+	// The transmit timestamp of the client is echoed as the originate timestamp
+	uint64_t originate = packet.TransmitTimestamp();
+	bool synchronised = (m_clockState == nullptr) || (snapshot.updates > 0);
+
+	packet.SetHeader(synchronised ? 0 : 3, version, 4);
+	packet.SetStratum(synchronised ? m_stratum : 16);
+	packet.SetPollInterval(packet.PollInterval()); // echo the poll of the client
+	packet.SetPrecision((unsigned char)m_precision);
+	packet.SetRootDelay(0);
+	// Root dispersion: the error bound of the served time (NTP short format, 16.16)
+	packet.SetRootDispersion((uint32_t)(((uint64_t)snapshot.errorBoundNs << 16) / 1000000000ULL));
+	packet.SetReferenceIdentifier(m_referenceId);
+	packet.SetReferenceTimestamp(snapshot.updates > 0 ? NtpTimestampFromNs(NtpClockState::Correct(snapshot, snapshot.updateTimeNs)) : 0);
+	packet.SetOriginateTimestamp(originate);
+	packet.SetReceiveTimestamp(NtpTimestampFromNs(NtpClockState::Correct(snapshot, receiveTimeNs)));
+	return true;
+}
+
+void
+NtpServer::Run(Worker& worker)
+{
+	// Preallocated for one batch; the responses are written over the requests
+	char buffers[BatchSize][NTP_SERVER_MAX_MESSAGE_SIZE];
+	char control[BatchSize][NTP_TIMESTAMP_CONTROL_SIZE];
+	struct sockaddr_storage addrs[BatchSize];
+	struct iovec recvIovs[BatchSize];
+	struct mmsghdr recvHdrs[BatchSize];
+	struct iovec sendIovs[BatchSize];
+	struct mmsghdr sendHdrs[BatchSize];
+	// The MAC of each request, and the key each response is signed with (0 for none)
+	const unsigned char* packets[BatchSize];
+	int lengths[BatchSize];
+	NtpAuth::Result results[BatchSize];
+	uint32_t keyIds[BatchSize];
+	NtpAuth* auth = worker.auth.get();
+
+	memset(recvHdrs, 0, sizeof(recvHdrs));
+	memset(sendHdrs, 0, sizeof(sendHdrs));
+	for (int ii = 0; ii < BatchSize; ii++)
+	{
+		recvIovs[ii].iov_base = buffers[ii];
+		recvIovs[ii].iov_len = NTP_SERVER_MAX_MESSAGE_SIZE;
+		recvHdrs[ii].msg_hdr.msg_iov = &recvIovs[ii];
+		recvHdrs[ii].msg_hdr.msg_iovlen = 1;
+	}
+
+	NtpClockState::Snapshot unsynchronised;
+	memset(&unsynchronised, 0, sizeof(unsynchronised));
+
+	while (!m_stop.load(std::memory_order_relaxed))
+	{
+		for (int ii = 0; ii < BatchSize; ii++)
+		{
+			recvHdrs[ii].msg_hdr.msg_name = &addrs[ii];
+			recvHdrs[ii].msg_hdr.msg_namelen = sizeof(addrs[ii]);
+			recvHdrs[ii].msg_hdr.msg_control = control[ii];
+			recvHdrs[ii].msg_hdr.msg_controllen = sizeof(control[ii]);
+		}
+
+		// Blocks for the first datagram only, then takes what is already queued
+		int received = recvmmsg(worker.fd, recvHdrs, BatchSize, MSG_WAITFORONE, nullptr);
+		if (received <= 0)
+		{
+			if (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			{
+				perror("recvmmsg");
+				break;
+			}
+			continue;
+		}
+
+		// One read of the clock state per batch
+		NtpClockState::Snapshot snapshot = (m_clockState != nullptr) ? m_clockState->Read() : unsynchronised;
+
+		// The MACs of the batch are checked in one pass, before the requests are overwritten
+		if (auth != nullptr)
+		{
+			for (int ii = 0; ii < received; ii++)
+			{
+				packets[ii] = (const unsigned char*)buffers[ii];
+				lengths[ii] = (int)recvHdrs[ii].msg_len;
+			}
+			auth->VerifyBatch(packets, lengths, received, results);
+		}
+
+		int responses = 0;
+		struct timespec ts;
+		for (int ii = 0; ii < received; ii++)
+		{
+			if (!NtpReadRxTimestamp(&recvHdrs[ii].msg_hdr, &ts))
+				clock_gettime(CLOCK_REALTIME, &ts);
+			int64_t receiveTimeNs = ((int64_t)ts.tv_sec * 1000000000LL) + ts.tv_nsec;
+
+			if (!Respond(buffers[ii], (int)recvHdrs[ii].msg_len, receiveTimeNs, snapshot))
+				continue;
+
+			// A signed request gets a reply signed with its key (once T3 is written), or a
+			// crypto-NAK if it could not be authenticated
+			int length = NTP_MSG_SIZE;
+			keyIds[responses] = 0;
+			if (auth != nullptr && results[ii] == NtpAuth::Authentic)
+			{
+				keyIds[responses] = NtpAuth::GetKeyId((const unsigned char*)buffers[ii], lengths[ii]);
+				length = NTP_AUTH_MSG_SIZE;
+			}
+			else if (auth != nullptr && (results[ii] == NtpAuth::UnknownKey || results[ii] == NtpAuth::BadMac))
+			{
+				length = NtpAuth::SetCryptoNak((unsigned char*)buffers[ii]);
+				worker.cryptoNaks.fetch_add(1, std::memory_order_relaxed);
+			}
+
+			sendIovs[responses].iov_base = buffers[ii];
+			sendIovs[responses].iov_len = length;
+			sendHdrs[responses].msg_hdr.msg_name = &addrs[ii];
+			sendHdrs[responses].msg_hdr.msg_namelen = recvHdrs[ii].msg_hdr.msg_namelen;
+			sendHdrs[responses].msg_hdr.msg_iov = &sendIovs[responses];
+			sendHdrs[responses].msg_hdr.msg_iovlen = 1;
+			responses++;
+		}
+		worker.requests.fetch_add(received, std::memory_order_relaxed);
+		worker.dropped.fetch_add(received - responses, std::memory_order_relaxed);
+		if (responses == 0)
+			continue;
+
+		// T3: one timestamp for the batch, right before the transmission
+		clock_gettime(CLOCK_REALTIME, &ts);
+		uint64_t transmit = NtpTimestampFromNs(NtpClockState::Correct(snapshot, ((int64_t)ts.tv_sec * 1000000000LL) + ts.tv_nsec));
+		for (int ii = 0; ii < responses; ii++)
+		{
+			NtpPacketView((unsigned char*)sendIovs[ii].iov_base).SetTransmitTimestamp(transmit);
+			if (keyIds[ii] != 0)
+				auth->Sign((unsigned char*)sendIovs[ii].iov_base, keyIds[ii]);
+		}
+
+		int sent = 0;
+		while (sent < responses)
+		{
+			int ret = sendmmsg(worker.fd, sendHdrs + sent, responses - sent, 0);
+			if (ret < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				break; // e.g. the send buffer is full: the rest of the batch is dropped
+			}
+			sent += ret;
+		}
+		worker.responses.fetch_add(sent, std::memory_order_relaxed);
+		worker.dropped.fetch_add(responses - sent, std::memory_order_relaxed);
+	}
+}
+
+#endif  /* _WIN32 */
@@ -0,0 +1,137 @@
+/**
+ *  This class answers SNTP requests (mode 3) with server responses (mode 4), so that the
+ *  host can be the local time source of other machines.
+ *
+ *  One worker thread per core owns its own socket, bound to the same port with
+ *  SO_REUSEPORT, so that the kernel spreads the clients over the workers without any
+ *  lock or shared queue. Each worker receives up to 64 requests with one recvmmsg(),
+ *  builds the responses in place and sends them back with one sendmmsg(). The receive
+ *  timestamp (T2) of each request is the kernel timestamp (SO_TIMESTAMPNS); the transmit
+ *  timestamp (T3) is taken once per batch, right before sendmmsg().
+ *
+ *  The time served is the system clock corrected by a NtpClockState, if one is set
+ *  (e.g. kept by an NtpSyncEngine), otherwise the system clock as is.
+ *
+ *  With symmetric keys (see SetAuthentication), the MACs of a batch of requests are checked
+ *  in one pass (NtpAuth::VerifyBatch), and the replies are signed after T3 is written.
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#ifndef NTPSERVER_H
+#define NTPSERVER_H
+
+#ifndef _WIN32
+
+#include "NtpClient.h"
+#include "NtpClock.h"
+#include "NtpAuth.h"
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+class NtpServer
+{
+public:
+	enum { BatchSize = 64 };
+
+	struct Statistics
+	{
+		uint64_t requests;      /**< Datagrams received. */
+		uint64_t responses;     /**< Responses sent. */
+		uint64_t dropped;       /**< Datagrams ignored (too short, not a client request). */
+		uint64_t cryptoNaks;    /**< Signed requests that could not be authenticated (answered with a crypto-NAK). */
+	};
+
+	NtpServer();
+	~NtpServer();
+
+	/**
+	 * This function sets the fields that describe the clock of the server in the responses.
+	 *
+	 * \param stratum the stratum of the server (e.g. 1 for a reference clock, 16 for unsynchronised)
+	 * \param referenceId the reference identifier (e.g. 'GPS\0', or the address of the upstream server)
+	 * \param precision the precision of the clock (log2 s)
+	 */
+	void SetReference(unsigned char stratum, uint32_t referenceId, signed char precision);
+	/**
+	 * This function sets the state the served time is corrected with (nullptr: the system clock).
+	 * The root dispersion of the responses is then the error bound of the state.
+	 *
+	 * \param state the clock state (e.g. NtpClockState::Global())
+	 */
+	void SetClockState(const NtpClockState* state);
+	/**
+	 * This function sets the symmetric keys of the server: a signed request is answered
+	 * with a reply signed with its key, and one that cannot be authenticated (unknown key,
+	 * bad MAC) with a crypto-NAK. Unsigned requests are answered as usual.
+	 * Each worker copies the keys (with its own MAC contexts) when it is started.
+	 *
+	 * \param auth the keys (nullptr for none, the default); call it before Start()
+	 */
+	void SetAuthentication(const NtpAuth* auth);
+	/**
+	 * This function creates the sockets (one per worker) and binds them.
+	 *
+	 * \param port the UDP port (123 needs privileges)
+	 * \param workers the number of worker threads (0 for one per core)
+	 * \param address the local IPv4/IPv6 address to bind to (nullptr for all IPv4 addresses)
+	 *
+	 * Returns true upon success, false otherwise
+	 */
+	bool Open(uint16_t port = NTP_PORT, int workers = 0, const char* address = nullptr);
+	/**
+	 * This function starts the worker threads, each pinned to one core.
+	 *
+	 * Returns true upon success
+	 */
+	bool Start(void);
+	/**
+	 * This function stops the workers and closes the sockets.
+	 */
+	void Stop(void);
+	/**
+	 * This function returns the port the server is bound to (useful with port 0).
+	 */
+	uint16_t GetPort(void) const;
+	/**
+	 * This function returns the counters, summed over the workers.
+	 */
+	Statistics GetStatistics(void) const;
+
+private:
+	NtpServer(const NtpServer&);
+	NtpServer& operator=(const NtpServer&);
+
+	struct Worker
+	{
+		int fd;
+		int core;
+		std::thread thread;
+		std::atomic<uint64_t> requests;
+		std::atomic<uint64_t> responses;
+		std::atomic<uint64_t> dropped;
+		std::atomic<uint64_t> cryptoNaks;
+		std::unique_ptr<NtpAuth> auth;   // the keys of the server, with the contexts of this worker (nullptr if none)
+	};
+
+	// The loop of a worker thread
+	void Run(Worker& worker);
+	// Turns the request in buffer into the response, but the transmit timestamp; false if it is not a client request
+	bool Respond(char* buffer, int length, int64_t receiveTimeNs, const NtpClockState::Snapshot& snapshot) const;
+
+	std::vector<std::unique_ptr<Worker> > m_workers;
+	const NtpClockState* m_clockState;
+	const NtpAuth* m_auth;
+	std::atomic<bool> m_stop;
+	uint16_t m_port;
+	unsigned char m_stratum;
+	uint32_t m_referenceId;
+	signed char m_precision;
+};
+
+#endif  /* _WIN32 */
+
+#endif  /* NTPSERVER_H */
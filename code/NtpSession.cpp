@@ -0,0 +1,348 @@
+#ifdef _MSC_VER
+#pragma warning(disable:4996)
+#endif
+/**
+ *  This class keeps the state needed to query an NTP server open between requests.
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#ifdef _WIN32
+#ifndef UNICODE
+#define UNICODE
+#endif
+
+#define _WINSOCK_DEPRECATED_NO_WARNINGS
+
+#define WIN32_LEAN_AND_MEAN
+
+#include <Ws2tcpip.h>
+
+// Link with ws2_32.lib
+#pragma comment(lib, "Ws2_32.lib")
+#endif
+
+/******************************************************************************
+* Project Headers
+*****************************************************************************/
+#include "NtpSession.h"
+#include "NtpResolver.h"
+#include "NtpInstrumentation.h"
+#include "NtpAuth.h"
+#ifndef _WIN32
+#include "NtpTimestamping.h"
+#endif
+
+/******************************************************************************
+* System Headers
+*****************************************************************************/
+#include <stdio.h>
+#include <errno.h>
+#include <cstring>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <wchar.h>
+#else
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#endif
+
+/******************************************************************************
+* Class Member Function Definitions
+*****************************************************************************/
+
+NtpSession::NtpSession(NtpClient& client)
+	: m_client(client),
+#ifdef _WIN32
+	  m_socket(INVALID_SOCKET),
+	  m_wsaStarted(false),
+#else
+	  m_socket(-1),
+	  m_kernelTimestamps(false),
+#endif
+	  m_timeoutMs(0)
+{
+	memset(&m_address, 0, sizeof(m_address));
+	m_address.ss_family = AF_UNSPEC;
+}
+
+NtpSession::~NtpSession()
+{
+	Close();
+}
+
+bool
+NtpSession::IsOpen(void) const
+{
+#ifdef _WIN32
+	return (m_socket != INVALID_SOCKET);
+#else
+	return (m_socket >= 0);
+#endif
+}
+
+bool
+NtpSession::Open(const char* host, int timeoutMs)
+{
+	Close();
+	m_timeoutMs = timeoutMs;
+	m_host = host;
+
+#ifdef _WIN32
+	//----------------------
+	// Initialize Winsock
+	WSADATA wsaData;
+	int iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
+	if (iResult != NO_ERROR) {
+		wprintf(L"WSAStartup failed with error: %d\n", iResult);
+		return false;
+	}
+	m_wsaStarted = true;
+#endif
+
+	//---------------------------------------------
+	// Cached, so the periodic sessions do not query the DNS on each Open()
+	// The family that answered first when the server was raced (see NtpClient::ConnectAsync), if known
+	struct sockaddr_storage RecvAddr;
+	socklen_t RecvAddrLen;
+	if (!m_client.dns_lookup(host, &RecvAddr, &RecvAddrLen))
+	{
+		fprintf(stderr, "%s: host name lookup failure\n", host);
+		Close();
+		return false;
+	}
+
+	//---------------------------------------------
+	// Create a socket for sending data
+#ifdef _WIN32
+	m_socket = socket(RecvAddr.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+	if (m_socket == INVALID_SOCKET) {
+		wprintf(L"socket failed with error: %ld\n", WSAGetLastError());
+		Close();
+		return false;
+	}
+
+	// Do not wait forever if the request or the response is lost
+	DWORD recvTimeout = m_timeoutMs;
+	setsockopt(m_socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&recvTimeout, sizeof(recvTimeout));
+#else
+	m_socket = socket(RecvAddr.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+	if (m_socket < 0) {
+		perror("socket");
+		return false;
+	}
+
+	m_kernelTimestamps = m_client.m_kernelTimestamps;
+	if (m_kernelTimestamps)
+	{
+		NtpEnableRxTimestamps(m_socket);
+		NtpEnableTxTimestamps(m_socket);
+	}
+#endif
+
+	// The server address is fixed for the lifetime of the session
+	if (connect(m_socket, (struct sockaddr*) & RecvAddr, RecvAddrLen) < 0)
+	{
+		perror(host);
+		Close();
+		return false;
+	}
+	m_address = RecvAddr;
+	return true;
+}
+
+void
+NtpSession::Close(void)
+{
+#ifdef _WIN32
+	if (m_socket != INVALID_SOCKET)
+	{
+		closesocket(m_socket);
+		m_socket = INVALID_SOCKET;
+	}
+	if (m_wsaStarted)
+	{
+		WSACleanup();
+		m_wsaStarted = false;
+	}
+#else
+	if (m_socket >= 0)
+	{
+		close(m_socket);
+		m_socket = -1;
+	}
+#endif
+}
+
+bool
+NtpSession::Query(NtpClient::Sample* sample)
+{
+	if (!IsOpen())
+		return false;
+
+#ifdef _WIN32
+	char bufferRx[NTP_AUTH_MSG_SIZE] = { 0 };
+
+	// Drop the late responses to earlier (timed out) requests
+	fd_set readSet;
+	struct timeval zero = { 0, 0 };
+	for (;;)
+	{
+		FD_ZERO(&readSet);
+		FD_SET(m_socket, &readSet);
+		if (select(0, &readSet, nullptr, nullptr, &zero) <= 0 || recv(m_socket, bufferRx, sizeof(bufferRx), 0) == SOCKET_ERROR)
+			break;
+	}
+
+	//---------------------------------------------------------------------
+	// Create the NTP tx timestamp and fill the fields in the msg to be tx
+	char SendBuf[NTP_AUTH_MSG_SIZE] = { 0 };
+	m_client.CreateMessage(SendBuf);
+
+	NtpInstrumentation* instrumentation = m_client.m_instrumentation;
+	int length = m_client.SignMessage(SendBuf);
+	int iResult = (length < 0) ? SOCKET_ERROR : send(m_socket, SendBuf, length, 0);
+	if (iResult == SOCKET_ERROR) {
+		if (instrumentation != nullptr)
+			instrumentation->RequestFailed(m_host.c_str(), (length < 0) ? EINVAL : WSAGetLastError());
+		return false;
+	}
+	if (instrumentation != nullptr)
+		instrumentation->RequestSent(m_host.c_str());
+
+	iResult = recv(m_socket, bufferRx, sizeof(bufferRx), 0);
+	if (iResult == SOCKET_ERROR || iResult < NTP_MSG_SIZE) {
+		if (instrumentation != nullptr)
+		{
+			if (iResult == SOCKET_ERROR && WSAGetLastError() == WSAETIMEDOUT)
+				instrumentation->RequestTimedOut(m_host.c_str());
+			else
+				instrumentation->RequestFailed(m_host.c_str(), (iResult == SOCKET_ERROR) ? WSAGetLastError() : 0);
+		}
+		return false;
+	}
+
+	m_client.m_server = m_host;
+	m_client.m_serverAddress = m_address;
+	return m_client.AuthenticReply(bufferRx, iResult) && m_client.ReceivedMessage(bufferRx, sample);
+#else
+	char bufferRx[NTP_AUTH_MSG_SIZE];
+	struct timespec ts;
+	uint32_t id;
+
+	// Drop the late responses (and transmit timestamps) of earlier (timed out) requests
+	while (recv(m_socket, bufferRx, sizeof(bufferRx), MSG_DONTWAIT) >= 0)
+		;
+	while (m_kernelTimestamps && NtpReadTxTimestamp(m_socket, &ts, &id) >= 0)
+		;
+
+	//---------------------------------------------------------------------
+	// The NTP tx timestamp is written right before the transmission (but in a signed
+	// request, whose MAC covers the header: T1 is only kept)
+	char SendBuf[NTP_AUTH_MSG_SIZE];
+	struct timespec transmitTime;
+	bool kernelTransmitTimestamp = false;
+	memcpy(SendBuf, m_client.m_requestTemplate, NTP_MSG_SIZE);
+	m_client.SetCookie(SendBuf);
+	uint64_t cookie = m_client.m_transmitCookie;
+	int length = m_client.SignMessage(SendBuf);
+	if (m_client.m_auth == nullptr)
+		NtpStampMessage(SendBuf, NTP_MSG_OFFSET_ORIGINATE_TIMESTAMP, &transmitTime);
+	else
+		clock_gettime(CLOCK_REALTIME, &transmitTime);
+	NtpInstrumentation* instrumentation = m_client.m_instrumentation;
+	if (length < 0 || send(m_socket, SendBuf, length, MSG_NOSIGNAL) != length)
+	{
+		if (instrumentation != nullptr)
+			instrumentation->RequestFailed(m_host.c_str(), (length < 0) ? EINVAL : errno);
+		return false;
+	}
+	if (instrumentation != nullptr)
+		instrumentation->RequestSent(m_host.c_str());
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	int64_t deadline = ((int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000) + m_timeoutMs;
+
+	char control[NTP_TIMESTAMP_CONTROL_SIZE];
+	struct iovec iov = { bufferRx, sizeof(bufferRx) };
+	struct msghdr msg;
+	ssize_t received = -1;
+	while (received < NTP_MSG_SIZE)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		int64_t remaining = deadline - (((int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000));
+		if (remaining <= 0)
+		{
+			if (instrumentation != nullptr)
+				instrumentation->RequestTimedOut(m_host.c_str());
+			return false;
+		}
+
+		struct pollfd pfd = { m_socket, POLLIN, 0 };
+		int ret = poll(&pfd, 1, (int)remaining);
+		if (ret < 0 && errno != EINTR)
+		{
+			if (instrumentation != nullptr)
+				instrumentation->RequestFailed(m_host.c_str(), errno);
+			return false;
+		}
+		if (ret <= 0)
+			continue;
+
+		if ((pfd.revents & POLLERR) && m_kernelTimestamps)
+		{
+			int stamped;
+			while ((stamped = NtpReadTxTimestamp(m_socket, &ts, &id)) >= 0)
+			{
+				if (stamped == 1)
+				{
+					transmitTime = ts;
+					kernelTransmitTimestamp = true;
+				}
+			}
+		}
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		received = recvmsg(m_socket, &msg, MSG_DONTWAIT);
+		if (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			if (instrumentation != nullptr)
+				instrumentation->RequestFailed(m_host.c_str(), errno);
+			return false;
+		}
+		// Not the response to this request (e.g. a late one, or duplicated): keep waiting
+		if (received >= NTP_MSG_SIZE && NtpConstPacketView((const unsigned char*)bufferRx).OriginateTimestamp() != cookie)
+			received = -1;
+	}
+
+	struct timespec receiveTime;
+	bool kernelTimestamp = m_kernelTimestamps && NtpReadRxTimestamp(&msg, &receiveTime);
+	if (!kernelTimestamp)
+		clock_gettime(CLOCK_REALTIME, &receiveTime);
+
+	// The response may be processed before the transmit timestamp was read
+	int stamped;
+	while (m_kernelTimestamps && !kernelTransmitTimestamp && (stamped = NtpReadTxTimestamp(m_socket, &ts, &id)) >= 0)
+	{
+		if (stamped == 1)
+		{
+			transmitTime = ts;
+			kernelTransmitTimestamp = true;
+		}
+	}
+
+	m_client.m_originateTimestamp = NtpTimestampFromTimespec(&transmitTime);
+	m_client.m_originateTimestampSource = kernelTransmitTimestamp ? NtpClient::KernelTimestamp : NtpClient::UserSpaceTimestamp;
+	m_client.m_server = m_host;
+	m_client.m_serverAddress = m_address;
+	return m_client.AuthenticReply(bufferRx, (int)received) &&
+		m_client.ReceivedMessage(bufferRx, sample, NtpTimestampFromTimespec(&receiveTime), kernelTimestamp ? NtpClient::KernelTimestamp : NtpClient::UserSpaceTimestamp);
+#endif
+}
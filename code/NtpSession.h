@@ -0,0 +1,69 @@
+/**
+ *  This class keeps the state needed to query an NTP server open between requests:
+ *  Winsock is initialised, the server name is resolved and the UDP socket is created and
+ *  connected once, in Open(). Each Query() then only sends the request and waits (with a
+ *  timeout) for the response, which is processed by the NtpClient the session belongs to.
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#ifndef NTPSESSION_H
+#define NTPSESSION_H
+
+#include "NtpClient.h"
+
+#include <string>
+
+class NtpSession
+{
+public:
+	/**
+	 * \param client the client that processes the responses (and keeps the clock offset)
+	 */
+	explicit NtpSession(NtpClient& client);
+	~NtpSession();
+
+	/**
+	 * This function resolves the server and creates/connects the socket.
+	 *
+	 * \param host the hostname or IP address of the NTP server
+	 * \param timeoutMs the time (in ms) each Query() waits for the response
+	 *
+	 * Returns true upon success, false otherwise
+	 */
+	bool Open(const char* host, int timeoutMs = 2000);
+	/**
+	 * This function closes the socket (and releases Winsock).
+	 */
+	void Close(void);
+	/**
+	 * This function returns true if the session is open.
+	 */
+	bool IsOpen(void) const;
+	/**
+	 * This function sends one request to the server and waits for the response.
+	 *
+	 * \param sample the structure where the results are stored (optional)
+	 *
+	 * Returns true upon success, false upon timeout or error
+	 */
+	bool Query(NtpClient::Sample* sample = nullptr);
+
+private:
+	NtpSession(const NtpSession&);
+	NtpSession& operator=(const NtpSession&);
+
+	NtpClient& m_client;
+#ifdef _WIN32
+	SOCKET m_socket;
+	bool m_wsaStarted;
+#else
+	int m_socket;
+	bool m_kernelTimestamps;
+#endif
+	std::string m_host;      // the server, as reported to the instrumentation of the client
+	struct sockaddr_storage m_address; // and its address
+	int m_timeoutMs;
+};
+
+#endif  /* NTPSESSION_H */
@@ -0,0 +1,242 @@
+/**
+ *  This class is a deterministic discrete-event simulator of the network between an SNTP
+ *  client and its servers (see NtpSimulator.h).
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+/******************************************************************************
+* Project Headers
+*****************************************************************************/
+#include "NtpSimulator.h"
+#include "NtpClient.h"
+#include "NtpPacket.h"
+
+/******************************************************************************
+* System Headers
+*****************************************************************************/
+#include <errno.h>
+#include <string.h>
+#include <memory>
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+#define NTP_SIMULATOR_REFERENCE_ID (0x53494D00)   // "SIM"
+#define NTP_SIMULATOR_PRECISION (-20)              // about 1 us
+#define NTP_SIMULATOR_REFERENCE_AGE_NS (16000000000LL) // the servers were updated 16 s before each request
+
+/******************************************************************************
+* Static Function Definitions
+*****************************************************************************/
+
+// The 64-bit NTP timestamp of a UNIX time in ns
+static uint64_t
+NtpTimestampOfNs(int64_t ns)
+{
+	uint64_t seconds = (uint64_t)(ns / 1000000000LL) + 2208988800ULL; // Seconds from 1/1/1900 00.00 to 1/1/1970 00.00
+	uint64_t fraction = ((uint64_t)(ns % 1000000000LL) << 32) / 1000000000ULL;
+	return ((seconds & 0xFFFFFFFF) << 32) | fraction;
+}
+
+/******************************************************************************
+* Class Member Function Definitions
+*****************************************************************************/
+
+NtpSimulator::Clock::Clock(NtpSimulator& simulator, int64_t offsetNs, double drift)
+	: m_simulator(simulator),
+	  m_offsetNs(offsetNs),
+	  m_referenceNs(simulator.Now()),
+	  m_drift(drift)
+{
+}
+
+int64_t
+NtpSimulator::Clock::Now(void)
+{
+	return m_simulator.Now() + GetOffsetNs();
+}
+
+int64_t
+NtpSimulator::Clock::GetOffsetNs(void) const
+{
+	return m_offsetNs + (int64_t)(m_drift * (double)(m_simulator.Now() - m_referenceNs));
+}
+
+void
+NtpSimulator::Clock::Step(int64_t stepNs)
+{
+	m_offsetNs += stepNs;
+}
+
+void
+NtpSimulator::Clock::SetDrift(double drift)
+{
+	m_offsetNs = GetOffsetNs();
+	m_referenceNs = m_simulator.Now();
+	m_drift = drift;
+}
+
+NtpSimulator::NtpSimulator(uint64_t seed, int64_t startNs)
+	: m_nowNs(startNs),
+	  m_order(0),
+	  m_eventsRun(0),
+	  m_random(seed)
+{
+}
+
+void
+NtpSimulator::AddServer(const char* host, const Path& path, int64_t offsetNs, unsigned char stratum)
+{
+	Server& server = m_servers[host];
+	server.path = path;
+	server.offsetNs = offsetNs;
+	server.stratum = stratum;
+}
+
+void
+NtpSimulator::SetPath(const char* host, const Path& path)
+{
+	std::unordered_map<std::string, Server>::iterator it = m_servers.find(host);
+	if (it != m_servers.end())
+		it->second.path = path;
+}
+
+void
+NtpSimulator::SetServerOffset(const char* host, int64_t offsetNs)
+{
+	std::unordered_map<std::string, Server>::iterator it = m_servers.find(host);
+	if (it != m_servers.end())
+		it->second.offsetNs = offsetNs;
+}
+
+int64_t
+NtpSimulator::Now(void) const
+{
+	return m_nowNs;
+}
+
+void
+NtpSimulator::Schedule(int64_t timeNs, std::function<void()> event)
+{
+	Event _event;
+	_event.timeNs = (timeNs > m_nowNs) ? timeNs : m_nowNs;
+	_event.order = m_order++;
+	_event.run = std::move(event);
+	m_events.push(std::move(_event));
+}
+
+bool
+NtpSimulator::RunNext(void)
+{
+	if (m_events.empty())
+		return false;
+
+	// The event may schedule others, so it is taken off the queue first
+	Event _event = m_events.top();
+	m_events.pop();
+	m_nowNs = _event.timeNs;
+	m_eventsRun++;
+	_event.run();
+	return true;
+}
+
+void
+NtpSimulator::RunUntil(int64_t timeNs)
+{
+	while (!m_events.empty() && m_events.top().timeNs <= timeNs)
+		RunNext();
+	if (timeNs > m_nowNs)
+		m_nowNs = timeNs;
+}
+
+uint64_t
+NtpSimulator::GetEvents(void) const
+{
+	return m_eventsRun;
+}
+
+int64_t
+NtpSimulator::Delay(const Path& path, bool back)
+{
+	int64_t delay = path.delayNs + (back ? path.asymmetryNs : 0);
+	if (path.jitterNs > 0)
+		delay += (int64_t)(std::exponential_distribution<double>(1.0)(m_random) * (double)path.jitterNs);
+	return (delay > 0) ? delay : 0;
+}
+
+bool
+NtpSimulator::Lost(const Path& path)
+{
+	return (path.loss > 0.0) && (std::uniform_real_distribution<double>(0.0, 1.0)(m_random) < path.loss);
+}
+
+int
+NtpSimulator::Exchange(const char* host, const char* request, int length, char* response, int timeoutMs)
+{
+	std::unordered_map<std::string, Server>::iterator it = m_servers.find(host);
+	if (it == m_servers.end())
+	{
+		errno = EHOSTUNREACH;
+		return -1;
+	}
+	if (length < NTP_MSG_SIZE)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	// The packet of this exchange: the header of the request (a MAC is ignored), then the
+	// response once built by the server.
+	// A response that arrives after the timeout is dropped, as by the cookie check of the client.
+	struct Delivery
+	{
+		bool arrived;
+		unsigned char packet[NTP_MSG_SIZE];
+	};
+	std::shared_ptr<Delivery> delivery = std::make_shared<Delivery>();
+	delivery->arrived = false;
+	memcpy(delivery->packet, request, NTP_MSG_SIZE);
+	int64_t deadlineNs = m_nowNs + ((int64_t)timeoutMs * 1000000LL);
+
+	if (!Lost(it->second.path))
+	{
+		std::string name(host);
+		Schedule(m_nowNs + Delay(it->second.path, false), [this, delivery, name]()
+			{
+				// The server stamps the request with its own clock (T2) and answers after processing it (T3)
+				const Server& server = m_servers[name];
+				int64_t receiveNs = m_nowNs + server.offsetNs;
+				NtpPacketView packet(delivery->packet);
+				uint64_t originate = packet.TransmitTimestamp();
+				packet.SetHeader(0, packet.VersionNumber(), 4);
+				packet.SetStratum(server.stratum);
+				packet.SetPrecision((unsigned char)NTP_SIMULATOR_PRECISION);
+				packet.SetRootDelay(0);
+				packet.SetRootDispersion(0);
+				packet.SetReferenceIdentifier(NTP_SIMULATOR_REFERENCE_ID);
+				packet.SetReferenceTimestamp(NtpTimestampOfNs(receiveNs - NTP_SIMULATOR_REFERENCE_AGE_NS));
+				packet.SetOriginateTimestamp(originate);
+				packet.SetReceiveTimestamp(NtpTimestampOfNs(receiveNs));
+				packet.SetTransmitTimestamp(NtpTimestampOfNs(receiveNs + server.path.processingNs));
+
+				if (Lost(server.path))
+					return;
+				Schedule(m_nowNs + server.path.processingNs + Delay(server.path, true), [delivery]()
+					{
+						delivery->arrived = true;
+					});
+			});
+	}
+
+	while (!delivery->arrived && !m_events.empty() && m_events.top().timeNs <= deadlineNs)
+		RunNext();
+	if (!delivery->arrived)
+	{
+		RunUntil(deadlineNs);
+		return 0;
+	}
+
+	memcpy(response, delivery->packet, NTP_MSG_SIZE);
+	return NTP_MSG_SIZE;
+}
@@ -0,0 +1,181 @@
+/**
+ *  This class is a deterministic discrete-event simulator of the network between an SNTP
+ *  client and its servers, so that days of polling (and the convergence of the filter,
+ *  the selection and the discipline) run in a fraction of a second, against a known offset.
+ *
+ *  - The simulated (true) time only moves from one event to the next: the events (packets
+ *    reaching a server or the client) are kept in a priority queue, ordered by time.
+ *  - Each server has a path: a one-way delay, an asymmetry (extra delay of the way back),
+ *    an exponential queueing jitter per packet, a loss probability, and a processing time.
+ *    Its clock may have an offset, e.g. a falseticker.
+ *  - Clock is a simulated local clock (NtpTimeSource) with an offset and a frequency error
+ *    (drift), for the clients (see NtpClient::SetTimeSource).
+ *  - The simulator is an NtpChannel: NtpClient::Connect(simulator, ...) sends the request
+ *    at the current time, and the simulation runs until the response arrives or the
+ *    timeout expires.
+ *
+ *  The simulated servers hold no keys: they answer the header of a signed request (see
+ *  NtpAuth) without a MAC.
+ *
+ *  The randomness comes from one generator with a fixed seed, so a run can be repeated.
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#ifndef NTPSIMULATOR_H
+#define NTPSIMULATOR_H
+
+#include "NtpChannel.h"
+#include "NtpClock.h"
+
+#include <stdint.h>
+#include <functional>
+#include <queue>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+#define NTP_SIMULATOR_START_NS (1546300800000000000LL) // 1/1/2019 00.00, the default start of the simulated time
+
+class NtpSimulator : public NtpChannel
+{
+public:
+	// The network path between the client and a server
+	struct Path
+	{
+		int64_t delayNs;         /**< One-way delay (the way out), in ns. */
+		int64_t asymmetryNs;     /**< Extra delay of the way back (negative if the way out is slower), in ns. */
+		int64_t jitterNs;        /**< Mean of the exponential queueing delay added to each packet (each way), in ns. */
+		double loss;             /**< Probability that a packet is lost (each way). */
+		int64_t processingNs;    /**< Time the server holds the request (T3 - T2), in ns. */
+	};
+
+	// A simulated local clock: the simulated time plus an offset that grows with the drift
+	class Clock : public NtpTimeSource
+	{
+	public:
+		/**
+		 * \param simulator the simulator whose time the clock follows
+		 * \param offsetNs the offset of the clock (ahead if positive), in ns
+		 * \param drift the frequency error of the clock (s/s, e.g. 20e-6; runs fast if positive)
+		 */
+		Clock(NtpSimulator& simulator, int64_t offsetNs = 0, double drift = 0.0);
+
+		/**
+		 * This function returns the time of the clock (ns since the UNIX epoch).
+		 */
+		int64_t Now(void) override;
+		/**
+		 * This function returns the offset of the clock now (clock - simulated time, in ns),
+		 * i.e. minus the offset the client should measure.
+		 */
+		int64_t GetOffsetNs(void) const;
+		/**
+		 * This function steps the clock (e.g. an operator setting the time).
+		 */
+		void Step(int64_t stepNs);
+		/**
+		 * This function changes the frequency error from now on (e.g. a temperature change).
+		 */
+		void SetDrift(double drift);
+
+	private:
+		NtpSimulator& m_simulator;
+		int64_t m_offsetNs;      // offset at m_referenceNs
+		int64_t m_referenceNs;   // simulated time the offset was set
+		double m_drift;
+	};
+
+	/**
+	 * \param seed the seed of the random generator (the same seed gives the same run)
+	 * \param startNs the simulated time at the start (ns since the UNIX epoch)
+	 */
+	explicit NtpSimulator(uint64_t seed = 1, int64_t startNs = NTP_SIMULATOR_START_NS);
+
+	/**
+	 * This function adds a simulated server.
+	 *
+	 * \param host the name the clients query it with
+	 * \param path the path to the server
+	 * \param offsetNs the offset of the server clock (ahead if positive, 0 for a truechimer), in ns
+	 * \param stratum the stratum of the server
+	 */
+	void AddServer(const char* host, const Path& path, int64_t offsetNs = 0, unsigned char stratum = 1);
+	/**
+	 * This function changes the path to a server (e.g. a route change, congestion).
+	 */
+	void SetPath(const char* host, const Path& path);
+	/**
+	 * This function changes the offset of a server clock.
+	 */
+	void SetServerOffset(const char* host, int64_t offsetNs);
+
+	/**
+	 * This function returns the simulated (true) time (ns since the UNIX epoch).
+	 */
+	int64_t Now(void) const;
+	/**
+	 * This function schedules an event.
+	 *
+	 * \param timeNs the simulated time of the event (not before Now())
+	 * \param event the function called at that time
+	 */
+	void Schedule(int64_t timeNs, std::function<void()> event);
+	/**
+	 * This function runs the events up to timeNs (included), then sets the time to timeNs.
+	 */
+	void RunUntil(int64_t timeNs);
+	/**
+	 * This function returns the number of events run so far.
+	 */
+	uint64_t GetEvents(void) const;
+
+	/**
+	 * This function sends the request to the simulated server (at the current simulated time)
+	 * and runs the simulation until the response arrives, or until the timeout.
+	 */
+	int Exchange(const char* host, const char* request, int length, char* response, int timeoutMs) override;
+
+private:
+	NtpSimulator(const NtpSimulator&);
+	NtpSimulator& operator=(const NtpSimulator&);
+
+	struct Server
+	{
+		Path path;
+		int64_t offsetNs;
+		unsigned char stratum;
+	};
+
+	struct Event
+	{
+		int64_t timeNs;
+		uint64_t order;          // events at the same time run in the order they were scheduled
+		std::function<void()> run;
+
+		bool operator>(const Event& other) const
+		{
+			return (timeNs != other.timeNs) ? (timeNs > other.timeNs) : (order > other.order);
+		}
+	};
+
+	// Runs the next event; false if there is none
+	bool RunNext(void);
+	// The delay of one packet over the path (the way back if back is true)
+	int64_t Delay(const Path& path, bool back);
+	// True if a packet is lost
+	bool Lost(const Path& path);
+
+	std::unordered_map<std::string, Server> m_servers;
+	std::priority_queue<Event, std::vector<Event>, std::greater<Event> > m_events;
+	int64_t m_nowNs;
+	uint64_t m_order;
+	uint64_t m_eventsRun;
+	std::mt19937_64 m_random;
+};
+
+#endif  /* NTPSIMULATOR_H */
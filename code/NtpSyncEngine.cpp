@@ -0,0 +1,338 @@
+/**
+ *  This class keeps the clock synchronised in the background, with an adaptive poll
+ *  interval per server.
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+/******************************************************************************
+* Project Headers
+*****************************************************************************/
+#include "NtpSyncEngine.h"
+#include "NtpResolver.h"
+#ifndef _WIN32
+#include "NtpTransport.h"
+#endif
+
+/******************************************************************************
+* System Headers
+*****************************************************************************/
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <stdio.h>
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+#define NTP_SYNC_LIMIT (30)                 // bound of the agreement counter (LIMIT)
+#define NTP_SYNC_PGATE (4)                  // a sample agrees if within PGATE x jitter of the prediction
+#define NTP_SYNC_MIN_GATE_NS (250000LL)     // ... or within 250 us (jitter is tiny on a LAN)
+#define NTP_SYNC_POLL_SLICE_MS (100)        // longest wait in the transport, so that Stop() is not delayed
+
+/******************************************************************************
+* Class Member Function Definitions
+*****************************************************************************/
+
+NtpSyncEngine::NtpSyncEngine()
+	: m_minPoll(NTP_SYNC_MIN_POLL),
+	  m_maxPoll(NTP_SYNC_MAX_POLL),
+	  m_stop(false),
+	  m_running(false)
+{
+}
+
+NtpSyncEngine::~NtpSyncEngine()
+{
+	Stop();
+}
+
+int64_t
+NtpSyncEngine::NowMs(void)
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void
+NtpSyncEngine::AddServer(const char* host)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_select.AddServer(host);
+
+	PollState state;
+	state.poll = m_minPoll;
+	state.counter = 0;
+	state.nextPollMs = 0;
+	state.queries = 0;
+	state.responses = 0;
+	m_polls.push_back(state);
+	m_predictions.push_back(NtpFilter::Result());
+}
+
+void
+NtpSyncEngine::SetPollRange(int minPoll, int maxPoll)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_minPoll = minPoll;
+	m_maxPoll = std::max(minPoll, maxPoll);
+	for (size_t ii = 0; ii < m_polls.size(); ii++)
+		m_polls[ii].poll = std::min(std::max(m_polls[ii].poll, m_minPoll), m_maxPoll);
+}
+
+void
+NtpSyncEngine::SetClockState(NtpClockState* state)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_select.SetClockState(state);
+}
+
+bool
+NtpSyncEngine::Start(void)
+{
+	if (m_thread.joinable())
+		Stop(); // the thread of a previous Start() that failed
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_running || m_polls.empty())
+		return false;
+
+	m_stop = false;
+	m_running = true;
+	m_thread = std::thread(&NtpSyncEngine::Run, this);
+	return true;
+}
+
+void
+NtpSyncEngine::Stop(void)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_wakeup.notify_all();
+	if (m_thread.joinable())
+		m_thread.join();
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_running = false;
+}
+
+bool
+NtpSyncEngine::IsRunning(void) const
+{
+	return m_running;
+}
+
+NtpSelect::Result
+NtpSyncEngine::GetResult(void)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_select.GetResult();
+}
+
+NtpSyncEngine::PollState
+NtpSyncEngine::GetPollState(int index)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_polls[index];
+}
+
+void
+NtpSyncEngine::UpdatePoll(int index, bool responded, int64_t nowMs)
+{
+	PollState& state = m_polls[index];
+	NtpClient& client = *m_select.GetPeer(index).client;
+	int serverPoll = m_minPoll;
+
+	if (!responded)
+	{
+		// Back off from a server that does not respond
+		state.counter = 0;
+		state.poll = std::min(state.poll + 1, m_maxPoll);
+	}
+	else
+	{
+		state.responses++;
+		serverPoll = client.GetLastSample().pollInterval;
+
+		// Compare the new filter output to the one predicted before the query; the first samples only fill the filter
+		const NtpFilter::Result& before = m_predictions[index];
+		NtpFilter::Result after = client.GetFilterResult();
+		if (before.valid && after.count > NTP_FILTER_STAGES / 2)
+		{
+			// The offset drifts with the frequency error of the local clock
+			int64_t predicted = before.offsetNs + (int64_t)(m_select.GetFrequency() * (double)(after.timeNs - before.timeNs));
+			int64_t residual = after.offsetNs - predicted;
+			if (residual < 0)
+				residual = -residual;
+			int64_t gate = std::max((int64_t)NTP_SYNC_PGATE * before.jitterNs, (int64_t)NTP_SYNC_MIN_GATE_NS);
+
+			if (residual < gate && after.jitterNs < gate)
+			{
+				state.counter += state.poll;
+				if (state.counter > NTP_SYNC_LIMIT)
+				{
+					state.counter = NTP_SYNC_LIMIT;
+					if (state.poll < m_maxPoll)
+					{
+						state.poll++;
+						state.counter = 0;
+					}
+				}
+			}
+			else
+			{
+				state.counter -= 2 * state.poll;
+				if (state.counter < -NTP_SYNC_LIMIT)
+				{
+					state.counter = -NTP_SYNC_LIMIT;
+					if (state.poll > m_minPoll)
+					{
+						state.poll--;
+						state.counter = 0;
+					}
+				}
+			}
+		}
+	}
+
+	// Never faster than the server asks for
+	int interval = std::max(state.poll, std::min(std::max(serverPoll, m_minPoll), m_maxPoll));
+	state.nextPollMs = nowMs + (1000LL << interval);
+}
+
+void
+NtpSyncEngine::Run(void)
+{
+#ifndef _WIN32
+	NtpTransport transport;
+	if (!transport.Open())
+	{
+		perror("epoll_create1");
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_running = false;
+		return;
+	}
+#endif
+	std::vector<bool> inFlight(m_polls.size(), false);
+
+	// The resolution of the name of each server: a server is held back until its name is in
+	// the resolver cache, as the exchanges do not wait for the DNS, and the wait is not counted
+	// as a poll without response. The state is shared with the resolver callbacks, which may
+	// run after this thread returned
+	enum { NameUnknown, NameResolving, NameResolved, NameFailed };
+	std::vector<std::shared_ptr<std::atomic<int>>> names(m_polls.size());
+	for (size_t ii = 0; ii < names.size(); ii++)
+		names[ii] = std::make_shared<std::atomic<int>>(NameUnknown);
+
+	for (;;)
+	{
+		int64_t nextMs = INT64_MAX;
+		std::vector<int> due;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			if (m_stop)
+				break;
+
+			int64_t nowMs = NowMs();
+			for (size_t ii = 0; ii < m_polls.size(); ii++)
+			{
+				if (inFlight[ii])
+					continue;
+				if (m_polls[ii].nextPollMs <= nowMs)
+					due.push_back((int)ii);
+				else
+					nextMs = std::min(nextMs, m_polls[ii].nextPollMs);
+			}
+
+			bool resolving = false;
+			for (size_t ii = 0; ii < due.size(); )
+			{
+				std::shared_ptr<std::atomic<int>> name = names[due[ii]];
+				const char* host = m_select.GetPeer(due[ii]).host.c_str();
+				std::vector<struct sockaddr_storage> addresses;
+				int state = name->load();
+				if (state == NameUnknown && NtpResolver::Global().GetAddresses(host, &addresses) > 0)
+					state = NameResolved;
+				else if (state == NameUnknown)
+				{
+					state = NameResolving;
+					name->store(NameResolving);
+					NtpResolver::Global().ResolveAsync(host, [name](bool success)
+						{
+							name->store(success ? NameResolved : NameFailed);
+						});
+					state = name->load(); // the callback runs at once if the name was cached meanwhile
+				}
+
+				if (state == NameResolving)
+				{
+					resolving = true;
+					due.erase(due.begin() + ii);
+					continue;
+				}
+				// A name that does not resolve fails the query (the server is backed off), and
+				// is looked up again at the next poll
+				name->store(state == NameFailed ? NameUnknown : NameResolved);
+				ii++;
+			}
+			if (resolving)
+				nextMs = std::min(nextMs, nowMs + NTP_SYNC_POLL_SLICE_MS);
+
+#ifndef _WIN32
+			for (size_t ii = 0; ii < due.size(); ii++)
+			{
+				int index = due[ii];
+				m_predictions[index] = m_select.GetPeer(index).client->GetFilterResult();
+				m_select.GetPeer(index).client->SetPollInterval((signed char)m_polls[index].poll);
+				m_polls[index].queries++;
+
+				bool submitted = m_select.QueryAsync(transport, index,
+					[this, index, &inFlight](bool success)
+					{
+						std::lock_guard<std::mutex> guard(m_mutex);
+						inFlight[index] = false;
+						UpdatePoll(index, success, NowMs());
+						m_select.Select();
+					});
+				if (submitted)
+					inFlight[index] = true;
+				else
+					UpdatePoll(index, false, nowMs);
+			}
+
+			if (transport.Outstanding() == 0)
+			{
+				// Nothing in flight: sleep until the next query (or Stop())
+				if (nextMs != INT64_MAX && due.empty())
+					m_wakeup.wait_for(lock, std::chrono::milliseconds(nextMs - nowMs), [this] { return m_stop; });
+				continue;
+			}
+		}
+
+		if (transport.Poll(NTP_SYNC_POLL_SLICE_MS) < 0)
+			break;
+#else
+		}
+
+		// Blocking queries, one server after the other
+		for (size_t ii = 0; ii < due.size(); ii++)
+		{
+			int index = due[ii];
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_predictions[index] = m_select.GetPeer(index).client->GetFilterResult();
+			m_select.GetPeer(index).client->SetPollInterval((signed char)m_polls[index].poll);
+			m_polls[index].queries++;
+			bool success = m_select.Query(index);
+			UpdatePoll(index, success, NowMs());
+		}
+
+		if (due.empty())
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_wakeup.wait_for(lock, std::chrono::milliseconds(nextMs - NowMs()), [this] { return m_stop; });
+		}
+#endif
+	}
+}
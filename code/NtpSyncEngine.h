@@ -0,0 +1,118 @@
+/**
+ *  This class keeps the clock synchronised in the background: a thread queries each
+ *  server of an NtpSelect on its own schedule, runs the selection after each response
+ *  and publishes the combined offset (NtpClockState::Global() by default).
+ *
+ *  The poll interval of each server is 2^poll s, with poll from 4 (16 s) to 10 (1024 s),
+ *  adapted as in RFC 5905 (section 12): a counter goes up by poll when a new sample agrees
+ *  with the offset predicted from the clock filter and the frequency (within 4 x jitter),
+ *  and down by 2 x poll when it does not; poll is increased when the counter exceeds 30
+ *  and decreased when it goes below -30. A stable server is then queried up to 64 times
+ *  less often, while a rise of the jitter brings the interval back down. The interval is
+ *  never shorter than the poll exponent advertised by the server, and a server that does
+ *  not respond is backed off.
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#ifndef NTPSYNCENGINE_H
+#define NTPSYNCENGINE_H
+
+#include "NtpSelect.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+#define NTP_SYNC_MIN_POLL (4)     // 16 s (MINPOLL)
+#define NTP_SYNC_MAX_POLL (10)    // 1024 s (MAXPOLL)
+
+class NtpSyncEngine
+{
+public:
+	/**
+	 * The schedule of one server.
+	 */
+	struct PollState
+	{
+		int poll;                 /**< Current poll exponent (log2 s). */
+		int counter;              /**< Agreement counter (see above), within +/- 30. */
+		int64_t nextPollMs;       /**< Time of the next query (steady clock, ms). */
+		uint64_t queries;         /**< Number of queries sent to the server. */
+		uint64_t responses;       /**< Number of responses received. */
+	};
+
+	NtpSyncEngine();
+	~NtpSyncEngine();
+
+	/**
+	 * This function adds a server. It must be called before Start().
+	 *
+	 * \param host the hostname or IP address of the NTP server
+	 */
+	void AddServer(const char* host);
+	/**
+	 * This function sets the range of the poll exponent. It must be called before Start().
+	 *
+	 * \param minPoll the minimum poll exponent (log2 s)
+	 * \param maxPoll the maximum poll exponent (log2 s)
+	 */
+	void SetPollRange(int minPoll, int maxPoll);
+	/**
+	 * This function sets where the combined offset is published (see NtpSelect::SetClockState).
+	 * It must be called before Start().
+	 */
+	void SetClockState(NtpClockState* state);
+	/**
+	 * This function starts the background thread; all the servers are queried at once first.
+	 *
+	 * Returns true upon success, false if it is already running or there are no servers
+	 */
+	bool Start(void);
+	/**
+	 * This function stops the background thread (exchanges in flight are abandoned).
+	 */
+	void Stop(void);
+	/**
+	 * This function returns true if the background thread is running.
+	 */
+	bool IsRunning(void) const;
+	/**
+	 * This function returns the result of the last selection (may be called from any thread).
+	 */
+	NtpSelect::Result GetResult(void);
+	/**
+	 * This function returns the schedule of a server (may be called from any thread).
+	 *
+	 * \param index the index of the server, in the order they were added
+	 */
+	PollState GetPollState(int index);
+
+private:
+	NtpSyncEngine(const NtpSyncEngine&);
+	NtpSyncEngine& operator=(const NtpSyncEngine&);
+
+	// The loop of the background thread
+	void Run(void);
+	// Adapts the poll exponent of a server after a query, and schedules the next one
+	void UpdatePoll(int index, bool responded, int64_t nowMs);
+
+	static int64_t NowMs(void);
+
+	NtpSelect m_select;
+	std::vector<PollState> m_polls;
+	std::vector<NtpFilter::Result> m_predictions;   // filter state before each query (what the sample is compared to)
+	int m_minPoll;
+	int m_maxPoll;
+
+	std::thread m_thread;
+	std::mutex m_mutex;                  // protects m_select/m_polls against the getters, and m_stop
+	std::condition_variable m_wakeup;
+	bool m_stop;
+	bool m_running;
+};
+
+#endif  /* NTPSYNCENGINE_H */
@@ -0,0 +1,167 @@
+/**
+ *  This class keeps deadlines in a hierarchical timer wheel.
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+/******************************************************************************
+* Project Headers
+*****************************************************************************/
+#include "NtpTimerWheel.h"
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+// Expiries further away are clamped (about 4.6 hours with 1 ms ticks)
+#define NTP_TIMER_WHEEL_MAX_AHEAD ((1ULL << (NtpTimerWheel::SlotBits * NtpTimerWheel::Levels)) - (1ULL << (NtpTimerWheel::SlotBits * (NtpTimerWheel::Levels - 1))))
+
+/******************************************************************************
+* Class Member Function Definitions
+*****************************************************************************/
+
+NtpTimerWheel::NtpTimerWheel(uint64_t now)
+	: m_now(now),
+	  m_count(0)
+{
+	for (int level = 0; level < Levels; level++)
+	{
+		for (int slot = 0; slot < Slots; slot++)
+		{
+			m_slots[level][slot].prev = &m_slots[level][slot];
+			m_slots[level][slot].next = &m_slots[level][slot];
+		}
+	}
+}
+
+uint64_t
+NtpTimerWheel::Now(void) const
+{
+	return m_now;
+}
+
+int
+NtpTimerWheel::Count(void) const
+{
+	return m_count;
+}
+
+void
+NtpTimerWheel::Insert(Timer* timer)
+{
+	// The lowest level where the expiry is less than 64 slots of that level away
+	int level = 0;
+	while (level < Levels - 1 && ((timer->expiry >> (SlotBits * level)) - (m_now >> (SlotBits * level))) >= Slots)
+		level++;
+
+	Timer* head = &m_slots[level][(timer->expiry >> (SlotBits * level)) & (Slots - 1)];
+	timer->next = head;
+	timer->prev = head->prev;
+	head->prev->next = timer;
+	head->prev = timer;
+}
+
+void
+NtpTimerWheel::Schedule(Timer* timer, uint64_t expiry)
+{
+	Cancel(timer);
+
+	if (expiry <= m_now)
+		expiry = m_now + 1;
+	else if (expiry - m_now > NTP_TIMER_WHEEL_MAX_AHEAD)
+		expiry = m_now + NTP_TIMER_WHEEL_MAX_AHEAD;
+
+	timer->expiry = expiry;
+	Insert(timer);
+	m_count++;
+}
+
+void
+NtpTimerWheel::Cancel(Timer* timer)
+{
+	if (!timer->IsArmed())
+		return;
+
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->prev = nullptr;
+	timer->next = nullptr;
+	m_count--;
+}
+
+uint64_t
+NtpTimerWheel::NextExpiry(void) const
+{
+	if (m_count == 0)
+		return UINT64_MAX;
+
+	// The first slot in use of each level (the current slot of a level is always empty);
+	// a timer of an upper level may expire before the ones of the levels below
+	uint64_t next = UINT64_MAX;
+	for (int level = 0; level < Levels; level++)
+	{
+		uint64_t current = m_now >> (SlotBits * level);
+		for (uint64_t step = 1; step < Slots; step++)
+		{
+			const Timer* head = &m_slots[level][(current + step) & (Slots - 1)];
+			if (head->next != head)
+			{
+				uint64_t start = (current + step) << (SlotBits * level);
+				if (start < next)
+					next = start;
+				break;
+			}
+		}
+	}
+	return next;
+}
+
+NtpTimerWheel::Timer*
+NtpTimerWheel::Advance(uint64_t now)
+{
+	Timer* expired = nullptr;
+	Timer** tail = &expired;
+
+	while (m_now < now)
+	{
+		if (m_count == 0)
+		{
+			m_now = now; // nothing to expire on the way
+			break;
+		}
+		m_now++;
+
+		// When a level wraps, the timers of the next slot of the level above move down
+		for (int level = 1; level < Levels; level++)
+		{
+			if (((m_now >> (SlotBits * (level - 1))) & (Slots - 1)) != 0)
+				break;
+
+			Timer* head = &m_slots[level][(m_now >> (SlotBits * level)) & (Slots - 1)];
+			Timer* timer = head->next;
+			head->next = head;
+			head->prev = head;
+			while (timer != head)
+			{
+				Timer* next = timer->next;
+				Insert(timer);
+				timer = next;
+			}
+		}
+
+		Timer* head = &m_slots[0][m_now & (Slots - 1)];
+		Timer* timer = head->next;
+		head->next = head;
+		head->prev = head;
+		while (timer != head)
+		{
+			Timer* next = timer->next;
+			timer->prev = nullptr;
+			timer->next = nullptr;
+			*tail = timer;
+			tail = &timer->next;
+			m_count--;
+			timer = next;
+		}
+	}
+	return expired;
+}
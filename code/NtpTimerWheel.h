@@ -0,0 +1,89 @@
+/**
+ *  This class keeps a large number of deadlines (e.g. the timeouts of outstanding requests)
+ *  in a hierarchical timer wheel: 4 levels of 64 slots, the first one with a slot per tick,
+ *  each next one with a slot per 64 ticks of the previous one (up to 64^4 ticks ahead).
+ *  Arming and cancelling a timer are O(1) (the timers are linked in place, no allocation);
+ *  a timer further than 64 ticks away is moved down a level when its slot comes up, at most
+ *  3 times over its lifetime.
+ *
+ *  The timers are owned by the caller (e.g. embedded in its request slots); the wheel only
+ *  links them. The tick unit is up to the caller (e.g. 1 ms).
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#ifndef NTPTIMERWHEEL_H
+#define NTPTIMERWHEEL_H
+
+#include <stdint.h>
+
+class NtpTimerWheel
+{
+public:
+	enum { Levels = 4, SlotBits = 6, Slots = 1 << SlotBits };
+
+	struct Timer
+	{
+		Timer* prev;          /**< Links of the slot (nullptr when the timer is not armed). */
+		Timer* next;
+		uint64_t expiry;      /**< Tick at which the timer expires. */
+		int id;               /**< Free for the owner (e.g. the index of its request). */
+
+		Timer() : prev(nullptr), next(nullptr), expiry(0), id(0) {}
+		bool IsArmed(void) const { return prev != nullptr; }
+	};
+
+	/**
+	 * \param now the current tick
+	 */
+	explicit NtpTimerWheel(uint64_t now = 0);
+
+	/**
+	 * This function arms the timer (or re-arms it, if it is already armed).
+	 *
+	 * \param timer the timer
+	 * \param expiry the tick at which it expires (a tick not after the current one expires at the next Advance())
+	 */
+	void Schedule(Timer* timer, uint64_t expiry);
+	/**
+	 * This function disarms the timer (nothing happens if it is not armed).
+	 */
+	void Cancel(Timer* timer);
+	/**
+	 * This function moves the wheel to the given tick and disarms the timers that expire.
+	 *
+	 * \param now the current tick
+	 *
+	 * Returns the expired timers, linked by next (nullptr if none)
+	 */
+	Timer* Advance(uint64_t now);
+	/**
+	 * This function returns a tick at which Advance() is due: not after the earliest expiry
+	 * of the armed timers (the start of its slot for a timer of an upper level, which is
+	 * moved down then), or UINT64_MAX if none is armed. It scans at most the 64 slots of
+	 * each level.
+	 */
+	uint64_t NextExpiry(void) const;
+	/**
+	 * This function returns the current tick (the last one Advance() was called with).
+	 */
+	uint64_t Now(void) const;
+	/**
+	 * This function returns the number of armed timers.
+	 */
+	int Count(void) const;
+
+private:
+	NtpTimerWheel(const NtpTimerWheel&);
+	NtpTimerWheel& operator=(const NtpTimerWheel&);
+
+	// Links the timer in the slot of its expiry
+	void Insert(Timer* timer);
+
+	// Each slot is the head of a circular list (the head is never a timer)
+	Timer m_slots[Levels][Slots];
+	uint64_t m_now;
+	int m_count;
+};
+
+#endif  /* NTPTIMERWHEEL_H */
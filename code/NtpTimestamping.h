@@ -0,0 +1,194 @@
+/**
+ *  Helpers for the kernel timestamps (SO_TIMESTAMPNS / SO_TIMESTAMPING) on Linux.
+ *  The kernel stamps the datagram when it is received by the network stack, so scheduler
+ *  and wake-up latency of the receiving thread do not end up in the T4 timestamp.
+ *  Likewise, the software transmit timestamp (read from the socket error queue) gives the
+ *  time the request was handed to the device, which is a precise T1.
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#ifndef NTPTIMESTAMPING_H
+#define NTPTIMESTAMPING_H
+
+#ifndef _WIN32
+
+#include "NtpPacket.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+// Enough room for SCM_TIMESTAMPNS or SCM_TIMESTAMPING (3 x timespec)
+#define NTP_TIMESTAMP_CONTROL_SIZE (CMSG_SPACE(sizeof(struct timespec) * 3))
+// Enough room for SCM_TIMESTAMPING and the extended error that comes with it on the error queue
+#define NTP_ERRQUEUE_CONTROL_SIZE (CMSG_SPACE(sizeof(struct timespec) * 3) + CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6)))
+
+/**
+ * This function returns the 64-bit NTP timestamp of a (CLOCK_REALTIME) time.
+ *
+ * \param ts the UNIX time
+ */
+inline uint64_t
+NtpTimestampFromTimespec(const struct timespec* ts)
+{
+	uint64_t seconds = (uint64_t)ts->tv_sec + 2208988800ULL; // Seconds from 1/1/1900 00.00 to 1/1/1970 00.00
+	uint64_t fraction = ((uint64_t)ts->tv_nsec << 32) / 1000000000ULL;
+	return ((seconds & 0xFFFFFFFF) << 32) | fraction;
+}
+
+/**
+ * This function returns the 64-bit NTP timestamp of a UNIX time in ns.
+ *
+ * \param ns the ns since 1/1/1970 00.00
+ */
+inline uint64_t
+NtpTimestampFromNs(int64_t ns)
+{
+	struct timespec ts;
+	ts.tv_sec = (time_t)(ns / 1000000000LL);
+	ts.tv_nsec = (long)(ns % 1000000000LL);
+	return NtpTimestampFromTimespec(&ts);
+}
+
+/**
+ * This function writes the current time as a 64-bit NTP timestamp (network byte order)
+ * into the message, e.g. in the Originate Timestamp field of a request about to be sent.
+ *
+ * \param buffer the message
+ * \param offset the offset of the timestamp in the message
+ * \param ts the structure where the time written is stored
+ */
+inline void
+NtpStampMessage(char* buffer, int offset, struct timespec* ts)
+{
+	clock_gettime(CLOCK_REALTIME, ts);
+	NtpWire::Store64((unsigned char*)buffer + offset, NtpTimestampFromTimespec(ts));
+}
+
+/**
+ * This function asks the kernel to timestamp the datagrams received on the socket.
+ *
+ * \param fd the socket descriptor
+ *
+ * Returns true upon success, false otherwise (e.g. not supported)
+ */
+inline bool
+NtpEnableRxTimestamps(int fd)
+{
+	int enable = 1;
+	return (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)) == 0);
+}
+
+/**
+ * This function asks the kernel to report a software timestamp for every datagram sent on
+ * the socket. The timestamps are queued on the error queue (see NtpReadTxTimestamp) and are
+ * numbered per socket (SOF_TIMESTAMPING_OPT_ID), starting from 0.
+ *
+ * \param fd the socket descriptor
+ *
+ * Returns true upon success, false otherwise (e.g. not supported)
+ */
+inline bool
+NtpEnableTxTimestamps(int fd)
+{
+	int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+	return (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0);
+}
+
+/**
+ * This function reads one transmit timestamp from the error queue of the socket (non-blocking).
+ *
+ * \param fd the socket descriptor
+ * \param ts the structure where the timestamp is stored
+ * \param id the number of the datagram the timestamp belongs to (see NtpEnableTxTimestamps)
+ *
+ * Returns 1 if a timestamp was read, 0 if the error queue held something else, -1 if it is empty
+ */
+inline int
+NtpReadTxTimestamp(int fd, struct timespec* ts, uint32_t* id)
+{
+	char control[NTP_ERRQUEUE_CONTROL_SIZE];
+	char data[64];
+	struct iovec iov = { data, sizeof(data) };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+		return -1;
+
+	bool haveStamp = false;
+	bool haveId = false;
+	for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING)
+		{
+			struct timespec stamps[3];
+			memcpy(stamps, CMSG_DATA(cmsg), sizeof(stamps));
+			*ts = stamps[0];
+			haveStamp = (stamps[0].tv_sec != 0 || stamps[0].tv_nsec != 0);
+		}
+		else if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+			(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+		{
+			struct sock_extended_err err;
+			memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+			if (err.ee_errno == ENOMSG && err.ee_origin == SO_EE_ORIGIN_TIMESTAMPING)
+			{
+				*id = err.ee_data;
+				haveId = true;
+			}
+		}
+	}
+	return (haveStamp && haveId) ? 1 : 0;
+}
+
+/**
+ * This function looks for a kernel receive timestamp in the control messages returned
+ * by recvmsg()/recvmmsg().
+ *
+ * \param msg the message header (with msg_control set)
+ * \param ts the structure where the timestamp is stored
+ *
+ * Returns true if a timestamp was found, false otherwise
+ */
+inline bool
+NtpReadRxTimestamp(struct msghdr* msg, struct timespec* ts)
+{
+	for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(msg, cmsg))
+	{
+		if (cmsg->cmsg_level != SOL_SOCKET)
+			continue;
+
+		if (cmsg->cmsg_type == SCM_TIMESTAMPNS)
+		{
+			memcpy(ts, CMSG_DATA(cmsg), sizeof(*ts));
+			return true;
+		}
+		if (cmsg->cmsg_type == SCM_TIMESTAMPING)
+		{
+			// [0] software, [1] deprecated, [2] raw hardware
+			struct timespec stamps[3];
+			memcpy(stamps, CMSG_DATA(cmsg), sizeof(stamps));
+			if (stamps[0].tv_sec != 0 || stamps[0].tv_nsec != 0)
+			{
+				*ts = stamps[0];
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+#endif  /* _WIN32 */
+
+#endif  /* NTPTIMESTAMPING_H */
@@ -0,0 +1,490 @@
+/**
+ *  This class provides the non-blocking UDP transport used by the SNTP client on
+ *  POSIX platforms (epoll event loop).
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#ifndef _WIN32
+
+/******************************************************************************
+* Project Headers
+*****************************************************************************/
+#include "NtpTransport.h"
+#include "NtpTimestamping.h"
+
+/******************************************************************************
+* System Headers
+*****************************************************************************/
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <limits.h>
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+#define NTP_TRANSPORT_MAX_EVENTS (64)
+
+/******************************************************************************
+* Class Member Function Definitions
+*****************************************************************************/
+
+NtpTransport::NtpTransport()
+	: m_epollFd(-1),
+	  m_nextId(0),
+	  m_kernelTimestamps(true),
+	  m_wheel(MonotonicMs()),
+	  m_mailbox(std::make_shared<Mailbox>()),
+	  m_nextTask(0)
+{
+	m_mailbox->open = false;
+	m_mailbox->eventFd = -1;
+}
+
+NtpTransport::~NtpTransport()
+{
+	Close();
+}
+
+bool
+NtpTransport::Open(void)
+{
+	if (m_epollFd >= 0)
+		return true;
+
+	m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (m_epollFd < 0)
+		return false;
+
+	// The functions returned by Defer() wake Poll() up through an eventfd
+	int eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = eventFd;
+	if (eventFd < 0 || epoll_ctl(m_epollFd, EPOLL_CTL_ADD, eventFd, &ev) < 0)
+	{
+		if (eventFd >= 0)
+			close(eventFd);
+		close(m_epollFd);
+		m_epollFd = -1;
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mailbox->mutex);
+	m_mailbox->open = true;
+	m_mailbox->eventFd = eventFd;
+	return true;
+}
+
+void
+NtpTransport::Close(void)
+{
+	for (auto& it : m_exchanges)
+	{
+		m_wheel.Cancel(&it.second.timer);
+		close(it.first);
+	}
+
+	m_exchanges.clear();
+	m_done.clear();
+	m_idToFd.clear();
+	m_deferred.clear();
+	m_tasks.clear();
+
+	{
+		std::lock_guard<std::mutex> lock(m_mailbox->mutex);
+		m_mailbox->open = false;
+		m_mailbox->ready.clear();
+		if (m_mailbox->eventFd >= 0)
+		{
+			close(m_mailbox->eventFd);
+			m_mailbox->eventFd = -1;
+		}
+	}
+
+	if (m_epollFd >= 0)
+	{
+		close(m_epollFd);
+		m_epollFd = -1;
+	}
+}
+
+uint64_t
+NtpTransport::MonotonicMs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+int
+NtpTransport::Submit(const struct sockaddr* addr, socklen_t addrLen, const char* request, int length, int timeoutMs, Callback callback, int stampOffset, int delayMs)
+{
+	if (m_epollFd < 0 || length <= 0 || length > MaxMessageSize || stampOffset + 8 > length)
+		return -1;
+
+	int fd = socket(addr->sa_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+	if (fd < 0)
+		return -1;
+
+	if (m_kernelTimestamps)
+	{
+		NtpEnableRxTimestamps(fd);
+		NtpEnableTxTimestamps(fd);
+	}
+
+	// A connected UDP socket only accepts datagrams from the server we sent to
+	if (connect(fd, addr, addrLen) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	Exchange& exchange = m_exchanges[fd];
+	exchange.id = m_nextId++;
+	if (m_nextId < 0)
+		m_nextId = 0;
+	exchange.fd = fd;
+	exchange.pendingSend = false;
+	exchange.delayed = (delayMs > 0);
+	exchange.sendAt = MonotonicMs() + (delayMs > 0 ? delayMs : 0);
+	exchange.kernelTransmitTimestamp = false;
+	exchange.stampOffset = stampOffset;
+	exchange.deadline = exchange.sendAt + (timeoutMs > 0 ? timeoutMs : 0);
+	exchange.length = length;
+	memcpy(exchange.request, request, length);
+	exchange.callback = callback;
+	memset(&exchange.transmitTime, 0, sizeof(exchange.transmitTime));
+
+	if (!exchange.delayed)
+	{
+		int _error = TrySend(exchange);
+		if (_error != 0 && _error != EAGAIN)
+		{
+			m_exchanges.erase(fd);
+			close(fd);
+			return -1;
+		}
+		exchange.pendingSend = (_error == EAGAIN);
+	}
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | (exchange.pendingSend ? (uint32_t)EPOLLOUT : 0);
+	ev.data.fd = fd;
+	if (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fd, &ev) < 0)
+	{
+		m_exchanges.erase(fd);
+		close(fd);
+		return -1;
+	}
+
+	// An idle wheel skips ahead, so that the deadline is not measured from a stale tick
+	uint64_t now = MonotonicMs();
+	if (m_wheel.Count() == 0)
+		m_wheel.Advance(now);
+	exchange.timer.id = fd;
+	m_wheel.Schedule(&exchange.timer, exchange.delayed ? exchange.sendAt : exchange.deadline);
+
+	int id = exchange.id;
+	m_idToFd[id] = fd;
+	return id;
+}
+
+bool
+NtpTransport::Cancel(int id)
+{
+	auto it = m_idToFd.find(id);
+	if (it == m_idToFd.end())
+		return false;
+
+	int fd = it->second;
+	m_idToFd.erase(it);
+	auto exchange = m_exchanges.find(fd);
+	if (exchange != m_exchanges.end())
+	{
+		m_wheel.Cancel(&exchange->second.timer);
+		m_exchanges.erase(exchange);
+	}
+	epoll_ctl(m_epollFd, EPOLL_CTL_DEL, fd, nullptr);
+	close(fd);
+	return true;
+}
+
+int
+NtpTransport::TrySend(Exchange& exchange)
+{
+	if (exchange.stampOffset >= 0)
+		NtpStampMessage(exchange.request, exchange.stampOffset, &exchange.transmitTime);
+	else
+		clock_gettime(CLOCK_REALTIME, &exchange.transmitTime);
+
+	ssize_t sent = send(exchange.fd, exchange.request, exchange.length, MSG_NOSIGNAL);
+	if (sent == exchange.length)
+		return 0;
+	if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return EAGAIN;
+	return (sent < 0) ? errno : EMSGSIZE;
+}
+
+void
+NtpTransport::SendDelayed(Exchange& exchange)
+{
+	exchange.delayed = false;
+	int _error = TrySend(exchange);
+	if (_error == EAGAIN)
+	{
+		exchange.pendingSend = true;
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLOUT;
+		ev.data.fd = exchange.fd;
+		epoll_ctl(m_epollFd, EPOLL_CTL_MOD, exchange.fd, &ev);
+	}
+	else if (_error != 0)
+	{
+		Complete(exchange.fd, Failed, _error, nullptr, 0);
+		return;
+	}
+	m_wheel.Schedule(&exchange.timer, exchange.deadline);
+}
+
+void
+NtpTransport::ReadTransmitTimestamp(Exchange& exchange)
+{
+	struct timespec ts;
+	uint32_t id;
+	int ret;
+	while ((ret = NtpReadTxTimestamp(exchange.fd, &ts, &id)) >= 0)
+	{
+		// One datagram per socket, so the first timestamp is the one of the request
+		if (ret == 1 && !exchange.kernelTransmitTimestamp)
+		{
+			exchange.transmitTime = ts;
+			exchange.kernelTransmitTimestamp = true;
+		}
+	}
+}
+
+void
+NtpTransport::Complete(int fd, CompletionStatus status, int error, const char* buffer, int length, const struct timespec* receiveTime, bool kernelTimestamp)
+{
+	auto it = m_exchanges.find(fd);
+	if (it == m_exchanges.end())
+		return;
+
+	m_done.push_back(Done());
+	Done& done = m_done.back();
+	done.callback = std::move(it->second.callback);
+	Completion& completion = done.completion;
+	completion.id = it->second.id;
+	completion.status = status;
+	completion.error = error;
+	completion.length = (buffer != nullptr) ? length : 0;
+	if (completion.length > 0)
+		memcpy(done.buffer, buffer, completion.length);
+	completion.buffer = nullptr; // set in Deliver(), as m_done may still grow
+	completion.transmitTime = it->second.transmitTime;
+	completion.kernelTransmitTimestamp = it->second.kernelTransmitTimestamp;
+	completion.kernelTimestamp = kernelTimestamp;
+	if (receiveTime != nullptr)
+		completion.receiveTime = *receiveTime;
+	else
+		memset(&completion.receiveTime, 0, sizeof(completion.receiveTime));
+
+	m_wheel.Cancel(&it->second.timer);
+	m_idToFd.erase(completion.id);
+	m_exchanges.erase(it);
+	epoll_ctl(m_epollFd, EPOLL_CTL_DEL, fd, nullptr);
+	close(fd);
+}
+
+int
+NtpTransport::Deliver(void)
+{
+	// The released tasks first (they may submit exchanges), then the completions
+	std::vector<Task> tasks;
+	tasks.swap(m_tasks);
+	for (size_t ii = 0; ii < tasks.size(); ii++)
+		tasks[ii]();
+
+	// Moved out first, as the callbacks may submit exchanges that complete in the next Poll()
+	std::vector<Done> done;
+	done.swap(m_done);
+	for (size_t ii = 0; ii < done.size(); ii++)
+	{
+		done[ii].completion.buffer = done[ii].buffer;
+		if (done[ii].callback)
+			done[ii].callback(done[ii].completion);
+	}
+	return (int)done.size();
+}
+
+int
+NtpTransport::Poll(int timeoutMs)
+{
+	if (m_epollFd < 0)
+		return -1;
+	if (m_exchanges.empty() && m_deferred.empty() && timeoutMs < 0)
+		return 0;
+
+	// Never sleep past the nearest deadline (or delayed request)
+	uint64_t now = MonotonicMs();
+	int waitMs = timeoutMs;
+	uint64_t next = m_wheel.NextExpiry();
+	if (next != UINT64_MAX)
+	{
+		int remaining = (next <= now) ? 0 : (next - now > (uint64_t)INT_MAX) ? INT_MAX : (int)(next - now);
+		if (waitMs < 0 || remaining < waitMs)
+			waitMs = remaining;
+	}
+
+	struct epoll_event events[NTP_TRANSPORT_MAX_EVENTS];
+	int n = epoll_wait(m_epollFd, events, NTP_TRANSPORT_MAX_EVENTS, waitMs);
+	if (n < 0)
+		return (errno == EINTR) ? 0 : -1;
+
+	for (int ii = 0; ii < n; ii++)
+	{
+		int fd = events[ii].data.fd;
+		if (fd == m_mailbox->eventFd)
+		{
+			uint64_t counter;
+			ssize_t _read = read(fd, &counter, sizeof(counter));
+			(void)_read;
+
+			std::vector<int> ready;
+			{
+				std::lock_guard<std::mutex> lock(m_mailbox->mutex);
+				ready.swap(m_mailbox->ready);
+			}
+			for (size_t jj = 0; jj < ready.size(); jj++)
+			{
+				auto task = m_deferred.find(ready[jj]);
+				if (task == m_deferred.end())
+					continue;
+				m_tasks.push_back(std::move(task->second));
+				m_deferred.erase(task);
+			}
+			continue;
+		}
+
+		auto it = m_exchanges.find(fd);
+		if (it == m_exchanges.end())
+			continue;
+
+		Exchange& exchange = it->second;
+		if (exchange.pendingSend && (events[ii].events & EPOLLOUT))
+		{
+			int _error = TrySend(exchange);
+			if (_error == 0)
+			{
+				exchange.pendingSend = false;
+				struct epoll_event ev;
+				memset(&ev, 0, sizeof(ev));
+				ev.events = EPOLLIN;
+				ev.data.fd = fd;
+				epoll_ctl(m_epollFd, EPOLL_CTL_MOD, fd, &ev);
+			}
+			else if (_error != EAGAIN)
+			{
+				Complete(fd, Failed, _error, nullptr, 0);
+				continue;
+			}
+		}
+
+		// The transmit timestamp is queued on the error queue (which raises EPOLLERR)
+		if ((events[ii].events & EPOLLERR) && m_kernelTimestamps && !exchange.pendingSend)
+			ReadTransmitTimestamp(exchange);
+
+		if (events[ii].events & (EPOLLIN | EPOLLERR))
+		{
+			char bufferRx[MaxMessageSize];
+			char control[NTP_TIMESTAMP_CONTROL_SIZE];
+			struct iovec iov = { bufferRx, sizeof(bufferRx) };
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+
+			ssize_t received = recvmsg(fd, &msg, 0);
+			if (received >= 0)
+			{
+				struct timespec receiveTime;
+				bool kernelTimestamp = NtpReadRxTimestamp(&msg, &receiveTime);
+				if (!kernelTimestamp)
+					clock_gettime(CLOCK_REALTIME, &receiveTime);
+
+				// The reply may be processed before the transmit timestamp was read
+				if (m_kernelTimestamps && !exchange.kernelTransmitTimestamp)
+					ReadTransmitTimestamp(exchange);
+
+				Complete(fd, Completed, 0, bufferRx, (int)received, &receiveTime, kernelTimestamp);
+			}
+			else if (errno != EAGAIN && errno != EWOULDBLOCK)
+				Complete(fd, Failed, errno, nullptr, 0);
+		}
+	}
+
+	// The timers that are due: the delayed requests to send, and the exchanges that expire
+	NtpTimerWheel::Timer* timer = m_wheel.Advance(MonotonicMs());
+	while (timer != nullptr)
+	{
+		NtpTimerWheel::Timer* nextTimer = timer->next; // before the timer is armed again
+		auto it = m_exchanges.find(timer->id);
+		if (it != m_exchanges.end())
+		{
+			if (it->second.delayed)
+				SendDelayed(it->second);
+			else
+				Complete(it->first, TimedOut, 0, nullptr, 0);
+		}
+		timer = nextTimer;
+	}
+
+	return Deliver();
+}
+
+std::function<void()>
+NtpTransport::Defer(Task task)
+{
+	int id = m_nextTask++;
+	if (m_nextTask < 0)
+		m_nextTask = 0;
+	m_deferred[id] = std::move(task);
+
+	std::shared_ptr<Mailbox> mailbox = m_mailbox;
+	return [mailbox, id]()
+		{
+			std::lock_guard<std::mutex> lock(mailbox->mutex);
+			if (!mailbox->open)
+				return;
+			mailbox->ready.push_back(id);
+			uint64_t one = 1;
+			ssize_t _written = write(mailbox->eventFd, &one, sizeof(one));
+			(void)_written; // the counter only fails to grow if it is about to overflow
+		};
+}
+
+size_t
+NtpTransport::Outstanding(void) const
+{
+	return m_exchanges.size() + m_deferred.size();
+}
+
+void
+NtpTransport::SetKernelTimestamps(bool enable)
+{
+	m_kernelTimestamps = enable;
+}
+
+#endif  /* _WIN32 */
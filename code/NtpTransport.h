@@ -0,0 +1,218 @@
+/**
+ *  This class provides the non-blocking UDP transport used by the SNTP client on
+ *  POSIX platforms. Requests are submitted together with a timeout and a completion
+ *  callback, and the owner drives the epoll event loop by calling Poll(). A single
+ *  thread can therefore keep many request-response exchanges in flight, and a lost
+ *  packet results in a timeout completion rather than a blocked thread.
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#ifndef NTPTRANSPORT_H
+#define NTPTRANSPORT_H
+
+#ifndef _WIN32
+
+#include "NtpTimerWheel.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <time.h>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+class NtpTransport
+{
+public:
+	/**
+	 * The outcome of a submitted exchange, delivered via the completion callback.
+	 */
+	enum CompletionStatus
+	{
+		Completed,      // 0 - A reply of the expected size has been received
+		TimedOut,       // 1 - No reply before the deadline
+		Failed          // 2 - Socket error (see Completion::error)
+	};
+
+	struct Completion
+	{
+		int id;                         /**< Identifier returned by Submit(). */
+		CompletionStatus status;        /**< Outcome of the exchange. */
+		int error;                      /**< errno value when status is Failed, 0 otherwise. */
+		const char* buffer;             /**< The received message (only valid inside the callback). */
+		int length;                     /**< Number of bytes in buffer. */
+		struct timespec transmitTime;   /**< Time (CLOCK_REALTIME) the request was sent. */
+		bool kernelTransmitTimestamp;   /**< True if transmitTime was taken by the kernel, false if by the transport before send(). */
+		struct timespec receiveTime;    /**< Time (CLOCK_REALTIME) the reply was received. */
+		bool kernelTimestamp;           /**< True if receiveTime was taken by the kernel, false if by the transport after recvmsg(). */
+	};
+
+	typedef std::function<void(const Completion&)> Callback;
+	typedef std::function<void()> Task;
+
+	NtpTransport();
+	~NtpTransport();
+
+	/**
+	 * This function creates the epoll instance. It must be called before Submit().
+	 * Returns true upon success, false otherwise.
+	 */
+	bool Open(void);
+	/**
+	 * This function cancels every outstanding exchange (without invoking the callbacks)
+	 * and releases the epoll instance.
+	 */
+	void Close(void);
+	/**
+	 * This function submits a request to the given server. The request is sent right away
+	 * (or as soon as the socket becomes writable) and the callback is invoked from Poll()
+	 * when the reply arrives, the timeout expires or the socket fails.
+	 * If stampOffset is given, the current time is written (as an NTP timestamp) at that offset
+	 * of the request right before it is sent, so that setting up the socket does not end up in T1.
+	 * If delayMs is given, the request is only sent after that delay (unless the exchange is
+	 * cancelled meanwhile), and the timeout runs from then on.
+	 *
+	 * \param addr the address of the server
+	 * \param addrLen the size of addr
+	 * \param request the message to be sent
+	 * \param length the size of the message to be sent
+	 * \param timeoutMs the time (in ms) to wait for the reply
+	 * \param callback the function to be invoked upon completion
+	 * \param stampOffset the offset of the timestamp to be written at send time (-1 for none)
+	 * \param delayMs the time (in ms) to wait before sending the request
+	 *
+	 * Returns the id of the exchange, or -1 if it could not be submitted
+	 */
+	int Submit(const struct sockaddr* addr, socklen_t addrLen, const char* request, int length, int timeoutMs, Callback callback, int stampOffset = -1, int delayMs = 0);
+	/**
+	 * This function cancels an outstanding exchange without invoking its callback.
+	 *
+	 * \param id the id returned by Submit()
+	 *
+	 * Returns true if the exchange was outstanding, false otherwise
+	 */
+	bool Cancel(int id);
+	/**
+	 * This function defers a task until an event of another thread, e.g. the resolution of a
+	 * name. The returned function may be called from any thread (even once the transport is
+	 * gone), and has the task run by Poll(), on its thread. The task counts in Outstanding()
+	 * until then; it is dropped if the transport is closed first.
+	 *
+	 * \param task the function to be invoked from Poll()
+	 *
+	 * Returns the function that releases the task
+	 */
+	std::function<void()> Defer(Task task);
+	/**
+	 * This function waits for I/O for up to timeoutMs (-1 waits until the next deadline)
+	 * and delivers the completions that are ready. The callbacks are invoked once the events
+	 * are handled, so they may submit or cancel exchanges.
+	 *
+	 * \param timeoutMs the maximum time (in ms) to block
+	 *
+	 * Returns the number of completions delivered, or -1 on error
+	 */
+	int Poll(int timeoutMs);
+	/**
+	 * This function returns the number of exchanges still in flight (and of deferred tasks).
+	 */
+	size_t Outstanding(void) const;
+	/**
+	 * This function enables (default) or disables the kernel receive and transmit timestamps
+	 * for the exchanges submitted from now on. When they are not available the transport falls
+	 * back to reading the clock right before send() and right after recvmsg() return.
+	 *
+	 * \param enable true to request kernel timestamps
+	 */
+	void SetKernelTimestamps(bool enable);
+
+private:
+	NtpTransport(const NtpTransport&);
+	NtpTransport& operator=(const NtpTransport&);
+
+	enum { MaxMessageSize = 68 }; // 48-byte header + optional key id (4) and digest (16)
+
+	struct Exchange
+	{
+		int id;
+		int fd;
+		bool pendingSend;
+		bool delayed;                  // not sent before sendAt
+		uint64_t sendAt;               // CLOCK_MONOTONIC, in ms
+		bool kernelTransmitTimestamp;
+		uint64_t deadline;             // CLOCK_MONOTONIC, in ms
+		NtpTimerWheel::Timer timer;    // armed for sendAt while delayed, then for deadline (id: the socket)
+		struct timespec transmitTime;
+		int stampOffset;
+		int length;
+		char request[MaxMessageSize];
+		Callback callback;
+	};
+
+	/**
+	 * This function returns the CLOCK_MONOTONIC time in ms.
+	 */
+	static uint64_t MonotonicMs(void);
+	/**
+	 * This function tries to transmit the request of the exchange.
+	 * Returns 0 if sent, EAGAIN if the socket is not writable yet, or the errno value.
+	 */
+	int TrySend(Exchange& exchange);
+	/**
+	 * This function sends a delayed request whose time has come, and arms its deadline.
+	 */
+	void SendDelayed(Exchange& exchange);
+	/**
+	 * This function drains the error queue of the exchange, picking up its kernel transmit timestamp.
+	 */
+	void ReadTransmitTimestamp(Exchange& exchange);
+	/**
+	 * This function removes the exchange from epoll, closes its socket and queues the completion
+	 * (see Deliver()).
+	 */
+	void Complete(int fd, CompletionStatus status, int error, const char* buffer, int length, const struct timespec* receiveTime = nullptr, bool kernelTimestamp = false);
+	/**
+	 * This function invokes the callbacks of the queued completions.
+	 * Returns the number of completions delivered.
+	 */
+	int Deliver(void);
+
+	// The deferred tasks released by other threads, shared with the functions returned by Defer()
+	struct Mailbox
+	{
+		std::mutex mutex;
+		bool open;
+		int eventFd;             // raised for Poll() (registered in epoll)
+		std::vector<int> ready;
+	};
+
+	// A completion queued until the events of Poll() are handled: a callback that submits or
+	// cancels an exchange could otherwise get a descriptor reused by the kernel while an event
+	// of the old one is still to be handled
+	struct Done
+	{
+		Callback callback;
+		Completion completion;
+		char buffer[MaxMessageSize];
+	};
+
+	int m_epollFd;
+	int m_nextId;
+	bool m_kernelTimestamps;
+	std::unordered_map<int, Exchange> m_exchanges;  // keyed by socket descriptor (the elements do not move)
+	std::unordered_map<int, int> m_idToFd;
+	NtpTimerWheel m_wheel;                          // the deadlines (1 ms ticks, CLOCK_MONOTONIC)
+	std::vector<Done> m_done;
+	std::shared_ptr<Mailbox> m_mailbox;
+	std::unordered_map<int, Task> m_deferred;      // keyed by task id
+	int m_nextTask;
+	std::vector<Task> m_tasks;                      // released, run by Deliver()
+};
+
+#endif  /* _WIN32 */
+
+#endif  /* NTPTRANSPORT_H */
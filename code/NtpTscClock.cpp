@@ -0,0 +1,168 @@
+/**
+ *  This file provides the TSC-interpolated corrected clock.
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+/******************************************************************************
+* Project Headers
+*****************************************************************************/
+#include "NtpTscClock.h"
+
+/******************************************************************************
+* System Headers
+*****************************************************************************/
+#include <thread>
+#if NTP_HAVE_TSC && !defined(_MSC_VER)
+#include <cpuid.h>
+#endif
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+#define NTP_TSC_CALIBRATION_MS (10)      // initial measurement of the TSC rate
+#define NTP_TSC_ANCHOR_TRIES (5)         // reads of the TSC/system clock pair (the tightest is kept)
+#define NTP_TSC_MAX_RATE_CHANGE (1e-3)   // larger changes mean the system clock was stepped
+
+/******************************************************************************
+* Class Member Function Definitions
+*****************************************************************************/
+
+NtpTscClock::NtpTscClock()
+	: m_sequence(0),
+	  m_tscBase(0),
+	  m_timeBaseNs(-1),
+	  m_nsPerTick(0.0),
+	  m_anchorTsc(0),
+	  m_anchorSystemTimeNs(0),
+	  m_systemNsPerTick(0.0)
+{
+}
+
+NtpTscClock&
+NtpTscClock::Global(void)
+{
+	static NtpTscClock clock;
+	return clock;
+}
+
+void
+NtpTscClock::Anchor(uint64_t* tsc, int64_t* systemTimeNs)
+{
+	uint64_t best = ~0ULL;
+	for (int i = 0; i < NTP_TSC_ANCHOR_TRIES; i++)
+	{
+		uint64_t before = ReadTsc();
+		int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+		uint64_t after = ReadTsc();
+		if (after - before < best)
+		{
+			best = after - before;
+			*tsc = before + ((after - before) / 2);
+			*systemTimeNs = now;
+		}
+	}
+}
+
+bool
+NtpTscClock::Enable(NtpClockState& state)
+{
+#if NTP_HAVE_TSC
+	// CPUID.80000007H:EDX[8], invariant TSC
+	unsigned int regs[4] = { 0, 0, 0, 0 };
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0x80000000);
+	regs[0] = (unsigned int)info[0];
+	if (regs[0] >= 0x80000007)
+	{
+		__cpuid(info, 0x80000007);
+		regs[3] = (unsigned int)info[3];
+	}
+#else
+	if (__get_cpuid(0x80000000, &regs[0], &regs[1], &regs[2], &regs[3]) && regs[0] >= 0x80000007)
+		__get_cpuid(0x80000007, &regs[0], &regs[1], &regs[2], &regs[3]);
+	else
+		regs[3] = 0;
+#endif
+	if ((regs[3] & (1u << 8)) == 0)
+		return false;
+
+	uint64_t startTsc = 0, endTsc = 0;
+	int64_t startNs = 0, endNs = 0;
+	Anchor(&startTsc, &startNs);
+	std::this_thread::sleep_for(std::chrono::milliseconds(NTP_TSC_CALIBRATION_MS));
+	Anchor(&endTsc, &endNs);
+	if (endTsc <= startTsc || endNs <= startNs)
+		return false;
+
+	m_systemNsPerTick = (double)(endNs - startNs) / (double)(endTsc - startTsc);
+	m_anchorTsc = endTsc;
+	m_anchorSystemTimeNs = endNs;
+
+	Recalibrate(state.Read());
+	state.SetTscClock(this);
+	return true;
+#else
+	(void)state;
+	return false;
+#endif
+}
+
+bool
+NtpTscClock::IsEnabled(void) const
+{
+	return (m_timeBaseNs.load(std::memory_order_relaxed) >= 0);
+}
+
+void
+NtpTscClock::Recalibrate(const NtpClockState::Snapshot& snapshot)
+{
+	uint64_t tsc = 0;
+	int64_t systemTimeNs = 0;
+	Anchor(&tsc, &systemTimeNs);
+
+	// Refine the rate over the whole interval since the last calibration
+	if (tsc > m_anchorTsc && systemTimeNs > m_anchorSystemTimeNs)
+	{
+		double nsPerTick = (double)(systemTimeNs - m_anchorSystemTimeNs) / (double)(tsc - m_anchorTsc);
+		double change = (nsPerTick - m_systemNsPerTick) / m_systemNsPerTick;
+		if (change < NTP_TSC_MAX_RATE_CHANGE && change > -NTP_TSC_MAX_RATE_CHANGE)
+			m_systemNsPerTick = nsPerTick;
+	}
+	m_anchorTsc = tsc;
+	m_anchorSystemTimeNs = systemTimeNs;
+
+	uint64_t sequence = m_sequence.load(std::memory_order_relaxed);
+	m_sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	m_tscBase.store(tsc, std::memory_order_relaxed);
+	m_timeBaseNs.store(NtpClockState::Correct(snapshot, systemTimeNs), std::memory_order_relaxed);
+	m_nsPerTick.store(m_systemNsPerTick * (1.0 + snapshot.frequency), std::memory_order_relaxed);
+
+	m_sequence.store(sequence + 2, std::memory_order_release);
+}
+
+int64_t
+NtpTscClock::Now(void) const
+{
+	for (;;)
+	{
+		uint64_t before = m_sequence.load(std::memory_order_acquire);
+		uint64_t tscBase = m_tscBase.load(std::memory_order_relaxed);
+		int64_t timeBaseNs = m_timeBaseNs.load(std::memory_order_relaxed);
+		double nsPerTick = m_nsPerTick.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+
+		if ((before & 1) == 0 && m_sequence.load(std::memory_order_relaxed) == before)
+		{
+			if (timeBaseNs < 0)
+				return -1;
+			// Signed, in case this core's TSC is slightly behind the one that calibrated
+			int64_t ticks = (int64_t)(ReadTsc() - tscBase);
+			return timeBaseNs + (int64_t)((double)ticks * nsPerTick);
+		}
+	}
+}
@@ -0,0 +1,132 @@
+/**
+ *  This file provides an optional fast path for the corrected time: the invariant TSC
+ *  (x86) is calibrated against the NTP-corrected clock, so that a read is one rdtsc,
+ *  a multiply and an add, instead of a clock_gettime() call.
+ *
+ *  The calibration (a TSC value, the corrected time at that value and the length of a
+ *  tick) is kept in a seqlock, like NtpClockState. Once attached to a NtpClockState, it is
+ *  recalibrated from the publishing thread every time a new snapshot is published (i.e.
+ *  after each exchange). The length of a tick is measured against the system clock over
+ *  the whole interval between two publications, and scaled by the published frequency.
+ *
+ *  The TSC has to be invariant (constant rate, not stopped in deep C-states) and
+ *  synchronised across cores, as on all recent x86 CPUs; Enable() fails otherwise, and
+ *  ntp_tsc_clock::now() then falls back to ntp_clock::now().
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#ifndef NTPTSCCLOCK_H
+#define NTPTSCCLOCK_H
+
+#include "NtpClock.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define NTP_HAVE_TSC (1)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#else
+#define NTP_HAVE_TSC (0)
+#endif
+
+class NtpTscClock
+{
+public:
+	NtpTscClock();
+
+	/**
+	 * This function checks that the TSC is invariant, measures its rate (about 10 ms)
+	 * and attaches the clock to the given state, which recalibrates it on each Publish().
+	 * Call it before the state is published by another thread.
+	 *
+	 * \param state the state the TSC is calibrated against
+	 *
+	 * Returns true upon success, false if there is no invariant TSC
+	 */
+	bool Enable(NtpClockState& state);
+	/**
+	 * This function returns true if the clock is calibrated (Enable() succeeded).
+	 */
+	bool IsEnabled(void) const;
+	/**
+	 * This function recalibrates the clock against the snapshot just published.
+	 * It is called by NtpClockState::Publish(); only one thread may call it at a time.
+	 *
+	 * \param snapshot the new clock state
+	 */
+	void Recalibrate(const NtpClockState::Snapshot& snapshot);
+	/**
+	 * This function returns the corrected time (ns since the UNIX epoch), computed from the
+	 * TSC, or -1 if the clock is not calibrated.
+	 */
+	int64_t Now(void) const;
+	/**
+	 * This function returns the clock used by ntp_tsc_clock.
+	 */
+	static NtpTscClock& Global(void);
+
+	static inline uint64_t ReadTsc(void)
+	{
+#if NTP_HAVE_TSC
+		return __rdtsc();
+#else
+		return 0;
+#endif
+	}
+
+private:
+	NtpTscClock(const NtpTscClock&);
+	NtpTscClock& operator=(const NtpTscClock&);
+
+	// Reads the TSC and the system clock as close together as possible
+	static void Anchor(uint64_t* tsc, int64_t* systemTimeNs);
+
+	// Read by Now(), on a cache line of their own
+	alignas(64) std::atomic<uint64_t> m_sequence;
+	std::atomic<uint64_t> m_tscBase;         // TSC value at the last calibration
+	std::atomic<int64_t> m_timeBaseNs;       // corrected time at m_tscBase
+	std::atomic<double> m_nsPerTick;         // length of a tick, in corrected ns
+	char m_padding[64 - 4 * 8];
+
+	// Only used by the thread that recalibrates
+	uint64_t m_anchorTsc;
+	int64_t m_anchorSystemTimeNs;
+	double m_systemNsPerTick;                // length of a tick, in system clock ns
+};
+
+/**
+ * std::chrono clock that returns the NTP-corrected UTC time from the TSC (same epoch as
+ * std::chrono::system_clock), calibrated by NtpTscClock::Global(); falls back to ntp_clock
+ * until NtpTscClock::Global().Enable() succeeds.
+ */
+struct ntp_tsc_clock
+{
+	typedef ntp_clock::duration duration;
+	typedef duration::rep rep;
+	typedef duration::period period;
+	typedef std::chrono::time_point<ntp_tsc_clock> time_point;
+	static constexpr bool is_steady = false;
+
+	static time_point now() noexcept
+	{
+		int64_t ns = NtpTscClock::Global().Now();
+		if (ns < 0)
+			return time_point(ntp_clock::now().time_since_epoch());
+		return time_point(duration(ns));
+	}
+
+	static std::chrono::system_clock::time_point to_sys(const time_point& tp) noexcept
+	{
+		return std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(tp.time_since_epoch()));
+	}
+
+	static time_point from_sys(const std::chrono::system_clock::time_point& tp) noexcept
+	{
+		return time_point(std::chrono::duration_cast<duration>(tp.time_since_epoch()));
+	}
+};
+
+#endif  /* NTPTSCCLOCK_H */
@@ -0,0 +1,638 @@
+/**
+ *  This class sends a batch of SNTP requests and collects the responses through io_uring.
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+/******************************************************************************
+* Project Headers
+*****************************************************************************/
+#include "NtpUringBatch.h"
+
+#if NTP_HAVE_IO_URING
+
+#include "NtpTimestamping.h"
+
+/******************************************************************************
+* System Headers
+*****************************************************************************/
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+#define NTP_URING_MAX_SQ_ENTRIES (4096)
+#define NTP_URING_MAX_CQ_ENTRIES (65536)
+#define NTP_URING_MIN_BUFFERS (64)
+#define NTP_URING_MAX_BUFFERS (32768)     // the buffer ids are 16-bit
+#define NTP_URING_BUFFER_GROUP (0)
+#define NTP_URING_SOCKET_BUFFER (4 * 1024 * 1024) // room for the responses of a large batch
+#define NTP_URING_SEND_TAG (1ULL)
+#define NTP_URING_RECV_TAG (2ULL)
+
+/******************************************************************************
+* Static Function Definitions
+*****************************************************************************/
+
+static bool
+SameAddress(const struct sockaddr_storage& a, const struct sockaddr_storage& b)
+{
+	if (a.ss_family != b.ss_family)
+		return false;
+
+	if (a.ss_family == AF_INET)
+	{
+		const struct sockaddr_in* a4 = (const struct sockaddr_in*)&a;
+		const struct sockaddr_in* b4 = (const struct sockaddr_in*)&b;
+		return (a4->sin_port == b4->sin_port && a4->sin_addr.s_addr == b4->sin_addr.s_addr);
+	}
+	const struct sockaddr_in6* a6 = (const struct sockaddr_in6*)&a;
+	const struct sockaddr_in6* b6 = (const struct sockaddr_in6*)&b;
+	return (a6->sin6_port == b6->sin6_port && memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr)) == 0);
+}
+
+static unsigned int
+RoundUpPowerOfTwo(unsigned int value)
+{
+	unsigned int power = 1;
+	while (power < value)
+		power <<= 1;
+	return power;
+}
+
+static int64_t
+MonotonicNs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec * 1000000000LL) + ts.tv_nsec;
+}
+
+/******************************************************************************
+* Class Member Function Definitions
+*****************************************************************************/
+
+NtpUringBatch::NtpUringBatch(int capacity)
+	: m_capacity(capacity > 0 ? capacity : 1),
+	  m_count(0),
+	  m_kernelTimestamps(true),
+	  m_pendingSends(0),
+	  m_systemCalls(0),
+	  m_cookies(m_capacity),
+	  m_ringFd(-1),
+	  m_sqRing(MAP_FAILED),
+	  m_sqRingSize(0),
+	  m_cqRing(MAP_FAILED),
+	  m_cqRingSize(0),
+	  m_sqes(MAP_FAILED),
+	  m_sqesSize(0),
+	  m_sqHead(nullptr),
+	  m_sqTail(nullptr),
+	  m_sqMask(0),
+	  m_sqEntries(0),
+	  m_sqQueued(0),
+	  m_cqHead(nullptr),
+	  m_cqTail(nullptr),
+	  m_cqMask(0),
+	  m_cqes(nullptr),
+	  m_bufferRing(MAP_FAILED),
+	  m_bufferRingSize(0),
+	  m_bufferCount(0),
+	  m_bufferSize(0),
+	  m_bufferTail(0)
+{
+	m_slots.resize(m_capacity);
+	for (int ii = 0; ii < 2; ii++)
+	{
+		m_receivers[ii].fd = -1;
+		m_receivers[ii].armed = false;
+		memset(&m_receivers[ii].msg, 0, sizeof(m_receivers[ii].msg));
+	}
+
+	if (!Setup() && m_ringFd >= 0)
+	{
+		close(m_ringFd);
+		m_ringFd = -1;
+	}
+}
+
+NtpUringBatch::~NtpUringBatch()
+{
+	// Closing the ring cancels the multishot receives
+	if (m_ringFd >= 0)
+		close(m_ringFd);
+	for (int ii = 0; ii < 2; ii++)
+	{
+		if (m_receivers[ii].fd >= 0)
+			close(m_receivers[ii].fd);
+	}
+
+	if (m_bufferRing != MAP_FAILED)
+		munmap(m_bufferRing, m_bufferRingSize);
+	if (m_sqes != MAP_FAILED)
+		munmap(m_sqes, m_sqesSize);
+	if (m_cqRing != MAP_FAILED && m_cqRing != m_sqRing)
+		munmap(m_cqRing, m_cqRingSize);
+	if (m_sqRing != MAP_FAILED)
+		munmap(m_sqRing, m_sqRingSize);
+}
+
+bool
+NtpUringBatch::Setup(void)
+{
+	// Room to queue the whole batch (up to the limit of the kernel), and twice as many completions
+	unsigned int entries = RoundUpPowerOfTwo((unsigned int)m_capacity + 2);
+	if (entries > NTP_URING_MAX_SQ_ENTRIES)
+		entries = NTP_URING_MAX_SQ_ENTRIES;
+	unsigned int cqEntries = RoundUpPowerOfTwo(((unsigned int)m_capacity * 2) + 64);
+	if (cqEntries > NTP_URING_MAX_CQ_ENTRIES)
+		cqEntries = NTP_URING_MAX_CQ_ENTRIES;
+
+	// Only this thread uses the ring, and the completions are only needed when it waits for them.
+	// Not IORING_SETUP_DEFER_TASKRUN: its wait counts the task works, not the completions, and
+	// one task work of a multishot receive may post several responses (the wait would time out)
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+	params.cq_entries = cqEntries;
+	m_ringFd = (int)syscall(__NR_io_uring_setup, entries, &params);
+	if (m_ringFd < 0 && errno == EINVAL)
+	{
+		memset(&params, 0, sizeof(params));
+		params.flags = IORING_SETUP_CQSIZE;
+		params.cq_entries = cqEntries;
+		m_ringFd = (int)syscall(__NR_io_uring_setup, entries, &params);
+	}
+	if (m_ringFd < 0 || !(params.features & IORING_FEAT_EXT_ARG))
+		return false;
+
+	m_sqRingSize = params.sq_off.array + (params.sq_entries * sizeof(unsigned int));
+	m_cqRingSize = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (m_cqRingSize > m_sqRingSize)
+			m_sqRingSize = m_cqRingSize;
+	}
+	m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQ_RING);
+	if (m_sqRing == MAP_FAILED)
+		return false;
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		m_cqRing = m_sqRing;
+	else
+	{
+		m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_CQ_RING);
+		if (m_cqRing == MAP_FAILED)
+			return false;
+	}
+	m_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	m_sqes = mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQES);
+	if (m_sqes == MAP_FAILED)
+		return false;
+
+	char* sq = (char*)m_sqRing;
+	char* cq = (char*)m_cqRing;
+	m_sqHead = (unsigned int*)(sq + params.sq_off.head);
+	m_sqTail = (unsigned int*)(sq + params.sq_off.tail);
+	m_sqMask = *(unsigned int*)(sq + params.sq_off.ring_mask);
+	m_sqEntries = params.sq_entries;
+	unsigned int* array = (unsigned int*)(sq + params.sq_off.array);
+	for (unsigned int ii = 0; ii < m_sqEntries; ii++)
+		array[ii] = ii;
+	m_cqHead = (unsigned int*)(cq + params.cq_off.head);
+	m_cqTail = (unsigned int*)(cq + params.cq_off.tail);
+	m_cqMask = *(unsigned int*)(cq + params.cq_off.ring_mask);
+	m_cqes = cq + params.cq_off.cqes;
+
+	// The buffers the multishot receives fill: header, source address, control messages, payload
+	m_bufferCount = RoundUpPowerOfTwo((unsigned int)m_capacity);
+	if (m_bufferCount < NTP_URING_MIN_BUFFERS)
+		m_bufferCount = NTP_URING_MIN_BUFFERS;
+	if (m_bufferCount > NTP_URING_MAX_BUFFERS)
+		m_bufferCount = NTP_URING_MAX_BUFFERS;
+	m_bufferSize = (unsigned int)(sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_storage) +
+		NTP_TIMESTAMP_CONTROL_SIZE + MaxMessageSize + 63) & ~63u;
+	m_buffers.resize((size_t)m_bufferCount * m_bufferSize);
+
+	m_bufferRingSize = m_bufferCount * sizeof(struct io_uring_buf);
+	m_bufferRing = mmap(nullptr, m_bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (m_bufferRing == MAP_FAILED)
+		return false;
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)m_bufferRing;
+	reg.ring_entries = m_bufferCount;
+	reg.bgid = NTP_URING_BUFFER_GROUP;
+	if (syscall(__NR_io_uring_register, m_ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+		return false;
+
+	// The entries start at the ring itself (the tail overlays the first one), but the bufs
+	// member of io_uring_buf_ring is not at offset 0 in C++ (empty struct of __DECLARE_FLEX_ARRAY)
+	struct io_uring_buf* bufs = (struct io_uring_buf*)m_bufferRing;
+	for (unsigned int ii = 0; ii < m_bufferCount; ii++)
+	{
+		bufs[ii].addr = (uint64_t)(uintptr_t)&m_buffers[(size_t)ii * m_bufferSize];
+		bufs[ii].len = m_bufferSize;
+		bufs[ii].bid = (unsigned short)ii;
+	}
+	m_bufferTail = (unsigned short)m_bufferCount;
+	__atomic_store_n(&((struct io_uring_buf_ring*)m_bufferRing)->tail, m_bufferTail, __ATOMIC_RELEASE);
+	return true;
+}
+
+bool
+NtpUringBatch::IsOpen(void) const
+{
+	return (m_ringFd >= 0);
+}
+
+void
+NtpUringBatch::Clear(void)
+{
+	m_count = 0;
+	m_cookies.Clear();
+}
+
+int
+NtpUringBatch::Add(const struct sockaddr* addr, socklen_t addrLen, const char* request, int length, int stampOffset)
+{
+	if (m_count >= m_capacity || length <= 0 || length > MaxMessageSize || stampOffset + 8 > length ||
+		addrLen > sizeof(struct sockaddr_storage) || (addr->sa_family != AF_INET && addr->sa_family != AF_INET6))
+		return -1;
+
+	Slot& slot = m_slots[m_count];
+	memcpy(&slot.addr, addr, addrLen);
+	slot.addrLen = addrLen;
+	slot.length = length;
+	slot.stampOffset = stampOffset;
+	slot.replyLength = 0;
+	memcpy(slot.request, request, length);
+
+	// A transmit timestamp written by the caller (not at send time) is the cookie of the request
+	slot.cookie = 0;
+	if (length >= NtpConstPacketView::Size && stampOffset != NtpConstPacketView::OffsetTransmitTimestamp)
+		slot.cookie = NtpConstPacketView((const unsigned char*)request).TransmitTimestamp();
+	if (slot.cookie != 0)
+		m_cookies.Insert(slot.cookie, (uint32_t)m_count);
+	return m_count++;
+}
+
+int
+NtpUringBatch::Count(void) const
+{
+	return m_count;
+}
+
+const char*
+NtpUringBatch::Reply(int index) const
+{
+	if (index < 0 || index >= m_count || m_slots[index].replyLength == 0)
+		return nullptr;
+	return m_slots[index].reply;
+}
+
+int
+NtpUringBatch::ReplyLength(int index) const
+{
+	if (index < 0 || index >= m_count)
+		return 0;
+	return m_slots[index].replyLength;
+}
+
+struct timespec
+NtpUringBatch::ReceiveTime(int index) const
+{
+	struct timespec ts = { 0, 0 };
+	if (index >= 0 && index < m_count)
+		ts = m_slots[index].receiveTime;
+	return ts;
+}
+
+bool
+NtpUringBatch::KernelTimestamp(int index) const
+{
+	if (index < 0 || index >= m_count)
+		return false;
+	return m_slots[index].kernelTimestamp;
+}
+
+struct timespec
+NtpUringBatch::TransmitTime(int index) const
+{
+	struct timespec ts = { 0, 0 };
+	if (index >= 0 && index < m_count)
+		ts = m_slots[index].transmitTime;
+	return ts;
+}
+
+bool
+NtpUringBatch::KernelTransmitTimestamp(int) const
+{
+	return false;
+}
+
+void
+NtpUringBatch::SetKernelTimestamps(bool enable)
+{
+	m_kernelTimestamps = enable;
+}
+
+uint64_t
+NtpUringBatch::GetSystemCalls(void) const
+{
+	return m_systemCalls;
+}
+
+NtpUringBatch::Receiver*
+NtpUringBatch::GetReceiver(int family)
+{
+	Receiver& receiver = m_receivers[(family == AF_INET6) ? 1 : 0];
+	if (receiver.fd >= 0)
+		return &receiver;
+
+	receiver.fd = socket(family, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+	if (receiver.fd < 0)
+		return nullptr;
+
+	int size = NTP_URING_SOCKET_BUFFER;
+	setsockopt(receiver.fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	if (m_kernelTimestamps)
+		NtpEnableRxTimestamps(receiver.fd);
+
+	// Bound now, as the receive is armed before the first send
+	struct sockaddr_storage local;
+	memset(&local, 0, sizeof(local));
+	local.ss_family = (sa_family_t)family;
+	bind(receiver.fd, (struct sockaddr*)&local, (family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+
+	receiver.msg.msg_namelen = sizeof(struct sockaddr_storage);
+	receiver.msg.msg_controllen = m_kernelTimestamps ? NTP_TIMESTAMP_CONTROL_SIZE : 0;
+	return &receiver;
+}
+
+void*
+NtpUringBatch::GetSqe(void)
+{
+	unsigned int tail = *m_sqTail + m_sqQueued;
+	if (tail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries)
+	{
+		if (Enter(0, 0) != 0)
+			return nullptr;
+		tail = *m_sqTail + m_sqQueued;
+		if (tail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries)
+			return nullptr;
+	}
+
+	struct io_uring_sqe* sqe = &((struct io_uring_sqe*)m_sqes)[tail & m_sqMask];
+	memset(sqe, 0, sizeof(*sqe));
+	m_sqQueued++;
+	return sqe;
+}
+
+bool
+NtpUringBatch::QueueSend(int index)
+{
+	Slot& slot = m_slots[index];
+	Receiver* receiver = GetReceiver(slot.addr.ss_family);
+	if (receiver == nullptr)
+		return false;
+
+	struct io_uring_sqe* sqe = (struct io_uring_sqe*)GetSqe();
+	if (sqe == nullptr)
+		return false;
+
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = receiver->fd;
+	sqe->addr = (uint64_t)(uintptr_t)slot.request;
+	sqe->len = (uint32_t)slot.length;
+	sqe->addr2 = (uint64_t)(uintptr_t)&slot.addr;   // the destination of an unconnected socket
+	sqe->addr_len = (uint16_t)slot.addrLen;
+	sqe->user_data = (NTP_URING_SEND_TAG << 32) | (uint32_t)index;
+	m_pendingSends++;
+	return true;
+}
+
+bool
+NtpUringBatch::QueueReceive(int receiver)
+{
+	struct io_uring_sqe* sqe = (struct io_uring_sqe*)GetSqe();
+	if (sqe == nullptr)
+		return false;
+
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = m_receivers[receiver].fd;
+	sqe->addr = (uint64_t)(uintptr_t)&m_receivers[receiver].msg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = NTP_URING_BUFFER_GROUP;
+	sqe->user_data = (NTP_URING_RECV_TAG << 32) | (uint32_t)receiver;
+	m_receivers[receiver].armed = true;
+	return true;
+}
+
+int
+NtpUringBatch::Enter(unsigned int minComplete, int64_t deadlineNs)
+{
+	if (m_sqQueued > 0)
+	{
+		__atomic_store_n(m_sqTail, *m_sqTail + m_sqQueued, __ATOMIC_RELEASE);
+		m_sqQueued = 0;
+	}
+	unsigned int toSubmit = *m_sqTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+
+	// The completions are posted when the thread enters the ring (IORING_SETUP_COOP_TASKRUN)
+	unsigned int flags = IORING_ENTER_GETEVENTS;
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	void* argp = nullptr;
+	size_t argSize = 0;
+	if (minComplete > 0)
+	{
+		int64_t remaining = deadlineNs - MonotonicNs();
+		if (remaining < 0)
+			remaining = 0;
+		ts.tv_sec = remaining / 1000000000LL;
+		ts.tv_nsec = remaining % 1000000000LL;
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+		flags |= IORING_ENTER_EXT_ARG;
+		argp = &arg;
+		argSize = sizeof(arg);
+	}
+
+	for (;;)
+	{
+		m_systemCalls++;
+		int ret = (int)syscall(__NR_io_uring_enter, m_ringFd, toSubmit, minComplete, flags, argp, argSize);
+		if (ret >= 0 || errno == ETIME || errno == EBUSY || (errno == EINTR && minComplete == 0))
+			return 0;
+		if (errno != EINTR && errno != EAGAIN)
+			return errno;
+		toSubmit = *m_sqTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+	}
+}
+
+bool
+NtpUringBatch::Match(const struct sockaddr_storage& from, const char* payload, int length, struct msghdr* control)
+{
+	// The request whose cookie the response echoes (a constant time lookup), if any;
+	// otherwise the first unanswered request without cookie sent to the source address
+	int index = -1;
+	uint32_t found;
+	if (length >= NtpConstPacketView::Size &&
+		m_cookies.Find(NtpConstPacketView((const unsigned char*)payload).OriginateTimestamp(), &found))
+	{
+		if ((int)found < m_count && m_slots[found].replyLength == 0 && SameAddress(m_slots[found].addr, from))
+			index = (int)found;
+	}
+	else
+	{
+		for (int jj = 0; jj < m_count; jj++)
+		{
+			if (m_slots[jj].cookie == 0 && m_slots[jj].replyLength == 0 && SameAddress(m_slots[jj].addr, from))
+			{
+				index = jj;
+				break;
+			}
+		}
+	}
+	if (index < 0 || length <= 0)
+		return false; // late, duplicated or spoofed
+
+	Slot& slot = m_slots[index];
+	slot.replyLength = (length < MaxMessageSize) ? length : (int)MaxMessageSize;
+	slot.kernelTimestamp = (control->msg_controllen > 0) && NtpReadRxTimestamp(control, &slot.receiveTime);
+	if (!slot.kernelTimestamp)
+		clock_gettime(CLOCK_REALTIME, &slot.receiveTime);
+	memcpy(slot.reply, payload, slot.replyLength);
+	return true;
+}
+
+int
+NtpUringBatch::Reap(void)
+{
+	int answered = 0;
+	bool recycled = false;
+	struct io_uring_buf_ring* bufferRing = (struct io_uring_buf_ring*)m_bufferRing;
+	unsigned int head = *m_cqHead;
+	unsigned int tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++)
+	{
+		const struct io_uring_cqe* cqe = &((const struct io_uring_cqe*)m_cqes)[head & m_cqMask];
+		uint64_t tag = cqe->user_data >> 32;
+		int index = (int)(cqe->user_data & 0xFFFFFFFF);
+
+		if (tag == NTP_URING_SEND_TAG)
+		{
+			m_pendingSends--; // a request that could not be sent is simply not answered
+			continue;
+		}
+
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			m_receivers[index].armed = false; // ended (e.g. out of buffers): armed again before the next wait
+		if (!(cqe->flags & IORING_CQE_F_BUFFER))
+			continue;
+
+		unsigned short bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+		char* buffer = &m_buffers[(size_t)bid * m_bufferSize];
+		const struct msghdr& layout = m_receivers[index].msg;
+		size_t headerSize = sizeof(struct io_uring_recvmsg_out) + layout.msg_namelen + layout.msg_controllen;
+		if (cqe->res >= (int)headerSize)
+		{
+			const struct io_uring_recvmsg_out* out = (const struct io_uring_recvmsg_out*)buffer;
+			struct sockaddr_storage from;
+			memset(&from, 0, sizeof(from));
+			memcpy(&from, buffer + sizeof(*out), (out->namelen < layout.msg_namelen) ? out->namelen : layout.msg_namelen);
+
+			struct msghdr control;
+			memset(&control, 0, sizeof(control));
+			control.msg_control = buffer + sizeof(*out) + layout.msg_namelen;
+			control.msg_controllen = (out->controllen < layout.msg_controllen) ? out->controllen : layout.msg_controllen;
+
+			int available = cqe->res - (int)headerSize;
+			int length = ((int)out->payloadlen < available) ? (int)out->payloadlen : available;
+			if (Match(from, buffer + headerSize, length, &control))
+				answered++;
+		}
+
+		// Hand the buffer back to the kernel
+		struct io_uring_buf* buf = (struct io_uring_buf*)m_bufferRing + (m_bufferTail & (m_bufferCount - 1));
+		buf->addr = (uint64_t)(uintptr_t)buffer;
+		buf->len = m_bufferSize;
+		buf->bid = bid;
+		m_bufferTail++;
+		recycled = true;
+	}
+
+	__atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+	if (recycled)
+		__atomic_store_n(&bufferRing->tail, m_bufferTail, __ATOMIC_RELEASE);
+	return answered;
+}
+
+int
+NtpUringBatch::Exchange(int timeoutMs)
+{
+	if (m_ringFd < 0)
+	{
+		errno = ENOSYS;
+		return -1;
+	}
+
+	for (int ii = 0; ii < m_count; ii++)
+		m_slots[ii].replyLength = 0;
+	if (m_count == 0)
+		return 0;
+
+	// All the requests are submitted at once, so they share the T1 (unless stamped in the request)
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	for (int ii = 0; ii < m_count; ii++)
+	{
+		Slot& slot = m_slots[ii];
+		if (slot.stampOffset >= 0)
+			NtpStampMessage(slot.request, slot.stampOffset, &slot.transmitTime);
+		else
+			slot.transmitTime = now;
+		if (!QueueSend(ii))
+			return -1;
+	}
+
+	int64_t deadline = MonotonicNs() + ((int64_t)timeoutMs * 1000000LL);
+	int answered = 0;
+	for (;;)
+	{
+		for (int ii = 0; ii < 2; ii++)
+		{
+			if (m_receivers[ii].fd >= 0 && !m_receivers[ii].armed && !QueueReceive(ii))
+				return -1;
+		}
+
+		// With the kernel receive timestamps, waking up once for all the completions is enough
+		bool expired = (MonotonicNs() >= deadline);
+		unsigned int wanted = (unsigned int)m_pendingSends + (expired ? 0 : (unsigned int)(m_count - answered));
+		if (!m_kernelTimestamps && wanted > 0)
+			wanted = 1;
+		int _error = Enter(wanted, expired ? MonotonicNs() + 10000000LL : deadline);
+		if (_error != 0)
+		{
+			errno = _error;
+			return -1;
+		}
+
+		answered += Reap();
+		if (m_pendingSends == 0 && (answered >= m_count || MonotonicNs() >= deadline))
+			break;
+	}
+	return answered;
+}
+
+#endif  /* NTP_HAVE_IO_URING */
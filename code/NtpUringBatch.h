@@ -0,0 +1,222 @@
+/**
+ *  This class is the io_uring backend of NtpBatch: it sends a batch of SNTP requests to
+ *  several servers and collects the responses, with the same interface, but with almost
+ *  no system call per packet:
+ *  - the requests are queued on the submission ring and sent with one io_uring_enter(),
+ *    straight from their slots (a 48-byte request is copied by the kernel anyway, so
+ *    registered buffers, which IORING_OP_SEND does not take on every kernel, gain nothing);
+ *  - the responses are received by one multishot recvmsg per socket, which keeps running
+ *    across batches, into a ring of provided buffers (registered with the kernel) that are
+ *    handed back as soon as the response is copied to its slot;
+ *  - the same io_uring_enter() that submits the requests waits for the completions.
+ *  The kernel receive timestamps come with each response (SO_TIMESTAMPNS), but reading the
+ *  kernel transmit timestamps would take one system call per packet (the error queue), so
+ *  the transmit time is the one read right before the requests are submitted.
+ *
+ *  The ring is set up with raw system calls (no liburing). Building it requires the
+ *  <linux/io_uring.h> header (NTP_HAVE_IO_URING), and running it Linux 6.0 or later
+ *  (multishot recvmsg, buffer rings): check IsOpen(), and use NtpBatch otherwise.
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#ifndef NTPURINGBATCH_H
+#define NTPURINGBATCH_H
+
+#ifndef NTP_HAVE_IO_URING
+#if !defined(_WIN32) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define NTP_HAVE_IO_URING (1)
+#endif
+#endif
+#endif
+#ifndef NTP_HAVE_IO_URING
+#define NTP_HAVE_IO_URING (0)
+#endif
+
+#if NTP_HAVE_IO_URING
+
+#include "NtpRequestTable.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+
+class NtpUringBatch
+{
+public:
+	/**
+	 * \param capacity the maximum number of requests in one batch
+	 */
+	explicit NtpUringBatch(int capacity);
+	~NtpUringBatch();
+
+	/**
+	 * This function returns true if the ring could be set up (the kernel supports io_uring).
+	 */
+	bool IsOpen(void) const;
+	/**
+	 * This function removes all the requests (the buffers are kept for reuse).
+	 */
+	void Clear(void);
+	/**
+	 * This function adds a request to the batch (see NtpBatch::Add).
+	 *
+	 * Returns the index of the request in the batch, or -1 if the batch is full
+	 */
+	int Add(const struct sockaddr* addr, socklen_t addrLen, const char* request, int length, int stampOffset = -1);
+	/**
+	 * This function sends all the requests and waits up to timeoutMs for the responses
+	 * (see NtpBatch::Exchange for how the responses are matched to the requests).
+	 *
+	 * Returns the number of responses received, or -1 on error
+	 */
+	int Exchange(int timeoutMs);
+	/**
+	 * This function returns the number of requests in the batch.
+	 */
+	int Count(void) const;
+	/**
+	 * This function returns the response to the request at index (nullptr if none was received).
+	 */
+	const char* Reply(int index) const;
+	/**
+	 * This function returns the size of the response to the request at index (0 if none was received).
+	 */
+	int ReplyLength(int index) const;
+	/**
+	 * This function returns the (CLOCK_REALTIME) time at which the response to the request at
+	 * index was received (the kernel receive timestamp if KernelTimestamp(index)).
+	 */
+	struct timespec ReceiveTime(int index) const;
+	/**
+	 * This function returns true if ReceiveTime(index) was taken by the kernel.
+	 */
+	bool KernelTimestamp(int index) const;
+	/**
+	 * This function returns the (CLOCK_REALTIME) time at which the request at index was
+	 * submitted to the ring.
+	 */
+	struct timespec TransmitTime(int index) const;
+	/**
+	 * This function returns false: the kernel transmit timestamps are not read (see above).
+	 */
+	bool KernelTransmitTimestamp(int index) const;
+	/**
+	 * This function enables (default) or disables the kernel receive timestamps.
+	 * It must be called before the first Exchange().
+	 */
+	void SetKernelTimestamps(bool enable);
+	/**
+	 * This function returns the number of io_uring_enter() calls so far, e.g. to check the
+	 * system calls per packet.
+	 */
+	uint64_t GetSystemCalls(void) const;
+
+private:
+	NtpUringBatch(const NtpUringBatch&);
+	NtpUringBatch& operator=(const NtpUringBatch&);
+
+	enum { MaxMessageSize = 68 }; // 48-byte header + optional key id (4) and digest (16)
+
+	struct Slot
+	{
+		char request[MaxMessageSize];
+		char reply[MaxMessageSize];
+		struct sockaddr_storage addr;
+		socklen_t addrLen;
+		int length;
+		int stampOffset;
+		int replyLength;
+		uint64_t cookie;                 // transmit timestamp of the request (0 if none)
+		struct timespec transmitTime;
+		struct timespec receiveTime;
+		bool kernelTimestamp;
+	};
+
+	// The receive side of a socket (one per address family)
+	struct Receiver
+	{
+		int fd;
+		bool armed;                      // the multishot recvmsg is running
+		struct msghdr msg;               // layout of the provided buffers (name and control sizes)
+	};
+
+	/**
+	 * This function creates the ring, maps its queues and registers the buffers.
+	 */
+	bool Setup(void);
+	/**
+	 * This function returns the receiver of the address family (its socket created on first use).
+	 */
+	Receiver* GetReceiver(int family);
+	/**
+	 * This function returns a free submission queue entry, submitting the queued ones if the ring is full.
+	 */
+	void* GetSqe(void);
+	/**
+	 * This function queues the send of the request at index.
+	 */
+	bool QueueSend(int index);
+	/**
+	 * This function queues the multishot recvmsg of the receiver.
+	 */
+	bool QueueReceive(int receiver);
+	/**
+	 * This function submits the queued entries and waits for up to minComplete completions
+	 * (or until the deadline, CLOCK_MONOTONIC in ns, 0 for no wait).
+	 * Returns 0 upon success (or timeout), or the errno value.
+	 */
+	int Enter(unsigned int minComplete, int64_t deadlineNs);
+	/**
+	 * This function processes the completions in the ring.
+	 * Returns the number of newly answered slots.
+	 */
+	int Reap(void);
+	/**
+	 * This function matches a received datagram to its slot.
+	 * Returns true if it answered a slot.
+	 */
+	bool Match(const struct sockaddr_storage& from, const char* payload, int length, struct msghdr* control);
+
+	int m_capacity;
+	int m_count;
+	bool m_kernelTimestamps;
+	int m_pendingSends;
+	uint64_t m_systemCalls;
+	std::vector<Slot> m_slots;
+	NtpRequestTable m_cookies;           // cookie -> slot
+	Receiver m_receivers[2];             // IPv4, IPv6
+
+	// The ring
+	int m_ringFd;
+	void* m_sqRing;
+	size_t m_sqRingSize;
+	void* m_cqRing;
+	size_t m_cqRingSize;
+	void* m_sqes;
+	size_t m_sqesSize;
+	unsigned int* m_sqHead;
+	unsigned int* m_sqTail;
+	unsigned int m_sqMask;
+	unsigned int m_sqEntries;
+	unsigned int m_sqQueued;             // entries written but not submitted yet
+	unsigned int* m_cqHead;
+	unsigned int* m_cqTail;
+	unsigned int m_cqMask;
+	void* m_cqes;
+
+	// The provided buffers of the responses
+	void* m_bufferRing;
+	size_t m_bufferRingSize;
+	unsigned int m_bufferCount;
+	unsigned int m_bufferSize;
+	std::vector<char> m_buffers;
+	unsigned short m_bufferTail;
+};
+
+#endif  /* NTP_HAVE_IO_URING */
+
+#endif  /* NTPURINGBATCH_H */
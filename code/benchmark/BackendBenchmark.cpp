@@ -0,0 +1,173 @@
+/**
+ *  Benchmark of the client I/O backends: batches of SNTP requests to an NtpServer on the
+ *  loopback, sent and collected by
+ *  - the epoll transport (NtpTransport, one socket per exchange),
+ *  - recvmmsg()/sendmmsg() (NtpBatch),
+ *  - io_uring (NtpUringBatch, if built with <linux/io_uring.h> and supported by the kernel).
+ *  Prints the cost per packet (us) and the share of the packets answered per backend, and the
+ *  io_uring_enter() calls per packet, one "name value" per line.
+ *
+ *  Build (from the code folder):
+ *    g++ -O2 -std=c++17 -pthread -I. benchmark/BackendBenchmark.cpp NtpTransport.cpp NtpTimerWheel.cpp NtpBatch.cpp NtpUringBatch.cpp NtpRequestTable.cpp NtpServer.cpp NtpAuth.cpp NtpClock.cpp NtpTscClock.cpp -lcrypto -o backend_benchmark
+ *
+ *  Usage: backend_benchmark [batch size] [batches]
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#include "NtpServer.h"
+#include "NtpPacket.h"
+#include "NtpTransport.h"
+#include "NtpBatch.h"
+#include "NtpUringBatch.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+#define BENCHMARK_BATCH_SIZE (64)
+#define BENCHMARK_BATCHES (2000)
+#define BENCHMARK_WARMUP_BATCHES (20)
+#define BENCHMARK_TIMEOUT_MS (1000)
+
+struct Result
+{
+	double usPerPacket;
+	double answered;     // share of the requests answered
+};
+
+class BackendBenchmark
+{
+public:
+	BackendBenchmark(uint16_t port, int batchSize, int batches)
+		: m_batchSize(batchSize),
+		  m_batches(batches)
+	{
+		memset(&m_server, 0, sizeof(m_server));
+		m_server.sin_family = AF_INET;
+		m_server.sin_port = htons(port);
+		m_server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		memset(m_request, 0, sizeof(m_request));
+		NtpPacketView(m_request).SetHeader(0, 4, 3);
+	}
+
+	Result Transport(void)
+	{
+		NtpTransport transport;
+		transport.Open();
+		uint64_t answered = 0;
+		auto round = [&]() {
+			for (int i = 0; i < m_batchSize; i++)
+			{
+				transport.Submit((const struct sockaddr*)&m_server, sizeof(m_server), (const char*)m_request, NTP_MSG_SIZE,
+					BENCHMARK_TIMEOUT_MS, [&](const NtpTransport::Completion& completion) {
+						if (completion.status == NtpTransport::Completed)
+							answered++;
+					}, NtpConstPacketView::OffsetTransmitTimestamp);
+			}
+			while (transport.Outstanding() > 0)
+				transport.Poll(-1);
+		};
+		return Run(round, &answered);
+	}
+
+	template <typename Batch>
+	Result Batched(Batch& batch)
+	{
+		uint64_t answered = 0;
+		auto round = [&]() {
+			batch.Clear();
+			for (int i = 0; i < m_batchSize; i++)
+				batch.Add((const struct sockaddr*)&m_server, sizeof(m_server), (const char*)m_request, NTP_MSG_SIZE,
+					NtpConstPacketView::OffsetTransmitTimestamp);
+			int received = batch.Exchange(BENCHMARK_TIMEOUT_MS);
+			if (received > 0)
+				answered += received;
+		};
+		return Run(round, &answered);
+	}
+
+	int Packets(void) const
+	{
+		return m_batchSize * m_batches;
+	}
+
+private:
+	template <typename Round>
+	Result Run(Round round, uint64_t* answered)
+	{
+		for (int b = 0; b < BENCHMARK_WARMUP_BATCHES; b++)
+			round();
+		*answered = 0;
+
+		auto start = std::chrono::steady_clock::now();
+		for (int b = 0; b < m_batches; b++)
+			round();
+		auto end = std::chrono::steady_clock::now();
+
+		Result result;
+		result.usPerPacket = std::chrono::duration<double, std::micro>(end - start).count() / Packets();
+		result.answered = (double)*answered / Packets();
+		return result;
+	}
+
+	struct sockaddr_in m_server;
+	unsigned char m_request[NTP_MSG_SIZE];
+	int m_batchSize;
+	int m_batches;
+};
+
+static void
+Print(const char* name, const Result& result)
+{
+	printf("%s_us_per_packet %.3f\n", name, result.usPerPacket);
+	printf("%s_answered %.4f\n", name, result.answered);
+}
+
+int main(int argc, char** argv)
+{
+	int batchSize = (argc > 1) ? atoi(argv[1]) : BENCHMARK_BATCH_SIZE;
+	int batches = (argc > 2) ? atoi(argv[2]) : BENCHMARK_BATCHES;
+
+	NtpServer server;
+	server.SetReference(1, 0x47505300, -20); // "GPS"
+	if (!server.Open(0, 2, "127.0.0.1") || !server.Start())
+	{
+		printf("failed to start the server\n");
+		return 1;
+	}
+
+	BackendBenchmark benchmark(server.GetPort(), batchSize, batches);
+	printf("batch_size %d\n", batchSize);
+	Print("epoll", benchmark.Transport());
+
+	NtpBatch batch(batchSize);
+	Print("mmsg", benchmark.Batched(batch));
+
+#if NTP_HAVE_IO_URING
+	NtpUringBatch uring(batchSize);
+	if (uring.IsOpen())
+	{
+		uint64_t before = uring.GetSystemCalls();
+		Print("io_uring", benchmark.Batched(uring));
+		// Warm-up included
+		printf("io_uring_enter_per_packet %.4f\n", (double)(uring.GetSystemCalls() - before) /
+			((double)batchSize * (batches + BENCHMARK_WARMUP_BATCHES)));
+	}
+	else
+		printf("io_uring_unavailable 1\n");
+#else
+	printf("io_uring_unavailable 1\n");
+#endif
+
+	server.Stop();
+	return 0;
+}
@@ -0,0 +1,219 @@
+/**
+ *  Benchmark suite of the SNTP client hot path, to catch regressions:
+ *  - cost per call (ns) of CreateMessage(), ReceivedMessage(), the GetNtp* decoders and
+ *    the UNIX/NTP converters;
+ *  - latency of a full exchange (CreateMessage, send, server, receive, ReceivedMessage) on
+ *    the loopback against an in-process NtpServer, as p50/p99/p999 (Linux only).
+ *  The output is one "name value" per line (ns), e.g. to be diffed against a baseline.
+ *
+ *  Build (from the code folder):
+ *    g++ -O2 -std=c++17 -pthread -I. benchmark/NtpBenchmark.cpp NtpClient.cpp NtpRequestTable.cpp NtpResolver.cpp NtpServer.cpp NtpTransport.cpp NtpTimerWheel.cpp NtpBatch.cpp NtpUringBatch.cpp NtpAuth.cpp NtpClock.cpp NtpTscClock.cpp NtpFilter.cpp NtpDiscipline.cpp NtpInstrumentation.cpp NtpMetrics.cpp -lresolv -lcrypto -o ntp_benchmark
+ *
+ *  Usage: ntp_benchmark [exchanges]
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#include "NtpClient.h"
+#include "NtpPacket.h"
+
+#ifndef _WIN32
+#include "NtpServer.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+#define BENCHMARK_CALLS (2000000)
+#define BENCHMARK_SLOW_CALLS (200000)      // for the functions that take the time
+#define BENCHMARK_EXCHANGES (100000)
+#define BENCHMARK_WARMUP_EXCHANGES (1000)
+
+// Keeps the results from being optimised away
+static volatile uint64_t g_sink;
+
+class NtpBenchmark
+{
+public:
+	template <typename Call>
+	static double NsPerCall(int calls, Call call)
+	{
+		uint64_t sink = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < calls; i++)
+			sink += call(i);
+		auto end = std::chrono::steady_clock::now();
+		g_sink = sink;
+		return std::chrono::duration<double, std::nano>(end - start).count() / calls;
+	}
+
+	// A response to the request in buffer, as a server 1 ms away would send it
+	static void MakeResponse(const NtpClient& client, const char* request, char* response, uint64_t* receiveTimestamp)
+	{
+		NtpConstPacketView requestView((const unsigned char*)request);
+		NtpPacketView view((unsigned char*)response);
+		memset(response, 0, NTP_MSG_SIZE);
+		view.SetHeader(0, 4, 4);
+		view.SetStratum(1);
+		view.SetPollInterval(6);
+		view.SetPrecision((unsigned char)-20);
+		view.SetRootDispersion(0x00000010);
+		view.SetReferenceIdentifier(0x47505300); // "GPS"
+		uint64_t t1 = client.m_originateTimestamp;
+		view.SetOriginateTimestamp(requestView.TransmitTimestamp()); // the cookie
+		view.SetReceiveTimestamp(t1 + (1ULL << 22));
+		view.SetTransmitTimestamp(t1 + (1ULL << 22) + (1ULL << 12));
+		*receiveTimestamp = t1 + (1ULL << 23);
+	}
+
+	static void Codec(void)
+	{
+		NtpClient client;
+		client.SetClockState(nullptr);
+		char request[NTP_MSG_SIZE];
+		char response[NTP_MSG_SIZE];
+		uint64_t receiveTimestamp;
+		client.CreateMessage(request);
+		MakeResponse(client, request, response, &receiveTimestamp);
+		uint64_t cookie = client.m_transmitCookie;
+
+		printf("create_message_ns %.2f\n", NsPerCall(BENCHMARK_SLOW_CALLS, [&](int) {
+			client.CreateMessage(request);
+			return (uint64_t)request[NTP_MSG_OFFSET_ORIGINATE_TIMESTAMP + 7];
+		}));
+
+		double received = NsPerCall(BENCHMARK_SLOW_CALLS, [&](int) {
+			client.m_transmitCookie = cookie; // as if each call were the response to a new request
+			client.ReceivedMessage(response, nullptr, receiveTimestamp, NtpClient::KernelTimestamp);
+			return (uint64_t)client.GetClockOffsetNs();
+		});
+		printf("received_message_ns %.2f\n", received);
+
+		printf("get_ntp_timestamp64_ns %.2f\n", NsPerCall(BENCHMARK_CALLS, [&](int i) {
+			return client.GetNtpTimestamp64(NTP_MSG_OFFSET_TRANSMIT_TIMESTAMP - (i & 8), response);
+		}));
+		printf("get_ntp_field32_ns %.2f\n", NsPerCall(BENCHMARK_CALLS, [&](int i) {
+			return (uint64_t)client.GetNtpField32(NTP_MSG_OFFSET_ROOT_DISPERSION - (i & 4), response);
+		}));
+		printf("get_reference_id_ns %.2f\n", NsPerCall(BENCHMARK_CALLS, [&](int) {
+			int refId[4];
+			client.GetReferenceId(NTP_MSG_OFFSET_REFERENCE_IDENTIFIER, response, refId);
+			return (uint64_t)(refId[0] + refId[3]);
+		}));
+
+		printf("convert_unix_to_ntp_ns %.2f\n", NsPerCall(BENCHMARK_CALLS, [&](int i) {
+			struct timeval unixTs = { 1700000000 + i, i % 1000000 };
+			struct NtpClient::ntp_timestamp ntpTs;
+			client.convert_unix_to_ntp(&ntpTs, &unixTs);
+			return (uint64_t)ntpTs.fraction;
+		}));
+		printf("convert_ntp_to_unix_ns %.2f\n", NsPerCall(BENCHMARK_CALLS, [&](int i) {
+			struct NtpClient::ntp_timestamp ntpTs = { 3908988800u + (uint32_t)i, (uint32_t)i * 4295u };
+			struct timeval unixTs;
+			client.convert_ntp_to_unix(&ntpTs, &unixTs);
+			return (uint64_t)unixTs.tv_usec;
+		}));
+		printf("convert_ntp_to_unix_ns_ns %.2f\n", NsPerCall(BENCHMARK_CALLS, [&](int i) {
+			return (uint64_t)NtpClient::convert_ntp_to_unix_ns(receiveTimestamp + ((uint64_t)i << 20));
+		}));
+		printf("convert_ntp_diff_to_ns_ns %.2f\n", NsPerCall(BENCHMARK_CALLS, [&](int i) {
+			return (uint64_t)NtpClient::convert_ntp_diff_to_ns((int64_t)i << 16);
+		}));
+		printf("convert_ntp_to_date_ns %.2f\n", NsPerCall(BENCHMARK_CALLS, [&](int i) {
+			struct NtpClient::date_structure date;
+			client.convert_ntp_to_date(receiveTimestamp + ((uint64_t)i << 20), &date);
+			return (uint64_t)date.millisecond;
+		}));
+	}
+
+#ifndef _WIN32
+	static void Loopback(int exchanges)
+	{
+		NtpServer server;
+		server.SetReference(1, 0x47505300, -20); // "GPS"
+		if (!server.Open(0, 1, "127.0.0.1") || !server.Start())
+		{
+			printf("loopback_error 1\n");
+			return;
+		}
+
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(server.GetPort());
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		struct timeval timeout = { 1, 0 };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+
+		NtpClient client;
+		client.SetClockState(nullptr);
+		char request[NTP_MSG_SIZE];
+		char response[NTP_MSG_SIZE];
+		std::vector<double> latencies;
+		latencies.reserve(exchanges);
+		int lost = 0;
+
+		for (int i = 0; i < BENCHMARK_WARMUP_EXCHANGES + exchanges; i++)
+		{
+			auto start = std::chrono::steady_clock::now();
+			client.CreateMessage(request);
+			if (send(fd, request, NTP_MSG_SIZE, 0) != NTP_MSG_SIZE ||
+				recv(fd, response, NTP_MSG_SIZE, 0) != NTP_MSG_SIZE)
+			{
+				lost++;
+				continue;
+			}
+			if (!client.ReceivedMessage(response))
+			{
+				lost++;
+				continue;
+			}
+			auto end = std::chrono::steady_clock::now();
+			if (i >= BENCHMARK_WARMUP_EXCHANGES)
+				latencies.push_back(std::chrono::duration<double, std::nano>(end - start).count());
+		}
+		close(fd);
+		server.Stop();
+
+		if (latencies.empty())
+		{
+			printf("loopback_error 1\n");
+			return;
+		}
+		std::sort(latencies.begin(), latencies.end());
+		size_t n = latencies.size();
+		printf("loopback_exchanges %zu\n", n);
+		printf("loopback_lost %d\n", lost);
+		printf("loopback_p50_ns %.0f\n", latencies[n / 2]);
+		printf("loopback_p99_ns %.0f\n", latencies[std::min(n - 1, (n * 99) / 100)]);
+		printf("loopback_p999_ns %.0f\n", latencies[std::min(n - 1, (n * 999) / 1000)]);
+		printf("loopback_max_ns %.0f\n", latencies[n - 1]);
+	}
+#endif
+};
+
+int main(int argc, char** argv)
+{
+	int exchanges = (argc > 1) ? atoi(argv[1]) : BENCHMARK_EXCHANGES;
+
+	NtpBenchmark::Codec();
+#ifndef _WIN32
+	NtpBenchmark::Loopback(exchanges);
+#else
+	(void)exchanges;
+#endif
+	return 0;
+}
@@ -0,0 +1,164 @@
+/**
+ *  Benchmark of the SNTP server: an NtpServer on the loopback, loaded by client threads
+ *  that each keep a window of requests in flight with sendmmsg()/recvmmsg(). Prints the
+ *  responses per second, one "name value" per line.
+ *
+ *  Build (from the code folder):
+ *    g++ -O2 -std=c++17 -pthread -I. benchmark/ServerBenchmark.cpp NtpServer.cpp NtpAuth.cpp NtpClock.cpp NtpTscClock.cpp -lcrypto -o server_benchmark
+ *
+ *  Usage: server_benchmark [workers] [client threads] [seconds]
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#include "NtpServer.h"
+#include "NtpPacket.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+#define BENCHMARK_SOCKETS_PER_CLIENT (4)     // source ports, so that SO_REUSEPORT spreads the load
+#define BENCHMARK_WINDOW (256)               // requests in flight per socket
+#define BENCHMARK_LOSS_TIMEOUT_MS (20)       // the window is refilled after this long without replies
+
+static std::atomic<bool> g_stop(false);
+
+static void
+Client(uint16_t port, std::atomic<uint64_t>* replies)
+{
+	struct sockaddr_in server;
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_port = htons(port);
+	server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	int fds[BENCHMARK_SOCKETS_PER_CLIENT];
+	int inFlight[BENCHMARK_SOCKETS_PER_CLIENT];
+	for (int s = 0; s < BENCHMARK_SOCKETS_PER_CLIENT; s++)
+	{
+		fds[s] = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		connect(fds[s], (struct sockaddr*)&server, sizeof(server));
+		inFlight[s] = 0;
+	}
+
+	unsigned char request[NTP_MSG_SIZE];
+	memset(request, 0, sizeof(request));
+	NtpPacketView(request).SetHeader(0, 4, 3);
+
+	struct iovec iovs[NtpServer::BatchSize];
+	struct mmsghdr hdrs[NtpServer::BatchSize];
+	unsigned char buffers[NtpServer::BatchSize][NTP_MSG_SIZE];
+	uint64_t received = 0;
+	auto lastReply = std::chrono::steady_clock::now();
+
+	while (!g_stop.load(std::memory_order_relaxed))
+	{
+		bool any = false;
+		for (int s = 0; s < BENCHMARK_SOCKETS_PER_CLIENT; s++)
+		{
+			// Top up the window, one batch at a time
+			int count = BENCHMARK_WINDOW - inFlight[s];
+			if (count > NtpServer::BatchSize)
+				count = NtpServer::BatchSize;
+			if (count > 0)
+			{
+				memset(hdrs, 0, sizeof(hdrs));
+				for (int i = 0; i < count; i++)
+				{
+					iovs[i].iov_base = request;
+					iovs[i].iov_len = NTP_MSG_SIZE;
+					hdrs[i].msg_hdr.msg_iov = &iovs[i];
+					hdrs[i].msg_hdr.msg_iovlen = 1;
+				}
+				int sent = sendmmsg(fds[s], hdrs, count, MSG_DONTWAIT);
+				if (sent > 0)
+					inFlight[s] += sent;
+			}
+
+			memset(hdrs, 0, sizeof(hdrs));
+			for (int i = 0; i < NtpServer::BatchSize; i++)
+			{
+				iovs[i].iov_base = buffers[i];
+				iovs[i].iov_len = NTP_MSG_SIZE;
+				hdrs[i].msg_hdr.msg_iov = &iovs[i];
+				hdrs[i].msg_hdr.msg_iovlen = 1;
+			}
+			int got = recvmmsg(fds[s], hdrs, NtpServer::BatchSize, MSG_DONTWAIT, nullptr);
+			if (got > 0)
+			{
+				inFlight[s] -= got;
+				if (inFlight[s] < 0)
+					inFlight[s] = 0;
+				received += got;
+				any = true;
+			}
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		if (any)
+		{
+			lastReply = now;
+		}
+		else if (now - lastReply > std::chrono::milliseconds(BENCHMARK_LOSS_TIMEOUT_MS))
+		{
+			// Requests (or replies) were dropped on the way: forget them
+			for (int s = 0; s < BENCHMARK_SOCKETS_PER_CLIENT; s++)
+				inFlight[s] = 0;
+			lastReply = now;
+		}
+	}
+
+	for (int s = 0; s < BENCHMARK_SOCKETS_PER_CLIENT; s++)
+		close(fds[s]);
+	replies->fetch_add(received);
+}
+
+int main(int argc, char** argv)
+{
+	int cores = (int)std::thread::hardware_concurrency();
+	int workers = (argc > 1) ? atoi(argv[1]) : (cores > 1 ? cores / 2 : 1);
+	int clients = (argc > 2) ? atoi(argv[2]) : (cores > 1 ? cores / 2 : 1);
+	int seconds = (argc > 3) ? atoi(argv[3]) : 5;
+
+	NtpServer server;
+	server.SetReference(1, 0x47505300, -20); // "GPS"
+	if (!server.Open(0, workers, "127.0.0.1") || !server.Start())
+	{
+		printf("failed to start the server\n");
+		return 1;
+	}
+
+	std::atomic<uint64_t> replies(0);
+	std::vector<std::thread> threads;
+	for (int i = 0; i < clients; i++)
+		threads.push_back(std::thread(Client, server.GetPort(), &replies));
+
+	std::this_thread::sleep_for(std::chrono::seconds(seconds));
+	g_stop = true;
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+
+	NtpServer::Statistics statistics = server.GetStatistics();
+	server.Stop();
+
+	printf("server_workers %d\n", workers);
+	printf("client_threads %d\n", clients);
+	printf("server_requests %llu\n", (unsigned long long)statistics.requests);
+	printf("server_responses %llu\n", (unsigned long long)statistics.responses);
+	printf("server_dropped %llu\n", (unsigned long long)statistics.dropped);
+	printf("server_responses_per_second %.0f\n", (double)statistics.responses / seconds);
+	printf("client_replies_per_second %.0f\n", (double)replies.load() / seconds);
+	return 0;
+}
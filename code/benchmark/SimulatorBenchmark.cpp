@@ -0,0 +1,201 @@
+/**
+ *  Accuracy benchmark of the offset estimators against a known offset, on the simulated
+ *  network (NtpSimulator): the local clock starts 50 ms ahead and drifts, the client polls
+ *  every 64 s for a simulated day per scenario, and right before each poll the error of
+ *  each estimator is taken against the true offset:
+ *  - raw: the offset of the last sample;
+ *  - filter: the offset of the clock filter (minimum delay of the last 8 samples);
+ *  - discipline: the time corrected with the published clock state (offset + frequency).
+ *  The raw and filter offsets are measurements at the time of their sample, so they are
+ *  scored against the true offset at that time (the drift since is the discipline's job);
+ *  the discipline is scored against the time now;
+ *  - select: the offset combined over 5 servers, one of them a falseticker (NtpSelect),
+ *    against the plain mean of the last samples of the servers.
+ *  Prints the mean and the 99th percentile of the absolute errors (us) per scenario and
+ *  estimator, then the simulated and the wall-clock time, one "name value" per line.
+ *
+ *  Build (from the code folder):
+ *    g++ -O2 -std=c++17 -pthread -I. benchmark/SimulatorBenchmark.cpp NtpSimulator.cpp NtpSelect.cpp NtpSession.cpp NtpClient.cpp NtpRequestTable.cpp NtpResolver.cpp NtpTransport.cpp NtpTimerWheel.cpp NtpBatch.cpp NtpUringBatch.cpp NtpAuth.cpp NtpClock.cpp NtpTscClock.cpp NtpFilter.cpp NtpDiscipline.cpp NtpInstrumentation.cpp NtpMetrics.cpp -lresolv -lcrypto -o simulator_benchmark
+ *
+ *  Usage: simulator_benchmark [hours] [seed]
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#include "NtpSimulator.h"
+#include "NtpClient.h"
+#include "NtpSelect.h"
+#include "NtpClock.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+#define SIMULATOR_HOURS (24)
+#define SIMULATOR_POLL_S (64)
+#define SIMULATOR_WARMUP_S (3600)             // the errors of the first hour are not counted
+#define SIMULATOR_OFFSET_NS (50000000LL)      // the local clock is 50 ms ahead
+#define SIMULATOR_DRIFT (20e-6)               // and runs 20 ppm fast
+#define SIMULATOR_FALSETICKER_NS (100000000LL) // the falseticker is 100 ms off
+#define SIMULATOR_SERVERS (5)
+
+// The absolute errors of one estimator
+class Errors
+{
+public:
+	void Add(int64_t errorNs)
+	{
+		m_errors.push_back(errorNs < 0 ? -errorNs : errorNs);
+	}
+
+	void Print(const std::string& name)
+	{
+		double mean = 0;
+		for (size_t ii = 0; ii < m_errors.size(); ii++)
+			mean += (double)m_errors[ii];
+		if (!m_errors.empty())
+			mean /= (double)m_errors.size();
+
+		int64_t p99 = 0;
+		if (!m_errors.empty())
+		{
+			std::sort(m_errors.begin(), m_errors.end());
+			p99 = m_errors[std::min(m_errors.size() - 1, (size_t)((double)m_errors.size() * 0.99))];
+		}
+		printf("%s_mean_us %.3f\n", name.c_str(), mean / 1000.0);
+		printf("%s_p99_us %.3f\n", name.c_str(), (double)p99 / 1000.0);
+	}
+
+private:
+	std::vector<int64_t> m_errors;
+};
+
+static NtpSimulator::Path
+MakePath(int64_t delayNs, int64_t asymmetryNs, int64_t jitterNs, double loss)
+{
+	NtpSimulator::Path path;
+	path.delayNs = delayNs;
+	path.asymmetryNs = asymmetryNs;
+	path.jitterNs = jitterNs;
+	path.loss = loss;
+	path.processingNs = 20000;
+	return path;
+}
+
+// One client, one server: raw sample, clock filter and discipline
+static void
+RunSingle(const char* name, const NtpSimulator::Path& path, int hours, uint64_t seed)
+{
+	NtpSimulator simulator(seed);
+	simulator.AddServer("server", path);
+	NtpSimulator::Clock clock(simulator, SIMULATOR_OFFSET_NS, SIMULATOR_DRIFT);
+
+	NtpClockState state;
+	NtpClient client;
+	client.SetTimeSource(&clock);
+	client.SetClockState(&state);
+	client.SetInstrumentation(nullptr);
+
+	Errors raw, filter, discipline;
+	int64_t startNs = simulator.Now();
+	int64_t lastOffsetNs = 0;
+	int64_t lastTrueOffsetNs = 0;
+	std::map<int64_t, int64_t> trueOffsets; // true offset per sample (by its local receive time)
+	int responses = 0;
+	for (int64_t t = 0; t < (int64_t)hours * 3600; t += SIMULATOR_POLL_S)
+	{
+		simulator.RunUntil(startNs + t * 1000000000LL);
+
+		if (t >= SIMULATOR_WARMUP_S && responses > 0)
+		{
+			raw.Add(lastOffsetNs - lastTrueOffsetNs);
+			NtpFilter::Result filtered = client.GetFilterResult();
+			auto it = trueOffsets.find(filtered.timeNs);
+			if (filtered.valid && it != trueOffsets.end())
+				filter.Add(filtered.offsetNs - it->second);
+			discipline.Add(NtpClockState::Correct(state.Read(), clock.Now()) - simulator.Now());
+		}
+
+		NtpClient::Sample sample;
+		if (client.Connect(simulator, "server", &sample))
+		{
+			// The offset the client should have found: the local clock is ahead by GetOffsetNs()
+			// (taken when the response arrived)
+			lastOffsetNs = sample.clockOffsetNs;
+			lastTrueOffsetNs = -clock.GetOffsetNs();
+			trueOffsets[sample.receiveTimeNs] = lastTrueOffsetNs;
+			responses++;
+		}
+	}
+
+	raw.Print(std::string(name) + "_raw");
+	filter.Print(std::string(name) + "_filter");
+	discipline.Print(std::string(name) + "_discipline");
+	printf("%s_frequency_error_ppm %.3f\n", name, (client.GetFrequency() + SIMULATOR_DRIFT) * 1e6);
+}
+
+// Several servers, one falseticker: combined offset against the plain mean of the samples
+static void
+RunSelect(const char* name, int hours, uint64_t seed)
+{
+	NtpSimulator simulator(seed);
+	NtpSimulator::Clock clock(simulator, SIMULATOR_OFFSET_NS, SIMULATOR_DRIFT);
+
+	NtpSelect select;
+	select.SetChannel(&simulator);
+	select.SetTimeSource(&clock);
+	select.SetClockState(nullptr);
+	for (int ii = 0; ii < SIMULATOR_SERVERS; ii++)
+	{
+		std::string host = "server" + std::to_string(ii);
+		simulator.AddServer(host.c_str(), MakePath(5000000LL * (ii + 1), 0, 1000000LL * (ii + 1), 0.01),
+			(ii == SIMULATOR_SERVERS - 1) ? SIMULATOR_FALSETICKER_NS : 0);
+		select.AddServer(host.c_str());
+		select.GetPeer(ii).client->SetInstrumentation(nullptr);
+	}
+
+	Errors combined, mean;
+	int64_t startNs = simulator.Now();
+	for (int64_t t = 0; t < (int64_t)hours * 3600; t += SIMULATOR_POLL_S)
+	{
+		simulator.RunUntil(startNs + t * 1000000000LL);
+		if (!select.Round() || t < SIMULATOR_WARMUP_S)
+			continue;
+
+		int64_t trueOffsetNs = -clock.GetOffsetNs();
+		combined.Add(select.GetClockOffsetNs() - trueOffsetNs);
+
+		int64_t sumNs = 0;
+		for (int ii = 0; ii < select.ServerCount(); ii++)
+			sumNs += select.GetPeer(ii).client->GetLastSample().clockOffsetNs;
+		mean.Add(sumNs / select.ServerCount() - trueOffsetNs);
+	}
+
+	combined.Print(std::string(name) + "_select");
+	mean.Print(std::string(name) + "_mean");
+}
+
+int main(int argc, char** argv)
+{
+	int hours = (argc > 1) ? atoi(argv[1]) : SIMULATOR_HOURS;
+	uint64_t seed = (argc > 2) ? strtoull(argv[2], nullptr, 10) : 1;
+
+	auto start = std::chrono::steady_clock::now();
+	RunSingle("lan", MakePath(200000, 0, 50000, 0.0), hours, seed);
+	RunSingle("wan", MakePath(15000000, 0, 5000000, 0.02), hours, seed);
+	RunSingle("asymmetric", MakePath(10000000, 4000000, 1000000, 0.0), hours, seed);
+	RunSelect("pool", hours, seed);
+	auto end = std::chrono::steady_clock::now();
+
+	printf("simulated_hours %d\n", hours * 4);
+	printf("wall_ms %.1f\n", std::chrono::duration<double, std::milli>(end - start).count());
+	return 0;
+}
@@ -0,0 +1,102 @@
+/**
+ *  Benchmark of the corrected time reads: cost per call of clock_gettime(), ntp_clock::now()
+ *  and ntp_tsc_clock::now(), and the error of the TSC path against ntp_clock while the
+ *  state is republished (as the sync thread does after each exchange).
+ *
+ *  Build (from the code folder):
+ *    g++ -O2 -std=c++17 -pthread -I. benchmark/TscClockBenchmark.cpp NtpClock.cpp NtpTscClock.cpp -o tsc_benchmark
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#include "NtpClock.h"
+#include "NtpTscClock.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <chrono>
+#include <thread>
+
+/******************************************************************************
+* Preprocessor Directives and Macros
+*****************************************************************************/
+#define BENCHMARK_CALLS (10000000)
+#define BENCHMARK_ERROR_SAMPLES (200000)
+#define BENCHMARK_REPUBLISH_MS (100)
+#define BENCHMARK_REPUBLISH_COUNT (20)
+#define BENCHMARK_MAX_BRACKET_NS (1000)
+
+static int64_t
+SystemTimeNs(void)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+template <typename Read>
+static double
+NsPerCall(Read read)
+{
+	int64_t sink = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < BENCHMARK_CALLS; i++)
+		sink += read();
+	auto end = std::chrono::steady_clock::now();
+	// Keep the reads from being optimised away
+	if (sink == 42)
+		printf(" ");
+	return std::chrono::duration<double, std::nano>(end - start).count() / BENCHMARK_CALLS;
+}
+
+int main()
+{
+	NtpClockState& state = NtpClockState::Global();
+	NtpClockState::Snapshot snapshot = { 500000000, 0.0, SystemTimeNs(), 1000000, 0 };
+	state.Publish(snapshot);
+
+	if (!NtpTscClock::Global().Enable(state))
+	{
+		printf("no invariant TSC, only the clock_gettime path is measured\n");
+	}
+
+	//---------------------------------------------------------------------
+	// Cost per call
+	printf("clock_gettime_ns_per_call %.2f\n", NsPerCall([] {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		return (int64_t)ts.tv_nsec;
+	}));
+	printf("ntp_clock_ns_per_call %.2f\n", NsPerCall([] { return ntp_clock::now().time_since_epoch().count(); }));
+	printf("ntp_tsc_clock_ns_per_call %.2f\n", NsPerCall([] { return ntp_tsc_clock::now().time_since_epoch().count(); }));
+
+	//---------------------------------------------------------------------
+	// Error of the TSC path, with the state republished every BENCHMARK_REPUBLISH_MS
+	int64_t maxError = 0;
+	double sumError = 0.0;
+	int64_t samples = 0;
+	for (int round = 0; round < BENCHMARK_REPUBLISH_COUNT; round++)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(BENCHMARK_REPUBLISH_MS));
+		snapshot.updateTimeNs = SystemTimeNs();
+		state.Publish(snapshot);
+
+		for (int i = 0; i < BENCHMARK_ERROR_SAMPLES / BENCHMARK_REPUBLISH_COUNT; i++)
+		{
+			// Compare against the middle of two clock_gettime() based reads
+			int64_t before = ntp_clock::now().time_since_epoch().count();
+			int64_t tsc = ntp_tsc_clock::now().time_since_epoch().count();
+			int64_t after = ntp_clock::now().time_since_epoch().count();
+			if (after - before > BENCHMARK_MAX_BRACKET_NS)
+				continue; // preempted
+			int64_t error = tsc - (before + ((after - before) / 2));
+			if (error < 0)
+				error = -error;
+			if (error > maxError)
+				maxError = error;
+			sumError += (double)error;
+			samples++;
+		}
+	}
+	printf("ntp_tsc_clock_mean_error_ns %.1f\n", sumError / (double)samples);
+	printf("ntp_tsc_clock_max_error_ns %lld\n", (long long)maxError);
+	return 0;
+}
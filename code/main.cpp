@@ -1,14 +1,21 @@
+#ifdef _MSC_VER
 #pragma warning(disable : 4996)
+#endif
 
 // Example program
 #include <iostream>
 #include "NtpClient.h"
+#include "NtpInstrumentation.h"
+#include "NtpMetrics.h"
 
 
 
 int main()
 {
+	// Print the exchanges (and keep the metrics)
+	NtpDebugSink _debug(&NtpMetrics::Global());
 	NtpClient _ntp;
+	_ntp.SetInstrumentation(&_debug);
 	_ntp.Connect();
 }
 
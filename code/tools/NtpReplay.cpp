@@ -0,0 +1,127 @@
+/**
+ *  Replays a journal (see NtpJournal) through the client: each recorded response is decoded
+ *  and added to the clock filter of its server (one NtpClient per server address), then the
+ *  selection runs over all the servers at the time of the response, as it did live, without
+ *  querying any server. Prints one line per record (the sample and the combined offset),
+ *  then the summary, one "name value" per line.
+ *
+ *  The filter and the selection can be tuned by rebuilding with other parameters, e.g.
+ *  -DNTP_FILTER_STAGES=4 -DNTP_SELECT_MIN_SURVIVORS=2, and replaying the same journal.
+ *
+ *  Build (from the code folder):
+ *    g++ -O2 -std=c++17 -pthread -I. tools/NtpReplay.cpp NtpJournal.cpp NtpSelect.cpp NtpClient.cpp NtpRequestTable.cpp NtpResolver.cpp NtpTransport.cpp NtpTimerWheel.cpp NtpBatch.cpp NtpUringBatch.cpp NtpAuth.cpp NtpClock.cpp NtpTscClock.cpp NtpFilter.cpp NtpDiscipline.cpp NtpInstrumentation.cpp NtpMetrics.cpp NtpSession.cpp -lresolv -lcrypto -o ntp_replay
+ *
+ *  Usage: ntp_replay <journal> [--summary]
+ *
+ *  Ioannis Selinis 2019 (5GIC, University of Surrey)
+ */
+
+#include "NtpJournal.h"
+#include "NtpSelect.h"
+#include "NtpResolver.h"
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <string>
+
+// The server of a record: its address (and port, if not the NTP one), or its name if not known
+static std::string
+ServerOf(const NtpJournal::Record& record)
+{
+	struct sockaddr_storage address;
+	NtpJournal::GetAddress(record, &address);
+	if (address.ss_family == AF_UNSPEC)
+		return std::string(record.server, strnlen(record.server, sizeof(record.server)));
+
+	std::string server = NtpResolver::ToString(address);
+	if (ntohs(record.port) != NTP_PORT)
+	{
+		if (address.ss_family == AF_INET6)
+			server = "[" + server + "]";
+		server += ":" + std::to_string(ntohs(record.port));
+	}
+	return server;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s <journal> [--summary]\n", argv[0]);
+		return 1;
+	}
+	bool summary = (argc > 2 && strcmp(argv[2], "--summary") == 0);
+
+	NtpJournal journal;
+	if (!journal.OpenReadOnly(argv[1]))
+		return 1;
+
+	// Nothing is published nor reported: the replay must not touch the clock of this host
+	NtpSelect select;
+	select.SetClockState(nullptr);
+	std::map<std::string, int> servers;
+
+	uint64_t replayed = 0, skipped = 0, invalid = 0;
+	NtpSelect::Result result;
+	memset(&result, 0, sizeof(result));
+
+	if (!summary)
+		printf("# sequence server offset_ns delay_ns valid combined_offset_ns survivors system_peer\n");
+
+	NtpJournal::Record record;
+	for (uint64_t sequence = journal.GetFirst(); sequence < journal.GetNext(); sequence++)
+	{
+		if (!journal.Read(sequence, &record))
+		{
+			skipped++;
+			continue;
+		}
+
+		std::string server = ServerOf(record);
+		std::map<std::string, int>::iterator it = servers.find(server);
+		if (it == servers.end())
+		{
+			select.AddServer(server.c_str());
+			select.GetPeer(select.ServerCount() - 1).client->SetInstrumentation(nullptr);
+			it = servers.insert(std::make_pair(server, select.ServerCount() - 1)).first;
+		}
+
+		NtpClient::Sample sample;
+		memset(&sample, 0, sizeof(sample));
+		NtpClient& client = *select.GetPeer(it->second).client;
+		bool valid = client.ReplayExchange(server.c_str(), record.response,
+			record.originateTimestamp, (NtpClient::TimestampSource)record.transmitTimestampSource,
+			record.destinationTimestamp, (NtpClient::TimestampSource)record.receiveTimestampSource, &sample);
+		replayed++;
+		if (!valid)
+		{
+			invalid++;
+			continue;
+		}
+
+		// The selection as it ran when the response arrived
+		result = select.Select(sample.receiveTimeNs);
+		if (!summary)
+		{
+			printf("%llu %s %lld %lld %d %lld %d %s\n", (unsigned long long)sequence, server.c_str(),
+				(long long)sample.clockOffsetNs, (long long)sample.roundTripDelayNs, (int)sample.valid,
+				(long long)result.offsetNs, result.survivors,
+				(result.systemPeer >= 0) ? select.GetPeer(result.systemPeer).host.c_str() : "-");
+		}
+	}
+
+	printf("records %llu\n", (unsigned long long)replayed);
+	printf("skipped %llu\n", (unsigned long long)skipped);
+	printf("invalid %llu\n", (unsigned long long)invalid);
+	printf("servers %d\n", select.ServerCount());
+	printf("valid %d\n", (int)result.valid);
+	printf("offset_ns %lld\n", (long long)result.offsetNs);
+	printf("jitter_ns %lld\n", (long long)result.jitterNs);
+	printf("root_distance_ns %lld\n", (long long)result.rootDistanceNs);
+	printf("survivors %d\n", result.survivors);
+	printf("frequency_ppm %.3f\n", result.frequency * 1e6);
+	return 0;
+}